@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "debug_stats.h"
+#include "json_writer.h"
+#include "req_arena.h"
+#include "outbox_latest.h"
+#include "log_ring.h"
+#include "lights_ledc.h"
+
+#ifndef CONFIG_DEBUG_HEAP_GROWTH_LIMIT
+#define CONFIG_DEBUG_HEAP_GROWTH_LIMIT 8192
+#endif
+
+// Task and heap statistics for sizing stacks and finding spare RAM.
+// Needs CONFIG_FREERTOS_USE_TRACE_FACILITY for uxTaskGetSystemState and
+// CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS for the per task CPU time
+
+// Run time counters from the last /debug/tasks request so CPU % is
+// reported for the time since then instead of since boot
+#define DEBUG_MAX_TASKS 24
+static TaskHandle_t last_handles[DEBUG_MAX_TASKS];
+static uint32_t last_run_time[DEBUG_MAX_TASKS];
+static uint32_t last_total_run_time = 0;
+static uint8_t last_task_count = 0;
+
+// Heap in use once everything has started. Every task stack and queue of
+// the firmware is static, so anything the heap grows by after this is a
+// leak or a buffer that keeps growing in a library
+static size_t heap_baseline_free = 0;
+static size_t heap_growth_max = 0;
+static size_t heap_growth_warned = 0;
+static uint32_t heap_warnings = 0;
+
+// Debug tag for log statements
+static const char *TAG = "Debug Stats";
+
+static const char* task_state_name(eTaskState state)
+{
+    switch (state) {
+        case eRunning:   return "running";
+        case eReady:     return "ready";
+        case eBlocked:   return "blocked";
+        case eSuspended: return "suspended";
+        default:         return "deleted";
+    }
+}
+
+// Gets the state of every task. The caller must free the array
+static TaskStatus_t* get_task_states(UBaseType_t* num_tasks, uint32_t* total_run_time)
+{
+    // Leave room in case tasks are created while this runs
+    UBaseType_t array_size = uxTaskGetNumberOfTasks() + 2;
+    TaskStatus_t* tasks = malloc(array_size * sizeof(TaskStatus_t));
+    if (tasks == NULL) {
+        *num_tasks = 0;
+        return NULL;
+    }
+    *num_tasks = uxTaskGetSystemState(tasks, array_size, total_run_time);
+    return tasks;
+}
+
+// Returns how much of the largest free block is missing from the total free
+// heap, as a percentage. 0 means all the free memory is in one block
+static uint32_t heap_fragmentation_pct(size_t free_size, size_t largest_block)
+{
+    if (free_size == 0) {
+        return 0;
+    }
+    return 100 - (uint32_t)((uint64_t)largest_block * 100 / free_size);
+}
+
+// Logs the stack and heap use of every task once the device has settled
+// after boot, so stack sizes can be checked from the serial log
+void debug_stats_boot_report(void)
+{
+    UBaseType_t num_tasks;
+    uint32_t total_run_time;
+    TaskStatus_t* tasks = get_task_states(&num_tasks, &total_run_time);
+    if (tasks == NULL) {
+        ESP_LOGI(TAG, "Not enough memory for the boot report");
+        return;
+    }
+    ESP_LOGI(TAG, "Boot report: %d tasks", num_tasks);
+    for (UBaseType_t i = 0; i < num_tasks; i++) {
+        ESP_LOGI(TAG, "  %-16s priority %2d, %5d bytes of stack never used",
+            tasks[i].pcTaskName, tasks[i].uxCurrentPriority, tasks[i].usStackHighWaterMark);
+    }
+    free(tasks);
+
+    size_t free_size = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    size_t largest_block = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+    ESP_LOGI(TAG, "Heap: %d free, %d minimum free, %d largest block (%d%% fragmented)",
+        free_size, heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT), largest_block,
+        heap_fragmentation_pct(free_size, largest_block));
+    heap_baseline_free = free_size;
+}
+
+// Compares the free heap with the baseline from the boot report
+// Warns when the heap in use has grown past the limit, and again for every
+// further step of the limit, so a slow leak is reported without flooding the log
+void debug_stats_heap_check(void)
+{
+    if (heap_baseline_free == 0) {
+        return;
+    }
+    size_t free_size = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    size_t growth = heap_baseline_free > free_size ? heap_baseline_free - free_size : 0;
+    heap_growth_max = MAX(heap_growth_max, growth);
+    if (growth >= heap_growth_warned + CONFIG_DEBUG_HEAP_GROWTH_LIMIT) {
+        heap_growth_warned = growth;
+        heap_warnings++;
+        size_t largest_block = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+        ESP_LOGW(TAG, "Heap in use grew %d bytes since boot. %d free, %d largest block (%d%% fragmented)",
+            growth, free_size, largest_block, heap_fragmentation_pct(free_size, largest_block));
+        LOG_RING("Heap grew %u bytes since boot, %u free, %u largest block", growth, free_size, largest_block);
+    }
+}
+
+// Sends task and heap stats in JSON format
+// CPU % is for the time since the last request, or since boot for the first
+// Stack is the least free stack each task has had, in bytes
+esp_err_t debug_tasks_get_handler(httpd_req_t *req)
+{
+    UBaseType_t num_tasks;
+    uint32_t total_run_time;
+    TaskStatus_t* tasks = get_task_states(&num_tasks, &total_run_time);
+    if (tasks == NULL) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        return ESP_OK;
+    }
+    uint32_t elapsed = total_run_time - last_total_run_time;
+
+    char json_data[256];
+    json_writer_t writer;
+    size_t free_size = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    size_t largest_block = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+    httpd_resp_set_type(req, "application/json");
+    json_writer_init(&writer, json_data, sizeof(json_data));
+    json_write_raw(&writer, "{\"uptime_ms\": ");
+    json_write_int(&writer, (int)(esp_timer_get_time() / 1000));
+    json_write_raw(&writer, ", \"heap\": {\"free\": ");
+    json_write_int(&writer, free_size);
+    json_write_raw(&writer, ", \"minimum_free\": ");
+    json_write_int(&writer, heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT));
+    json_write_raw(&writer, ", \"largest_block\": ");
+    json_write_int(&writer, largest_block);
+    json_write_raw(&writer, ", \"fragmentation_pct\": ");
+    json_write_int(&writer, heap_fragmentation_pct(free_size, largest_block));
+    json_write_raw(&writer, "}, \"request_arena\": {\"size\": ");
+    json_write_int(&writer, REQ_ARENA_SIZE);
+    json_write_raw(&writer, ", \"high_water\": ");
+    json_write_int(&writer, req_arena_high_water());
+    json_write_raw(&writer, "}");
+    httpd_resp_send_chunk(req, json_data, writer.len);
+
+    json_writer_init(&writer, json_data, sizeof(json_data));
+#ifdef CONFIG_MQTT_CUSTOM_OUTBOX
+    outbox_latest_stats_t outbox;
+    outbox_latest_get_stats(&outbox);
+    json_write_raw(&writer, ", \"mqtt_outbox\": {\"slots\": ");
+    json_write_int(&writer, outbox.slots);
+    json_write_raw(&writer, ", \"used\": ");
+    json_write_int(&writer, outbox.used);
+    json_write_raw(&writer, ", \"high_water\": ");
+    json_write_int(&writer, outbox.high_water);
+    json_write_raw(&writer, ", \"replaced\": ");
+    json_write_int(&writer, outbox.replaced);
+    json_write_raw(&writer, ", \"dropped\": ");
+    json_write_int(&writer, outbox.dropped);
+    json_write_raw(&writer, ", \"expired\": ");
+    json_write_int(&writer, outbox.expired);
+    json_write_raw(&writer, "}");
+#endif
+    json_write_raw(&writer, ", \"heap_check\": {\"baseline_free\": ");
+    json_write_int(&writer, heap_baseline_free);
+    json_write_raw(&writer, ", \"growth\": ");
+    json_write_int(&writer, heap_baseline_free > free_size ? heap_baseline_free - free_size : 0);
+    json_write_raw(&writer, ", \"growth_max\": ");
+    json_write_int(&writer, heap_growth_max);
+    json_write_raw(&writer, ", \"warnings\": ");
+    json_write_int(&writer, heap_warnings);
+    json_write_raw(&writer, "}");
+    httpd_resp_send_chunk(req, json_data, writer.len);
+
+    // CPU of each running effect, counted by the fade task per step
+    json_writer_init(&writer, json_data, sizeof(json_data));
+    json_write_raw(&writer, ", \"effects\": [");
+    httpd_resp_send_chunk(req, json_data, writer.len);
+    uint8_t effects_sent = 0;
+    for (int channel = 0; channel < 4; channel++) {
+        lights_effect_stats_t effect;
+        lights_get_effect_stats(channel, &effect);
+        if (effect.effect == LIGHTS_EFFECT_NONE) {
+            continue;
+        }
+        uint32_t cpu_pct_x1000 = (uint32_t)(((uint64_t)effect.busy_us * 100) / MAX(effect.run_ms, 1));
+        json_writer_init(&writer, json_data, sizeof(json_data));
+        json_write_raw(&writer, effects_sent ? ", {\"channel\": " : "{\"channel\": ");
+        json_write_int(&writer, channel);
+        json_write_raw(&writer, ", \"effect\": ");
+        json_write_string(&writer, lights_effect_name(effect.effect));
+        json_write_raw(&writer, ", \"steps\": ");
+        json_write_int(&writer, effect.steps);
+        json_write_raw(&writer, ", \"busy_us\": ");
+        json_write_int(&writer, effect.busy_us);
+        json_write_raw(&writer, ", \"step_max_us\": ");
+        json_write_int(&writer, effect.step_max_us);
+        json_write_raw(&writer, ", \"cpu_pct\": ");
+        char cpu_str[16];
+        sprintf(cpu_str, "%d.%03d", cpu_pct_x1000 / 1000, cpu_pct_x1000 % 1000);
+        json_write_raw(&writer, cpu_str);
+        json_write_raw(&writer, "}");
+        httpd_resp_send_chunk(req, json_data, writer.len);
+        effects_sent++;
+    }
+
+    json_writer_init(&writer, json_data, sizeof(json_data));
+    json_write_raw(&writer, "], \"tasks\": [");
+    httpd_resp_send_chunk(req, json_data, writer.len);
+
+    for (UBaseType_t i = 0; i < num_tasks; i++) {
+        // Find this task's run time from the last request
+        uint32_t task_run_time = tasks[i].ulRunTimeCounter;
+        for (uint8_t j = 0; j < last_task_count; j++) {
+            if (last_handles[j] == tasks[i].xHandle) {
+                task_run_time -= last_run_time[j];
+                break;
+            }
+        }
+        uint32_t cpu_pct_x10 = elapsed ? (uint32_t)((uint64_t)task_run_time * 1000 / elapsed) : 0;
+
+        json_writer_init(&writer, json_data, sizeof(json_data));
+        json_write_raw(&writer, i ? ", {\"name\": " : "{\"name\": ");
+        json_write_string(&writer, tasks[i].pcTaskName);
+        json_write_raw(&writer, ", \"priority\": ");
+        json_write_int(&writer, tasks[i].uxCurrentPriority);
+        json_write_raw(&writer, ", \"state\": ");
+        json_write_string(&writer, task_state_name(tasks[i].eCurrentState));
+        json_write_raw(&writer, ", \"cpu_pct\": ");
+        char cpu_str[12];
+        sprintf(cpu_str, "%d.%d", cpu_pct_x10 / 10, cpu_pct_x10 % 10);
+        json_write_raw(&writer, cpu_str);
+        json_write_raw(&writer, ", \"stack_free_min\": ");
+        json_write_int(&writer, tasks[i].usStackHighWaterMark);
+        json_write_raw(&writer, "}");
+        httpd_resp_send_chunk(req, json_data, writer.len);
+    }
+    httpd_resp_send_chunk(req, "]}", HTTPD_RESP_USE_STRLEN);
+    httpd_resp_send_chunk(req, NULL, 0);
+
+    // Save the counters for the next request
+    last_task_count = MIN(num_tasks, DEBUG_MAX_TASKS);
+    for (uint8_t j = 0; j < last_task_count; j++) {
+        last_handles[j] = tasks[j].xHandle;
+        last_run_time[j] = tasks[j].ulRunTimeCounter;
+    }
+    last_total_run_time = total_run_time;
+    free(tasks);
+    return ESP_OK;
+}
@@ -0,0 +1,13 @@
+#ifndef DEBUG_STATS_H_INCLUDED
+#define DEBUG_STATS_H_INCLUDED
+
+#include <esp_http_server.h>
+
+// How often app_main checks the heap against the boot baseline, in seconds
+#define DEBUG_HEAP_CHECK_INTERVAL 60
+
+void debug_stats_boot_report(void);
+void debug_stats_heap_check(void);
+esp_err_t debug_tasks_get_handler(httpd_req_t *req);
+
+#endif
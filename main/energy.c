@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+#include <freertos/FreeRTOS.h>
+#include <esp_timer.h>
+
+#include "energy.h"
+
+// Each output is tracked as a linear ramp from one level to another, which
+// is how the LEDC fader moves, followed by a steady level. The integral over
+// a ramp is exact, so the totals only need updating when the level is set
+// or read, with nothing sampling in the background.
+// Levels are kept with 8 fractional bits so slow fades don't round away
+#define ENERGY_Q8(level)  ((int64_t)(level) << 8)
+#define ENERGY_LEVEL_MAX  255
+
+typedef struct
+{
+  int64_t from_q8;
+  uint8_t to;
+  int64_t start_us;
+  int64_t end_us;
+  int64_t last_us;  // Totals are integrated up to here
+  uint16_t watts;
+  uint32_t level_rem; // Fractions left over from the last update
+  uint32_t energy_rem;
+} energy_channel_t;
+
+static energy_channel_t energy_channels[4];
+static energy_totals_t energy_totals;
+static portMUX_TYPE energy_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static int64_t level_q8_at(const energy_channel_t* ch, int64_t t)
+{
+    if (t >= ch->end_us) {
+        return ENERGY_Q8(ch->to);
+    }
+    return ch->from_q8 + ((ENERGY_Q8(ch->to) - ch->from_q8) * (t - ch->start_us)) / (ch->end_us - ch->start_us);
+}
+
+// Adds everything from the last update up to now to the totals
+// Must be called with energy_mux held
+static void energy_integrate(uint8_t channel, int64_t now)
+{
+    energy_channel_t* ch = &energy_channels[channel];
+    int64_t a = ch->last_us;
+    if (now <= a) {
+        return;
+    }
+    uint64_t area_q8 = 0;
+    uint64_t on_us = 0;
+
+    // Part of the ramp still to go, using the trapezoid rule
+    if (a < ch->end_us) {
+        int64_t b = MIN(now, ch->end_us);
+        area_q8 += ((level_q8_at(ch, a) + level_q8_at(ch, b)) * (b - a)) / 2;
+        if (ch->from_q8 > 0 || ch->to > 0) {
+            on_us += b - a;
+        }
+        a = b;
+    }
+    // Steady at the target level after that
+    if (now > a) {
+        area_q8 += ENERGY_Q8(ch->to) * (now - a);
+        if (ch->to > 0) {
+            on_us += now - a;
+        }
+    }
+    ch->last_us = now;
+
+    area_q8 += ch->level_rem;
+    uint64_t level_us = area_q8 >> 8;
+    ch->level_rem = area_q8 & 0xFF;
+
+    uint64_t energy = (level_us * ch->watts) + ch->energy_rem;
+    ch->energy_rem = energy % ENERGY_LEVEL_MAX;
+
+    energy_totals.level_us[channel] += level_us;
+    energy_totals.on_us[channel] += on_us;
+    energy_totals.energy_uj[channel] += energy / ENERGY_LEVEL_MAX;
+}
+
+// Starts tracking from the saved totals. Every output starts off
+void energy_init(const energy_totals_t* saved, const uint16_t* watts)
+{
+    int64_t now = esp_timer_get_time();
+    energy_totals = *saved;
+    for (int i = 0; i < 4; i++) {
+        memset(&energy_channels[i], 0, sizeof(energy_channel_t));
+        energy_channels[i].start_us = now;
+        energy_channels[i].end_us = now;
+        energy_channels[i].last_us = now;
+        energy_channels[i].watts = watts[i];
+    }
+}
+
+// Called every time an output is set. The output moves from wherever it is
+// now to the new level over fade_ms, or right away if fade_ms is 0
+void energy_set_level(uint8_t channel, uint8_t level, uint32_t fade_ms)
+{
+    if (channel > 3) {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&energy_mux);
+    energy_channel_t* ch = &energy_channels[channel];
+    energy_integrate(channel, now);
+    ch->from_q8 = level_q8_at(ch, now);
+    ch->to = level;
+    ch->start_us = now;
+    ch->end_us = now + ((int64_t)fade_ms * 1000);
+    portEXIT_CRITICAL(&energy_mux);
+}
+
+// Sets the load on an output. Energy already counted keeps the old wattage
+void energy_set_watts(uint8_t channel, uint16_t watts)
+{
+    if (channel > 3) {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&energy_mux);
+    energy_integrate(channel, now);
+    energy_channels[channel].watts = watts;
+    portEXIT_CRITICAL(&energy_mux);
+}
+
+uint16_t energy_get_watts(uint8_t channel)
+{
+    return channel < 4 ? energy_channels[channel].watts : 0;
+}
+
+// Brings the totals up to now and copies them out
+void energy_get_totals(energy_totals_t* totals)
+{
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&energy_mux);
+    for (uint8_t i = 0; i < 4; i++) {
+        energy_integrate(i, now);
+    }
+    *totals = energy_totals;
+    portEXIT_CRITICAL(&energy_mux);
+}
+
+uint64_t energy_on_hours_x1000(const energy_totals_t* totals, uint8_t channel)
+{
+    return totals->on_us[channel] / 3600000ULL;
+}
+
+uint64_t energy_watt_hours_x1000(const energy_totals_t* totals, uint8_t channel)
+{
+    return totals->energy_uj[channel] / 3600000ULL;
+}
+
+// Writes a fixed point value with 3 decimals, e.g. 1500 as "1.500"
+void energy_format_x1000(uint64_t value, char* buf, size_t size)
+{
+    snprintf(buf, size, "%llu.%03u", (unsigned long long)(value / 1000), (unsigned int)(value % 1000));
+}
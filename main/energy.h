@@ -0,0 +1,28 @@
+#ifndef ENERGY_H_INCLUDED
+#define ENERGY_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Running totals for each output, saved in NVS as a single blob
+// level_us is the brightness (0-255) integrated over time, so
+// level_us / (255 * on_us) is the average duty while the light was on
+typedef struct
+{
+  uint64_t level_us[4];
+  uint64_t on_us[4];
+  uint64_t energy_uj[4]; // Microjoules at the load wattage in effect at the time
+} energy_totals_t;
+
+void energy_init(const energy_totals_t* saved, const uint16_t* watts);
+void energy_set_level(uint8_t channel, uint8_t level, uint32_t fade_ms);
+void energy_set_watts(uint8_t channel, uint16_t watts);
+uint16_t energy_get_watts(uint8_t channel);
+void energy_get_totals(energy_totals_t* totals);
+
+// Conversions for reporting. Fixed point with 3 decimals, e.g. 1500 = 1.5
+uint64_t energy_on_hours_x1000(const energy_totals_t* totals, uint8_t channel);
+uint64_t energy_watt_hours_x1000(const energy_totals_t* totals, uint8_t channel);
+void energy_format_x1000(uint64_t value, char* buf, size_t size);
+
+#endif
@@ -325,11 +325,10 @@ JSMN_API int jsmn_parse(jsmn_parser *parser, const char *js, const size_t len,
           parser->toksuper = token->parent;
           break;
         }
+        /* Error if unmatched closing bracket, as without parent links.
+         * Upstream let this through once a key followed the closed root */
         if (token->parent == -1) {
-          if (token->type != type || parser->toksuper == -1) {
-            return JSMN_ERROR_INVAL;
-          }
-          break;
+          return JSMN_ERROR_INVAL;
         }
         token = &tokens[token->parent];
       }
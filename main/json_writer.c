@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "json_writer.h"
+
+void json_writer_init(json_writer_t* writer, char* buf, size_t size)
+{
+    writer->buf = buf;
+    writer->size = size;
+    writer->len = 0;
+    writer->overflow = 0;
+    if (size > 0) {
+        buf[0] = '\0';
+    }
+}
+
+// Appends len bytes, keeping room for the NUL terminator
+static void json_write_bytes(json_writer_t* writer, const char* data, size_t len)
+{
+    if (writer->overflow || writer->len + len >= writer->size) {
+        writer->overflow = 1;
+        return;
+    }
+    memcpy(writer->buf + writer->len, data, len);
+    writer->len += len;
+    writer->buf[writer->len] = '\0';
+}
+
+// Appends text as is. Used for the structure of the document
+void json_write_raw(json_writer_t* writer, const char* str)
+{
+    json_write_bytes(writer, str, strlen(str));
+}
+
+// Appends a quoted string, escaping quotes, backslashes and control characters
+// Bytes above 0x7F are copied through so UTF-8 names are kept
+void json_write_string(json_writer_t* writer, const char* str)
+{
+    json_write_bytes(writer, "\"", 1);
+    const char* run = str;
+    for (const char* c = str; *c != '\0'; c++) {
+        unsigned char ch = (unsigned char)*c;
+        if (ch != '"' && ch != '\\' && ch >= 0x20) {
+            continue;
+        }
+        // Copy everything up to the character that needs escaping in one go
+        json_write_bytes(writer, run, c - run);
+        char escaped[7];
+        switch (ch) {
+            case '"':  strcpy(escaped, "\\\""); break;
+            case '\\': strcpy(escaped, "\\\\"); break;
+            case '\n': strcpy(escaped, "\\n"); break;
+            case '\r': strcpy(escaped, "\\r"); break;
+            case '\t': strcpy(escaped, "\\t"); break;
+            default:   sprintf(escaped, "\\u%04x", ch); break;
+        }
+        json_write_raw(writer, escaped);
+        run = c + 1;
+    }
+    json_write_raw(writer, run);
+    json_write_bytes(writer, "\"", 1);
+}
+
+void json_write_int(json_writer_t* writer, int value)
+{
+    char num_str[12];
+    int len = sprintf(num_str, "%d", value);
+    json_write_bytes(writer, num_str, len);
+}
+
+// Appends "key": so the value can be written next
+void json_write_key(json_writer_t* writer, const char* key)
+{
+    json_write_string(writer, key);
+    json_write_bytes(writer, ": ", 2);
+}
@@ -0,0 +1,24 @@
+#ifndef JSON_WRITER_H_INCLUDED
+#define JSON_WRITER_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Bounded JSON writer. Everything is appended to a caller supplied buffer
+// and nothing is ever written past the end of it. If the output doesn't
+// fit, overflow is set and the buffer holds a truncated document
+typedef struct
+{
+  char* buf;
+  size_t size;
+  size_t len;
+  uint8_t overflow;
+} json_writer_t;
+
+void json_writer_init(json_writer_t* writer, char* buf, size_t size);
+void json_write_raw(json_writer_t* writer, const char* str);
+void json_write_string(json_writer_t* writer, const char* str);
+void json_write_int(json_writer_t* writer, int value);
+void json_write_key(json_writer_t* writer, const char* key);
+
+#endif
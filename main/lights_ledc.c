@@ -1,100 +1,671 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+
 #include "lights_ledc.h"
+#include "energy.h"
 #include "driver/ledc.h"
+#include "sdkconfig.h"
 
-#define LEDC_TIMER              LEDC_TIMER_0
 #define LEDC_MODE               LEDC_LOW_SPEED_MODE // ESP32-C3 only supports low speed mode
 #define LEDC_OUTPUT_IO_0        (7) // Define the output GPIO7
 #define LEDC_OUTPUT_IO_1        (6) // Define the output GPIO6
 #define LEDC_OUTPUT_IO_2        (5) // Define the output GPIO5
 #define LEDC_OUTPUT_IO_3        (4) // Define the output GPIO4
-#define LEDC_DUTY_RES           LEDC_TIMER_8_BIT // Set duty resolution to 8 bits
-#define LEDC_FREQUENCY          (25000) // Frequency in Hertz. Set frequency at 25 kHz
 #define LEDC_FADE_TIME          (250) // 250ms
 
+// PWM frequency for each channel, set in menuconfig under "Smart Light Outputs"
+#ifndef CONFIG_LIGHT0_PWM_FREQUENCY
+#define CONFIG_LIGHT0_PWM_FREQUENCY 25000
+#endif
+#ifndef CONFIG_LIGHT1_PWM_FREQUENCY
+#define CONFIG_LIGHT1_PWM_FREQUENCY 25000
+#endif
+#ifndef CONFIG_LIGHT2_PWM_FREQUENCY
+#define CONFIG_LIGHT2_PWM_FREQUENCY 25000
+#endif
+#ifndef CONFIG_LIGHT3_PWM_FREQUENCY
+#define CONFIG_LIGHT3_PWM_FREQUENCY 25000
+#endif
+
+// Every timer runs from the 80 MHz APB clock, so the widest duty resolution
+// for a frequency is the number of clock ticks per PWM period, rounded down
+// to a power of 2. Anything under 8 bits would make the low end steppy, so
+// frequencies that high fall back to the default
+#define LEDC_CLK_HZ             (80000000)
+#define LEDC_MAX_DUTY_RES       (14) // Widest duty resolution on the ESP32-C3
+#define LEDC_MIN_DUTY_RES       (8)
+#define LEDC_DEFAULT_FREQUENCY  (25000)
+
+// Brightness is always 0-255 in the API and scaled to each channel's resolution
+#define LIGHTS_PWM_MAX          (255)
+
+// Longer transitions are split into hardware fade segments so the timing
+// can be corrected against the clock as it goes
+#define LIGHTS_FADE_SEGMENT_MS  (1000) // 1s
+// The fader can wait at most 1023 PWM cycles per duty step. Anything slower
+// than this per step is stepped from a timer instead
+#define LIGHTS_FADE_MAX_STEP_US(freq_hz) ((1023LL * 1000000) / (freq_hz))
+
+// Fixed step times for each effect. Each step is one hardware fade
+// (or one duty change for strobe) started from the fade end interrupt
+#define EFFECT_BREATHE_STEP_MS  (1000) // Half of one breath
+#define EFFECT_CANDLE_STEP_MS   (100)
+#define EFFECT_STROBE_STEP_MS   (50)
+
+// What starts the next step of a channel. Only one is armed at a time, and
+// an event from anything else is stale and ignored. Setting a duty directly
+// still ends with a fade end interrupt, which is why this is needed
+typedef enum
+{
+  LIGHTS_STEP_NONE = 0,
+  LIGHTS_STEP_FADE,  // Fade end interrupt
+  LIGHTS_STEP_TIMER, // Step timer
+} lights_step_source_t;
+
+// Sent to the fade task when a step source fires
+typedef struct
+{
+  uint8_t channel;
+  uint8_t source;
+  uint32_t generation;
+  int64_t sent_us; // When the source fired, so an effect step is timed from there
+} lights_step_event_t;
+
+// State for a transition or effect running on one channel. The expected duty
+// at any time is interpolated from the start and end so segments never drift
+typedef struct
+{
+  uint8_t active;
+  uint8_t step_source;            // lights_step_source_t armed for the next step
+  volatile uint32_t generation;   // Bumped by every new command so old events are dropped
+  uint32_t start_duty;
+  uint32_t target_duty;
+  int64_t start_us;
+  int64_t end_us;
+  esp_timer_handle_t step_timer;
+  lights_effect_t effect;
+  uint32_t effect_level;
+  uint32_t effect_phase;
+  uint32_t effect_rand;
+  uint32_t effect_busy_us;     // Sum of effect step times, for CPU reporting
+  uint32_t effect_step_max_us; // Longest effect step
+} lights_transition_t;
+
+static const char* effect_names[LIGHTS_EFFECT_COUNT] = {
+    "none",
+    "breathe",
+    "candle",
+    "strobe"
+};
+
+// PWM setup for one channel. Channels with the same frequency share a timer
+typedef struct
+{
+  int gpio;
+  uint32_t freq_hz;
+  uint8_t duty_res;
+  uint32_t max_duty;
+  ledc_timer_t timer;
+} lights_channel_t;
+
+static lights_channel_t channels[4] = {
+    { .gpio = LEDC_OUTPUT_IO_0, .freq_hz = CONFIG_LIGHT0_PWM_FREQUENCY },
+    { .gpio = LEDC_OUTPUT_IO_1, .freq_hz = CONFIG_LIGHT1_PWM_FREQUENCY },
+    { .gpio = LEDC_OUTPUT_IO_2, .freq_hz = CONFIG_LIGHT2_PWM_FREQUENCY },
+    { .gpio = LEDC_OUTPUT_IO_3, .freq_hz = CONFIG_LIGHT3_PWM_FREQUENCY },
+};
+
+// Frequency and resolution each timer was configured with. 0 means unused
+static uint32_t timer_freq_hz[LEDC_TIMER_MAX];
+static uint8_t timer_duty_res[LEDC_TIMER_MAX];
+
+// Debug tag for log statements
+static const char *TAG = "Lights";
+
+static lights_transition_t transitions[4];
+static SemaphoreHandle_t transition_mutex = NULL;
+static StaticSemaphore_t transition_mutex_buffer;
+
+// Channels whose segment ended are queued here from the fade end interrupt
+// and the step timers, then the fade task starts the next segment
+// The queue and the task are static so nothing here comes from the heap
+#define LIGHTS_FADE_QUEUE_LENGTH  8
+#define LIGHTS_FADE_TASK_STACK    2048
+static QueueHandle_t fade_queue = NULL;
+static StaticQueue_t fade_queue_buffer;
+static uint8_t fade_queue_storage[LIGHTS_FADE_QUEUE_LENGTH * sizeof(lights_step_event_t)];
+static StackType_t fade_task_stack[LIGHTS_FADE_TASK_STACK];
+static StaticTask_t fade_task_tcb;
+
+static void lights_fade_task(void *Param);
+static bool lights_fade_end_cb(const ledc_cb_param_t *param, void *user_arg);
+static void lights_step_timer_cb(void *arg);
+
+// Widest duty resolution the clock divider allows at a frequency
+static uint8_t max_duty_resolution(uint32_t freq_hz)
+{
+    uint8_t bits = 0;
+    while (bits < LEDC_MAX_DUTY_RES && ((uint64_t)freq_hz << (bits + 1)) <= LEDC_CLK_HZ) {
+        bits++;
+    }
+    return bits;
+}
+
+// Finds a timer already running at this frequency and resolution, or
+// configures a free one. Returns -1 if every timer is taken or the config fails
+static int lights_timer_for(uint32_t freq_hz, uint8_t duty_res)
+{
+    for (int timer = 0; timer < LEDC_TIMER_MAX; timer++) {
+        if (timer_freq_hz[timer] == freq_hz && timer_duty_res[timer] == duty_res) {
+            return timer;
+        }
+    }
+    for (int timer = 0; timer < LEDC_TIMER_MAX; timer++) {
+        if (timer_freq_hz[timer] == 0) {
+            ledc_timer_config_t ledc_timer = {
+                .speed_mode       = LEDC_MODE,
+                .timer_num        = timer,
+                .duty_resolution  = duty_res,
+                .freq_hz          = freq_hz,
+                .clk_cfg          = LEDC_USE_APB_CLK
+            };
+            if (ledc_timer_config(&ledc_timer) != ESP_OK) {
+                return -1;
+            }
+            timer_freq_hz[timer] = freq_hz;
+            timer_duty_res[timer] = duty_res;
+            return timer;
+        }
+    }
+    return -1;
+}
+
+// Picks the frequency, resolution and timer for a channel
+// If the frequency can't be used the channel falls back to the default, and
+// if no timer is left it shares the timer with the closest frequency
+static void lights_channel_setup(uint8_t channel)
+{
+    lights_channel_t* ch = &channels[channel];
+    uint8_t duty_res = max_duty_resolution(ch->freq_hz);
+    if (ch->freq_hz == 0 || duty_res < LEDC_MIN_DUTY_RES) {
+        ESP_LOGW(TAG, "Channel %d: %d Hz is out of range. Using %d Hz", channel, ch->freq_hz, LEDC_DEFAULT_FREQUENCY);
+        ch->freq_hz = LEDC_DEFAULT_FREQUENCY;
+        duty_res = max_duty_resolution(ch->freq_hz);
+    }
+    int timer = lights_timer_for(ch->freq_hz, duty_res);
+    if (timer < 0) {
+        for (int t = 0; t < LEDC_TIMER_MAX; t++) {
+            if (timer_freq_hz[t] != 0 && (timer < 0 || abs((int)timer_freq_hz[t] - (int)ch->freq_hz) < abs((int)timer_freq_hz[timer] - (int)ch->freq_hz))) {
+                timer = t;
+            }
+        }
+        if (timer < 0) {
+            // Nothing could be configured, so the default has to work
+            timer = LEDC_TIMER_0;
+            duty_res = max_duty_resolution(LEDC_DEFAULT_FREQUENCY);
+            ledc_timer_config_t ledc_timer = {
+                .speed_mode       = LEDC_MODE,
+                .timer_num        = timer,
+                .duty_resolution  = duty_res,
+                .freq_hz          = LEDC_DEFAULT_FREQUENCY,
+                .clk_cfg          = LEDC_USE_APB_CLK
+            };
+            ESP_ERROR_CHECK(ledc_timer_config(&ledc_timer));
+            timer_freq_hz[timer] = LEDC_DEFAULT_FREQUENCY;
+            timer_duty_res[timer] = duty_res;
+        }
+        ESP_LOGW(TAG, "Channel %d: no timer free for %d Hz. Sharing timer %d at %d Hz", channel, ch->freq_hz, timer, timer_freq_hz[timer]);
+        ch->freq_hz = timer_freq_hz[timer];
+        duty_res = timer_duty_res[timer];
+    }
+    ch->timer = timer;
+    ch->duty_res = duty_res;
+    ch->max_duty = (1UL << duty_res) - 1;
+    ESP_LOGI(TAG, "Channel %d: %d Hz, %d bit on timer %d", channel, ch->freq_hz, ch->duty_res, ch->timer);
+}
+
+// Scales a 0-255 brightness to the channel's duty resolution
+static uint32_t lights_duty_from_pwm(int channel, int pwm)
+{
+    pwm = MAX(0, MIN(pwm, LIGHTS_PWM_MAX));
+    return (((uint32_t)pwm * channels[channel].max_duty) + (LIGHTS_PWM_MAX / 2)) / LIGHTS_PWM_MAX;
+}
+
+// Tells the energy counters where a channel is heading
+static void lights_track_level(int channel, int pwm, uint32_t fade_ms)
+{
+    energy_set_level(channel, MAX(0, MIN(pwm, LIGHTS_PWM_MAX)), fade_ms);
+}
+
 void lights_ledc_init(void)
 {
-    // Prepare and then apply the LEDC PWM timer configuration
-    ledc_timer_config_t ledc_timer = {
-        .speed_mode       = LEDC_MODE,
-        .timer_num        = LEDC_TIMER,
-        .duty_resolution  = LEDC_DUTY_RES,
-        .freq_hz          = LEDC_FREQUENCY,  // Set output frequency at 5 kHz
-        .clk_cfg          = LEDC_AUTO_CLK
-    };
-    ESP_ERROR_CHECK(ledc_timer_config(&ledc_timer));
-
-    // Prepare and then apply the LEDC PWM channel configuration
-    ledc_channel_config_t ledc_channel_0 = {
-        .speed_mode     = LEDC_MODE,
-        .channel        = LEDC_CHANNEL_0,
-        .timer_sel      = LEDC_TIMER,
-        .intr_type      = LEDC_INTR_DISABLE,
-        .gpio_num       = LEDC_OUTPUT_IO_0,
-        .duty           = 0, // Set duty to 0%
-        .hpoint         = 0
-    };
-    ESP_ERROR_CHECK(ledc_channel_config(&ledc_channel_0));
-
-    ledc_channel_config_t ledc_channel_1 = {
-        .speed_mode     = LEDC_MODE,
-        .channel        = LEDC_CHANNEL_1,
-        .timer_sel      = LEDC_TIMER,
-        .intr_type      = LEDC_INTR_DISABLE,
-        .gpio_num       = LEDC_OUTPUT_IO_1,
-        .duty           = 0, // Set duty to 0%
-        .hpoint         = 0
-    };
-    ESP_ERROR_CHECK(ledc_channel_config(&ledc_channel_1));
-
-    ledc_channel_config_t ledc_channel_2 = {
-        .speed_mode     = LEDC_MODE,
-        .channel        = LEDC_CHANNEL_2,
-        .timer_sel      = LEDC_TIMER,
-        .intr_type      = LEDC_INTR_DISABLE,
-        .gpio_num       = LEDC_OUTPUT_IO_2,
-        .duty           = 0, // Set duty to 0%
-        .hpoint         = 0
+    for (int channel = 0; channel < 4; channel++) {
+        lights_channel_setup(channel);
+
+        // Prepare and then apply the LEDC PWM channel configuration
+        ledc_channel_config_t ledc_channel = {
+            .speed_mode     = LEDC_MODE,
+            .channel        = channel,
+            .timer_sel      = channels[channel].timer,
+            .intr_type      = LEDC_INTR_DISABLE,
+            .gpio_num       = channels[channel].gpio,
+            .duty           = 0, // Set duty to 0%
+            .hpoint         = 0
+        };
+        ESP_ERROR_CHECK(ledc_channel_config(&ledc_channel));
+    }
+
+    ESP_ERROR_CHECK(ledc_fade_func_install(0));
+
+    transition_mutex = xSemaphoreCreateMutexStatic(&transition_mutex_buffer);
+    fade_queue = xQueueCreateStatic(LIGHTS_FADE_QUEUE_LENGTH, sizeof(lights_step_event_t), fade_queue_storage, &fade_queue_buffer);
+    ledc_cbs_t fade_cbs = {
+        .fade_cb = lights_fade_end_cb,
     };
-    ESP_ERROR_CHECK(ledc_channel_config(&ledc_channel_2));
-
-    ledc_channel_config_t ledc_channel_3 = {
-        .speed_mode     = LEDC_MODE,
-        .channel        = LEDC_CHANNEL_3,
-        .timer_sel      = LEDC_TIMER,
-        .intr_type      = LEDC_INTR_DISABLE,
-        .gpio_num       = LEDC_OUTPUT_IO_3,
-        .duty           = 0, // Set duty to 0%
-        .hpoint         = 0
+    for (int channel = 0; channel < 4; channel++) {
+        esp_timer_create_args_t timer_args = {
+            .callback = lights_step_timer_cb,
+            .arg = (void*)(intptr_t)channel,
+            .name = "light_step",
+        };
+        ESP_ERROR_CHECK(esp_timer_create(&timer_args, &transitions[channel].step_timer));
+        ESP_ERROR_CHECK(ledc_cb_register(LEDC_MODE, channel, &fade_cbs, (void*)(intptr_t)channel));
+    }
+    xTaskCreateStatic(lights_fade_task, "lights_fade_task", LIGHTS_FADE_TASK_STACK, NULL, 6, fade_task_stack, &fade_task_tcb);
+}
+
+// Called from the LEDC interrupt when a hardware fade finishes
+static bool IRAM_ATTR lights_fade_end_cb(const ledc_cb_param_t *param, void *user_arg)
+{
+    BaseType_t task_woken = pdFALSE;
+    if (param->event == LEDC_FADE_END_EVT) {
+        uint8_t channel = (uint8_t)(intptr_t)user_arg;
+        lights_step_event_t event = {
+            .channel = channel,
+            .source = LIGHTS_STEP_FADE,
+            .generation = transitions[channel].generation,
+            .sent_us = esp_timer_get_time(),
+        };
+        xQueueSendFromISR(fade_queue, &event, &task_woken);
+    }
+    return task_woken == pdTRUE;
+}
+
+// Called from the esp_timer task when a slow transition is due for its next step
+static void lights_step_timer_cb(void *arg)
+{
+    uint8_t channel = (uint8_t)(intptr_t)arg;
+    lights_step_event_t event = {
+        .channel = channel,
+        .source = LIGHTS_STEP_TIMER,
+        .generation = transitions[channel].generation,
+        .sent_us = esp_timer_get_time(),
     };
-    ESP_ERROR_CHECK(ledc_channel_config(&ledc_channel_3));
+    xQueueSend(fade_queue, &event, 0);
+}
 
-    ESP_ERROR_CHECK(ledc_fade_func_install(0));
+// Arms the fade end interrupt as the next step by starting a hardware fade
+// Must be called with the transition mutex held and no fade running
+static void step_on_fade(uint8_t channel, uint32_t duty, uint32_t fade_ms)
+{
+    transitions[channel].step_source = LIGHTS_STEP_FADE;
+    ledc_set_fade_with_time(LEDC_MODE, channel, duty, fade_ms);
+    ledc_fade_start(LEDC_MODE, channel, LEDC_FADE_NO_WAIT);
+}
+
+// Arms the step timer as the next step. Must be called with the transition mutex held
+static void step_on_timer(uint8_t channel, uint64_t timeout_us)
+{
+    transitions[channel].step_source = LIGHTS_STEP_TIMER;
+    esp_timer_start_once(transitions[channel].step_timer, timeout_us);
+}
+
+// Stops whatever is driving a channel so a new command can take it over
+// The running fade is stopped where it is rather than waited for, so this
+// never blocks. Must be called with the transition mutex held
+static void channel_stop(uint8_t channel)
+{
+    lights_transition_t* tr = &transitions[channel];
+    esp_timer_stop(tr->step_timer);
+    ledc_fade_stop(LEDC_MODE, channel);
+    tr->generation++;
+    tr->step_source = LIGHTS_STEP_NONE;
+}
+
+// Returns the duty a transition should be at for the given time
+static uint32_t transition_duty_at(lights_transition_t* tr, int64_t time_us)
+{
+    if (time_us >= tr->end_us) {
+        return tr->target_duty;
+    }
+    int64_t delta = (int64_t)tr->target_duty - (int64_t)tr->start_duty;
+    return tr->start_duty + ((delta * (time_us - tr->start_us)) / (tr->end_us - tr->start_us));
+}
+
+// Xorshift PRNG so effects like candle flicker are cheap and repeat the same way every time
+static uint32_t effect_random(lights_transition_t* tr)
+{
+    uint32_t x = tr->effect_rand;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    tr->effect_rand = x;
+    return x;
+}
+
+// Fades to a duty for one effect step. If the duty doesn't change there is
+// no fade end interrupt, so the step timer is used to keep the timing
+static void effect_fade_to(uint8_t channel, uint32_t duty, uint32_t fade_ms)
+{
+    if (duty == ledc_get_duty(LEDC_MODE, channel)) {
+        step_on_timer(channel, fade_ms * 1000);
+    }
+    else {
+        step_on_fade(channel, duty, fade_ms);
+    }
+}
+
+// Starts the next step of an effect. Must be called with the transition mutex held
+static void effect_step(uint8_t channel)
+{
+    lights_transition_t* tr = &transitions[channel];
+    switch (tr->effect) {
+    case LIGHTS_EFFECT_BREATHE:
+        // Fade between full and 1/8 brightness
+        effect_fade_to(channel, (tr->effect_phase & 1) ? tr->effect_level / 8 : tr->effect_level, EFFECT_BREATHE_STEP_MS);
+        break;
+    case LIGHTS_EFFECT_CANDLE:
+        // Flicker randomly between 60% and 100% brightness
+        effect_fade_to(channel, tr->effect_level - ((tr->effect_level * (effect_random(tr) % 41)) / 100), EFFECT_CANDLE_STEP_MS);
+        break;
+    case LIGHTS_EFFECT_STROBE:
+        ledc_set_duty_and_update(LEDC_MODE, channel, (tr->effect_phase & 1) ? 0 : tr->effect_level, 0);
+        step_on_timer(channel, EFFECT_STROBE_STEP_MS * 1000);
+        break;
+    default:
+        break;
+    }
+    tr->effect_phase++;
 }
 
+// Adds the time one event took to the CPU count of the effect on its channel
+static void effect_count_step(lights_transition_t* tr, int64_t step_us)
+{
+    tr->effect_busy_us += step_us;
+    tr->effect_step_max_us = MAX(tr->effect_step_max_us, step_us);
+}
+
+// Logs how much CPU an effect used when it stops
+static void effect_stop(uint8_t channel)
+{
+    lights_transition_t* tr = &transitions[channel];
+    if (tr->effect != LIGHTS_EFFECT_NONE) {
+        int64_t run_us = esp_timer_get_time() - tr->start_us;
+        ESP_LOGI(TAG, "Effect %s stopped on channel %d: %d steps, %dus busy (longest step %dus) in %dms (%d.%03d%% CPU)",
+            effect_names[tr->effect], channel, tr->effect_phase, tr->effect_busy_us, tr->effect_step_max_us, (int)(run_us / 1000),
+            (int)((tr->effect_busy_us * 100LL) / MAX(run_us, 1)), (int)(((tr->effect_busy_us * 100000LL) / MAX(run_us, 1)) % 1000));
+        tr->effect = LIGHTS_EFFECT_NONE;
+    }
+}
+
+// Starts the next piece of a transition. Must be called with the transition mutex held
+//  - If the duty steps are slow enough that the fader can't wait that long between
+//    steps, the duty is set to where it should be now and a timer is started for the next step
+//  - Otherwise a hardware fade is started for the next segment and the fade end
+//    interrupt queues the one after
+static void transition_step(uint8_t channel)
+{
+    lights_transition_t* tr = &transitions[channel];
+    if (tr->active == 0) {
+        return;
+    }
+    if (tr->effect != LIGHTS_EFFECT_NONE) {
+        effect_step(channel);
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    uint32_t total_steps = abs((int)tr->target_duty - (int)tr->start_duty);
+    if (now >= tr->end_us || total_steps == 0) {
+        ledc_set_duty_and_update(LEDC_MODE, channel, tr->target_duty, 0);
+        tr->active = 0;
+        tr->step_source = LIGHTS_STEP_NONE;
+        return;
+    }
+
+    int64_t total_us = tr->end_us - tr->start_us;
+    if (total_us / total_steps > LIGHTS_FADE_MAX_STEP_US(channels[channel].freq_hz)) {
+        uint32_t duty = transition_duty_at(tr, now);
+        ledc_set_duty_and_update(LEDC_MODE, channel, duty, 0);
+        uint32_t steps_done = abs((int)duty - (int)tr->start_duty);
+        int64_t next_us = tr->start_us + ((total_us * (steps_done + 1)) / total_steps);
+        step_on_timer(channel, MAX(next_us - now, 1000));
+    }
+    else {
+        int64_t segment_end = MIN(now + (LIGHTS_FADE_SEGMENT_MS * 1000), tr->end_us);
+        uint32_t duty = transition_duty_at(tr, segment_end);
+        if (duty == ledc_get_duty(LEDC_MODE, channel)) {
+            // Nothing to fade in a short last segment, and no fade means
+            // no fade end interrupt, so wait on the timer instead
+            step_on_timer(channel, MAX(segment_end - now, 1000));
+        }
+        else {
+            step_on_fade(channel, duty, (segment_end - now) / 1000);
+        }
+    }
+}
+
+// Starts the next segment of any channel whose last segment just ended
+// Events from a source that isn't armed, or from before the last command, are dropped
+// An effect step is timed from when its source fired to when the next one
+// is armed, so the interrupt or timer callback, the queue, the task waking
+// and waiting for the mutex are all counted, not just the step itself. An
+// event dropped while an effect runs is counted the same way, e.g. the fade
+// end every strobe duty change raises. Time the task spent waiting for
+// higher priority tasks is counted too, so this is an upper bound on the
+// CPU the effect costs
+static void lights_fade_task(void *Param)
+{
+    lights_step_event_t event;
+    while(1) {
+        if (xQueueReceive(fade_queue, &event, portMAX_DELAY) == pdTRUE && event.channel < 4) {
+            xSemaphoreTake(transition_mutex, portMAX_DELAY);
+            lights_transition_t* tr = &transitions[event.channel];
+            if (event.source == tr->step_source && event.generation == tr->generation) {
+                tr->step_source = LIGHTS_STEP_NONE;
+                transition_step(event.channel);
+            }
+            if (tr->effect != LIGHTS_EFFECT_NONE) {
+                effect_count_step(tr, esp_timer_get_time() - event.sent_us);
+            }
+            xSemaphoreGive(transition_mutex);
+        }
+    }
+}
+
+// Stops a running transition so a new command can take over the channel
+// Must be called with the transition mutex held
+static void transition_cancel(uint8_t channel)
+{
+    channel_stop(channel);
+    transitions[channel].active = 0;
+    effect_stop(channel);
+}
+
+// Sets up a transition from the current duty. Must be called with the transition mutex held
+static void transition_start(uint8_t channel, uint32_t duty, uint32_t fade_ms, int64_t start_us)
+{
+    lights_transition_t* tr = &transitions[channel];
+    channel_stop(channel);
+    effect_stop(channel);
+    tr->start_duty = ledc_get_duty(LEDC_MODE, channel);
+    tr->target_duty = duty;
+    tr->start_us = start_us;
+    tr->end_us = start_us + ((int64_t)fade_ms * 1000);
+    tr->active = 1;
+}
+
+// Fades a channel to a new brightness over the default time scaled by
+// how far the brightness changes, so a full 0 to 255 fade takes LEDC_FADE_TIME
 void lights_set_brightness(int pwm, int channel)
 {
-    if (channel == 0) {
-        uint32_t duty_to_fade = ledc_get_duty(LEDC_MODE, LEDC_CHANNEL_0);
-        duty_to_fade = (abs(duty_to_fade - pwm) * LEDC_FADE_TIME) / 255;
-        ledc_set_fade_with_time(LEDC_MODE, LEDC_CHANNEL_0, pwm, duty_to_fade);
-        ledc_fade_start(LEDC_MODE, LEDC_CHANNEL_0, LEDC_FADE_NO_WAIT);
-    }
-    else if (channel == 1) {
-        uint32_t duty_to_fade = ledc_get_duty(LEDC_MODE, LEDC_CHANNEL_1);
-        duty_to_fade = (abs(duty_to_fade - pwm) * LEDC_FADE_TIME) / 255;
-        ledc_set_fade_with_time(LEDC_MODE, LEDC_CHANNEL_1, pwm, duty_to_fade);
-        ledc_fade_start(LEDC_MODE, LEDC_CHANNEL_1, LEDC_FADE_NO_WAIT);
-    }
-    else if (channel == 2) {
-        uint32_t duty_to_fade = ledc_get_duty(LEDC_MODE, LEDC_CHANNEL_2);
-        duty_to_fade = (abs(duty_to_fade - pwm) * LEDC_FADE_TIME) / 255;
-        ledc_set_fade_with_time(LEDC_MODE, LEDC_CHANNEL_2, pwm, duty_to_fade);
-        ledc_fade_start(LEDC_MODE, LEDC_CHANNEL_2, LEDC_FADE_NO_WAIT);
-    }
-    else if (channel == 3) {
-        uint32_t duty_to_fade = ledc_get_duty(LEDC_MODE, LEDC_CHANNEL_3);
-        duty_to_fade = (abs(duty_to_fade - pwm) * LEDC_FADE_TIME) / 255;
-        ledc_set_fade_with_time(LEDC_MODE, LEDC_CHANNEL_3, pwm, duty_to_fade);
-        ledc_fade_start(LEDC_MODE, LEDC_CHANNEL_3, LEDC_FADE_NO_WAIT);
+    if (channel < 0 || channel > 3) {
+        return;
+    }
+    xSemaphoreTake(transition_mutex, portMAX_DELAY);
+    transition_cancel(channel);
+    uint32_t duty = lights_duty_from_pwm(channel, pwm);
+    uint32_t current = ledc_get_duty(LEDC_MODE, channel);
+    // The duties are unsigned, so take the difference the right way round
+    uint32_t change = (current > duty) ? (current - duty) : (duty - current);
+    uint32_t fade_ms = (change * LEDC_FADE_TIME) / channels[channel].max_duty;
+    // Not a transition, so its fade end starts nothing
+    ledc_set_fade_with_time(LEDC_MODE, channel, duty, fade_ms);
+    ledc_fade_start(LEDC_MODE, channel, LEDC_FADE_NO_WAIT);
+    xSemaphoreGive(transition_mutex);
+    lights_track_level(channel, pwm, fade_ms);
+}
+
+// Fades a channel to a new brightness over a fixed time instead of
+// the default time scaled by the brightness change
+// Any length works. Long fades run as a chain of hardware fade segments
+// The fade runs in duty steps, so higher resolution channels fade smoother
+void lights_set_brightness_with_time(int pwm, int channel, uint32_t fade_ms)
+{
+    if (channel < 0 || channel > 3) {
+        return;
+    }
+    xSemaphoreTake(transition_mutex, portMAX_DELAY);
+    transition_start(channel, lights_duty_from_pwm(channel, pwm), fade_ms, esp_timer_get_time());
+    transition_step(channel);
+    xSemaphoreGive(transition_mutex);
+    lights_track_level(channel, pwm, fade_ms);
+}
+
+// Starts a fade on every channel together so they all finish at the same time
+// Used when recalling a scene
+void lights_set_all_with_time(const uint8_t* pwm, uint32_t fade_ms)
+{
+    xSemaphoreTake(transition_mutex, portMAX_DELAY);
+    int64_t start_us = esp_timer_get_time();
+    for (int channel = 0; channel < 4; channel++) {
+        transition_start(channel, lights_duty_from_pwm(channel, pwm[channel]), fade_ms, start_us);
+    }
+    for (int channel = 0; channel < 4; channel++) {
+        transition_step(channel);
+    }
+    xSemaphoreGive(transition_mutex);
+    for (int channel = 0; channel < 4; channel++) {
+        lights_track_level(channel, pwm[channel], fade_ms);
+    }
+}
+
+// Sets a channel straight to a new brightness with no fade
+// Used for live control where the sender does its own fading
+void lights_set_brightness_immediate(int pwm, int channel)
+{
+    if (channel < 0 || channel > 3) {
+        return;
+    }
+    // Always stopped, since a plain fade from lights_set_brightness has no
+    // transition but would still hold up the duty change until it finished
+    xSemaphoreTake(transition_mutex, portMAX_DELAY);
+    transition_cancel(channel);
+    ledc_set_duty_and_update(LEDC_MODE, channel, lights_duty_from_pwm(channel, pwm), 0);
+    xSemaphoreGive(transition_mutex);
+    lights_track_level(channel, pwm, 0);
+}
+
+// Starts an effect on a channel at the given brightness
+// The effect keeps running from the fade end interrupt until any other
+// brightness command is sent for the channel
+void lights_start_effect(int channel, lights_effect_t effect, int pwm)
+{
+    if (channel < 0 || channel > 3 || effect >= LIGHTS_EFFECT_COUNT) {
+        return;
+    }
+    if (effect == LIGHTS_EFFECT_NONE) {
+        lights_set_brightness(pwm, channel);
+        return;
+    }
+    xSemaphoreTake(transition_mutex, portMAX_DELAY);
+    lights_transition_t* tr = &transitions[channel];
+    channel_stop(channel);
+    effect_stop(channel);
+    tr->effect = effect;
+    tr->effect_level = lights_duty_from_pwm(channel, pwm);
+    tr->effect_phase = 0;
+    tr->effect_rand = 0x9E3779B9 ^ (channel + 1); // Fixed seed so flicker is repeatable
+    tr->effect_busy_us = 0;
+    tr->effect_step_max_us = 0;
+    tr->active = 1;
+    ESP_LOGI(TAG, "Starting effect %s on channel %d", effect_names[effect], channel);
+    tr->start_us = esp_timer_get_time();
+    effect_step(channel);
+    effect_count_step(tr, esp_timer_get_time() - tr->start_us);
+    xSemaphoreGive(transition_mutex);
+
+    // Energy is counted at the average level of the effect
+    // Breathe ramps between full and 1/8, candle averages 80% and strobe is on half the time
+    pwm = MAX(0, MIN(pwm, LIGHTS_PWM_MAX));
+    if (effect == LIGHTS_EFFECT_BREATHE) {
+        lights_track_level(channel, (pwm * 9) / 16, 0);
+    }
+    else if (effect == LIGHTS_EFFECT_CANDLE) {
+        lights_track_level(channel, (pwm * 4) / 5, 0);
+    }
+    else {
+        lights_track_level(channel, pwm / 2, 0);
+    }
+}
+
+lights_effect_t lights_get_effect(int channel)
+{
+    if (channel < 0 || channel > 3) {
+        return LIGHTS_EFFECT_NONE;
+    }
+    return transitions[channel].effect;
+}
+
+void lights_get_effect_stats(int channel, lights_effect_stats_t* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (channel < 0 || channel > 3) {
+        return;
+    }
+    xSemaphoreTake(transition_mutex, portMAX_DELAY);
+    lights_transition_t* tr = &transitions[channel];
+    if (tr->effect != LIGHTS_EFFECT_NONE) {
+        stats->effect = tr->effect;
+        stats->steps = tr->effect_phase;
+        stats->busy_us = tr->effect_busy_us;
+        stats->step_max_us = tr->effect_step_max_us;
+        stats->run_ms = (uint32_t)((esp_timer_get_time() - tr->start_us) / 1000);
+    }
+    xSemaphoreGive(transition_mutex);
+}
+
+const char* lights_effect_name(lights_effect_t effect)
+{
+    if (effect >= LIGHTS_EFFECT_COUNT) {
+        return effect_names[LIGHTS_EFFECT_NONE];
+    }
+    return effect_names[effect];
+}
+
+// Returns LIGHTS_EFFECT_COUNT if the name isn't a known effect
+lights_effect_t lights_effect_from_name(const char* name, int name_len)
+{
+    for (int effect = 0; effect < LIGHTS_EFFECT_COUNT; effect++) {
+        if (name_len == strlen(effect_names[effect]) && strncmp(name, effect_names[effect], name_len) == 0) {
+            return effect;
+        }
     }
+    return LIGHTS_EFFECT_COUNT;
 }
@@ -1,7 +1,39 @@
 #ifndef LIGHTS_LEDC_H_INCLUDED
 #define LIGHTS_LEDC_H_INCLUDED
 
+#include <stdint.h>
+
+// Effects that run locally on the LEDC fader so Home Assistant
+// doesn't need to stream brightness commands
+typedef enum
+{
+  LIGHTS_EFFECT_NONE = 0,
+  LIGHTS_EFFECT_BREATHE,
+  LIGHTS_EFFECT_CANDLE,
+  LIGHTS_EFFECT_STROBE,
+  LIGHTS_EFFECT_COUNT
+} lights_effect_t;
+
+// CPU a running effect has used so far. Each step is timed from the fade
+// end interrupt or step timer that started it to the next one being armed
+typedef struct
+{
+  lights_effect_t effect; // LIGHTS_EFFECT_NONE if the channel has no effect running
+  uint32_t steps;
+  uint32_t busy_us;
+  uint32_t step_max_us;
+  uint32_t run_ms;
+} lights_effect_stats_t;
+
 void lights_ledc_init(void);
 void lights_set_brightness(int pwm, int channel);
+void lights_set_brightness_with_time(int pwm, int channel, uint32_t fade_ms);
+void lights_set_all_with_time(const uint8_t* pwm, uint32_t fade_ms);
+void lights_set_brightness_immediate(int pwm, int channel);
+void lights_start_effect(int channel, lights_effect_t effect, int pwm);
+lights_effect_t lights_get_effect(int channel);
+void lights_get_effect_stats(int channel, lights_effect_stats_t* stats);
+const char* lights_effect_name(lights_effect_t effect);
+lights_effect_t lights_effect_from_name(const char* name, int name_len);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <freertos/FreeRTOS.h>
+#include <esp_timer.h>
+
+#include "log_ring.h"
+
+typedef struct
+{
+  const char* format;
+  uint32_t time_ms;
+  uint32_t args[LOG_RING_MAX_ARGS];
+} log_ring_entry_t;
+
+static log_ring_entry_t log_ring[CONFIG_LOG_RING_ENTRIES];
+static uint32_t log_ring_next = 0; // Total entries ever written. Index is next % size
+static portMUX_TYPE log_ring_mux = portMUX_INITIALIZER_UNLOCKED;
+
+void log_ring_add(const char* format, int num_args, ...)
+{
+    log_ring_entry_t entry = {
+        .format = format,
+        .time_ms = (uint32_t)(esp_timer_get_time() / 1000),
+    };
+    va_list args;
+    va_start(args, num_args);
+    for (int i = 0; i < num_args && i < LOG_RING_MAX_ARGS; i++) {
+        entry.args[i] = va_arg(args, uint32_t);
+    }
+    va_end(args);
+
+    portENTER_CRITICAL(&log_ring_mux);
+    log_ring[log_ring_next % CONFIG_LOG_RING_ENTRIES] = entry;
+    log_ring_next++;
+    portEXIT_CRITICAL(&log_ring_mux);
+}
+
+// Sends the ring log as plain text, oldest entry first
+// Each entry is copied out under the lock and formatted after, so logging
+// from other tasks is never held up by the HTTP send
+esp_err_t log_ring_get_handler(httpd_req_t *req)
+{
+    char line[160];
+    httpd_resp_set_type(req, "text/plain");
+
+    portENTER_CRITICAL(&log_ring_mux);
+    uint32_t end = log_ring_next;
+    portEXIT_CRITICAL(&log_ring_mux);
+    uint32_t start = end > CONFIG_LOG_RING_ENTRIES ? end - CONFIG_LOG_RING_ENTRIES : 0;
+
+    for (uint32_t i = start; i < end; i++) {
+        log_ring_entry_t entry;
+        portENTER_CRITICAL(&log_ring_mux);
+        // Skip anything overwritten since the send started
+        uint8_t overwritten = log_ring_next - i > CONFIG_LOG_RING_ENTRIES;
+        entry = log_ring[i % CONFIG_LOG_RING_ENTRIES];
+        portEXIT_CRITICAL(&log_ring_mux);
+        if (overwritten) {
+            continue;
+        }
+        int len = snprintf(line, sizeof(line), "[%u.%03u] ", entry.time_ms / 1000, entry.time_ms % 1000);
+        len += snprintf(line + len, sizeof(line) - len - 1, entry.format,
+            entry.args[0], entry.args[1], entry.args[2], entry.args[3]);
+        if (len > sizeof(line) - 2) {
+            len = sizeof(line) - 2;
+        }
+        line[len++] = '\n';
+        line[len] = '\0';
+        httpd_resp_send_chunk(req, line, len);
+    }
+    httpd_resp_send_chunk(req, NULL, 0);
+    return ESP_OK;
+}
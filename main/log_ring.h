@@ -0,0 +1,52 @@
+#ifndef LOG_RING_H_INCLUDED
+#define LOG_RING_H_INCLUDED
+
+#include <stdint.h>
+#include <esp_log.h>
+#include <esp_http_server.h>
+#include "sdkconfig.h"
+
+// Compile-time log levels for the hot paths of each subsystem. Set them in
+// menuconfig under "Smart Light Logging". Anything above the level is
+// compiled out, so a busy slider or MQTT stream costs nothing on the UART.
+// Uses the same numbers as esp_log_level_t (3 = info, 4 = debug)
+#ifndef CONFIG_LOG_LEVEL_HTTP
+#define CONFIG_LOG_LEVEL_HTTP   2
+#endif
+#ifndef CONFIG_LOG_LEVEL_MQTT
+#define CONFIG_LOG_LEVEL_MQTT   2
+#endif
+#ifndef CONFIG_LOG_LEVEL_LIGHTS
+#define CONFIG_LOG_LEVEL_LIGHTS 2
+#endif
+#ifndef CONFIG_LOG_RING_ENTRIES
+#define CONFIG_LOG_RING_ENTRIES 128
+#endif
+
+#define SUBSYSTEM_LOG(level, max_level, tag, format, ...) do {                  \
+        if ((max_level) >= (level)) {                                           \
+            ESP_LOG_LEVEL_LOCAL(level, tag, format, ##__VA_ARGS__);             \
+        }                                                                       \
+    } while (0)
+
+#define HTTP_LOGI(tag, format, ...)   SUBSYSTEM_LOG(ESP_LOG_INFO, CONFIG_LOG_LEVEL_HTTP, tag, format, ##__VA_ARGS__)
+#define HTTP_LOGD(tag, format, ...)   SUBSYSTEM_LOG(ESP_LOG_DEBUG, CONFIG_LOG_LEVEL_HTTP, tag, format, ##__VA_ARGS__)
+#define MQTT_LOGI(tag, format, ...)   SUBSYSTEM_LOG(ESP_LOG_INFO, CONFIG_LOG_LEVEL_MQTT, tag, format, ##__VA_ARGS__)
+#define MQTT_LOGD(tag, format, ...)   SUBSYSTEM_LOG(ESP_LOG_DEBUG, CONFIG_LOG_LEVEL_MQTT, tag, format, ##__VA_ARGS__)
+#define LIGHTS_LOGI(tag, format, ...) SUBSYSTEM_LOG(ESP_LOG_INFO, CONFIG_LOG_LEVEL_LIGHTS, tag, format, ##__VA_ARGS__)
+
+// Binary ring log kept in RAM. Only the format string pointer, a timestamp
+// and up to 4 integer args are stored, so logging is a few word copies with
+// no formatting. The text is only built when /logs is read.
+// The format string must be a literal and the args must be integers (%d, %u, %x)
+// since strings could be gone by the time the log is read
+#define LOG_RING_MAX_ARGS 4
+
+#define LOG_RING_NARGS(...) LOG_RING_NARGS_(0, ##__VA_ARGS__, 4, 3, 2, 1, 0)
+#define LOG_RING_NARGS_(_0, _1, _2, _3, _4, N, ...) N
+#define LOG_RING(format, ...) log_ring_add(format, LOG_RING_NARGS(__VA_ARGS__), ##__VA_ARGS__)
+
+void log_ring_add(const char* format, int num_args, ...);
+esp_err_t log_ring_get_handler(httpd_req_t *req);
+
+#endif
@@ -11,6 +11,8 @@
 #include <esp_partition.h>
 #include <esp_tls_crypto.h>
 #include <esp_http_server.h>
+#include <esp_timer.h>
+#include <lwip/inet.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <freertos/event_groups.h>
@@ -19,6 +21,10 @@
 #include <mqtt_client.h>
 
 // Downloaded library for parsing JSON format
+// Parent links let jsmn find the enclosing object in one step on every
+// comma and closing brace instead of scanning back over all the tokens.
+// Costs 4 bytes per token. Token start, end and type are the same either way
+#define JSMN_PARENT_LINKS
 #include "jsmn.h"
 
 // Struct for saving light info
@@ -29,7 +35,7 @@ typedef struct
   uint8_t enabled;
   int duty_cycle;
   char mqtt_config_topic[50];
-  char mqtt_config_payload[200];
+  char mqtt_config_payload[384];
   char mqtt_command_topic[50];
   char mqtt_state_topic[50];
 } light_info_t;
@@ -38,18 +44,48 @@ typedef struct
 // accessing NVS data to separate files to clean up code
 #include "lights_ledc.h"
 #include "nvs_data.h"
+#include "schedule.h"
+#include "scene.h"
+#include "udp_control.h"
+#include "json_writer.h"
+#include "log_ring.h"
+#include "debug_stats.h"
+#include "req_arena.h"
+#include "wifi_fast.h"
+#include "wifi_link.h"
+#include "energy.h"
+#include "mqtt_tls.h"
+#include "outbox_latest.h"
 
 // Debug tag for log statements
 static const char *TAG = "wifi idf test";
 
-// Specify the max time and max number of retries for connecting
-// to wifi before switching to AP mode, whichever comes first
+// Specify the max number of retries for connecting to wifi before
+// bringing up the AP. The max time is WIFI_LINK_CONNECT_WAIT_MS
 #define ESP_MAXIMUM_CONNECT_RETRY  10
-#define ESP_WIFI_CONNECT_WAIT      15000 // In ms
 
 // Tracks the number of retries for connecting to Wifi
 static uint8_t wifi_retry_count = 0;
 
+// Set while the wifi task disconnects the station itself to apply new
+// settings, so the disconnect handler doesn't count it as a failure
+static uint8_t wifi_disconnecting = 0;
+
+// The AP from the last successful connection. The first attempt goes straight
+// to it on its channel, then falls back to a full scan if it isn't there
+static wifi_fast_cache_t wifi_cache = {0};
+static uint8_t wifi_cache_dirty = 0;
+static wifi_fast_mode_t wifi_connect_mode = WIFI_FAST_FULL_SCAN;
+static uint8_t wifi_mode_failures = 0;
+
+// Optional static IP. Skips DHCP when enabled
+static wifi_static_ip_t wifi_static_ip = {0};
+static esp_netif_t* sta_netif = NULL;
+
+// Time from starting the station to getting an IP, for the status API
+static int64_t wifi_connect_start_us = 0;
+static uint32_t wifi_time_to_ip_ms = 0;
+
 // Wifi data for AP mode. The program adds the ESP MAC address to the end of the SSID to avoid conflicts
 #define ESP_WIFI_AP_SSID           "esp_wifi"  
 #define ESP_WIFI_AP_PASS           "password"
@@ -69,6 +105,8 @@ static char mac_addr_str[13];
 static light_info_t light_data[4];
 
 // Flags to track if wifi and mqtt status
+// wifi_connected is set while the station has an IP, and ap_mode while
+// the softAP is up. Both can be set at once
 static uint8_t wifi_connected = 0;
 static uint8_t new_wifi_info = 0;
 static uint8_t ap_mode = 0;
@@ -87,11 +125,152 @@ static char esp_wifi_sta_pass[WIFI_PASS_LENGTH] = "";
 // Saves the current IP address of the ESP32
 static char esp_wifi_ip_addr[16] = "";
 
+// Station config. Kept here so the disconnect handler can switch it
+// from the cached AP to a full scan
+static wifi_config_t wifi_sta_config = {
+    .sta = {
+        /* Setting the threshold to WPA2 means the ESP will only connect to
+        networks with WPA2 security or stronger */
+        .threshold.authmode = WIFI_AUTH_WPA2_PSK,
+    },
+};
+
 // Saves the MQTT broker URI
 // And declares the MQTT client so MQTT messages can be sent by any function
 static char mqtt_broker_uri[257] = "";
 static esp_mqtt_client_handle_t mqtt_client;
 
+// Availability topic shared by every entity on the device. The broker
+// publishes the retained "offline" will if the keepalive runs out, and
+// "online" is published on every connect
+#ifndef CONFIG_MQTT_KEEPALIVE
+#define CONFIG_MQTT_KEEPALIVE    10
+#endif
+#define MQTT_AVAILABILITY_ONLINE   "online"
+#define MQTT_AVAILABILITY_OFFLINE  "offline"
+static char mqtt_availability_topic[50];
+
+// Home Assistant publishes "online" here when it starts. Discovery and state
+// are then republished after a delay derived from the MAC address, spread
+// over the window, so a whole site doesn't publish in the same instant
+#ifndef CONFIG_MQTT_DISCOVERY_WINDOW
+#define CONFIG_MQTT_DISCOVERY_WINDOW  5000
+#endif
+#define MQTT_HA_STATUS_TOPIC     "homeassistant/status"
+static esp_timer_handle_t mqtt_discovery_timer = NULL;
+static TaskHandle_t mqtt_task_handle = NULL;
+// Set from the MQTT event handler and httpd, and read by the MQTT task
+static uint8_t mqtt_discovery_force = 0;
+static portMUX_TYPE mqtt_discovery_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// The session is persistent so the broker keeps the subscriptions across
+// short drops, which needs a client id that doesn't change
+static char mqtt_client_id[32];
+
+// The MQTT client task runs below httpd and live control so a TLS handshake,
+// which takes seconds of CPU on the single core, doesn't stall them
+#ifndef CONFIG_MQTT_CLIENT_PRIORITY
+#define CONFIG_MQTT_CLIENT_PRIORITY  3
+#endif
+
+// Set when the TLS certificates change so the client config is rebuilt
+// before the next connect
+static uint8_t mqtt_tls_changed = 0;
+
+// Hashes of the last published discovery config for the 4 lights, the
+// scene select and the energy sensors, saved in NVS, and of the last
+// published states, kept in RAM. A reconnect only sends the ones that changed
+#define MQTT_DISCOVERY_ENTITIES  13
+#define MQTT_DISCOVERY_SCENE     4
+#define MQTT_DISCOVERY_ENERGY    5 // 2 sensors per light from here
+static uint32_t discovery_hashes[MQTT_DISCOVERY_ENTITIES];
+static uint32_t light_state_hashes[4];
+
+// Discovery configs waiting for the broker's PUBACK. A hash is only recorded
+// once the broker has the config, since the outbox can replace or drop a
+// queued publish and a config lost that way has to be sent again. The MQTT
+// task saves the hashes to NVS when discovery_hashes_dirty is set.
+// Guarded by mqtt_discovery_mux since the acks come from the MQTT client task
+static int discovery_pending_msg_id[MQTT_DISCOVERY_ENTITIES];
+static uint32_t discovery_pending_hash[MQTT_DISCOVERY_ENTITIES];
+static uint8_t discovery_hashes_dirty = 0;
+static uint32_t scene_state_hash = 0;
+
+// Discovery messages still to send, a bit per config index then the light
+// states and the scene state. A pass marks what it has to send and clears
+// each bit as the message goes into the outbox, so whatever the outbox had
+// no room for, or refused, is sent by the MQTT task once the broker has
+// acked some of the burst. Guarded by mqtt_discovery_mux since a rename
+// on the web server can have its config refused too
+#define DISCOVERY_LIGHT_STATE    MQTT_DISCOVERY_ENTITIES // 4 lights from here
+#define DISCOVERY_SCENE_STATE    (MQTT_DISCOVERY_ENTITIES + 4)
+static uint32_t discovery_unsent = 0;
+
+// Outbox slots discovery leaves free for light states and commands
+#define DISCOVERY_OUTBOX_RESERVE 2
+
+// On-device schedule so lights still follow their timers without Home Assistant
+// The timezone is a POSIX TZ string since schedule times are in local time
+static schedule_entry_t schedule_data[SCHEDULE_MAX_ENTRIES];
+static char schedule_timezone[SCHEDULE_TZ_LENGTH] = "UTC0";
+static char mqtt_schedule_topic[50];
+
+// Saved scenes and the MQTT topics for the Home Assistant select entity used to recall them
+static scene_t scene_data[SCENE_MAX_COUNT];
+static char active_scene[SCENE_NAME_LENGTH] = "";
+static char mqtt_scene_config_topic[50];
+// The config has to fit one outbox slot with its topic, so names that would
+// take it past that are left out of the options
+#define MQTT_SCENE_CONFIG_LENGTH  OUTBOX_SLOT_SIZE
+static char mqtt_scene_config_payload[MQTT_SCENE_CONFIG_LENGTH];
+static char mqtt_scene_command_topic[50];
+static char mqtt_scene_state_topic[50];
+
+// DMX universe and start address for live control over UDP (Art-Net / E1.31)
+static uint16_t dmx_universe = 1;
+static uint16_t dmx_address = 1;
+
+// Multicast groups this device is a member of. Bit 0 is group 1
+// Group commands sent to the MQTT topic are relayed to every board by multicast
+static uint16_t group_membership = 0;
+static char mqtt_group_topic[50];
+
+// Energy and on-hours sensors for each light. The totals are integrated by
+// the energy module whenever a light changes, published to Home Assistant
+// every publish interval and saved to NVS every save interval
+#ifndef CONFIG_ENERGY_PUBLISH_INTERVAL
+#define CONFIG_ENERGY_PUBLISH_INTERVAL  60
+#endif
+#ifndef CONFIG_ENERGY_SAVE_INTERVAL
+#define CONFIG_ENERGY_SAVE_INTERVAL     60
+#endif
+#define ENERGY_SENSOR_ENERGY    0
+#define ENERGY_SENSOR_ON_HOURS  1
+static energy_totals_t energy_saved;
+
+// Stacks and control blocks for the tasks started in app_main. They are
+// static so they show up in the RAM budget at link time and are never
+// taken from the heap, where they could fail or fragment it after days of
+// uptime. Sizes are in bytes since StackType_t is a byte on ESP-IDF
+#define WIFI_TASK_STACK         4096
+#define OTA_TASK_STACK          8192
+#define MQTT_TASK_STACK         4096
+#define SCHEDULE_TASK_STACK     3072
+#define UDP_CONTROL_TASK_STACK  3072
+#define GROUP_TASK_STACK        3072
+static StackType_t wifi_task_stack[WIFI_TASK_STACK];
+static StackType_t ota_task_stack[OTA_TASK_STACK];
+static StackType_t mqtt_task_stack[MQTT_TASK_STACK];
+static StackType_t schedule_task_stack[SCHEDULE_TASK_STACK];
+static StackType_t udp_control_task_stack[UDP_CONTROL_TASK_STACK];
+static StackType_t group_task_stack[GROUP_TASK_STACK];
+static StaticTask_t wifi_task_tcb;
+static StaticTask_t ota_task_tcb;
+static StaticTask_t mqtt_task_tcb;
+static StaticTask_t schedule_task_tcb;
+static StaticTask_t udp_control_task_tcb;
+static StaticTask_t group_task_tcb;
+
 // Struct to store authorization details for OTA
 typedef struct
 {
@@ -108,7 +287,7 @@ static basic_auth_info_t auth_info =
 
 #define HTTPD_401      "401 UNAUTHORIZED"           /*!< HTTP Response 401 */
 
-char auth_buffer[512];
+#define AUTH_BUFFER_LENGTH 512
 
 // Read HTML files into char arrays
 extern const char html_ota[] asm("_binary_ota_html_start");
@@ -118,6 +297,8 @@ extern const char html_index[] asm("_binary_index_html_start");
 // This message is sent to Home Assistant to automatically configure the lights
 // Moved this to a separate function so it can be changed when the light name is changed
 // or when the light is enabled/disabled
+// Lights using the JSON schema always support the "transition" key in Home Assistant,
+// so it doesn't need its own flag here. It is handled in handle_light_command
 static void set_mqtt_config_payload(uint8_t light_num)
 {
     if (light_data[light_num].enabled == 1) {
@@ -128,44 +309,511 @@ static void set_mqtt_config_payload(uint8_t light_num)
 \"unique_id\": \"light%d_%s\",\
 \"cmd_t\": \"~/set\",\
 \"stat_t\": \"~/state\",\
+\"avty_t\": \"%s\",\
 \"schema\": \"json\",\
-\"brightness\": true\
+\"brightness\": true,\
+\"effect\": true,\
+\"effect_list\": [\"breathe\", \"candle\", \"strobe\"]\
 }",
-            mac_addr_str, light_num, light_data[light_num].name, light_num, mac_addr_str);
+            mac_addr_str, light_num, light_data[light_num].name, light_num, mac_addr_str, mqtt_availability_topic);
     }
     else {
         sprintf(light_data[light_num].mqtt_config_payload, "");
     }
 }
 
+// Sets the config payload for the scene select entity in Home Assistant
+// The options list is built from the saved scene names, so this needs to be
+// called every time a scene is saved. If no scenes are saved the payload is
+// left empty which removes the entity from Home Assistant. A name that
+// would make the publish too big for an outbox slot is left out
+static void set_mqtt_scene_config_payload(void)
+{
+    char head[256];
+    snprintf(head, sizeof(head), "\
+{\
+\"~\": \"homeassistant/select/%s/scene\",\
+\"name\": \"Scene\",\
+\"unique_id\": \"scene_%s\",\
+\"cmd_t\": \"~/set\",\
+\"stat_t\": \"~/state\",\
+\"avty_t\": \"%s\",\
+\"icon\": \"mdi:palette\",\
+\"options\": [",
+        mac_addr_str, mac_addr_str, mqtt_availability_topic);
+
+    // Names are escaped since they can hold any character but a quote
+    // The writer is held to the payload an outbox slot can take, less the
+    // 2 bytes that close the options
+    size_t limit = MIN(sizeof(mqtt_scene_config_payload), OUTBOX_MAX_PAYLOAD(strlen(mqtt_scene_config_topic)) + 1);
+    json_writer_t writer;
+    json_writer_init(&writer, mqtt_scene_config_payload, limit - 2);
+    json_write_raw(&writer, head);
+    uint8_t count = 0;
+    for (int i = 0; i < SCENE_MAX_COUNT; i++) {
+        if (strlen(scene_data[i].name) > 0) {
+            size_t len = writer.len;
+            if (count > 0) {
+                json_write_raw(&writer, ",");
+            }
+            json_write_string(&writer, scene_data[i].name);
+            if (writer.overflow) {
+                ESP_LOGW(TAG, "Scene config too long for the outbox, leaving out \"%s\"", scene_data[i].name);
+                writer.len = len;
+                writer.overflow = 0;
+                mqtt_scene_config_payload[len] = '\0';
+                continue;
+            }
+            count++;
+        }
+    }
+    writer.size = limit;
+    json_write_raw(&writer, "]}");
+    if (count == 0) {
+        mqtt_scene_config_payload[0] = '\0';
+    }
+}
+
+// FNV-1a hash of a string. Used for the discovery jitter and to tell if a
+// payload is the same as the one last published
+static uint32_t mqtt_hash(const char* str)
+{
+    uint32_t hash = 2166136261UL;
+    for (const char* c = str; *c != '\0'; c++) {
+        hash ^= (uint8_t)*c;
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+// Marks or clears a discovery message as still to send
+static void set_discovery_unsent(uint8_t bit, uint8_t unsent)
+{
+    portENTER_CRITICAL(&mqtt_discovery_mux);
+    if (unsent) {
+        discovery_unsent |= 1UL << bit;
+    }
+    else {
+        discovery_unsent &= ~(1UL << bit);
+    }
+    portEXIT_CRITICAL(&mqtt_discovery_mux);
+}
+
+// Publishes a retained discovery config. Its hash is recorded when the
+// broker acks it, in discovery_config_acked. If the outbox refuses it, it
+// is marked to be sent again by the MQTT task
+static void publish_discovery_config(uint8_t index, const char* topic, const char* payload)
+{
+    uint32_t hash = mqtt_hash(payload);
+    int msg_id = esp_mqtt_client_publish(mqtt_client, topic, payload, 0, 1, 1);
+    MQTT_LOGI(TAG, "sent publish successful, msg_id=%d", msg_id);
+    if (msg_id <= 0) {
+        ESP_LOGW(TAG, "Discovery config refused by the outbox, sending it again later");
+        set_discovery_unsent(index, 1);
+        return;
+    }
+    portENTER_CRITICAL(&mqtt_discovery_mux);
+    discovery_unsent &= ~(1UL << index);
+    discovery_pending_msg_id[index] = msg_id;
+    discovery_pending_hash[index] = hash;
+    portEXIT_CRITICAL(&mqtt_discovery_mux);
+}
+
+// Called on MQTT_EVENT_PUBLISHED. If the ack is for a discovery config,
+// its hash is recorded and marked for saving
+static void discovery_config_acked(int msg_id)
+{
+    portENTER_CRITICAL(&mqtt_discovery_mux);
+    for (uint8_t i = 0; i < MQTT_DISCOVERY_ENTITIES; i++) {
+        if (discovery_pending_msg_id[i] == msg_id) {
+            discovery_pending_msg_id[i] = 0;
+            if (discovery_hashes[i] != discovery_pending_hash[i]) {
+                discovery_hashes[i] = discovery_pending_hash[i];
+                discovery_hashes_dirty = 1;
+            }
+        }
+    }
+    portEXIT_CRITICAL(&mqtt_discovery_mux);
+}
+
+// Saves the discovery hashes if an ack changed them. Called from the MQTT
+// task since the event handler is too busy for NVS writes
+static void save_discovery_hashes(void)
+{
+    uint32_t hashes[MQTT_DISCOVERY_ENTITIES];
+    portENTER_CRITICAL(&mqtt_discovery_mux);
+    uint8_t dirty = discovery_hashes_dirty;
+    discovery_hashes_dirty = 0;
+    memcpy(hashes, discovery_hashes, sizeof(hashes));
+    portEXIT_CRITICAL(&mqtt_discovery_mux);
+    if (dirty) {
+        save_discovery_hashes_to_nvs(hashes, MQTT_DISCOVERY_ENTITIES);
+    }
+}
+
+// Topic and payload for the energy and on-hours sensors of a light
+// Both sensors read from the same state message with a value template.
+// Built when needed rather than stored since they only change with the light name
+static void energy_config_topic(uint8_t num, uint8_t sensor, char* topic)
+{
+    sprintf(topic, "homeassistant/sensor/%s/light%d_%s/config", mac_addr_str, num, sensor == ENERGY_SENSOR_ENERGY ? "energy" : "on_hours");
+}
+
+static void energy_config_payload(uint8_t num, uint8_t sensor, char* payload)
+{
+    if (light_data[num].enabled == 0) {
+        sprintf(payload, "");
+    }
+    else if (sensor == ENERGY_SENSOR_ENERGY) {
+        sprintf(payload, "\
+{\
+\"~\": \"homeassistant/sensor/%s/light%d\",\
+\"name\": \"%s Energy\",\
+\"unique_id\": \"light%d_energy_%s\",\
+\"stat_t\": \"~/state\",\
+\"avty_t\": \"%s\",\
+\"dev_cla\": \"energy\",\
+\"stat_cla\": \"total_increasing\",\
+\"unit_of_meas\": \"Wh\",\
+\"val_tpl\": \"{{ value_json.energy }}\"\
+}",
+            mac_addr_str, num, light_data[num].name, num, mac_addr_str, mqtt_availability_topic);
+    }
+    else {
+        sprintf(payload, "\
+{\
+\"~\": \"homeassistant/sensor/%s/light%d\",\
+\"name\": \"%s On Time\",\
+\"unique_id\": \"light%d_on_hours_%s\",\
+\"stat_t\": \"~/state\",\
+\"avty_t\": \"%s\",\
+\"dev_cla\": \"duration\",\
+\"stat_cla\": \"total_increasing\",\
+\"unit_of_meas\": \"h\",\
+\"val_tpl\": \"{{ value_json.on_hours }}\"\
+}",
+            mac_addr_str, num, light_data[num].name, num, mac_addr_str, mqtt_availability_topic);
+    }
+}
+
+// Publishes the energy sensor configs for a light, only the ones that
+// changed unless forced, and adds what was sent to the counts
+static void publish_energy_configs(uint8_t num, uint8_t force, uint16_t* messages, uint32_t* bytes)
+{
+    char topic[64];
+    char payload[384];
+    for (uint8_t sensor = 0; sensor < 2; sensor++) {
+        uint8_t index = MQTT_DISCOVERY_ENERGY + (num * 2) + sensor;
+        energy_config_payload(num, sensor, payload);
+        if (force || mqtt_hash(payload) != discovery_hashes[index]) {
+            energy_config_topic(num, sensor, topic);
+            publish_discovery_config(index, topic, payload);
+            *messages += 1;
+            *bytes += strlen(topic) + strlen(payload);
+        }
+    }
+}
+
+// Publishes the energy totals of every enabled light
+// Returns the number of messages sent
+static uint16_t publish_energy_state(void)
+{
+    uint16_t messages = 0;
+    if (mqtt_connected == 0) {
+        return 0;
+    }
+    energy_totals_t totals;
+    energy_get_totals(&totals);
+    for (uint8_t num = 0; num < 4; num++) {
+        if (light_data[num].enabled == 0) {
+            continue;
+        }
+        char topic[64];
+        char payload[80];
+        char energy_str[24];
+        char hours_str[24];
+        energy_format_x1000(energy_watt_hours_x1000(&totals, num), energy_str, sizeof(energy_str));
+        energy_format_x1000(energy_on_hours_x1000(&totals, num), hours_str, sizeof(hours_str));
+        sprintf(topic, "homeassistant/sensor/%s/light%d/state", mac_addr_str, num);
+        sprintf(payload, "{\"energy\": %s, \"on_hours\": %s}", energy_str, hours_str);
+        int msg_id = esp_mqtt_client_publish(mqtt_client, topic, payload, 0, 1, 0);
+        MQTT_LOGI(TAG, "sent publish successful, msg_id=%d", msg_id);
+        messages++;
+    }
+    return messages;
+}
+
+// Saves the energy totals if they changed since the last save
+// Only called every save interval to keep flash wear down
+static void save_energy_totals(void)
+{
+    energy_totals_t totals;
+    energy_get_totals(&totals);
+    if (memcmp(&totals, &energy_saved, sizeof(energy_totals_t)) != 0) {
+        save_energy_totals_to_nvs(&totals);
+        energy_saved = totals;
+    }
+}
+
+// Publishes one light config right away, e.g. after it is renamed
+// The energy sensors carry the light name so they go with it
+static void publish_light_config(uint8_t num)
+{
+    if (mqtt_connected == 1) {
+        uint16_t messages = 0;
+        uint32_t bytes = 0;
+        publish_discovery_config(num, light_data[num].mqtt_config_topic, light_data[num].mqtt_config_payload);
+        publish_energy_configs(num, 0, &messages, &bytes);
+    }
+}
+
+// Builds the JSON state message for a light
+static void light_state_payload(uint8_t num, char* mqtt_state_payload)
+{
+    lights_effect_t effect = lights_get_effect(num);
+    if (light_data[num].duty_cycle > 0 && effect != LIGHTS_EFFECT_NONE) {
+        sprintf(mqtt_state_payload, "{\"state\": \"ON\", \"brightness\": %d, \"effect\": \"%s\"}", light_data[num].duty_cycle, lights_effect_name(effect));
+    }
+    else if (light_data[num].duty_cycle > 0) {
+        sprintf(mqtt_state_payload, "{\"state\": \"ON\", \"brightness\": %d}", light_data[num].duty_cycle);
+    }
+    else {
+        sprintf(mqtt_state_payload, "{\"state\": \"OFF\", \"brightness\": 0}");
+    }
+}
+
 // Every time a light is set whether it is from the web interface or
 // from Home Assistant through MQTT, a few things need to happen:
 //    - The PWM output needs to be changed
 //    - The new duty_cycle needs to be saved
 //    - If MQTT is connected, a status update needs to be sent to Home Assistant
+// Returns the msg_id, or -1 if it wasn't sent
+static int publish_light_state(uint8_t num) {
+    if (mqtt_connected == 0) {
+        return -1;
+    }
+    char mqtt_state_payload[64];
+    light_state_payload(num, mqtt_state_payload);
+    int msg_id = esp_mqtt_client_publish(mqtt_client, light_data[num].mqtt_state_topic, mqtt_state_payload, 0, 1, 0);
+    MQTT_LOGI(TAG, "sent publish successful, msg_id=%d", msg_id);
+    if (msg_id >= 0) {
+        light_state_hashes[num] = mqtt_hash(mqtt_state_payload);
+    }
+    return msg_id;
+}
+
+// Returns the msg_id, 0 if no scene is active, or -1 if it wasn't sent
+static int publish_scene_state(void)
+{
+    if (mqtt_connected == 0) {
+        return -1;
+    }
+    if (strlen(active_scene) == 0) {
+        return 0;
+    }
+    int msg_id = esp_mqtt_client_publish(mqtt_client, mqtt_scene_state_topic, active_scene, 0, 1, 0);
+    MQTT_LOGI(TAG, "sent publish successful, msg_id=%d", msg_id);
+    if (msg_id >= 0) {
+        scene_state_hash = mqtt_hash(active_scene);
+    }
+    return msg_id;
+}
+
 static void set_light(uint8_t num, uint8_t brightness) {
     if (num < 4) {
-        ESP_LOGI(TAG, "Setting light%d to %d", num, brightness);
+        LIGHTS_LOGI(TAG, "Setting light%d to %d", num, brightness);
+        LOG_RING("Light %d set to %d", num, brightness);
         lights_set_brightness(brightness, num);
         light_data[num].duty_cycle = brightness;
+        publish_light_state(num);
+    }
+    else {
+        ESP_LOGI(TAG, "Light num %d or brightness %d out of range", num, brightness);
+    }
+}
+
+// Same as set_light, but fades over the given time instead of the default fade
+// Used by the schedule when an entry fires and for Home Assistant transitions
+static void set_light_transition(uint8_t num, uint8_t brightness, uint32_t transition_ms) {
+    if (num < 4) {
+        LIGHTS_LOGI(TAG, "Setting light%d to %d over %dms", num, brightness, transition_ms);
+        LOG_RING("Light %d set to %d over %dms", num, brightness, transition_ms);
+        lights_set_brightness_with_time(brightness, num, transition_ms);
+        light_data[num].duty_cycle = brightness;
+        publish_light_state(num);
+    }
+    else {
+        ESP_LOGI(TAG, "Light num %d or brightness %d out of range", num, brightness);
+    }
+}
 
-        if (mqtt_connected == 1) {
-            char mqtt_state_payload[36];
-            if (brightness > 0) {
-                sprintf(mqtt_state_payload, "{\"state\": \"ON\", \"brightness\": %d}", brightness);
-            }
-            else {
-                sprintf(mqtt_state_payload, "{\"state\": \"OFF\", \"brightness\": 0}");
+// Recalls a saved scene by name
+// Every light fades to its scene brightness together in one coordinated fade
+// so a whole room changes with a single command
+// Returns 0 if the scene was found
+static int recall_scene_with_time(const char* name, int name_len, uint32_t fade_ms)
+{
+    for (int i = 0; i < SCENE_MAX_COUNT; i++) {
+        if (name_len > 0 && name_len == strlen(scene_data[i].name) && strncmp(scene_data[i].name, name, name_len) == 0) {
+            ESP_LOGI(TAG, "Recalling scene %s", scene_data[i].name);
+            lights_set_all_with_time(scene_data[i].brightness, fade_ms);
+            for (uint8_t num = 0; num < 4; num++) {
+                light_data[num].duty_cycle = scene_data[i].brightness[num];
+                publish_light_state(num);
             }
-            int msg_id = esp_mqtt_client_publish(mqtt_client, light_data[num].mqtt_state_topic, mqtt_state_payload, 0, 1, 0);
-            ESP_LOGI(TAG, "sent publish successful, msg_id=%d", msg_id);
+            strcpy(active_scene, scene_data[i].name);
+            publish_scene_state();
+            return 0;
+        }
+    }
+    ESP_LOGI(TAG, "Scene not found: %.*s", name_len, name);
+    return -1;
+}
+
+static int recall_scene(const char* name, int name_len)
+{
+    return recall_scene_with_time(name, name_len, SCENE_FADE_TIME);
+}
+
+// Saves the current brightness of every light as a scene
+// An empty name deletes the scene in that slot
+static void save_scene(uint8_t slot, const char* name, int name_len)
+{
+    strncpy(scene_data[slot].name, name, name_len);
+    scene_data[slot].name[name_len] = '\0';
+    for (uint8_t num = 0; num < 4; num++) {
+        scene_data[slot].brightness[num] = light_data[num].duty_cycle;
+    }
+    save_scenes_to_nvs(scene_data);
+
+    set_mqtt_scene_config_payload();
+    if (mqtt_connected == 1) {
+        publish_discovery_config(MQTT_DISCOVERY_SCENE, mqtt_scene_config_topic, mqtt_scene_config_payload);
+    }
+}
+
+// Called when live control over UDP stops. The lights hold the last levels
+// they were sent, so save them and let Home Assistant know
+static void udp_control_released(const uint8_t* levels) {
+    for (uint8_t num = 0; num < 4; num++) {
+        light_data[num].duty_cycle = levels[num];
+        publish_light_state(num);
+    }
+}
+
+// Runs a multicast group command once it is due
+// Every board in the group gets the same packet, so they all start together
+static void group_command_received(uint8_t command, const uint8_t* data, uint8_t len, uint16_t fade_ms) {
+    if (command == GROUP_COMMAND_SCENE) {
+        recall_scene_with_time((const char*)data, len, fade_ms);
+    }
+    else if (command == GROUP_COMMAND_LEVELS && len == 4) {
+        ESP_LOGI(TAG, "Group command setting all lights over %dms", fade_ms);
+        lights_set_all_with_time(data, fade_ms);
+        for (uint8_t num = 0; num < 4; num++) {
+            light_data[num].duty_cycle = data[num];
+            publish_light_state(num);
         }
     }
+    else {
+        ESP_LOGI(TAG, "Unknown group command %d", command);
+    }
+}
+
+// Starts an effect on a light. The effect runs on the device until
+// the light is set to something else
+static void set_light_effect(uint8_t num, lights_effect_t effect, uint8_t brightness) {
+    if (num < 4) {
+        ESP_LOGI(TAG, "Starting %s effect on light%d at %d", lights_effect_name(effect), num, brightness);
+        lights_start_effect(num, effect, brightness);
+        light_data[num].duty_cycle = brightness;
+        publish_light_state(num);
+    }
     else {
         ESP_LOGI(TAG, "Light num %d or brightness %d out of range", num, brightness);
     }
 }
 
+// Handles a schedule message from either the web interface or MQTT
+// Two formats are accepted:
+//  - {"timezone": "EST5EDT,M3.2.0,M11.1.0"}
+//  - {"schedule": "0", "enabled": "1", "light": "0", "brightness": "255",
+//     "hour": "7", "minute": "30", "days": "127", "transition": "60"}
+// days is a bitmask with bit 0 = Sunday. transition is in seconds
+// Returns 0 if the schedule was updated
+static int handle_schedule_message(const char* data, jsmntok_t* json_content, int num_tokens)
+{
+    static const char* schedule_keys[] = {
+        "schedule", "enabled", "light", "brightness", "hour", "minute", "days", "transition"
+    };
+    int values[8];
+    char token_str[SCHEDULE_TZ_LENGTH];
+    int token_len;
+
+    if (num_tokens < 3) {
+        ESP_LOGI(TAG, "Error parsing schedule JSON data");
+        return -1;
+    }
+    token_len = json_content[1].end - json_content[1].start;
+    if (num_tokens == 3 && token_len == strlen("timezone") && strncmp(data + json_content[1].start, "timezone", token_len) == 0) {
+        token_len = json_content[2].end - json_content[2].start;
+        if (token_len < 1 || token_len >= SCHEDULE_TZ_LENGTH) {
+            ESP_LOGI(TAG, "Timezone wrong length. Max %d characters", SCHEDULE_TZ_LENGTH - 1);
+            return -1;
+        }
+        strncpy(schedule_timezone, data + json_content[2].start, token_len);
+        schedule_timezone[token_len] = '\0';
+        schedule_set_timezone(schedule_timezone);
+        save_schedule_to_nvs(schedule_data, schedule_timezone);
+        ESP_LOGI(TAG, "Timezone set to %s", schedule_timezone);
+        return 0;
+    }
+
+    if (num_tokens != 17) {
+        ESP_LOGI(TAG, "Wrong number of tokens for schedule message!");
+        return -1;
+    }
+    for (int i = 0; i < 8; i++) {
+        jsmntok_t* key = &json_content[(i * 2) + 1];
+        jsmntok_t* val = &json_content[(i * 2) + 2];
+        token_len = key->end - key->start;
+        if (token_len != strlen(schedule_keys[i]) || strncmp(data + key->start, schedule_keys[i], token_len) != 0) {
+            ESP_LOGI(TAG, "Token doesn't match: %.*s", token_len, data + key->start);
+            return -1;
+        }
+        token_len = val->end - val->start;
+        if (token_len < 1 || token_len > 5) {
+            ESP_LOGI(TAG, "Schedule value for %s wrong length", schedule_keys[i]);
+            return -1;
+        }
+        strncpy(token_str, data + val->start, token_len);
+        token_str[token_len] = '\0';
+        values[i] = atoi(token_str);
+    }
+
+    if (values[0] < 0 || values[0] >= SCHEDULE_MAX_ENTRIES || values[2] < 0 || values[2] > 3 ||
+        values[3] < 0 || values[3] > 255 || values[4] < 0 || values[4] > 23 || values[5] < 0 || values[5] > 59 ||
+        values[6] < 0 || values[6] > 127 || values[7] < 0 || values[7] > 65535) {
+        ESP_LOGI(TAG, "Schedule value out of range");
+        return -1;
+    }
+    schedule_entry_t entry = {
+        .enabled = values[1] ? 1 : 0,
+        .light = values[2],
+        .brightness = values[3],
+        .hour = values[4],
+        .minute = values[5],
+        .days = values[6],
+        .transition_s = values[7],
+    };
+    if (schedule_set_entry(values[0], &entry) != 0) {
+        return -1;
+    }
+    save_schedule_to_nvs(schedule_data, schedule_timezone);
+    ESP_LOGI(TAG, "Schedule entry %d set", values[0]);
+    return 0;
+}
+
 // Borrowed the HTTP authorization and OTA code in the
 // next few functions from another project
 
@@ -173,17 +821,21 @@ static void set_light(uint8_t num, uint8_t brightness) {
 static char *http_auth_basic( const char *username, const char *password )
 {
   int out;
-  char user_info[128];
-  static char digest[512];
+  char *user_info = req_arena_alloc( 128 );
+  char *digest = req_arena_alloc( AUTH_BUFFER_LENGTH );
   size_t n = 0;
-  sprintf( user_info, "%s:%s", username, password );
+  if ( user_info == NULL || digest == NULL )
+  {
+    return NULL;
+  }
+  snprintf( user_info, 128, "%s:%s", username, password );
 
   esp_crypto_base64_encode( NULL, 0, &n, ( const unsigned char * )user_info, strlen( user_info ) );
 
   // 6: The length of the "Basic " string
   // n: Number of bytes for a base64 encode format
   // 1: Number of bytes for a reserved which be used to fill zero
-  if ( sizeof( digest ) > ( 6 + n + 1 ) )
+  if ( AUTH_BUFFER_LENGTH > ( 6 + n + 1 ) )
   {
     strcpy( digest, "Basic " );
     esp_crypto_base64_encode( ( unsigned char * )digest + 6, n, ( size_t * )&out, ( const unsigned char * )user_info, strlen( user_info ) );
@@ -198,14 +850,20 @@ static esp_err_t basic_auth_get_handler( httpd_req_t *req )
   basic_auth_info_t *basic_auth_info = req->user_ctx;
 
   size_t buf_len = httpd_req_get_hdr_value_len( req, "Authorization" ) + 1;
-  if ( ( buf_len > 1 ) && ( buf_len <= sizeof( auth_buffer ) ) )
+  char *auth_buffer = NULL;
+  if ( ( buf_len > 1 ) && ( buf_len <= AUTH_BUFFER_LENGTH ) )
+  {
+    auth_buffer = req_arena_alloc( buf_len );
+  }
+  if ( auth_buffer != NULL )
   {
     if ( httpd_req_get_hdr_value_str( req, "Authorization", auth_buffer, buf_len ) == ESP_OK )
     {
       char *auth_credentials = http_auth_basic( basic_auth_info->username, basic_auth_info->password );
-      if ( !strncmp( auth_credentials, auth_buffer, buf_len ) )
+      if ( auth_credentials != NULL && !strncmp( auth_credentials, auth_buffer, buf_len ) )
       {
         ESP_LOGI(TAG,  "Authenticated!\n" );
+        req_arena_reset();
         httpd_resp_set_status( req, HTTPD_200 );
         httpd_resp_set_hdr( req, "Connection", "keep-alive" );
         httpd_resp_send( req, html_ota, strlen( html_ota ) );
@@ -213,6 +871,7 @@ static esp_err_t basic_auth_get_handler( httpd_req_t *req )
       }
     }
   }
+  req_arena_reset();
 
   ESP_LOGI(TAG,  "Not authenticated\n" );
   httpd_resp_set_status( req, HTTPD_401 );
@@ -288,6 +947,8 @@ static esp_err_t ota_post_handler( httpd_req_t *req )
     httpd_resp_send( req, NULL, 0 );
     
     vTaskDelay( 2000 / portTICK_RATE_MS);
+    // Don't lose the energy counted since the last periodic save
+    save_energy_totals();
     esp_restart();
     
     return ESP_OK;
@@ -313,6 +974,93 @@ static esp_err_t index_get_handler( httpd_req_t *req )
     return ESP_OK;
 }
 
+// Largest body accepted by POST /. Bigger requests get a 413
+#define POST_MAX_BODY_LENGTH 1024
+#define POST_BODY_ERROR      (-100)
+
+// Returns 1 if the character could be part of a JSON number, true, false or null
+static uint8_t json_primitive_char(char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || c == '-' || c == '+' || c == '.' || c == 'E';
+}
+
+// Receives a whole request body and parses it as it arrives
+// The body is read into an arena buffer sized to content_len, so the handler
+// never truncates and doesn't need a stack buffer sized for the worst case.
+// jsmn is run in its resumable mode after every recv. It picks up where it
+// left off and returns JSMN_ERROR_PART until the JSON is complete.
+// On success *body is a NUL terminated copy of the body in the request arena,
+// and the return value is the jsmn result (negative if the JSON is bad).
+// Returns POST_BODY_ERROR if an error was sent and the socket should be closed
+static int receive_json_body(httpd_req_t *req, char** body, jsmn_parser* parser, jsmntok_t* tokens, unsigned int num_tokens)
+{
+    *body = NULL;
+    if (req->content_len > POST_MAX_BODY_LENGTH) {
+        ESP_LOGI(TAG, "Request body too large: %d bytes", req->content_len);
+        httpd_resp_set_status(req, "413 Payload Too Large");
+        httpd_resp_send(req, "Request too large", HTTPD_RESP_USE_STRLEN);
+        return POST_BODY_ERROR;
+    }
+    char* content = req_arena_alloc(req->content_len + 1);
+    if (content == NULL) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        return POST_BODY_ERROR;
+    }
+
+    jsmn_init(parser);
+    int num_parsed = JSMN_ERROR_PART;
+    size_t received = 0;
+    while (received < req->content_len) {
+        int ret = httpd_req_recv(req, content + received, req->content_len - received);
+        if (ret <= 0) {  // 0 return value indicates connection closed
+            if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
+                // Retrying here could block the server for every other client,
+                // so respond with an HTTP 408 (Request Timeout) error
+                httpd_resp_send_408(req);
+            }
+            // Returning ESP_FAIL from the handler closes the underlying socket
+            return POST_BODY_ERROR;
+        }
+        received += ret;
+
+        // Hold back a number or keyword at the end of the data, since jsmn
+        // would end it early instead of waiting for the rest of it
+        size_t parse_len = received;
+        if (received < req->content_len) {
+            while (parse_len > 0 && json_primitive_char(content[parse_len - 1])) {
+                parse_len--;
+            }
+        }
+        if (num_parsed == JSMN_ERROR_PART) {
+            num_parsed = jsmn_parse(parser, content, parse_len, tokens, num_tokens);
+        }
+    }
+    content[received] = '\0';
+
+    *body = content;
+    return num_parsed;
+}
+
+// Length of the plain text reply to POST /
+#define RESP_LENGTH 256
+
+// Copies a token into the request arena as a NUL terminated string
+// The copies are never bigger than the body they come from, and the arena
+// is sized to hold both. If it ever runs out an empty string is returned
+// so the caller sees an unrecognized value instead of crashing
+static char* copy_token(const char* content, const jsmntok_t* token)
+{
+    static char empty_str[1] = "";
+    int token_len = token->end - token->start;
+    char* token_str = req_arena_alloc(token_len + 1);
+    if (token_str == NULL) {
+        return empty_str;
+    }
+    strncpy(token_str, content + token->start, token_len);
+    token_str[token_len] = '\0';
+    return token_str;
+}
+
 // Post handler for index page
 // Reads and decodes the content of the request which is in JSON format
 // Depending on the request, it will either:
@@ -322,39 +1070,27 @@ static esp_err_t index_get_handler( httpd_req_t *req )
 //  - Save new MQTT info
 static esp_err_t index_post_handler( httpd_req_t *req )
 {
-    ESP_LOGI(TAG, "Received index POST request\n");
-
-    char content[512];
+    HTTP_LOGI(TAG, "Received index POST request");
 
-    // Truncate if content length larger than the buffer
-    size_t recv_size = MIN(req->content_len, sizeof(content));
-
-    // Read content from post request
-    int ret = httpd_req_recv(req, content, recv_size);
-    if (ret <= 0) {  // 0 return value indicates connection closed
-        // Check if timeout occurred */
-        if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
-            /* In case of timeout one can choose to retry calling
-             * httpd_req_recv(), but to keep it simple, here we
-             * respond with an HTTP 408 (Request Timeout) error */
-            httpd_resp_send_408(req);
-        }
-        /* In case of error, returning ESP_FAIL will
-         * ensure that the underlying socket is closed */
+    char* content = NULL;
+    jsmn_parser json_parser;
+    jsmntok_t json_content[32];
+    int num_tokens = receive_json_body(req, &content, &json_parser, json_content, 32);
+    if (num_tokens == POST_BODY_ERROR) {
+        req_arena_reset();
         return ESP_FAIL;
     }
 
-    ESP_LOGI(TAG, "Content: %s\n", content);
+    // Can include wifi passwords, so only logged at debug level
+    HTTP_LOGD(TAG, "Content: %s", content);
 
-    char resp[256] = "";
-
-    // Parse JSON data
-    jsmn_parser json_parser;
-    jsmntok_t json_content[32];
-    int num_tokens;
-
-    jsmn_init(&json_parser);
-    num_tokens = jsmn_parse(&json_parser, content, recv_size, json_content, 32);
+    char* resp = req_arena_alloc(RESP_LENGTH);
+    if (resp == NULL) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        req_arena_reset();
+        return ESP_FAIL;
+    }
+    resp[0] = '\0';
 
     int token_len = 0;
     char* token_str = NULL;
@@ -364,9 +1100,7 @@ static esp_err_t index_post_handler( httpd_req_t *req )
     }
     else {
         token_len = json_content[1].end - json_content[1].start;
-        token_str = (char*)malloc((token_len + 1) * sizeof(char));
-        strncpy(token_str, content+json_content[1].start, token_len);
-        token_str[token_len] = '\0';
+        token_str = copy_token(content, &json_content[1]);
 
         // Message for changing a light value
         if (strcmp(token_str, "light") == 0) {
@@ -375,9 +1109,7 @@ static esp_err_t index_post_handler( httpd_req_t *req )
             }
             else {
                 token_len = json_content[2].end - json_content[2].start;
-                token_str = (char*)realloc(token_str, (token_len + 1) * sizeof(char));
-                strncpy(token_str, content+json_content[2].start, token_len);
-                token_str[token_len] = '\0';
+                token_str = copy_token(content, &json_content[2]);
 
                 int light_num = atoi(token_str);
 
@@ -386,18 +1118,14 @@ static esp_err_t index_post_handler( httpd_req_t *req )
                 }
                 else {
                     token_len = json_content[3].end - json_content[3].start;
-                    token_str = (char*)realloc(token_str, (token_len + 1) * sizeof(char));
-                    strncpy(token_str, content+json_content[3].start, token_len);
-                    token_str[token_len] = '\0';
+                    token_str = copy_token(content, &json_content[3]);
 
                     if (strcmp(token_str, "val") != 0) {
                         ESP_LOGI(TAG, "Found light, but no value token");
                     }
                     else {
                         token_len = json_content[4].end - json_content[4].start;
-                        token_str = (char*)realloc(token_str, (token_len + 1) * sizeof(char));
-                        strncpy(token_str, content+json_content[4].start, token_len);
-                        token_str[token_len] = '\0';
+                        token_str = copy_token(content, &json_content[4]);
 
                         int light_val = atoi(token_str);
 
@@ -419,9 +1147,7 @@ static esp_err_t index_post_handler( httpd_req_t *req )
             }
             else {
                 token_len = json_content[2].end - json_content[2].start;
-                token_str = (char*)realloc(token_str, (token_len + 1) * sizeof(char));
-                strncpy(token_str, content+json_content[2].start, token_len);
-                token_str[token_len] = '\0';
+                token_str = copy_token(content, &json_content[2]);
 
                 if (token_len < 1 || token_len > 32) {
                     ESP_LOGI(TAG, "SSID is too long. Max 32 characters");
@@ -431,18 +1157,14 @@ static esp_err_t index_post_handler( httpd_req_t *req )
                     strcpy(new_ssid, token_str);
 
                     token_len = json_content[3].end - json_content[3].start;
-                    token_str = (char*)realloc(token_str, (token_len + 1) * sizeof(char));
-                    strncpy(token_str, content+json_content[3].start, token_len);
-                    token_str[token_len] = '\0';
+                    token_str = copy_token(content, &json_content[3]);
 
                     if (strcmp(token_str, "psk") != 0) {
                         ESP_LOGI(TAG, "Found ssid, but no password token");
                     }
                     else {
                         token_len = json_content[4].end - json_content[4].start;
-                        token_str = (char*)realloc(token_str, (token_len + 1) * sizeof(char));
-                        strncpy(token_str, content+json_content[4].start, token_len);
-                        token_str[token_len] = '\0';
+                        token_str = copy_token(content, &json_content[4]);
 
                         if (token_len < 8 || token_len > 63) {
                             ESP_LOGI(TAG, "Password is wrong length. Min 8 characters. Max 63 characters");
@@ -451,10 +1173,12 @@ static esp_err_t index_post_handler( httpd_req_t *req )
                             // If wifi info is ok, save it to the global variables,
                             // save it to NVS, and set the new_wifi_info flag to trigger a reconnect
                             ESP_LOGI(TAG, "New SSID: %s", new_ssid);
-                            ESP_LOGI(TAG, "New PSK: %s", token_str);
                             strcpy(esp_wifi_sta_ssid, new_ssid);
                             strcpy(esp_wifi_sta_pass, token_str);
                             save_wifi_info_to_nvs(esp_wifi_sta_ssid, esp_wifi_sta_pass);
+                            // The cached AP belongs to the old network
+                            wifi_cache.valid = 0;
+                            wifi_cache_dirty = 1;
                             new_wifi_info = 1;
                             sprintf(resp, "New SSID and Password set! Connecting now");
                         }
@@ -469,9 +1193,7 @@ static esp_err_t index_post_handler( httpd_req_t *req )
             }
             else {
                 token_len = json_content[2].end - json_content[2].start;
-                token_str = (char*)realloc(token_str, (token_len + 1) * sizeof(char));
-                strncpy(token_str, content+json_content[2].start, token_len);
-                token_str[token_len] = '\0';
+                token_str = copy_token(content, &json_content[2]);
 
                 if (token_len > 256) {
                     ESP_LOGI(TAG, "MQTT Broker URI too long. Must be 256 characters or less");
@@ -496,9 +1218,7 @@ static esp_err_t index_post_handler( httpd_req_t *req )
                 for (int i = 0; i < 4; i++){
                     index = (i * 4) + 1;
                     token_len = json_content[index].end - json_content[index].start;
-                    token_str = (char*)realloc(token_str, (token_len + 1) * sizeof(char));
-                    strncpy(token_str, content+json_content[index].start, token_len);
-                    token_str[token_len] = '\0';
+                    token_str = copy_token(content, &json_content[index]);
 
                     sprintf(cmp_str, "light%d_name", i);
                     if (strcmp(cmp_str, token_str) != 0) {
@@ -510,9 +1230,7 @@ static esp_err_t index_post_handler( httpd_req_t *req )
                     index = (i * 4) + 2;
                     token_len = json_content[index].end - json_content[index].start;
                     if (token_len > 0) {
-                        token_str = (char*)realloc(token_str, (token_len + 1) * sizeof(char));
-                        strncpy(token_str, content+json_content[index].start, token_len);
-                        token_str[token_len] = '\0';
+                        token_str = copy_token(content, &json_content[index]);
 
                         if (token_len > 12) {
                             ESP_LOGI(TAG, "Name too long. Max 12 chars: %s", token_str);
@@ -524,9 +1242,7 @@ static esp_err_t index_post_handler( httpd_req_t *req )
 
                     index = (i * 4) + 3;
                     token_len = json_content[index].end - json_content[index].start;
-                    token_str = (char*)realloc(token_str, (token_len + 1) * sizeof(char));
-                    strncpy(token_str, content+json_content[index].start, token_len);
-                    token_str[token_len] = '\0';
+                    token_str = copy_token(content, &json_content[index]);
 
                     sprintf(cmp_str, "light%d_en", i);
                     if (strcmp(cmp_str, token_str) != 0) {
@@ -537,9 +1253,7 @@ static esp_err_t index_post_handler( httpd_req_t *req )
 
                     index = (i * 4) + 4;
                     token_len = json_content[index].end - json_content[index].start;
-                    token_str = (char*)realloc(token_str, (token_len + 1) * sizeof(char));
-                    strncpy(token_str, content+json_content[index].start, token_len);
-                    token_str[token_len] = '\0';
+                    token_str = copy_token(content, &json_content[index]);
 
                     if (strcmp(token_str, "true") == 0) {
                         light_data[i].enabled = 1;
@@ -557,95 +1271,855 @@ static esp_err_t index_post_handler( httpd_req_t *req )
                         break;
                     }
                     set_mqtt_config_payload(i);
-                    if (mqtt_connected == 1) {
-                        int msg_id = esp_mqtt_client_publish(mqtt_client, light_data[i].mqtt_config_topic, light_data[i].mqtt_config_payload, 0, 1, 1);
-                        ESP_LOGI(TAG, "sent publish successful, msg_id=%d", msg_id);
-                    }
+                    publish_light_config(i);
                 }
                 save_light_info_to_nvs(light_data);
             }
         }
+        // Message for recalling a scene
+        else if (strcmp(token_str, "scene") == 0) {
+            if (num_tokens != 3) {
+                ESP_LOGI(TAG, "Wrong number of tokens for scene message!");
+            }
+            else if (recall_scene(content + json_content[2].start, json_content[2].end - json_content[2].start) == 0) {
+                sprintf(resp, "Scene recalled");
+            }
+            else {
+                sprintf(resp, "Scene not found");
+            }
+        }
+        // Message for saving the current light levels as a scene
+        else if (strcmp(token_str, "scene_save") == 0) {
+            if (num_tokens != 5) {
+                ESP_LOGI(TAG, "Wrong number of tokens for scene save message!");
+            }
+            else {
+                token_len = json_content[2].end - json_content[2].start;
+                token_str = copy_token(content, &json_content[2]);
+
+                int slot = atoi(token_str);
+                token_len = json_content[4].end - json_content[4].start;
+
+                if (slot < 0 || slot >= SCENE_MAX_COUNT) {
+                    ESP_LOGI(TAG, "Scene number %d out of range! Must be 0-%d", slot, SCENE_MAX_COUNT - 1);
+                }
+                else if (json_content[3].end - json_content[3].start != 4 || strncmp(content + json_content[3].start, "name", 4) != 0) {
+                    ESP_LOGI(TAG, "Found scene_save, but no name token");
+                }
+                else if (token_len > SCENE_NAME_LENGTH - 1 || memchr(content + json_content[4].start, '"', token_len) != NULL) {
+                    ESP_LOGI(TAG, "Scene name too long. Max %d chars", SCENE_NAME_LENGTH - 1);
+                }
+                else {
+                    save_scene(slot, content + json_content[4].start, token_len);
+                    sprintf(resp, "Scene saved!");
+                }
+            }
+        }
+        // Message for setting the DMX universe and start address for live control
+        else if (strcmp(token_str, "dmx_universe") == 0) {
+            if (num_tokens != 5) {
+                ESP_LOGI(TAG, "Wrong number of tokens for DMX message!");
+            }
+            else if (json_content[3].end - json_content[3].start != strlen("dmx_address") || strncmp(content + json_content[3].start, "dmx_address", strlen("dmx_address")) != 0) {
+                ESP_LOGI(TAG, "Found dmx_universe, but no dmx_address token");
+            }
+            else {
+                int universe = atoi(content + json_content[2].start);
+                int address = atoi(content + json_content[4].start);
+                if (universe < 1 || universe > 63999 || address < 1 || address > 509) {
+                    ESP_LOGI(TAG, "DMX universe %d or address %d out of range", universe, address);
+                    sprintf(resp, "DMX universe must be 1-63999 and address 1-509");
+                }
+                else {
+                    dmx_universe = universe;
+                    dmx_address = address;
+                    udp_control_set_address(dmx_universe, dmx_address);
+                    save_dmx_info_to_nvs(dmx_universe, dmx_address);
+                    sprintf(resp, "DMX settings saved!");
+                }
+            }
+        }
+        // Message for setting which multicast groups this device is in
+        else if (strcmp(token_str, "groups") == 0) {
+            if (num_tokens != 3) {
+                ESP_LOGI(TAG, "Wrong number of tokens for groups message!");
+            }
+            else {
+                token_str = copy_token(content, &json_content[2]);
+                long groups = strtol(token_str, NULL, 10);
+                if (groups < 0 || groups > 0xFFFF) {
+                    ESP_LOGI(TAG, "Groups mask %ld out of range", groups);
+                }
+                else {
+                    group_membership = groups;
+                    udp_control_set_groups(group_membership);
+                    save_groups_to_nvs(group_membership);
+                    sprintf(resp, "Groups saved!");
+                }
+            }
+        }
+        // Message for saving a schedule entry or the timezone
+        else if (strcmp(token_str, "schedule") == 0 || strcmp(token_str, "timezone") == 0) {
+            if (handle_schedule_message(content, json_content, num_tokens) == 0) {
+                sprintf(resp, "Schedule saved!");
+            }
+            else {
+                sprintf(resp, "Error saving schedule");
+            }
+        }
         else {
             ESP_LOGI(TAG, "JSON token not recognized: %s", token_str);
         }
     }
 
-    free(token_str);
     httpd_resp_send(req, resp, HTTPD_RESP_USE_STRLEN);
+    req_arena_reset();
     return ESP_OK;
 }
 
-// The website is set up to request a status update every 2 seconds
-// This function provides that update in JSON format
-static esp_err_t status_update_handler( httpd_req_t *req )
+// Everything shown in the status update. A copy is taken on every poll
+// and compared with the last one so the JSON is only rebuilt when
+// something actually changed
+typedef struct
 {
-    char json_data[1024];
-    sprintf(json_data, 
-"{\"lights\":\
-{\
-\"light0\":\
-{\
-\"name\": \"%s\",\
-\"enabled\": \"%d\",\
-\"duty_cycle\": \"%d\"\
-},\
-\"light1\":\
-{\
-\"name\": \"%s\",\
-\"enabled\": \"%d\",\
-\"duty_cycle\": \"%d\"\
-},\
-\"light2\":\
-{\
-\"name\": \"%s\",\
-\"enabled\": \"%d\",\
-\"duty_cycle\": \"%d\"\
-},\
-\"light3\":\
-{\
-\"name\": \"%s\",\
-\"enabled\": \"%d\",\
-\"duty_cycle\": \"%d\"\
-}\
-},\
-\"status\":\
-{\
-\"wifi_status\": \"%d\",\
-\"wifi_ssid\": \"%s\",\
-\"wifi_ip\": \"%s\",\
-\"mqtt_status\": \"%d\",\
-\"mqtt_uri\": \"%s\"\
-}\
-}",
-        light_data[0].name,
-        light_data[0].enabled,
-        light_data[0].duty_cycle,
-        light_data[1].name,
-        light_data[1].enabled,
-        light_data[1].duty_cycle,
-        light_data[2].name,
-        light_data[2].enabled,
-        light_data[2].duty_cycle,
-        light_data[3].name,
-        light_data[3].enabled,
-        light_data[3].duty_cycle,
-        wifi_connected + ap_mode,
-        ap_mode ? ap_ssid_name : esp_wifi_sta_ssid,
-        esp_wifi_ip_addr,
-        mqtt_connected,
-        mqtt_broker_uri);
-    ESP_LOGI(TAG,  "Sending update. JSON length: %d", strlen(json_data));
-    httpd_resp_send(req, json_data, HTTPD_RESP_USE_STRLEN);
-    return ESP_OK;
+  char light_name[4][13];
+  uint8_t light_enabled[4];
+  int light_duty_cycle[4];
+  uint8_t wifi_status;
+  uint8_t mqtt_status;
+  char wifi_ssid[33];
+  char wifi_ip[16];
+  char mqtt_uri[257];
+} status_snapshot_t;
+
+// Cached status JSON. Sized for the worst case where every string
+// needs escaping, so the bounded writer should never truncate it
+#define STATUS_JSON_LENGTH 2560
+static char status_json[STATUS_JSON_LENGTH];
+static size_t status_json_len = 0;
+static status_snapshot_t status_rendered;
+static uint8_t status_valid = 0;
+
+static void status_take_snapshot(status_snapshot_t* snapshot)
+{
+    // Zero first so unused bytes after each string compare equal
+    memset(snapshot, 0, sizeof(status_snapshot_t));
+    for (int i = 0; i < 4; i++) {
+        strncpy(snapshot->light_name[i], light_data[i].name, sizeof(snapshot->light_name[i]) - 1);
+        snapshot->light_enabled[i] = light_data[i].enabled;
+        snapshot->light_duty_cycle[i] = light_data[i].duty_cycle;
+    }
+    // 1 when on the network, 2 in AP mode, 0 otherwise
+    snapshot->wifi_status = wifi_connected ? 1 : (ap_mode ? 2 : 0);
+    snapshot->mqtt_status = mqtt_connected;
+    strncpy(snapshot->wifi_ssid, wifi_connected ? esp_wifi_sta_ssid : ap_ssid_name, sizeof(snapshot->wifi_ssid) - 1);
+    strncpy(snapshot->wifi_ip, esp_wifi_ip_addr, sizeof(snapshot->wifi_ip) - 1);
+    strncpy(snapshot->mqtt_uri, mqtt_broker_uri, sizeof(snapshot->mqtt_uri) - 1);
 }
 
-// Starts the webserver after wifi is connected or AP mode is started
-static httpd_handle_t start_webserver( void )
+// Renders the status JSON from a snapshot. Values are sent as strings
+// since that's what the web page expects
+static void status_render(const status_snapshot_t* snapshot)
 {
-  httpd_handle_t server = NULL;
+    json_writer_t writer;
+    char key[8];
+    json_writer_init(&writer, status_json, sizeof(status_json));
+    json_write_raw(&writer, "{\"lights\": {");
+    for (int i = 0; i < 4; i++) {
+        sprintf(key, "light%d", i);
+        json_write_raw(&writer, i ? ", " : "");
+        json_write_key(&writer, key);
+        json_write_raw(&writer, "{\"name\": ");
+        json_write_string(&writer, snapshot->light_name[i]);
+        json_write_raw(&writer, ", \"enabled\": \"");
+        json_write_int(&writer, snapshot->light_enabled[i]);
+        json_write_raw(&writer, "\", \"duty_cycle\": \"");
+        json_write_int(&writer, snapshot->light_duty_cycle[i]);
+        json_write_raw(&writer, "\"}");
+    }
+    json_write_raw(&writer, "}, \"status\": {\"wifi_status\": \"");
+    json_write_int(&writer, snapshot->wifi_status);
+    json_write_raw(&writer, "\", \"wifi_ssid\": ");
+    json_write_string(&writer, snapshot->wifi_ssid);
+    json_write_raw(&writer, ", \"wifi_ip\": ");
+    json_write_string(&writer, snapshot->wifi_ip);
+    json_write_raw(&writer, ", \"mqtt_status\": \"");
+    json_write_int(&writer, snapshot->mqtt_status);
+    json_write_raw(&writer, "\", \"mqtt_uri\": ");
+    json_write_string(&writer, snapshot->mqtt_uri);
+    json_write_raw(&writer, "}}");
+
+    if (writer.overflow) {
+        ESP_LOGI(TAG, "Status JSON truncated at %d bytes", writer.len);
+    }
+    status_json_len = writer.len;
+}
+
+// The website is set up to request a status update every 2 seconds
+// This function provides that update in JSON format
+// The httpd server runs handlers one at a time on its own task, so the
+// cached JSON is only touched from here and needs no lock. Every poller
+// between changes gets the same cached bytes
+static esp_err_t status_update_handler( httpd_req_t *req )
+{
+    status_snapshot_t snapshot;
+    status_take_snapshot(&snapshot);
+    if (status_valid == 0 || memcmp(&snapshot, &status_rendered, sizeof(status_snapshot_t)) != 0) {
+        status_render(&snapshot);
+        status_rendered = snapshot;
+        status_valid = 1;
+        HTTP_LOGI(TAG, "Status changed. JSON length: %d", status_json_len);
+        LOG_RING("Status JSON rebuilt, %d bytes", status_json_len);
+    }
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_send(req, status_json, status_json_len);
+    return ESP_OK;
+}
+
+// Sends the schedule table in JSON format for the schedule page
+// Only entries that have been set up are included. Each entry is sent as
+// its own chunk so the full table never needs to fit in one buffer
+static esp_err_t schedule_get_handler( httpd_req_t *req )
+{
+    char json_data[160];
+    httpd_resp_set_type(req, "application/json");
+    sprintf(json_data, "{\"timezone\": \"%s\", \"time_synced\": \"%d\", \"entries\": [", schedule_timezone, schedule_time_synced());
+    httpd_resp_send_chunk(req, json_data, HTTPD_RESP_USE_STRLEN);
+    uint8_t first = 1;
+    for (int i = 0; i < SCHEDULE_MAX_ENTRIES; i++) {
+        schedule_entry_t* entry = &schedule_data[i];
+        if (entry->days == 0 && entry->enabled == 0) {
+            continue;
+        }
+        sprintf(json_data, "%s{\"schedule\": \"%d\", \"enabled\": \"%d\", \"light\": \"%d\", \"brightness\": \"%d\", \"hour\": \"%d\", \"minute\": \"%d\", \"days\": \"%d\", \"transition\": \"%d\"}",
+            first ? "" : ",", i, entry->enabled, entry->light, entry->brightness, entry->hour, entry->minute, entry->days, entry->transition_s);
+        httpd_resp_send_chunk(req, json_data, HTTPD_RESP_USE_STRLEN);
+        first = 0;
+    }
+    httpd_resp_send_chunk(req, "]}", HTTPD_RESP_USE_STRLEN);
+    httpd_resp_send_chunk(req, NULL, 0);
+    return ESP_OK;
+}
+
+// Sends the saved scenes in JSON format so the web page can show recall buttons
+static esp_err_t scenes_get_handler( httpd_req_t *req )
+{
+    // Each scene is at most 128 bytes with every name character escaped
+    size_t json_size = (SCENE_MAX_COUNT * 128) + 16;
+    char* json_data = req_arena_alloc(json_size);
+    if (json_data == NULL) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        req_arena_reset();
+        return ESP_FAIL;
+    }
+    json_writer_t writer;
+    json_writer_init(&writer, json_data, json_size);
+    json_write_raw(&writer, "{\"scenes\": [");
+    for (int i = 0; i < SCENE_MAX_COUNT; i++) {
+        json_write_raw(&writer, i ? ",{" : "{");
+        json_write_key(&writer, "name");
+        json_write_string(&writer, scene_data[i].name);
+        json_write_raw(&writer, ", \"lights\": [");
+        for (int light = 0; light < 4; light++) {
+            if (light > 0) {
+                json_write_raw(&writer, ", ");
+            }
+            json_write_int(&writer, scene_data[i].brightness[light]);
+        }
+        json_write_raw(&writer, "]}");
+    }
+    json_write_raw(&writer, "]}");
+    if (writer.overflow) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Scene list too long");
+        req_arena_reset();
+        return ESP_FAIL;
+    }
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_send(req, json_data, HTTPD_RESP_USE_STRLEN);
+    req_arena_reset();
+    return ESP_OK;
+}
+
+// REST resource API
+// Each resource has its own URI and a small parser for its own body, so
+// scripts can change one light or one setting without building the full
+// config messages the web page sends to POST /. Routes are:
+//  - GET/PUT /api/lights/{n}    {"brightness": 128, "transition": 2.5, "name": "Desk", "enabled": true}
+//  - GET/PUT /api/config/wifi   {"ssid": "network", "psk": "password"}
+//                               {"static_ip": "192.168.1.50", "gateway": "192.168.1.1"}
+//  - GET/PUT /api/config/mqtt   {"broker": "mqtt://192.168.1.101:1883"}
+//  - PUT /api/config/mqtt/tls/{ca_cert|client_cert|client_key}  with a PEM body
+// PUT keys are all optional and can come in any order. Responses are sent
+// in one piece so they carry a Content-Length and the connection stays open.
+// Bodies are read into the request arena, which is reset once the response
+// has been sent, so every exit from a handler must go through api_send_json
+#define API_MAX_BODY_LENGTH 512
+#define API_MAX_TOKENS      16
+
+// Longest transition accepted, the same as a schedule entry
+#define API_MAX_TRANSITION_S 65535
+
+// api_parse_body return value when the connection has to be closed
+// because the body couldn't be read
+#define API_BODY_CLOSE      -2
+
+// Sends a JSON response with the given status
+static esp_err_t api_send_json(httpd_req_t *req, const char* status, const char* json)
+{
+    httpd_resp_set_status(req, status);
+    httpd_resp_set_type(req, "application/json");
+    esp_err_t err = httpd_resp_send(req, json, strlen(json));
+    req_arena_reset();
+    return err;
+}
+
+// Sends an error as {"error": "..."} with the given status
+static esp_err_t api_send_error(httpd_req_t *req, const char* status, const char* message)
+{
+    char json_data[96];
+    snprintf(json_data, sizeof(json_data), "{\"error\": \"%s\"}", message);
+    return api_send_json(req, status, json_data);
+}
+
+// Receives the whole body into buf and NUL terminates it
+// Returns 0, or API_BODY_CLOSE if the client closed the connection or
+// stalled, with the arena reset. A stall is answered with a 408 rather than
+// retried, since retrying would block the server for every other client
+static int api_recv_body(httpd_req_t *req, char* buf, size_t len)
+{
+    size_t received = 0;
+    while (received < len) {
+        int ret = httpd_req_recv(req, buf + received, len - received);
+        if (ret <= 0) {  // 0 return value indicates connection closed
+            if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
+                httpd_resp_send_408(req);
+            }
+            req_arena_reset();
+            return API_BODY_CLOSE;
+        }
+        received += ret;
+    }
+    buf[received] = '\0';
+    return 0;
+}
+
+// Reads the whole request body and parses it as a flat JSON object
+// The body is put in the request arena and returned in *body
+// Returns the number of tokens, -1 if an error response has already been
+// sent, or API_BODY_CLOSE if the handler must return ESP_FAIL to close the
+// socket, since the rest of the body is still waiting on it
+static int api_parse_body(httpd_req_t *req, char** body, jsmntok_t* tokens)
+{
+    if (req->content_len == 0) {
+        api_send_error(req, HTTPD_400, "Body is empty");
+        return -1;
+    }
+    if (req->content_len >= API_MAX_BODY_LENGTH) {
+        api_send_error(req, "413 Payload Too Large", "Body is too large");
+        return API_BODY_CLOSE;
+    }
+    char* content = req_arena_alloc(req->content_len + 1);
+    if (content == NULL) {
+        api_send_error(req, HTTPD_500, "Out of memory");
+        return API_BODY_CLOSE;
+    }
+    *body = content;
+    if (api_recv_body(req, content, req->content_len) != 0) {
+        return API_BODY_CLOSE;
+    }
+    size_t received = req->content_len;
+
+    jsmn_parser json_parser;
+    jsmn_init(&json_parser);
+    int num_tokens = jsmn_parse(&json_parser, content, received, tokens, API_MAX_TOKENS);
+    if (num_tokens < 1 || tokens[0].type != JSMN_OBJECT) {
+        api_send_error(req, HTTPD_400, "Body must be a JSON object");
+        return -1;
+    }
+    // Only flat objects are accepted, so keys and values alternate
+    for (int t = 1; t + 1 < num_tokens; t += 2) {
+        if (tokens[t].type != JSMN_STRING || tokens[t + 1].type == JSMN_OBJECT || tokens[t + 1].type == JSMN_ARRAY) {
+            api_send_error(req, HTTPD_400, "Nested values are not supported");
+            return -1;
+        }
+    }
+    return num_tokens;
+}
+
+// Parses a whole value token as an integer from min to max
+// Returns 0, or -1 if it isn't a number or is out of range
+static int api_value_int(const char* str, int len, long min, long max, int* value)
+{
+    char num_str[12];
+    if (len < 1 || len >= sizeof(num_str)) {
+        return -1;
+    }
+    memcpy(num_str, str, len);
+    num_str[len] = '\0';
+    char* end;
+    long num = strtol(num_str, &end, 10);
+    if (end != num_str + len || num < min || num > max) {
+        return -1;
+    }
+    *value = num;
+    return 0;
+}
+
+// Parses a value token in seconds, e.g. 2.5, as milliseconds from 0 to max_s
+// Returns 0, or -1 if it isn't a number or is out of range
+static int api_value_ms(const char* str, int len, int max_s, int* value_ms)
+{
+    char num_str[24];
+    if (len < 1 || len >= sizeof(num_str)) {
+        return -1;
+    }
+    memcpy(num_str, str, len);
+    num_str[len] = '\0';
+    char* end;
+    double seconds = strtod(num_str, &end);
+    // Written so NaN fails the range check too
+    if (end != num_str + len || !(seconds >= 0 && seconds <= max_s)) {
+        return -1;
+    }
+    *value_ms = (int)(seconds * 1000);
+    return 0;
+}
+
+// Returns 1 if the key token matches the given key exactly
+static uint8_t api_key_is(const char* content, const jsmntok_t* key, const char* name)
+{
+    int len = key->end - key->start;
+    return len == strlen(name) && strncmp(content + key->start, name, len) == 0;
+}
+
+// Gets the light number from a /api/lights/{n} URI, or -1 if it isn't valid
+static int api_light_from_uri(httpd_req_t *req)
+{
+    const char* num_str = req->uri + strlen("/api/lights/");
+    if (num_str[0] < '0' || num_str[0] > '3' || (num_str[1] != '\0' && num_str[1] != '?')) {
+        return -1;
+    }
+    return num_str[0] - '0';
+}
+
+static void api_light_json(uint8_t num, char* json_data, size_t json_size)
+{
+    json_writer_t writer;
+    json_writer_init(&writer, json_data, json_size);
+    json_write_raw(&writer, "{\"light\": ");
+    json_write_int(&writer, num);
+    json_write_raw(&writer, ", \"name\": ");
+    json_write_string(&writer, light_data[num].name);
+    json_write_raw(&writer, light_data[num].enabled ? ", \"enabled\": true" : ", \"enabled\": false");
+    json_write_raw(&writer, ", \"brightness\": ");
+    json_write_int(&writer, light_data[num].duty_cycle);
+    json_write_raw(&writer, ", \"effect\": ");
+    json_write_string(&writer, lights_effect_name(lights_get_effect(num)));
+    json_write_raw(&writer, ", \"watts\": ");
+    json_write_int(&writer, energy_get_watts(num));
+    energy_totals_t totals;
+    char value[24];
+    energy_get_totals(&totals);
+    json_write_raw(&writer, ", \"energy_wh\": ");
+    energy_format_x1000(energy_watt_hours_x1000(&totals, num), value, sizeof(value));
+    json_write_raw(&writer, value);
+    json_write_raw(&writer, ", \"on_hours\": ");
+    energy_format_x1000(energy_on_hours_x1000(&totals, num), value, sizeof(value));
+    json_write_raw(&writer, value);
+    json_write_raw(&writer, "}");
+}
+
+static esp_err_t api_light_get_handler( httpd_req_t *req )
+{
+    int num = api_light_from_uri(req);
+    if (num < 0) {
+        return api_send_error(req, HTTPD_404, "No such light");
+    }
+    char json_data[256];
+    api_light_json(num, json_data, sizeof(json_data));
+    return api_send_json(req, HTTPD_200, json_data);
+}
+
+static esp_err_t api_light_put_handler( httpd_req_t *req )
+{
+    int num = api_light_from_uri(req);
+    if (num < 0) {
+        return api_send_error(req, HTTPD_404, "No such light");
+    }
+    char* content;
+    jsmntok_t tokens[API_MAX_TOKENS];
+    int num_tokens = api_parse_body(req, &content, tokens);
+    if (num_tokens < 0) {
+        return num_tokens == API_BODY_CLOSE ? ESP_FAIL : ESP_OK;
+    }
+
+    int brightness = -1;
+    int transition_ms = -1;
+    int enabled = -1;
+    int watts = -1;
+    const char* name = NULL;
+    int name_len = 0;
+
+    // Validate everything before changing anything
+    for (int t = 1; t + 1 < num_tokens; t += 2) {
+        jsmntok_t* val = &tokens[t + 1];
+        const char* val_str = content + val->start;
+        int val_len = val->end - val->start;
+        if (api_key_is(content, &tokens[t], "brightness")) {
+            if (api_value_int(val_str, val_len, 0, 255, &brightness) != 0) {
+                return api_send_error(req, HTTPD_400, "Brightness must be 0-255");
+            }
+        }
+        else if (api_key_is(content, &tokens[t], "transition")) {
+            if (api_value_ms(val_str, val_len, API_MAX_TRANSITION_S, &transition_ms) != 0) {
+                return api_send_error(req, HTTPD_400, "Transition must be 0-65535 seconds");
+            }
+        }
+        else if (api_key_is(content, &tokens[t], "enabled")) {
+            if (val_len == 4 && strncmp(val_str, "true", 4) == 0) {
+                enabled = 1;
+            }
+            else if (val_len == 5 && strncmp(val_str, "false", 5) == 0) {
+                enabled = 0;
+            }
+            else {
+                return api_send_error(req, HTTPD_400, "Enabled must be true or false");
+            }
+        }
+        else if (api_key_is(content, &tokens[t], "name")) {
+            if (val_len < 1 || val_len > 12 || memchr(val_str, '"', val_len) != NULL) {
+                return api_send_error(req, HTTPD_400, "Name must be 1-12 characters");
+            }
+            name = val_str;
+            name_len = val_len;
+        }
+        else if (api_key_is(content, &tokens[t], "watts")) {
+            if (api_value_int(val_str, val_len, 0, 65535, &watts) != 0) {
+                return api_send_error(req, HTTPD_400, "Watts must be 0-65535");
+            }
+        }
+        else {
+            return api_send_error(req, HTTPD_400, "Unknown key");
+        }
+    }
+    // Disabling the light fades it to 0, so that counts as a brightness
+    if (transition_ms >= 0 && brightness < 0 && enabled != 0) {
+        return api_send_error(req, HTTPD_400, "Transition needs a brightness");
+    }
+
+    if (name != NULL || enabled != -1) {
+        if (name != NULL) {
+            strncpy(light_data[num].name, name, name_len);
+            light_data[num].name[name_len] = '\0';
+        }
+        if (enabled != -1) {
+            light_data[num].enabled = enabled;
+            if (enabled == 0) {
+                brightness = 0;
+            }
+        }
+        save_light_info_to_nvs(light_data);
+        set_mqtt_config_payload(num);
+        publish_light_config(num);
+    }
+    if (watts >= 0) {
+        energy_set_watts(num, watts);
+        uint16_t load_watts[4];
+        for (uint8_t i = 0; i < 4; i++) {
+            load_watts[i] = energy_get_watts(i);
+        }
+        save_load_watts_to_nvs(load_watts);
+    }
+    if (brightness >= 0 && transition_ms >= 0) {
+        set_light_transition(num, brightness, transition_ms);
+    }
+    else if (brightness >= 0) {
+        set_light(num, brightness);
+    }
+
+    char json_data[256];
+    api_light_json(num, json_data, sizeof(json_data));
+    return api_send_json(req, HTTPD_200, json_data);
+}
+
+static esp_err_t api_wifi_get_handler( httpd_req_t *req )
+{
+    char json_data[320];
+    json_writer_t writer;
+    json_writer_init(&writer, json_data, sizeof(json_data));
+    json_write_raw(&writer, "{\"ssid\": ");
+    json_write_string(&writer, esp_wifi_sta_ssid);
+    json_write_raw(&writer, wifi_connected ? ", \"connected\": true" : ", \"connected\": false");
+    json_write_raw(&writer, ap_mode ? ", \"ap_mode\": true" : ", \"ap_mode\": false");
+    json_write_raw(&writer, ", \"ip\": ");
+    json_write_string(&writer, esp_wifi_ip_addr);
+    json_write_raw(&writer, ", \"static_ip\": ");
+    if (wifi_static_ip.enabled) {
+        char ip_str[16];
+        struct in_addr addr = { .s_addr = wifi_static_ip.ip };
+        json_write_string(&writer, inet_ntoa_r(addr, ip_str, sizeof(ip_str)));
+    }
+    else {
+        json_write_raw(&writer, "null");
+    }
+    json_write_raw(&writer, wifi_connect_mode == WIFI_FAST_DIRECTED ? ", \"fast_connect\": true" : ", \"fast_connect\": false");
+    json_write_raw(&writer, ", \"time_to_ip_ms\": ");
+    json_write_int(&writer, wifi_time_to_ip_ms);
+    json_write_raw(&writer, "}");
+    return api_send_json(req, HTTPD_200, json_data);
+}
+
+// Parses a dotted quad string value into a network byte order address
+// Returns 0 if it isn't a valid address
+static uint8_t api_parse_ip(const char* content, const jsmntok_t* val, uint32_t* addr)
+{
+    char ip_str[16];
+    int len = val->end - val->start;
+    if (len < 7 || len > 15) {
+        return 0;
+    }
+    strncpy(ip_str, content + val->start, len);
+    ip_str[len] = '\0';
+    struct in_addr in;
+    if (inet_aton(ip_str, &in) == 0) {
+        return 0;
+    }
+    *addr = in.s_addr;
+    return 1;
+}
+
+static esp_err_t api_wifi_put_handler( httpd_req_t *req )
+{
+    char* content;
+    jsmntok_t tokens[API_MAX_TOKENS];
+    int num_tokens = api_parse_body(req, &content, tokens);
+    if (num_tokens < 0) {
+        return num_tokens == API_BODY_CLOSE ? ESP_FAIL : ESP_OK;
+    }
+
+    jsmntok_t* ssid = NULL;
+    jsmntok_t* psk = NULL;
+    jsmntok_t* ip = NULL;
+    jsmntok_t* netmask = NULL;
+    jsmntok_t* gateway = NULL;
+    jsmntok_t* dns = NULL;
+    for (int t = 1; t + 1 < num_tokens; t += 2) {
+        if (api_key_is(content, &tokens[t], "ssid")) {
+            ssid = &tokens[t + 1];
+        }
+        else if (api_key_is(content, &tokens[t], "psk")) {
+            psk = &tokens[t + 1];
+        }
+        else if (api_key_is(content, &tokens[t], "static_ip")) {
+            ip = &tokens[t + 1];
+        }
+        else if (api_key_is(content, &tokens[t], "netmask")) {
+            netmask = &tokens[t + 1];
+        }
+        else if (api_key_is(content, &tokens[t], "gateway")) {
+            gateway = &tokens[t + 1];
+        }
+        else if (api_key_is(content, &tokens[t], "dns")) {
+            dns = &tokens[t + 1];
+        }
+        else {
+            return api_send_error(req, HTTPD_400, "Unknown key");
+        }
+    }
+    if ((ssid == NULL) != (psk == NULL)) {
+        return api_send_error(req, HTTPD_400, "Both ssid and psk are required");
+    }
+    if (ssid == NULL && ip == NULL) {
+        return api_send_error(req, HTTPD_400, "Nothing to update");
+    }
+
+    // An empty static_ip goes back to DHCP. Otherwise gateway is required,
+    // the netmask defaults to /24 and DNS defaults to the gateway
+    wifi_static_ip_t static_ip = wifi_static_ip;
+    if (ip != NULL && ip->end == ip->start) {
+        static_ip.enabled = 0;
+    }
+    else if (ip != NULL) {
+        static_ip.enabled = 1;
+        static_ip.netmask = htonl(0xFFFFFF00);
+        if (!api_parse_ip(content, ip, &static_ip.ip) || gateway == NULL || !api_parse_ip(content, gateway, &static_ip.gateway)) {
+            return api_send_error(req, HTTPD_400, "static_ip and gateway must be IPv4 addresses");
+        }
+        if (netmask != NULL && !api_parse_ip(content, netmask, &static_ip.netmask)) {
+            return api_send_error(req, HTTPD_400, "netmask must be an IPv4 address");
+        }
+        static_ip.dns = static_ip.gateway;
+        if (dns != NULL && !api_parse_ip(content, dns, &static_ip.dns)) {
+            return api_send_error(req, HTTPD_400, "dns must be an IPv4 address");
+        }
+    }
+
+    if (ssid != NULL) {
+        int ssid_len = ssid->end - ssid->start;
+        int psk_len = psk->end - psk->start;
+        if (ssid_len < 1 || ssid_len > 32) {
+            return api_send_error(req, HTTPD_400, "SSID must be 1-32 characters");
+        }
+        if (psk_len < 8 || psk_len > 63) {
+            return api_send_error(req, HTTPD_400, "Password must be 8-63 characters");
+        }
+
+        // Same as the web page. Save it and let the wifi task reconnect
+        strncpy(esp_wifi_sta_ssid, content + ssid->start, ssid_len);
+        esp_wifi_sta_ssid[ssid_len] = '\0';
+        strncpy(esp_wifi_sta_pass, content + psk->start, psk_len);
+        esp_wifi_sta_pass[psk_len] = '\0';
+        ESP_LOGI(TAG, "New SSID: %s", esp_wifi_sta_ssid);
+        save_wifi_info_to_nvs(esp_wifi_sta_ssid, esp_wifi_sta_pass);
+        wifi_cache.valid = 0;
+        wifi_cache_dirty = 1;
+    }
+    if (ip != NULL) {
+        wifi_static_ip = static_ip;
+        ESP_LOGI(TAG, "Static IP %s", wifi_static_ip.enabled ? "enabled" : "disabled");
+        save_static_ip_to_nvs(&wifi_static_ip);
+    }
+    new_wifi_info = 1;
+
+    // 202 since the reconnect happens after the response is sent
+    return api_send_json(req, "202 Accepted", "{\"status\": \"connecting\"}");
+}
+
+static esp_err_t api_mqtt_get_handler( httpd_req_t *req )
+{
+    char json_data[640];
+    json_writer_t writer;
+    mqtt_tls_stats_t stats;
+    mqtt_tls_get_stats(&stats);
+    json_writer_init(&writer, json_data, sizeof(json_data));
+    json_write_raw(&writer, "{\"broker\": ");
+    json_write_string(&writer, mqtt_broker_uri);
+    json_write_raw(&writer, mqtt_connected ? ", \"connected\": true" : ", \"connected\": false");
+    json_write_raw(&writer, ", \"tls\": {");
+    for (int i = 0; i < MQTT_TLS_PEM_COUNT; i++) {
+        json_write_raw(&writer, i ? ", " : "");
+        json_write_key(&writer, mqtt_tls_pem_name(i));
+        json_write_raw(&writer, mqtt_tls_has_pem(i) ? "true" : "false");
+    }
+    json_write_raw(&writer, "}, \"connect_ms\": {\"last\": ");
+    json_write_int(&writer, stats.last_ms);
+    json_write_raw(&writer, ", \"min\": ");
+    json_write_int(&writer, stats.min_ms);
+    json_write_raw(&writer, ", \"max\": ");
+    json_write_int(&writer, stats.max_ms);
+    json_write_raw(&writer, ", \"avg\": ");
+    json_write_int(&writer, stats.avg_ms);
+    json_write_raw(&writer, ", \"connects\": ");
+    json_write_int(&writer, stats.connects);
+    json_write_raw(&writer, ", \"failures\": ");
+    json_write_int(&writer, stats.failures);
+    json_write_raw(&writer, "}, \"handshake_ms\": {\"full\": ");
+    json_write_int(&writer, stats.full_avg_ms);
+    json_write_raw(&writer, ", \"full_count\": ");
+    json_write_int(&writer, stats.full_handshakes);
+    json_write_raw(&writer, ", \"resumed\": ");
+    json_write_int(&writer, stats.resumed_avg_ms);
+    json_write_raw(&writer, ", \"resumed_count\": ");
+    json_write_int(&writer, stats.resumed_handshakes);
+    json_write_raw(&writer, "}}");
+    if (writer.overflow) {
+        return api_send_error(req, HTTPD_500, "Broker URI too long to send");
+    }
+    return api_send_json(req, HTTPD_200, json_data);
+}
+
+static esp_err_t api_mqtt_put_handler( httpd_req_t *req )
+{
+    char* content;
+    jsmntok_t tokens[API_MAX_TOKENS];
+    int num_tokens = api_parse_body(req, &content, tokens);
+    if (num_tokens < 0) {
+        return num_tokens == API_BODY_CLOSE ? ESP_FAIL : ESP_OK;
+    }
+
+    jsmntok_t* broker = NULL;
+    for (int t = 1; t + 1 < num_tokens; t += 2) {
+        if (api_key_is(content, &tokens[t], "broker")) {
+            broker = &tokens[t + 1];
+        }
+        else {
+            return api_send_error(req, HTTPD_400, "Unknown key");
+        }
+    }
+    if (broker == NULL) {
+        return api_send_error(req, HTTPD_400, "broker is required");
+    }
+    int broker_len = broker->end - broker->start;
+    if (broker_len > 256) {
+        return api_send_error(req, HTTPD_400, "Broker URI must be 256 characters or less");
+    }
+
+    strncpy(mqtt_broker_uri, content + broker->start, broker_len);
+    mqtt_broker_uri[broker_len] = '\0';
+    save_mqtt_info_to_nvs(mqtt_broker_uri);
+    new_mqtt_info = 1;
+    ESP_LOGI(TAG, "MQTT Broker set!");
+    return api_send_json(req, "202 Accepted", "{\"status\": \"connecting\"}");
+}
+
+// Stores a certificate or key for MQTT over TLS
+// The body is the PEM itself rather than JSON so it can be sent straight
+// from a file, e.g. curl -X PUT --data-binary @ca.crt. An empty body removes it
+static esp_err_t api_mqtt_tls_put_handler( httpd_req_t *req )
+{
+    const char* name = req->uri + strlen("/api/config/mqtt/tls/");
+    int name_len = strcspn(name, "?");
+    int pem = mqtt_tls_pem_from_name(name, name_len);
+    if (pem < 0) {
+        return api_send_error(req, HTTPD_404, "Must be ca_cert, client_cert or client_key");
+    }
+    if (req->content_len >= MQTT_TLS_PEM_LENGTH) {
+        api_send_error(req, "413 Payload Too Large", "PEM is too large");
+        return ESP_FAIL;
+    }
+    char* content = req_arena_alloc(req->content_len + 1);
+    if (content == NULL) {
+        api_send_error(req, HTTPD_500, "Out of memory");
+        return ESP_FAIL;
+    }
+    if (api_recv_body(req, content, req->content_len) != 0) {
+        return ESP_FAIL;
+    }
+    size_t received = req->content_len;
+
+    if (mqtt_tls_set_pem(pem, content, received) != 0) {
+        return api_send_error(req, HTTPD_400, "Body must be a PEM starting with -----BEGIN");
+    }
+    save_mqtt_pem_to_nvs(pem, mqtt_tls_pem(pem));
+    // Reconnect so the next handshake uses it
+    mqtt_tls_changed = 1;
+    new_mqtt_info = 1;
+    ESP_LOGI(TAG, "MQTT %s %s", mqtt_tls_pem_name(pem), received ? "set" : "removed");
+    return api_send_json(req, "202 Accepted", "{\"status\": \"connecting\"}");
+}
+
+// Starts the webserver. It is started once when wifi starts and runs from then on
+static httpd_handle_t start_webserver( void )
+{
+  httpd_handle_t server = NULL;
   httpd_config_t config = HTTPD_DEFAULT_CONFIG();
   config.lru_purge_enable = true;
 
+  // Wildcard matching for the per-light API routes, and room for all the handlers
+  config.uri_match_fn = httpd_uri_match_wildcard;
+  config.max_uri_handlers = 16;
+
+  // Server profile is picked in menuconfig under "Smart Light Web Server"
+#ifdef CONFIG_WEB_SERVER_PROFILE_TUNED
+  config.max_open_sockets = CONFIG_WEB_SERVER_MAX_OPEN_SOCKETS;
+  config.stack_size = CONFIG_WEB_SERVER_STACK_SIZE;
+  config.task_priority = CONFIG_WEB_SERVER_TASK_PRIORITY;
+  config.recv_wait_timeout = CONFIG_WEB_SERVER_SOCKET_TIMEOUT;
+  config.send_wait_timeout = CONFIG_WEB_SERVER_SOCKET_TIMEOUT;
+  config.backlog_conn = CONFIG_WEB_SERVER_BACKLOG;
+  ESP_LOGI(TAG, "Using tuned web server profile");
+#endif
+
   // Start the httpd server
   ESP_LOGI(TAG,  "Starting server on port %d\n", config.server_port );
 
@@ -696,42 +2170,161 @@ static httpd_handle_t start_webserver( void )
     };
     httpd_register_uri_handler( server, &status_update );
 
+    static httpd_uri_t schedule_get =
+    {
+      .uri       = "/schedule",
+      .method    = HTTP_GET,
+      .handler   = schedule_get_handler,
+      .user_ctx  = NULL
+    };
+    httpd_register_uri_handler( server, &schedule_get );
+
+    static httpd_uri_t scenes_get =
+    {
+      .uri       = "/scenes",
+      .method    = HTTP_GET,
+      .handler   = scenes_get_handler,
+      .user_ctx  = NULL
+    };
+    httpd_register_uri_handler( server, &scenes_get );
+
+    static httpd_uri_t logs_get =
+    {
+      .uri       = "/logs",
+      .method    = HTTP_GET,
+      .handler   = log_ring_get_handler,
+      .user_ctx  = NULL
+    };
+    httpd_register_uri_handler( server, &logs_get );
+
+    static httpd_uri_t debug_tasks_get =
+    {
+      .uri       = "/debug/tasks",
+      .method    = HTTP_GET,
+      .handler   = debug_tasks_get_handler,
+      .user_ctx  = NULL
+    };
+    httpd_register_uri_handler( server, &debug_tasks_get );
+
+    static httpd_uri_t api_light_get =
+    {
+      .uri       = "/api/lights/*",
+      .method    = HTTP_GET,
+      .handler   = api_light_get_handler,
+      .user_ctx  = NULL
+    };
+    httpd_register_uri_handler( server, &api_light_get );
+
+    static httpd_uri_t api_light_put =
+    {
+      .uri       = "/api/lights/*",
+      .method    = HTTP_PUT,
+      .handler   = api_light_put_handler,
+      .user_ctx  = NULL
+    };
+    httpd_register_uri_handler( server, &api_light_put );
+
+    static httpd_uri_t api_wifi_get =
+    {
+      .uri       = "/api/config/wifi",
+      .method    = HTTP_GET,
+      .handler   = api_wifi_get_handler,
+      .user_ctx  = NULL
+    };
+    httpd_register_uri_handler( server, &api_wifi_get );
+
+    static httpd_uri_t api_wifi_put =
+    {
+      .uri       = "/api/config/wifi",
+      .method    = HTTP_PUT,
+      .handler   = api_wifi_put_handler,
+      .user_ctx  = NULL
+    };
+    httpd_register_uri_handler( server, &api_wifi_put );
+
+    static httpd_uri_t api_mqtt_get =
+    {
+      .uri       = "/api/config/mqtt",
+      .method    = HTTP_GET,
+      .handler   = api_mqtt_get_handler,
+      .user_ctx  = NULL
+    };
+    httpd_register_uri_handler( server, &api_mqtt_get );
+
+    static httpd_uri_t api_mqtt_put =
+    {
+      .uri       = "/api/config/mqtt",
+      .method    = HTTP_PUT,
+      .handler   = api_mqtt_put_handler,
+      .user_ctx  = NULL
+    };
+    httpd_register_uri_handler( server, &api_mqtt_put );
+
+    static httpd_uri_t api_mqtt_tls_put =
+    {
+      .uri       = "/api/config/mqtt/tls/*",
+      .method    = HTTP_PUT,
+      .handler   = api_mqtt_tls_put_handler,
+      .user_ctx  = NULL
+    };
+    httpd_register_uri_handler( server, &api_mqtt_tls_put );
+
   }
     
-  return NULL;
+  return server;
 }
 
 // Interrupt to start connecting to Wifi once the wifi station mode is started
 static void sta_start_handler( void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data )
 {
+    // The station also starts with the softAP when there's no wifi info yet
+    if (strcmp(esp_wifi_sta_ssid, "") == 0) {
+        return;
+    }
     ESP_LOGI(TAG, "Connecting to WIFI");
     esp_wifi_connect();
 }
 
-// If wifi disconnects, stop the webserver if it's running and retry to connect
+// If wifi disconnects, retry to connect. The webserver keeps running
+// since it also serves the softAP if the wifi task brings it up
 static void disconnect_handler( void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data )
 {
-    httpd_handle_t *server = ( httpd_handle_t * ) arg;
-
-    if ( *server )
-    {
-        ESP_LOGI(TAG,  "Stopping webserver" );
-        httpd_stop( *server );
-        *server = NULL;
+    wifi_event_sta_disconnected_t* event = (wifi_event_sta_disconnected_t*) event_data;
+    wifi_connected = 0;
+
+    // The wifi task reconnects with the new settings itself. If the station
+    // wasn't connected there is no event for it, so the flag is cleared by
+    // whatever disconnect comes next and a real failure is still handled
+    if (wifi_disconnecting) {
+        wifi_disconnecting = 0;
+        if (event->reason == WIFI_REASON_ASSOC_LEAVE) {
+            ESP_LOGI(TAG, "Station disconnected to reconnect with new settings");
+            return;
+        }
     }
 
     if (wifi_retry_count < ESP_MAXIMUM_CONNECT_RETRY) {
+        // Give up on the cached AP once it has failed enough times
+        wifi_mode_failures++;
+        wifi_fast_mode_t next_mode = wifi_fast_after_failure(wifi_connect_mode, wifi_mode_failures, event->reason);
+        if (next_mode != wifi_connect_mode) {
+            ESP_LOGI(TAG, "Cached AP not reachable (reason %d). Falling back to a full scan", event->reason);
+            LOG_RING("wifi: fast connect failed, reason %d", event->reason);
+            wifi_connect_mode = next_mode;
+            wifi_mode_failures = 0;
+            wifi_fast_apply(&wifi_sta_config.sta, &wifi_cache, wifi_connect_mode);
+            esp_wifi_set_config(WIFI_IF_STA, &wifi_sta_config);
+        }
         esp_wifi_connect();
         wifi_retry_count++;
         ESP_LOGI(TAG, "Retry to connect to the AP");
     } else {
-        wifi_connected = 0;
         ESP_LOGI(TAG, "Failed to connect to Wifi");
     }
 
 }
 
-// If wifi connects, set the wifi_connected flag and start the webserver
+// If wifi connects, set the wifi_connected flag
 static void connect_handler( void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data )
 {
     ESP_LOGI(TAG, "Connected!\n");
@@ -739,13 +2332,24 @@ static void connect_handler( void *arg, esp_event_base_t event_base, int32_t eve
     ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
     sprintf(esp_wifi_ip_addr, IPSTR, IP2STR(&event->ip_info.ip));
     wifi_connected = 1;
-    httpd_handle_t *server = ( httpd_handle_t * ) arg;
+    wifi_mode_failures = 0;
+
+    if (wifi_connect_start_us != 0) {
+        wifi_time_to_ip_ms = (esp_timer_get_time() - wifi_connect_start_us) / 1000;
+        wifi_connect_start_us = 0;
+        ESP_LOGI(TAG, "Time to IP: %u ms (%s, %s), %u ms since boot", wifi_time_to_ip_ms,
+            wifi_connect_mode == WIFI_FAST_DIRECTED ? "cached AP" : "full scan",
+            wifi_static_ip.enabled ? "static IP" : "DHCP", (uint32_t)(esp_timer_get_time() / 1000));
+        LOG_RING("wifi: ip in %u ms, fast %d, static %d", wifi_time_to_ip_ms, wifi_connect_mode == WIFI_FAST_DIRECTED, wifi_static_ip.enabled);
+    }
 
-    if ( *server == NULL )
-    {
-        ESP_LOGI(TAG,  "Starting webserver" );
-        *server = start_webserver();
+    // Remember the AP for next time. The wifi task saves it since NVS
+    // writes are too heavy for the event task stack
+    wifi_ap_record_t ap_info;
+    if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK && wifi_fast_update_cache(&wifi_cache, ap_info.bssid, ap_info.primary)) {
+        wifi_cache_dirty = 1;
     }
+    schedule_start_sntp();
 }
 
 // Wifi AP event handler. Just logs debug info when wifi stations connect/disconnect
@@ -779,50 +2383,89 @@ static void initialise_mdns(void)
     mdns_instance_name_set(ESP_HOSTNAME);
 }
 
+// Points the station at the saved wifi info and connects. Tries the cached AP
+// first if there is one, and sets up the static IP so DHCP is skipped.
+// The driver is only started the first time. After that the station just
+// reconnects, so the softAP and the webserver carry on as they are
+static void start_sta_mode(void)
+{
+    static uint8_t wifi_started = 0;
+    if (wifi_started) {
+        wifi_disconnecting = 1;
+        esp_wifi_disconnect();
+    }
+
+    memcpy(wifi_sta_config.sta.ssid, esp_wifi_sta_ssid, 32);
+    memcpy(wifi_sta_config.sta.password, esp_wifi_sta_pass, 64);
+    wifi_connect_mode = wifi_fast_first_mode(&wifi_cache);
+    wifi_mode_failures = 0;
+    wifi_retry_count = 0;
+    wifi_fast_apply(&wifi_sta_config.sta, &wifi_cache, wifi_connect_mode);
+    ESP_LOGI(TAG, "Connecting with %s", wifi_connect_mode == WIFI_FAST_DIRECTED ? "cached AP" : "full scan");
+
+    if (wifi_static_ip.enabled) {
+        esp_netif_dhcpc_stop(sta_netif);
+        esp_netif_ip_info_t ip_info = {
+            .ip.addr = wifi_static_ip.ip,
+            .netmask.addr = wifi_static_ip.netmask,
+            .gw.addr = wifi_static_ip.gateway,
+        };
+        esp_netif_set_ip_info(sta_netif, &ip_info);
+        esp_netif_dns_info_t dns_info = {
+            .ip.u_addr.ip4.addr = wifi_static_ip.dns,
+            .ip.type = ESP_IPADDR_TYPE_V4,
+        };
+        esp_netif_set_dns_info(sta_netif, ESP_NETIF_DNS_MAIN, &dns_info);
+    }
+    else {
+        esp_netif_dhcpc_start(sta_netif);
+    }
+
+    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_sta_config) );
+    wifi_connect_start_us = esp_timer_get_time();
+    if (wifi_started) {
+        esp_wifi_connect();
+    }
+    else {
+        // sta_start_handler connects once the driver is up
+        ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA) );
+        ESP_ERROR_CHECK(esp_wifi_start() );
+        wifi_started = 1;
+    }
+}
+
 // The wifi task intializes the wifi interface and attempts to connect in station
-// mode if wifi info is saved. If no info is saved or the connection fails, it
-// defaults back to AP mode. If new wifi data is entered, it will attempt to 
-// connect in station mode again. While in AP mode, if no stations are connected,
-// it will re-attempt to connect in station mode about every 60 seconds
+// mode if wifi info is saved. If no info is saved or the connection fails, the
+// AP is brought up alongside the station (AP+STA mode). While the AP is up and
+// no stations are connected to it, the station re-attempts to connect about
+// every 60 seconds, and the AP is taken down again a minute after it connects.
+// New wifi data just reconnects the station. The driver is never stopped and
+// there is a single webserver for the whole time, which answers on both
+// interfaces, so pages and API calls keep working through all of this
 static void wifi_task( void *Param )
 {
     ESP_LOGI(TAG,  "Wifi task starting\n" );
-  
-    httpd_handle_t server = NULL;
-  
+
     ESP_ERROR_CHECK(esp_netif_init());
     ESP_ERROR_CHECK(esp_event_loop_create_default());
-    esp_netif_create_default_wifi_sta();
+    sta_netif = esp_netif_create_default_wifi_sta();
     esp_netif_create_default_wifi_ap();
     initialise_mdns();
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
 
-    // Register event handlers to stop the server when Wi-Fi is disconnected, and re-start it upon connection
     esp_event_handler_instance_t instance_sta_start;
     esp_event_handler_instance_t instance_connected;
     esp_event_handler_instance_t instance_disconnected;
     esp_event_handler_instance_t instance_ap_handler;
     ESP_ERROR_CHECK(esp_event_handler_instance_register( WIFI_EVENT, WIFI_EVENT_STA_START, &sta_start_handler, NULL, &instance_sta_start ));
-    ESP_ERROR_CHECK(esp_event_handler_instance_register( IP_EVENT, IP_EVENT_STA_GOT_IP, &connect_handler, &server, &instance_connected ));
-    ESP_ERROR_CHECK(esp_event_handler_instance_register( WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &disconnect_handler, &server, &instance_disconnected ));
+    ESP_ERROR_CHECK(esp_event_handler_instance_register( IP_EVENT, IP_EVENT_STA_GOT_IP, &connect_handler, NULL, &instance_connected ));
+    ESP_ERROR_CHECK(esp_event_handler_instance_register( WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &disconnect_handler, NULL, &instance_disconnected ));
     ESP_ERROR_CHECK(esp_event_handler_instance_register( WIFI_EVENT, WIFI_EVENT_AP_STACONNECTED, &wifi_ap_handler, NULL, &instance_ap_handler));
 
-    wifi_config_t wifi_sta_config = {
-        .sta = {
-            //.ssid = esp_wifi_sta_ssid,
-            //.password = esp_wifi_sta_pass,
-            /* Setting the threshold to WPA2 means the ESP will only connect to
-            networks with WPA2 security or stronger */
-            .threshold.authmode = WIFI_AUTH_WPA2_PSK,
-        },
-    };
-    memcpy(wifi_sta_config.sta.ssid, esp_wifi_sta_ssid, 32);
-    memcpy(wifi_sta_config.sta.password, esp_wifi_sta_pass, 64);
-
-    
-
+    // The channel only applies while the station isn't connected. Once it
+    // is, the AP has to move to the station's channel
     wifi_config_t wifi_ap_config = {
         .ap = {
             .ssid = ESP_WIFI_AP_SSID,
@@ -842,90 +2485,82 @@ static void wifi_task( void *Param )
 
     if (strcmp(esp_wifi_sta_ssid, "") != 0) {
         ESP_LOGI(TAG, "Wifi info detected. Starting in STA mode");
-
-        ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA) );
-        ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_sta_config) );
-        ESP_ERROR_CHECK(esp_wifi_start() );
-
-        ESP_LOGI(TAG, "wifi_init_sta finished");
-
-        vTaskDelay(ESP_WIFI_CONNECT_WAIT / portTICK_RATE_MS);
     }
     else {
         ESP_LOGI(TAG, "No Wifi info detected");
     }
-    
+    start_sta_mode();
+
+    // Started once and never stopped. It listens on every interface, so it
+    // is reachable from the AP and the station as each comes and goes
+    ESP_LOGI(TAG,  "Starting webserver");
+    httpd_handle_t server = start_webserver();
+    if (server == NULL) {
+        ESP_LOGI(TAG, "Webserver failed to start");
+    }
+
     const uint32_t task_delay_ms = 1000;
-    int second_counter = 0;
+    wifi_link_mode_t link_mode = WIFI_LINK_STA;
+    uint8_t last_connected = 0;
+    uint32_t sta_ms = 0;
     while(1) {
-        if (wifi_connected == 0) {
-            ESP_LOGI(TAG, "Wifi Disconnected! Switching to AP mode");
-            ap_mode = 1;
-            ESP_ERROR_CHECK(esp_wifi_stop() );
-            ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_AP) );
-            ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_AP, &wifi_ap_config) );
-            ESP_ERROR_CHECK(esp_wifi_start() );
-            if (server == NULL) {
-                ESP_LOGI(TAG,  "Starting webserver");
-                server = start_webserver();
-            }
-            wifi_connected = 1;
-            second_counter = 0;
-        }
         if (new_wifi_info == 1) {
-            ap_mode = 0;
-            wifi_connected = 0;
-            wifi_retry_count = 0;
-            ESP_LOGI(TAG, "New Wifi info detected. Switching to STA mode");
-            if (server){
-                ESP_LOGI(TAG,  "Stopping webserver" );
-                httpd_stop(server);
-                server = NULL;
-            }
-            memcpy(wifi_sta_config.sta.ssid, esp_wifi_sta_ssid, 32);
-            memcpy(wifi_sta_config.sta.password, esp_wifi_sta_pass, 64);
-            ESP_ERROR_CHECK(esp_wifi_stop() );
-            ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA) );
-            ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_sta_config) );
-            ESP_ERROR_CHECK(esp_wifi_start() );
             new_wifi_info = 0;
-            vTaskDelay(ESP_WIFI_CONNECT_WAIT / portTICK_RATE_MS);
-        }
-        if (second_counter >= 60) {
-            second_counter = 0;
-            ESP_LOGI(TAG, "60 second timer");
-            if (strcmp(esp_wifi_sta_ssid, "") != 0 && ap_mode == 1) {
-                ESP_LOGI(TAG, "Checking if any stations connected");
-                wifi_sta_list_t station_list;
-                if (esp_wifi_ap_get_sta_list(&station_list) == ESP_OK) {
-                    ESP_LOGI(TAG, "%d stations connected", station_list.num);
-                    if (station_list.num == 0) {
-                        ESP_LOGI(TAG, "No stations connected to AP. Checking for wifi");
-                        ap_mode = 0;
-                        wifi_connected = 0;
-                        wifi_retry_count = 0;
-                        if (server){
-                            ESP_LOGI(TAG,  "Stopping webserver" );
-                            httpd_stop(server);
-                            server = NULL;
-                        }
-                        memcpy(wifi_sta_config.sta.ssid, esp_wifi_sta_ssid, 32);
-                        memcpy(wifi_sta_config.sta.password, esp_wifi_sta_pass, 64);
-                        ESP_ERROR_CHECK(esp_wifi_stop() );
-                        ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA) );
-                        ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_sta_config) );
-                        ESP_ERROR_CHECK(esp_wifi_start() );
-                        new_wifi_info = 0;
-                        vTaskDelay(ESP_WIFI_CONNECT_WAIT / portTICK_RATE_MS);
-                    }
-                    else {
-                        ESP_LOGI(TAG, "STA0 MAC: %x:%x:%x:%x:%x:%x", station_list.sta[0].mac[0], station_list.sta[0].mac[1], station_list.sta[0].mac[2], station_list.sta[0].mac[3], station_list.sta[0].mac[4], station_list.sta[0].mac[5]);
-                    }
-                }
-            }
+            ESP_LOGI(TAG, "New Wifi info detected. Reconnecting the station");
+            start_sta_mode();
+            sta_ms = 0;
+        }
+        if (wifi_connected != last_connected) {
+            last_connected = wifi_connected;
+            sta_ms = 0;
+        }
+
+        wifi_sta_list_t station_list = {0};
+        if (link_mode == WIFI_LINK_APSTA && esp_wifi_ap_get_sta_list(&station_list) != ESP_OK) {
+            station_list.num = 0;
+        }
+        wifi_link_state_t link = {
+            .mode = link_mode,
+            .has_credentials = strcmp(esp_wifi_sta_ssid, "") != 0,
+            .sta_connected = wifi_connected,
+            .sta_gave_up = wifi_retry_count >= ESP_MAXIMUM_CONNECT_RETRY,
+            .ap_stations = station_list.num,
+            .sta_ms = sta_ms,
+        };
+        switch (wifi_link_next(&link)) {
+            case WIFI_LINK_START_AP:
+                ESP_LOGI(TAG, "Wifi Disconnected! Starting the AP alongside the station");
+                LOG_RING("wifi: ap started");
+                ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_APSTA) );
+                ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_AP, &wifi_ap_config) );
+                link_mode = WIFI_LINK_APSTA;
+                ap_mode = 1;
+                sta_ms = 0;
+                break;
+            case WIFI_LINK_RETRY_STA:
+                ESP_LOGI(TAG, "No stations connected to AP. Checking for wifi");
+                start_sta_mode();
+                sta_ms = 0;
+                break;
+            case WIFI_LINK_STOP_AP:
+                ESP_LOGI(TAG, "Wifi connected and AP not in use. Stopping the AP");
+                LOG_RING("wifi: ap stopped");
+                ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA) );
+                link_mode = WIFI_LINK_STA;
+                ap_mode = 0;
+                break;
+            default:
+                break;
+        }
+
+        if (wifi_cache_dirty == 1) {
+            wifi_cache_dirty = 0;
+            save_wifi_cache_to_nvs(&wifi_cache);
         }
         vTaskDelay(task_delay_ms / portTICK_RATE_MS);
-        second_counter++;
+        if (sta_ms < UINT32_MAX - task_delay_ms) {
+            sta_ms += task_delay_ms;
+        }
     }
     
 }
@@ -950,12 +2585,349 @@ static void ota_task(void *Param)
     }
 }
 
+// Handles a Home Assistant JSON schema light command, e.g.
+//   {"state": "ON", "brightness": 128, "transition": 2.5}
+//   {"state": "ON", "effect": "candle"}
+// Keys can come in any order. brightness, transition and effect are optional.
+// transition is in seconds and runs on the LEDC hardware fader
+static void handle_light_command(uint8_t num, const char* data, int data_len)
+{
+    jsmn_parser json_parser;
+    jsmntok_t json_content[32];
+    int num_tokens;
+
+    jsmn_init(&json_parser);
+    num_tokens = jsmn_parse(&json_parser, data, data_len, json_content, 32);
+
+    if (num_tokens < 3 || json_content[0].type != JSMN_OBJECT) {
+        ESP_LOGI(TAG, "Error parsing JSON data");
+        return;
+    }
+
+    int state = -1;
+    int brightness = -1;
+    int transition_ms = -1;
+    lights_effect_t effect = LIGHTS_EFFECT_NONE;
+    char token_str[16];
+    int token_len;
+
+    // Walk the top level key/value pairs. Nested values aren't expected
+    // since the discovery config only advertises brightness
+    for (int t = 1; t + 1 < num_tokens; t += 2) {
+        jsmntok_t* key = &json_content[t];
+        jsmntok_t* val = &json_content[t + 1];
+        if (val->type == JSMN_OBJECT || val->type == JSMN_ARRAY) {
+            ESP_LOGI(TAG, "JSON data doesn't match expected format");
+            return;
+        }
+        token_len = val->end - val->start;
+        if (token_len >= sizeof(token_str)) {
+            ESP_LOGI(TAG, "JSON value too long");
+            return;
+        }
+        strncpy(token_str, data + val->start, token_len);
+        token_str[token_len] = '\0';
+
+        token_len = key->end - key->start;
+        if (token_len == 5 && strncmp(data + key->start, "state", 5) == 0) {
+            if (strcmp(token_str, "ON") == 0) {
+                state = 1;
+            }
+            else if (strcmp(token_str, "OFF") == 0) {
+                state = 0;
+            }
+            else {
+                ESP_LOGI(TAG, "Unrecognized light state: %s", token_str);
+                return;
+            }
+        }
+        else if (token_len == 10 && strncmp(data + key->start, "brightness", 10) == 0) {
+            brightness = atoi(token_str);
+        }
+        else if (token_len == 10 && strncmp(data + key->start, "transition", 10) == 0) {
+            transition_ms = (int)(atof(token_str) * 1000);
+            if (transition_ms < 0) {
+                transition_ms = 0;
+            }
+        }
+        else if (token_len == 6 && strncmp(data + key->start, "effect", 6) == 0) {
+            effect = lights_effect_from_name(token_str, strlen(token_str));
+            if (effect == LIGHTS_EFFECT_COUNT) {
+                ESP_LOGI(TAG, "Unrecognized effect: %s", token_str);
+                return;
+            }
+        }
+        else {
+            ESP_LOGI(TAG, "Ignoring JSON key: %.*s", token_len, data + key->start);
+        }
+    }
+
+    if (state == -1) {
+        ESP_LOGI(TAG, "JSON data doesn't match expected format");
+        return;
+    }
+    if (state == 0) {
+        brightness = 0;
+    }
+    else if (brightness == -1) {
+        brightness = 255;
+    }
+    else if (brightness < 0 || brightness > 255) {
+        ESP_LOGI(TAG, "Light value %d out of range! Must be 0-255", brightness);
+        return;
+    }
+
+    if (effect != LIGHTS_EFFECT_NONE && brightness > 0) {
+        set_light_effect(num, effect, brightness);
+    }
+    else if (transition_ms >= 0) {
+        set_light_transition(num, brightness, transition_ms);
+    }
+    else {
+        set_light(num, brightness);
+    }
+}
+
+// Handles a group command sent over MQTT and relays it to every board
+// by multicast, e.g. {"group": 2, "scene": "Evening", "fade": 1.5}
+// group 0 is every board. fade is in seconds and is optional
+static void handle_group_command(const char* data, int data_len)
+{
+    jsmn_parser json_parser;
+    jsmntok_t json_content[16];
+    jsmn_init(&json_parser);
+    int num_tokens = jsmn_parse(&json_parser, data, data_len, json_content, 16);
+    if (num_tokens < 3 || json_content[0].type != JSMN_OBJECT) {
+        ESP_LOGI(TAG, "Error parsing JSON data");
+        return;
+    }
+
+    int group = -1;
+    int fade_ms = SCENE_FADE_TIME;
+    const char* scene = NULL;
+    int scene_len = 0;
+    for (int t = 1; t + 1 < num_tokens; t += 2) {
+        jsmntok_t* key = &json_content[t];
+        jsmntok_t* val = &json_content[t + 1];
+        int key_len = key->end - key->start;
+        if (key_len == 5 && strncmp(data + key->start, "group", 5) == 0) {
+            group = atoi(data + val->start);
+        }
+        else if (key_len == 5 && strncmp(data + key->start, "scene", 5) == 0) {
+            scene = data + val->start;
+            scene_len = val->end - val->start;
+        }
+        else if (key_len == 4 && strncmp(data + key->start, "fade", 4) == 0) {
+            fade_ms = (int)(atof(data + val->start) * 1000);
+        }
+    }
+    if (group < 0 || group > UDP_CONTROL_MAX_GROUPS || scene == NULL || scene_len < 1 || scene_len >= SCENE_NAME_LENGTH) {
+        ESP_LOGI(TAG, "Group command needs a group 0-%d and a scene name", UDP_CONTROL_MAX_GROUPS);
+        return;
+    }
+    if (fade_ms < 0 || fade_ms > 0xFFFF) {
+        fade_ms = SCENE_FADE_TIME;
+    }
+    udp_control_send_group(group, GROUP_COMMAND_SCENE, (const uint8_t*)scene, scene_len, fade_ms, UDP_CONTROL_GROUP_DELAY);
+}
+
+// Delay before this device republishes discovery, in ms. Derived from the MAC
+// address with FNV-1a so it is spread evenly over the window but is the same
+// every time, which makes a busy site easy to reason about
+static uint32_t discovery_jitter_ms(void)
+{
+    if (CONFIG_MQTT_DISCOVERY_WINDOW == 0) {
+        return 0;
+    }
+    return mqtt_hash(mac_addr_str) % CONFIG_MQTT_DISCOVERY_WINDOW;
+}
+
+// Runs on the esp_timer task, so just wakes the MQTT task to do the publishing
+static void discovery_timer_cb(void* arg)
+{
+    if (mqtt_task_handle != NULL) {
+        xTaskNotifyGive(mqtt_task_handle);
+    }
+}
+
+// Arms the discovery timer. A second request before it fires restarts it
+// force sends everything, otherwise only what changed since it was last sent
+static void schedule_discovery_publish(uint8_t force)
+{
+    portENTER_CRITICAL(&mqtt_discovery_mux);
+    mqtt_discovery_force |= force;
+    portEXIT_CRITICAL(&mqtt_discovery_mux);
+    uint32_t delay_ms = discovery_jitter_ms();
+    ESP_LOGI(TAG, "Publishing discovery in %u ms", delay_ms);
+    esp_timer_stop(mqtt_discovery_timer);
+    esp_timer_start_once(mqtt_discovery_timer, ((uint64_t)delay_ms * 1000) + 1);
+}
+
+// Points topic and payload at a discovery config. The energy sensor
+// configs aren't stored, so they are built into the buffers given
+static void discovery_config(uint8_t index, char* topic_buf, char* payload_buf, const char** topic, const char** payload)
+{
+    if (index < MQTT_DISCOVERY_SCENE) {
+        *topic = light_data[index].mqtt_config_topic;
+        *payload = light_data[index].mqtt_config_payload;
+    }
+    else if (index == MQTT_DISCOVERY_SCENE) {
+        *topic = mqtt_scene_config_topic;
+        *payload = mqtt_scene_config_payload;
+    }
+    else {
+        uint8_t num = (index - MQTT_DISCOVERY_ENERGY) / 2;
+        uint8_t sensor = (index - MQTT_DISCOVERY_ENERGY) % 2;
+        energy_config_topic(num, sensor, topic_buf);
+        energy_config_payload(num, sensor, payload_buf);
+        *topic = topic_buf;
+        *payload = payload_buf;
+    }
+}
+
+static uint8_t discovery_is_unsent(uint8_t bit)
+{
+    portENTER_CRITICAL(&mqtt_discovery_mux);
+    uint8_t unsent = (discovery_unsent >> bit) & 1;
+    portEXIT_CRITICAL(&mqtt_discovery_mux);
+    return unsent;
+}
+
+// Free outbox slots discovery can use, so a burst waits for the broker's
+// acks rather than filling the outbox until configs are refused
+static int discovery_outbox_room(void)
+{
+#ifdef CONFIG_MQTT_CUSTOM_OUTBOX
+    outbox_latest_stats_t outbox;
+    outbox_latest_get_stats(&outbox);
+    return (int)outbox.slots - (int)outbox.used - DISCOVERY_OUTBOX_RESERVE;
+#else
+    // The library outbox grows on the heap, so every message has room
+    return DISCOVERY_SCENE_STATE + 1;
+#endif
+}
+
+// Sends the discovery messages marked in discovery_unsent, configs first,
+// while the outbox has room. Adds what was sent to the counts and returns
+// the number of messages left for a later pass
+static uint16_t send_discovery_unsent(uint16_t* messages, uint32_t* bytes)
+{
+    char topic_buf[64];
+    char payload_buf[384];
+    uint16_t waiting = 0;
+    for (uint8_t bit = 0; bit <= DISCOVERY_SCENE_STATE; bit++) {
+        if (discovery_is_unsent(bit) == 0) {
+            continue;
+        }
+        if (mqtt_connected == 0 || discovery_outbox_room() <= 0) {
+            waiting++;
+            continue;
+        }
+        if (bit < MQTT_DISCOVERY_ENTITIES) {
+            const char* topic;
+            const char* payload;
+            discovery_config(bit, topic_buf, payload_buf, &topic, &payload);
+            publish_discovery_config(bit, topic, payload);
+            if (discovery_is_unsent(bit) == 0) {
+                *bytes += strlen(topic) + strlen(payload);
+            }
+        }
+        else if (bit < DISCOVERY_SCENE_STATE) {
+            set_discovery_unsent(bit, publish_light_state(bit - DISCOVERY_LIGHT_STATE) < 0);
+        }
+        else {
+            set_discovery_unsent(bit, publish_scene_state() < 0);
+        }
+        if (discovery_is_unsent(bit)) {
+            waiting++;
+        }
+        else {
+            *messages += 1;
+        }
+    }
+    return waiting;
+}
+
+// Publishes the config and state of the entities on the device so Home
+// Assistant can rebuild them. Unless forced, only configs whose hash differs
+// from the last one published and states that changed while offline are
+// sent. Logs the size of the burst against a full republish so the window
+// can be sized for the number of devices on the broker. Messages the outbox
+// has no room for yet are left to publish_discovery_unsent
+static void publish_discovery(uint8_t force)
+{
+    if (mqtt_connected == 0) {
+        return;
+    }
+    char topic_buf[64];
+    char payload_buf[384];
+    char mqtt_state_payload[64];
+    uint32_t marked = 0;
+    uint16_t full_messages = MQTT_DISCOVERY_ENTITIES + 4;
+    for (uint8_t index = 0; index < MQTT_DISCOVERY_ENTITIES; index++) {
+        const char* topic;
+        const char* payload;
+        discovery_config(index, topic_buf, payload_buf, &topic, &payload);
+        if (force || mqtt_hash(payload) != discovery_hashes[index]) {
+            marked |= 1UL << index;
+        }
+    }
+    for (uint8_t i = 0; i < 4; i++) {
+        light_state_payload(i, mqtt_state_payload);
+        if (force || mqtt_hash(mqtt_state_payload) != light_state_hashes[i]) {
+            marked |= 1UL << (DISCOVERY_LIGHT_STATE + i);
+        }
+    }
+    if (strlen(active_scene) > 0) {
+        if (force || mqtt_hash(active_scene) != scene_state_hash) {
+            marked |= 1UL << DISCOVERY_SCENE_STATE;
+        }
+        full_messages++;
+    }
+    portENTER_CRITICAL(&mqtt_discovery_mux);
+    discovery_unsent |= marked;
+    portEXIT_CRITICAL(&mqtt_discovery_mux);
+
+    uint16_t messages = 0;
+    uint32_t bytes = 0;
+    uint16_t waiting = send_discovery_unsent(&messages, &bytes);
+    // The energy totals go out every CONFIG_ENERGY_PUBLISH_INTERVAL anyway,
+    // so they are only sent now if everything else fitted
+    for (uint8_t num = 0; num < 4; num++) {
+        full_messages += light_data[num].enabled;
+    }
+    if (waiting == 0) {
+        messages += publish_energy_state();
+    }
+    ESP_LOGI(TAG, "Discovery published: %d of %d messages, %u bytes of config, %d waiting for outbox room", messages, full_messages, bytes, waiting);
+    LOG_RING("mqtt: discovery sent %d of %d msgs, %u bytes, %d waiting", messages, full_messages, bytes, waiting);
+}
+
+// Sends the discovery messages a pass had no outbox room for, or that the
+// outbox refused. Called by the MQTT task every second while connected
+static void publish_discovery_unsent(void)
+{
+    portENTER_CRITICAL(&mqtt_discovery_mux);
+    uint32_t unsent = discovery_unsent;
+    portEXIT_CRITICAL(&mqtt_discovery_mux);
+    if (unsent == 0 || mqtt_connected == 0) {
+        return;
+    }
+    uint16_t messages = 0;
+    uint32_t bytes = 0;
+    uint16_t waiting = send_discovery_unsent(&messages, &bytes);
+    if (messages > 0) {
+        ESP_LOGI(TAG, "Discovery sent %d more messages, %u bytes of config, %d waiting for outbox room", messages, bytes, waiting);
+        LOG_RING("mqtt: discovery sent %d more msgs, %d waiting", messages, waiting);
+    }
+}
+
 // Event handler for MQTT. Important events handled include:
 //  - MQTT_EVENT_CONNECTED
 //      - Sets the mqtt_connected flag to 1
-//      - Publishes the config message for each light to auto-config in Home Assistant
-//      - Subscribes to the command topic for each light
-//      - Sends the initial state topic for each light
+//      - Publishes the retained "online" availability message
+//      - Subscribes to the command topic for each light and homeassistant/status
+//      - Schedules the config and state messages that changed for each light to auto-config in Home Assistant
 //  - MQTT_EVENT_DISCONNECTED
 //      - Sets the mqtt_connected flag to 0
 //  - MQTT_EVENT_DATA
@@ -969,115 +2941,90 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
     case MQTT_EVENT_CONNECTED:
         mqtt_connected = 1;
         ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
-        char mqtt_state_payload[36];
+        mqtt_tls_connect_done(1);
+        // Birth message first so Home Assistant marks the entities available
+        // before their state arrives
+        msg_id = esp_mqtt_client_publish(mqtt_client, mqtt_availability_topic, MQTT_AVAILABILITY_ONLINE, 0, 1, 1);
+        MQTT_LOGI(TAG, "sent publish successful, msg_id=%d", msg_id);
+        // Subscribes are sent even when the broker kept the session. They
+        // are cheap, and a firmware update may have added a topic the old
+        // session doesn't have
         for (uint8_t i = 0; i < 4; i++) {
-            msg_id = esp_mqtt_client_publish(mqtt_client, light_data[i].mqtt_config_topic, light_data[i].mqtt_config_payload, 0, 1, 1);
-            ESP_LOGI(TAG, "sent publish successful, msg_id=%d", msg_id);
-
             msg_id = esp_mqtt_client_subscribe(mqtt_client, light_data[i].mqtt_command_topic, 1);
-            ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
-
-            if (light_data[i].duty_cycle > 0) {
-                sprintf(mqtt_state_payload, "{\"state\": \"ON\", \"brightness\": %d}", light_data[i].duty_cycle);
-            }
-            else {
-                sprintf(mqtt_state_payload, "{\"state\": \"OFF\", \"brightness\": %d}", light_data[i].duty_cycle);
-            }
-            msg_id = esp_mqtt_client_publish(mqtt_client, light_data[i].mqtt_state_topic, mqtt_state_payload, 0, 1, 0);
-            ESP_LOGI(TAG, "sent publish successful, msg_id=%d", msg_id);
+            MQTT_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
         }
+        msg_id = esp_mqtt_client_subscribe(mqtt_client, mqtt_schedule_topic, 1);
+        MQTT_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
+        msg_id = esp_mqtt_client_subscribe(mqtt_client, mqtt_group_topic, 1);
+        MQTT_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
+        msg_id = esp_mqtt_client_subscribe(mqtt_client, mqtt_scene_command_topic, 1);
+        MQTT_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
+        msg_id = esp_mqtt_client_subscribe(mqtt_client, MQTT_HA_STATUS_TOPIC, 1);
+        MQTT_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
+
+        // With a persistent session the broker still has the retained
+        // configs, so only what changed needs sending. Without one the
+        // broker has been restarted or wiped, so send everything
+
+        // After a broker restart every device reconnects together, so
+        // discovery is jittered here as well
+        schedule_discovery_publish(!event->session_present);
         break;
     case MQTT_EVENT_DISCONNECTED:
         mqtt_connected = 0;
         ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
         break;
+    case MQTT_EVENT_BEFORE_CONNECT:
+        mqtt_tls_connect_started();
+        break;
     case MQTT_EVENT_SUBSCRIBED:
-        ESP_LOGI(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
+        MQTT_LOGI(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
         break;
     case MQTT_EVENT_UNSUBSCRIBED:
-        ESP_LOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
+        MQTT_LOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
         break;
     case MQTT_EVENT_PUBLISHED:
-        ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+        MQTT_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+        discovery_config_acked(event->msg_id);
         break;
     case MQTT_EVENT_DATA:
-        ESP_LOGI(TAG, "MQTT_EVENT_DATA");
-        printf("TOPIC=%.*s\r\n", event->topic_len, event->topic);
-        printf("DATA=%.*s\r\n", event->data_len, event->data);
+        MQTT_LOGD(TAG, "MQTT_EVENT_DATA");
+        MQTT_LOGD(TAG, "TOPIC=%.*s", event->topic_len, event->topic);
+        MQTT_LOGD(TAG, "DATA=%.*s", event->data_len, event->data);
+        LOG_RING("MQTT data received, %d byte topic, %d byte payload", event->topic_len, event->data_len);
+        if (strncmp(event->topic, mqtt_schedule_topic, event->topic_len) == 0 && event->topic_len == strlen(mqtt_schedule_topic)) {
+            jsmn_parser json_parser;
+            jsmntok_t json_content[32];
+            jsmn_init(&json_parser);
+            int num_tokens = jsmn_parse(&json_parser, event->data, event->data_len, json_content, 32);
+            handle_schedule_message(event->data, json_content, num_tokens);
+            break;
+        }
+        if (event->topic_len == strlen(MQTT_HA_STATUS_TOPIC) && strncmp(event->topic, MQTT_HA_STATUS_TOPIC, event->topic_len) == 0) {
+            if (event->data_len == 6 && strncmp(event->data, "online", 6) == 0) {
+                ESP_LOGI(TAG, "Home Assistant started");
+                schedule_discovery_publish(1);
+            }
+            break;
+        }
+        if (strncmp(event->topic, mqtt_group_topic, event->topic_len) == 0 && event->topic_len == strlen(mqtt_group_topic)) {
+            handle_group_command(event->data, event->data_len);
+            break;
+        }
+        // The select entity sends the scene name as plain text
+        if (strncmp(event->topic, mqtt_scene_command_topic, event->topic_len) == 0 && event->topic_len == strlen(mqtt_scene_command_topic)) {
+            recall_scene(event->data, event->data_len);
+            break;
+        }
         for (uint8_t i = 0; i < 4; i++) {
             if (strncmp(event->topic, light_data[i].mqtt_command_topic, event->topic_len) == 0 && event->topic_len == strlen(light_data[i].mqtt_command_topic)) {
-                // Parse JSON data
-                jsmn_parser json_parser;
-                jsmntok_t json_content[32];
-                int num_tokens;
-
-                jsmn_init(&json_parser);
-                num_tokens = jsmn_parse(&json_parser, event->data, event->data_len, json_content, 32);
-
-                int token_len = 0;
-                char* token_str = NULL;
-
-                if (num_tokens < 3) {
-                    ESP_LOGI(TAG, "Error parsing JSON data");
-                }
-                else {
-                    token_len = json_content[1].end - json_content[1].start;
-                    token_str = (char*)malloc((token_len + 1) * sizeof(char));
-                    strncpy(token_str, event->data+json_content[1].start, token_len);
-                    token_str[token_len] = '\0';
-
-                    ESP_LOGI(TAG, "Token str: %s", token_str);
-
-                    if (strcmp(token_str, "state") == 0) {
-                        token_len = json_content[2].end - json_content[2].start;
-                        token_str = (char*)malloc((token_len + 1) * sizeof(char));
-                        strncpy(token_str, event->data+json_content[2].start, token_len);
-                        token_str[token_len] = '\0';
-
-                        ESP_LOGI(TAG, "Token str: %s", token_str);
-
-                        if (strcmp(token_str, "OFF") == 0) {
-                            set_light(i, 0);                            
-                        }
-                        else if (strcmp(token_str, "ON") == 0 && num_tokens == 3) {
-                            set_light(i, 255);
-                        }
-                        else if (strcmp(token_str, "ON") == 0) {
-                            token_len = json_content[3].end - json_content[3].start;
-                            token_str = (char*)malloc((token_len + 1) * sizeof(char));
-                            strncpy(token_str, event->data+json_content[3].start, token_len);
-                            token_str[token_len] = '\0';
-
-                            ESP_LOGI(TAG, "Token str: %s", token_str);
-
-                            if (strcmp(token_str, "brightness") == 0) {
-                                token_len = json_content[4].end - json_content[4].start;
-                                token_str = (char*)malloc((token_len + 1) * sizeof(char));
-                                strncpy(token_str, event->data+json_content[4].start, token_len);
-                                token_str[token_len] = '\0';
-
-                                ESP_LOGI(TAG, "Token str: %s", token_str);
-
-                                set_light(i, atoi(token_str));
-                                ESP_LOGI(TAG, "Setting light%d brightness to %s", i, token_str);
-                            }
-                            else{
-                                ESP_LOGI(TAG, "JSON data doesn't match expected format");
-                            }
-                        }
-                        else {
-                            ESP_LOGI(TAG, "Unrecognized light state: %s", token_str);
-                        }
-                    }
-                    else {
-                        ESP_LOGI(TAG, "JSON data doesn't match expected format");
-                    }
-                }
+                handle_light_command(i, event->data, event->data_len);
             }
         }
         break;
     case MQTT_EVENT_ERROR:
         ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
+        mqtt_tls_connect_done(0);
         if (event->error_handle->error_type == MQTT_ERROR_TYPE_TCP_TRANSPORT) {
             /*
             log_error_if_nonzero("reported from esp-tls", event->error_handle->esp_tls_last_esp_err);
@@ -1094,26 +3041,52 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
     }
 }
 
+// Fills in the MQTT client config
+// The will is retained so Home Assistant sees the device as offline
+// even if it restarts after the device lost power
+static void mqtt_client_config(esp_mqtt_client_config_t* mqtt_cfg)
+{
+    memset(mqtt_cfg, 0, sizeof(esp_mqtt_client_config_t));
+    mqtt_cfg->uri = "";
+    mqtt_cfg->client_id = mqtt_client_id;
+    mqtt_cfg->disable_clean_session = 1;
+    mqtt_cfg->lwt_topic = mqtt_availability_topic;
+    mqtt_cfg->lwt_msg = MQTT_AVAILABILITY_OFFLINE;
+    mqtt_cfg->lwt_qos = 1;
+    mqtt_cfg->lwt_retain = 1;
+    mqtt_cfg->keepalive = CONFIG_MQTT_KEEPALIVE;
+    mqtt_cfg->task_prio = CONFIG_MQTT_CLIENT_PRIORITY;
+    mqtt_tls_apply(mqtt_cfg);
+}
+
 // MQTT task
 // Sets up the MQTT configuration and connects to the MQTT broker
-// Reconfigures the client if a new broker is set
+// Reconfigures the client if a new broker or new certificates are set
 // Retries to connect to the broker every 30 seconds if connection fails
 static void mqtt_task(void *Param)
 {
     ESP_LOGI(TAG, "Starting MQTT task");
-    const esp_mqtt_client_config_t mqtt_cfg = {
-        .uri = "",
-    };
+    esp_mqtt_client_config_t mqtt_cfg;
+    mqtt_client_config(&mqtt_cfg);
     ESP_LOGI(TAG, "Setting up MQTT client");
     mqtt_client = esp_mqtt_client_init(&mqtt_cfg);
+    mqtt_task_handle = xTaskGetCurrentTaskHandle();
+    const esp_timer_create_args_t discovery_timer_args = {
+        .callback = &discovery_timer_cb,
+        .name = "mqtt_discovery",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&discovery_timer_args, &mqtt_discovery_timer));
     ESP_LOGI(TAG, "Registering MQTT event handler");
     esp_mqtt_client_register_event(mqtt_client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
     ESP_LOGI(TAG, "Starting MQTT loop");
     int retry_counter = 30;
     const uint32_t task_delay_ms = 1000;
+    int64_t energy_published_us = 0;
     while(1) {
         if (new_mqtt_info == 1 && mqtt_connected == 1) {
             ESP_LOGI(TAG, "New MQTT info detected. Disconnecting MQTT");
+            // A clean disconnect doesn't send the will, so mark the device offline first
+            esp_mqtt_client_publish(mqtt_client, mqtt_availability_topic, MQTT_AVAILABILITY_OFFLINE, 0, 1, 1);
             esp_mqtt_client_disconnect(mqtt_client);
             esp_mqtt_client_stop(mqtt_client);
             new_mqtt_info = 0;
@@ -1122,14 +3095,20 @@ static void mqtt_task(void *Param)
             ESP_LOGI(TAG, "New MQTT info detected, but no MQTT connection");
             new_mqtt_info = 0;
         }
-        if (wifi_connected == 1 && ap_mode == 0 && mqtt_connected == 0 && strcmp(mqtt_broker_uri, "") != 0 && retry_counter >= 30) {
+        if (wifi_connected == 1 && mqtt_connected == 0 && strcmp(mqtt_broker_uri, "") != 0 && retry_counter >= 30) {
             retry_counter = 0;
             ESP_LOGI(TAG, "Starting MQTT client");
+            if (mqtt_tls_changed == 1) {
+                mqtt_tls_changed = 0;
+                mqtt_client_config(&mqtt_cfg);
+                mqtt_cfg.uri = mqtt_broker_uri;
+                esp_mqtt_set_config(mqtt_client, &mqtt_cfg);
+            }
             esp_mqtt_client_set_uri(mqtt_client, mqtt_broker_uri);
             esp_mqtt_client_register_event(mqtt_client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
             esp_mqtt_client_start(mqtt_client);
         }
-        if (mqtt_connected == 1 && (wifi_connected == 0 || ap_mode == 1)) {
+        if (mqtt_connected == 1 && wifi_connected == 0) {
             ESP_LOGI(TAG, "Wifi disconnected. Stopping MQTT client");
             esp_mqtt_client_disconnect(mqtt_client);
             esp_mqtt_client_stop(mqtt_client);
@@ -1137,7 +3116,21 @@ static void mqtt_task(void *Param)
         if (retry_counter < 30) {
             retry_counter++;
         }
-        vTaskDelay( task_delay_ms / portTICK_RATE_MS);
+        save_discovery_hashes();
+        publish_discovery_unsent();
+        if (mqtt_connected == 1 && esp_timer_get_time() - energy_published_us >= (int64_t)CONFIG_ENERGY_PUBLISH_INTERVAL * 1000000) {
+            energy_published_us = esp_timer_get_time();
+            publish_energy_state();
+        }
+        // Sleeps for a second, or wakes early when the discovery timer fires
+        // so the publish lands on its jittered time
+        if (ulTaskNotifyTake(pdTRUE, task_delay_ms / portTICK_RATE_MS) > 0) {
+            portENTER_CRITICAL(&mqtt_discovery_mux);
+            uint8_t force = mqtt_discovery_force;
+            mqtt_discovery_force = 0;
+            portEXIT_CRITICAL(&mqtt_discovery_mux);
+            publish_discovery(force);
+        }
     }
 }
 
@@ -1172,12 +3165,51 @@ static void initialize_data()
     read_data_from_nvs(esp_wifi_sta_ssid, esp_wifi_sta_pass, light_data, mqtt_broker_uri);
 
     // Set up MQTT config topics and payloads
+    // The availability topic goes first since every config payload refers to it
+    sprintf(mqtt_availability_topic, "homeassistant/light/%s/availability", mac_addr_str);
+    sprintf(mqtt_client_id, "esp32_light_%s", mac_addr_str);
+    read_discovery_hashes_from_nvs(discovery_hashes, MQTT_DISCOVERY_ENTITIES);
     for (int i = 0; i < 4; i++) {
         sprintf(light_data[i].mqtt_config_topic, "homeassistant/light/%s/light%d/config", mac_addr_str, i);
         set_mqtt_config_payload(i);
         sprintf(light_data[i].mqtt_command_topic, "homeassistant/light/%s/light%d/set", mac_addr_str, i);
         sprintf(light_data[i].mqtt_state_topic, "homeassistant/light/%s/light%d/state", mac_addr_str, i);
     }
+    sprintf(mqtt_schedule_topic, "homeassistant/light/%s/schedule/set", mac_addr_str);
+    sprintf(mqtt_group_topic, "homeassistant/light/%s/group/set", mac_addr_str);
+
+    // Initialize the schedule from NVS
+    read_schedule_from_nvs(schedule_data, schedule_timezone);
+
+    // Initialize scenes from NVS and set up the scene select entity
+    read_scenes_from_nvs(scene_data);
+    sprintf(mqtt_scene_config_topic, "homeassistant/select/%s/scene/config", mac_addr_str);
+    sprintf(mqtt_scene_command_topic, "homeassistant/select/%s/scene/set", mac_addr_str);
+    sprintf(mqtt_scene_state_topic, "homeassistant/select/%s/scene/state", mac_addr_str);
+    set_mqtt_scene_config_payload();
+
+    // Initialize the DMX address for live control from NVS
+    read_dmx_info_from_nvs(&dmx_universe, &dmx_address);
+    read_groups_from_nvs(&group_membership);
+
+    // Initialize the cached AP and static IP for fast connects from NVS
+    read_wifi_cache_from_nvs(&wifi_cache);
+    read_static_ip_from_nvs(&wifi_static_ip);
+
+    // Load the certificates for MQTT over TLS from NVS. A buffer is only
+    // allocated for the ones that are stored
+    for (int i = 0; i < MQTT_TLS_PEM_COUNT; i++) {
+        if (read_mqtt_pem_length_from_nvs(i) > 1 && mqtt_tls_pem_buffer(i) != NULL) {
+            read_mqtt_pem_from_nvs(i, mqtt_tls_pem_buffer(i), MQTT_TLS_PEM_LENGTH);
+        }
+    }
+    mqtt_tls_init();
+
+    // Carry on the energy totals from where they were last saved
+    uint16_t load_watts[4] = {0, 0, 0, 0};
+    read_energy_totals_from_nvs(&energy_saved);
+    read_load_watts_from_nvs(load_watts);
+    energy_init(&energy_saved, load_watts);
 
 }
 
@@ -1200,22 +3232,50 @@ void app_main( void )
     // Initialize global variables
     initialize_data();
   
-    // Start wifi, ota, and mqtt tasks
-    xTaskCreate( wifi_task, "wifi_task", 4096, NULL, 0, NULL );
-    xTaskCreate( ota_task, "ota_task", 8192, NULL, 5, NULL);
-    xTaskCreate( mqtt_task, "mqtt_task", 4096, NULL, 0, NULL);
+    // Set up the schedule so it calls back into set_light when an entry fires
+    schedule_init(schedule_data, schedule_timezone, set_light_transition);
+
+    // Set up live control so the lights can be driven straight from a lighting desk
+    udp_control_init(dmx_universe, dmx_address, udp_control_released);
+    udp_control_init_groups(group_membership, group_command_received);
+
+    // Start wifi, ota, mqtt, schedule, udp control and group command tasks
+    xTaskCreateStatic( wifi_task, "wifi_task", WIFI_TASK_STACK, NULL, 0, wifi_task_stack, &wifi_task_tcb );
+    xTaskCreateStatic( ota_task, "ota_task", OTA_TASK_STACK, NULL, 5, ota_task_stack, &ota_task_tcb );
+    xTaskCreateStatic( mqtt_task, "mqtt_task", MQTT_TASK_STACK, NULL, 0, mqtt_task_stack, &mqtt_task_tcb );
+    xTaskCreateStatic( schedule_task, "schedule_task", SCHEDULE_TASK_STACK, NULL, 1, schedule_task_stack, &schedule_task_tcb );
+    xTaskCreateStatic( udp_control_task, "udp_control_task", UDP_CONTROL_TASK_STACK, NULL, 6, udp_control_task_stack, &udp_control_task_tcb );
+    xTaskCreateStatic( udp_control_group_task, "group_task", GROUP_TASK_STACK, NULL, 6, group_task_stack, &group_task_tcb );
   
     const uint32_t task_delay_ms = 1000;
     int bootloop_timer = 0;
+    uint32_t energy_save_timer = 0;
+    uint32_t heap_check_timer = 0;
     while(1) {
         vTaskDelay( task_delay_ms / portTICK_RATE_MS);
         fflush(stdout);
+        // Energy totals are only written every save interval so the
+        // flash isn't worn out by a counter that changes all the time
+        energy_save_timer++;
+        if (energy_save_timer >= CONFIG_ENERGY_SAVE_INTERVAL * 60) {
+            energy_save_timer = 0;
+            save_energy_totals();
+        }
         if (bootloop_timer == 30) {
             // If program runs for 30 seconds, mark the app valid to prevent rollback
             // After an OTA update, if the ESP resets before this function is called
             // it will automatically roll back to the previous FW
             esp_ota_mark_app_valid_cancel_rollback();
             ESP_LOGI(TAG,  "Running for 30 seconds. Rollback canceled");
+
+            // By now wifi, MQTT and the web server are all running, so
+            // report how much stack and heap everything is using
+            // The heap in use now is the baseline for the heap check
+            debug_stats_boot_report();
+        }
+        if (bootloop_timer > 30 && heap_check_timer++ >= DEBUG_HEAP_CHECK_INTERVAL) {
+            heap_check_timer = 0;
+            debug_stats_heap_check();
         }
         if (bootloop_timer <= 30) {
             bootloop_timer++;
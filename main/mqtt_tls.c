@@ -0,0 +1,208 @@
+#include <string.h>
+#include <stdlib.h>
+#include <sys/param.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_crt_bundle.h>
+#include <freertos/FreeRTOS.h>
+
+#include "mqtt_tls.h"
+#include "log_ring.h"
+
+// The MQTT client keeps pointers to these rather than copies, so a buffer
+// is never freed once allocated. Each is only allocated when a PEM is
+// stored, so a plain mqtt:// broker costs no RAM. One changed during a
+// handshake only fails that handshake, and the reconnect that follows
+// every change uses the new one
+static char* tls_pems[MQTT_TLS_PEM_COUNT];
+
+static const char* tls_pem_names[MQTT_TLS_PEM_COUNT] = {
+    "ca_cert",
+    "client_cert",
+    "client_key",
+};
+
+// Connect timing. Set from the MQTT event handler and read from httpd
+static int64_t connect_start_us = 0;
+static uint64_t connect_total_ms = 0;
+static uint64_t full_total_ms = 0;
+static uint64_t resumed_total_ms = 0;
+static mqtt_tls_stats_t tls_stats;
+static portMUX_TYPE tls_stats_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Set when the certificates are applied to the client config, so the
+// saved session isn't offered to a broker the new ones haven't checked
+static uint8_t session_stale = 0;
+
+// Debug tag for log statements
+static const char *TAG = "MQTT TLS";
+
+// One PEM, or an empty string if it isn't stored
+const char* mqtt_tls_pem(mqtt_tls_pem_t pem)
+{
+    return tls_pems[pem] != NULL ? tls_pems[pem] : "";
+}
+
+// Buffer of MQTT_TLS_PEM_LENGTH bytes for one PEM, allocated the first time
+// so it can be loaded from NVS. NULL if there is no memory for it
+char* mqtt_tls_pem_buffer(mqtt_tls_pem_t pem)
+{
+    if (tls_pems[pem] == NULL) {
+        tls_pems[pem] = calloc(1, MQTT_TLS_PEM_LENGTH);
+    }
+    return tls_pems[pem];
+}
+
+// Logs what was loaded from NVS
+void mqtt_tls_init(void)
+{
+    ESP_LOGI(TAG, "CA cert %s, client cert %s", mqtt_tls_has_pem(MQTT_TLS_CA_CERT) ? "stored" : "from bundle",
+        mqtt_tls_has_pem(MQTT_TLS_CLIENT_CERT) && mqtt_tls_has_pem(MQTT_TLS_CLIENT_KEY) ? "stored" : "none");
+}
+
+// Returns the PEM for a name used in the API, or -1 if there isn't one
+int mqtt_tls_pem_from_name(const char* name, int name_len)
+{
+    for (int i = 0; i < MQTT_TLS_PEM_COUNT; i++) {
+        if (name_len == strlen(tls_pem_names[i]) && strncmp(name, tls_pem_names[i], name_len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char* mqtt_tls_pem_name(mqtt_tls_pem_t pem)
+{
+    return pem < MQTT_TLS_PEM_COUNT ? tls_pem_names[pem] : "";
+}
+
+// Stores a PEM. An empty one removes it. The caller saves it to NVS
+// Returns 0 on success, -1 if it is too long, isn't PEM or there is no
+// memory for it
+int mqtt_tls_set_pem(mqtt_tls_pem_t pem, const char* data, size_t len)
+{
+    if (pem >= MQTT_TLS_PEM_COUNT || len >= MQTT_TLS_PEM_LENGTH) {
+        return -1;
+    }
+    if (len > 0 && (len < 11 || strncmp(data, "-----BEGIN ", 11) != 0)) {
+        return -1;
+    }
+    if (len == 0 && tls_pems[pem] == NULL) {
+        return 0;
+    }
+    char* buffer = mqtt_tls_pem_buffer(pem);
+    if (buffer == NULL) {
+        return -1;
+    }
+    memcpy(buffer, data, len);
+    buffer[len] = '\0';
+    return 0;
+}
+
+uint8_t mqtt_tls_has_pem(mqtt_tls_pem_t pem)
+{
+    return pem < MQTT_TLS_PEM_COUNT && tls_pems[pem] != NULL && tls_pems[pem][0] != '\0';
+}
+
+// Adds the certificates to the client config. A stored CA is used on its
+// own, which is also quicker to verify against than searching the bundle.
+// Without one the server is checked against the built-in CA bundle.
+// Only used for mqtts:// and wss:// URIs, so plain MQTT is unaffected.
+// The next handshake is a full one so the new certificates are checked
+void mqtt_tls_apply(esp_mqtt_client_config_t* config)
+{
+    portENTER_CRITICAL(&tls_stats_mux);
+    session_stale = 1;
+    portEXIT_CRITICAL(&tls_stats_mux);
+    config->cert_pem = NULL;
+    config->crt_bundle_attach = NULL;
+    config->client_cert_pem = NULL;
+    config->client_key_pem = NULL;
+    if (mqtt_tls_has_pem(MQTT_TLS_CA_CERT)) {
+        config->cert_pem = tls_pems[MQTT_TLS_CA_CERT];
+    }
+    else {
+        config->crt_bundle_attach = esp_crt_bundle_attach;
+    }
+    if (mqtt_tls_has_pem(MQTT_TLS_CLIENT_CERT) && mqtt_tls_has_pem(MQTT_TLS_CLIENT_KEY)) {
+        config->client_cert_pem = tls_pems[MQTT_TLS_CLIENT_CERT];
+        config->client_key_pem = tls_pems[MQTT_TLS_CLIENT_KEY];
+    }
+}
+
+// Called on MQTT_EVENT_BEFORE_CONNECT, just before the client opens the socket
+void mqtt_tls_connect_started(void)
+{
+    portENTER_CRITICAL(&tls_stats_mux);
+    connect_start_us = esp_timer_get_time();
+    portEXIT_CRITICAL(&tls_stats_mux);
+}
+
+// Called when the broker accepts the connection, or when it fails
+void mqtt_tls_connect_done(uint8_t success)
+{
+    portENTER_CRITICAL(&tls_stats_mux);
+    if (connect_start_us == 0) {
+        portEXIT_CRITICAL(&tls_stats_mux);
+        return;
+    }
+    uint32_t elapsed_ms = (uint32_t)((esp_timer_get_time() - connect_start_us) / 1000);
+    connect_start_us = 0;
+    if (success) {
+        tls_stats.connects++;
+        tls_stats.last_ms = elapsed_ms;
+        tls_stats.min_ms = tls_stats.connects == 1 ? elapsed_ms : MIN(tls_stats.min_ms, elapsed_ms);
+        tls_stats.max_ms = MAX(tls_stats.max_ms, elapsed_ms);
+        connect_total_ms += elapsed_ms;
+        tls_stats.avg_ms = connect_total_ms / tls_stats.connects;
+    }
+    else {
+        tls_stats.failures++;
+    }
+    portEXIT_CRITICAL(&tls_stats_mux);
+
+    if (success) {
+        ESP_LOGI(TAG, "Connected to the broker in %u ms", elapsed_ms);
+        LOG_RING("mqtt: connected in %u ms", elapsed_ms);
+    }
+    else {
+        ESP_LOGI(TAG, "Connection failed after %u ms", elapsed_ms);
+        LOG_RING("mqtt: connect failed after %u ms", elapsed_ms);
+    }
+}
+
+void mqtt_tls_get_stats(mqtt_tls_stats_t* stats)
+{
+    portENTER_CRITICAL(&tls_stats_mux);
+    *stats = tls_stats;
+    portEXIT_CRITICAL(&tls_stats_mux);
+}
+
+// Called by the esp-tls wrapper in mqtt_tls_session.c after each handshake
+void mqtt_tls_handshake_done(uint8_t resumed, uint32_t elapsed_ms)
+{
+    portENTER_CRITICAL(&tls_stats_mux);
+    if (resumed) {
+        tls_stats.resumed_handshakes++;
+        resumed_total_ms += elapsed_ms;
+        tls_stats.resumed_avg_ms = resumed_total_ms / tls_stats.resumed_handshakes;
+    }
+    else {
+        tls_stats.full_handshakes++;
+        full_total_ms += elapsed_ms;
+        tls_stats.full_avg_ms = full_total_ms / tls_stats.full_handshakes;
+    }
+    portEXIT_CRITICAL(&tls_stats_mux);
+    ESP_LOGI(TAG, "TLS handshake %s in %u ms", resumed ? "resumed the last session" : "was a full one", elapsed_ms);
+    LOG_RING("mqtt: tls %s handshake in %u ms", resumed ? "resumed" : "full", elapsed_ms);
+}
+
+// Returns 1 once after the certificates have been applied
+uint8_t mqtt_tls_session_stale(void)
+{
+    portENTER_CRITICAL(&tls_stats_mux);
+    uint8_t stale = session_stale;
+    session_stale = 0;
+    portEXIT_CRITICAL(&tls_stats_mux);
+    return stale;
+}
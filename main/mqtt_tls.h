@@ -0,0 +1,53 @@
+#ifndef MQTT_TLS_H_INCLUDED
+#define MQTT_TLS_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mqtt_client.h>
+
+// Max length of each PEM, including the null terminator
+// This is the most NVS stores in one string, and is enough for a 4096 bit
+// RSA key or a certificate with an intermediate in its chain
+#define MQTT_TLS_PEM_LENGTH  4000
+
+// Certificates and key for mqtts:// and wss:// brokers, kept in NVS
+typedef enum
+{
+  MQTT_TLS_CA_CERT = 0,
+  MQTT_TLS_CLIENT_CERT,
+  MQTT_TLS_CLIENT_KEY,
+  MQTT_TLS_PEM_COUNT
+} mqtt_tls_pem_t;
+
+// Time from starting a connection to the broker's CONNACK, covering
+// TCP, the TLS handshake and the MQTT connect. The TLS handshakes alone
+// are counted and averaged apart by whether they resumed the last session
+typedef struct
+{
+  uint32_t connects;
+  uint32_t failures;
+  uint32_t last_ms;
+  uint32_t min_ms;
+  uint32_t max_ms;
+  uint32_t avg_ms;
+  uint32_t full_handshakes;
+  uint32_t full_avg_ms;
+  uint32_t resumed_handshakes;
+  uint32_t resumed_avg_ms;
+} mqtt_tls_stats_t;
+
+const char* mqtt_tls_pem(mqtt_tls_pem_t pem);
+char* mqtt_tls_pem_buffer(mqtt_tls_pem_t pem);
+void mqtt_tls_init(void);
+int mqtt_tls_pem_from_name(const char* name, int name_len);
+const char* mqtt_tls_pem_name(mqtt_tls_pem_t pem);
+int mqtt_tls_set_pem(mqtt_tls_pem_t pem, const char* data, size_t len);
+uint8_t mqtt_tls_has_pem(mqtt_tls_pem_t pem);
+void mqtt_tls_apply(esp_mqtt_client_config_t* config);
+void mqtt_tls_connect_started(void);
+void mqtt_tls_connect_done(uint8_t success);
+void mqtt_tls_get_stats(mqtt_tls_stats_t* stats);
+void mqtt_tls_handshake_done(uint8_t resumed, uint32_t elapsed_ms);
+uint8_t mqtt_tls_session_stale(void);
+
+#endif
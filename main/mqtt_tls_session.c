@@ -0,0 +1,89 @@
+#include <string.h>
+#include <stdlib.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_tls.h>
+#include "sdkconfig.h"
+
+#include "mqtt_tls.h"
+
+// TLS session resumption for mqtts:// and wss:// brokers. A reconnect that
+// resumes the last session skips the certificate checks and the key
+// exchange, which are most of what a full handshake costs the ESP32-C3
+//
+// esp-mqtt in IDF 4.4 has no way to give its SSL transport a client
+// session, so the transport's call to esp_tls_conn_new_sync is wrapped at
+// link time (see CMakeLists.txt). The wrapper offers the session saved from
+// the last handshake with the same broker and saves the new one after
+// every handshake. Only the MQTT client task connects, so the saved
+// session needs no lock
+
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+
+#define SESSION_HOST_LENGTH 128
+
+static esp_tls_client_session_t* saved_session = NULL;
+static char saved_host[SESSION_HOST_LENGTH];
+static int saved_port = 0;
+
+// IDF 4.4 has no esp_tls_free_client_session
+static void free_session(esp_tls_client_session_t* session)
+{
+    if (session != NULL) {
+        mbedtls_ssl_session_free(&session->saved_session);
+        free(session);
+    }
+}
+
+static void forget_session(void)
+{
+    free_session(saved_session);
+    saved_session = NULL;
+    saved_host[0] = '\0';
+}
+
+int __real_esp_tls_conn_new_sync(const char* hostname, int hostlen, int port, const esp_tls_cfg_t* cfg, esp_tls_t* tls);
+
+int __wrap_esp_tls_conn_new_sync(const char* hostname, int hostlen, int port, const esp_tls_cfg_t* cfg, esp_tls_t* tls)
+{
+    // New certificates have to be checked with a full handshake, and a
+    // session is only offered to the broker it came from
+    if (mqtt_tls_session_stale()) {
+        forget_session();
+    }
+    if (saved_session != NULL && (port != saved_port || hostlen != strlen(saved_host) || strncmp(hostname, saved_host, hostlen) != 0)) {
+        forget_session();
+    }
+    esp_tls_cfg_t session_cfg = *cfg;
+    session_cfg.client_session = saved_session;
+
+    int64_t start_us = esp_timer_get_time();
+    int ret = __real_esp_tls_conn_new_sync(hostname, hostlen, port, &session_cfg, tls);
+    uint32_t elapsed_ms = (uint32_t)((esp_timer_get_time() - start_us) / 1000);
+    if (ret <= 0) {
+        forget_session();
+        return ret;
+    }
+
+    // A resumed handshake keeps the master secret of the session it
+    // resumed, where a full one agrees a new one. The broker can turn the
+    // session down, e.g. after a restart, so offering one isn't enough
+    esp_tls_client_session_t* session = esp_tls_get_client_session(tls);
+    uint8_t resumed = saved_session != NULL && session != NULL &&
+        memcmp(session->saved_session.master, saved_session->saved_session.master, sizeof(session->saved_session.master)) == 0;
+    mqtt_tls_handshake_done(resumed, elapsed_ms);
+
+    forget_session();
+    if (session != NULL && hostlen < SESSION_HOST_LENGTH) {
+        saved_session = session;
+        memcpy(saved_host, hostname, hostlen);
+        saved_host[hostlen] = '\0';
+        saved_port = port;
+    }
+    else {
+        free_session(session);
+    }
+    return ret;
+}
+
+#endif
@@ -2,6 +2,11 @@
 #include <esp_err.h>
 #include <nvs_flash.h>
 
+#include "schedule.h"
+#include "scene.h"
+#include "wifi_fast.h"
+#include "energy.h"
+
 // Namespace for storing data
 #define ESP_NVS_NAMESPACE "esp_saved_data"
 
@@ -30,13 +35,47 @@ static const char* light_enabled_keys[] = {
 #define ESP_NVS_MQTT_BROKER_KEY  "mqtt_uri"
 #define MQTT_BROKER_LENGTH       257
 
+// Keys for storing schedule data
+// The whole schedule table is saved as one blob
+#define ESP_NVS_SCHEDULE_KEY     "schedule"
+#define ESP_NVS_TIMEZONE_KEY     "timezone"
+
+// Key for storing scenes. All scenes are saved as one blob
+#define ESP_NVS_SCENES_KEY       "scenes"
+
+// Keys for storing the DMX universe and start address for UDP live control
+#define ESP_NVS_DMX_UNIVERSE_KEY "dmx_universe"
+#define ESP_NVS_DMX_ADDRESS_KEY  "dmx_address"
+
+// Key for storing which multicast groups this device is a member of
+#define ESP_NVS_GROUPS_KEY       "groups"
+
+// Keys for the cached AP used for fast reconnects and the optional static IP
+#define ESP_NVS_WIFI_CACHE_KEY   "wifi_cache"
+#define ESP_NVS_STATIC_IP_KEY    "static_ip"
+
+// Key for the hashes of the last published MQTT discovery configs
+#define ESP_NVS_DISCOVERY_KEY    "disc_hashes"
+
+// Keys for the energy totals of each output and the load wattage of each one
+#define ESP_NVS_ENERGY_KEY       "energy"
+#define ESP_NVS_LOAD_WATTS_KEY   "load_watts"
+
+// Keys for the CA cert, client cert and client key for MQTT over TLS
+// Saved as strings in the same order as mqtt_tls_pem_t
+static const char* mqtt_pem_keys[] = {
+    "mqtt_ca",
+    "mqtt_cert",
+    "mqtt_key"
+};
+
 typedef struct
 {
   char name[13];
   uint8_t enabled;
   int duty_cycle;
   char mqtt_config_topic[50];
-  char mqtt_config_payload[200];
+  char mqtt_config_payload[384];
   char mqtt_command_topic[50];
   char mqtt_state_topic[50];
 } light_info_t;
@@ -71,7 +110,8 @@ void read_data_from_nvs(char* esp_wifi_sta_ssid, char* esp_wifi_sta_pass, light_
         err = nvs_get_str(esp_nvs_handle, ESP_NVS_PASS_KEY, esp_wifi_sta_pass, &required_length);
         switch (err) {
             case ESP_OK:
-                ESP_LOGI(TAG, "Password = %s\n", esp_wifi_sta_pass);
+                // Only the length, so the password never reaches the logs
+                ESP_LOGI(TAG, "Password read, %d characters\n", (int)strlen(esp_wifi_sta_pass));
                 break;
             case ESP_ERR_NVS_NOT_FOUND:
                 ESP_LOGI(TAG, "The SSID value is not initialized yet!\n");
@@ -239,4 +279,640 @@ void save_mqtt_info_to_nvs(char* mqtt_broker_uri)
         }
         nvs_close(esp_nvs_handle);
     }
-}
\ No newline at end of file
+}
+
+// Reads the schedule table and timezone from NVS
+// Entries not found in NVS are left as they were initialized
+void read_schedule_from_nvs(schedule_entry_t* schedule, char* timezone)
+{
+    ESP_LOGI(TAG, "Opening Non-Volatile Storage (NVS) handle... ");
+    nvs_handle_t esp_nvs_handle;
+    esp_err_t err = nvs_open(ESP_NVS_NAMESPACE, NVS_READONLY, &esp_nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error (%s) opening NVS handle!\n", esp_err_to_name(err));
+    } else {
+        ESP_LOGI(TAG, "Reading schedule from NVS ... ");
+        size_t required_length = 0;
+        err = nvs_get_blob(esp_nvs_handle, ESP_NVS_SCHEDULE_KEY, NULL, &required_length);
+        if (err == ESP_OK && required_length > sizeof(schedule_entry_t) * SCHEDULE_MAX_ENTRIES) {
+            // Only read as many entries as fit if the table size was reduced
+            required_length = sizeof(schedule_entry_t) * SCHEDULE_MAX_ENTRIES;
+        }
+        if (err == ESP_OK) {
+            err = nvs_get_blob(esp_nvs_handle, ESP_NVS_SCHEDULE_KEY, schedule, &required_length);
+        }
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "Schedule loaded. %d bytes\n", required_length);
+                break;
+            case ESP_ERR_NVS_NOT_FOUND:
+                ESP_LOGI(TAG, "The schedule is not initialized yet!\n");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s) reading!\n", esp_err_to_name(err));
+        }
+        ESP_LOGI(TAG, "Reading timezone from NVS ... ");
+        required_length = SCHEDULE_TZ_LENGTH;
+        err = nvs_get_str(esp_nvs_handle, ESP_NVS_TIMEZONE_KEY, timezone, &required_length);
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "Timezone = %s\n", timezone);
+                break;
+            case ESP_ERR_NVS_NOT_FOUND:
+                ESP_LOGI(TAG, "The timezone is not initialized yet!\n");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s) reading!\n", esp_err_to_name(err));
+        }
+        nvs_close(esp_nvs_handle);
+    }
+}
+
+// Saves the schedule table and timezone to NVS so it is preserved on reboot
+void save_schedule_to_nvs(schedule_entry_t* schedule, char* timezone)
+{
+    ESP_LOGI(TAG, "Opening Non-Volatile Storage (NVS) handle... ");
+    nvs_handle_t esp_nvs_handle;
+    esp_err_t err = nvs_open(ESP_NVS_NAMESPACE, NVS_READWRITE, &esp_nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error (%s) opening NVS handle!\n", esp_err_to_name(err));
+    } else {
+        ESP_LOGI(TAG, "Saving schedule to NVS ... ");
+        err = nvs_set_blob(esp_nvs_handle, ESP_NVS_SCHEDULE_KEY, schedule, sizeof(schedule_entry_t) * SCHEDULE_MAX_ENTRIES);
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "Schedule saved!");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s) writing!\n", esp_err_to_name(err));
+        }
+        ESP_LOGI(TAG, "Saving timezone to NVS ... ");
+        err = nvs_set_str(esp_nvs_handle, ESP_NVS_TIMEZONE_KEY, timezone);
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "Timezone saved!");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s) writing!\n", esp_err_to_name(err));
+        }
+        ESP_LOGI(TAG, "Committing updates in NVS ... ");
+        err = nvs_commit(esp_nvs_handle);
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "Done");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s)\n", esp_err_to_name(err));
+        }
+        nvs_close(esp_nvs_handle);
+    }
+}
+
+// Reads the saved scenes from NVS
+void read_scenes_from_nvs(scene_t* scenes)
+{
+    ESP_LOGI(TAG, "Opening Non-Volatile Storage (NVS) handle... ");
+    nvs_handle_t esp_nvs_handle;
+    esp_err_t err = nvs_open(ESP_NVS_NAMESPACE, NVS_READONLY, &esp_nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error (%s) opening NVS handle!\n", esp_err_to_name(err));
+    } else {
+        ESP_LOGI(TAG, "Reading scenes from NVS ... ");
+        size_t required_length = sizeof(scene_t) * SCENE_MAX_COUNT;
+        err = nvs_get_blob(esp_nvs_handle, ESP_NVS_SCENES_KEY, scenes, &required_length);
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "Scenes loaded. %d bytes\n", required_length);
+                break;
+            case ESP_ERR_NVS_NOT_FOUND:
+                ESP_LOGI(TAG, "The scenes are not initialized yet!\n");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s) reading!\n", esp_err_to_name(err));
+        }
+        nvs_close(esp_nvs_handle);
+    }
+}
+
+// Saves the scenes to NVS so they are preserved on reboot
+void save_scenes_to_nvs(scene_t* scenes)
+{
+    ESP_LOGI(TAG, "Opening Non-Volatile Storage (NVS) handle... ");
+    nvs_handle_t esp_nvs_handle;
+    esp_err_t err = nvs_open(ESP_NVS_NAMESPACE, NVS_READWRITE, &esp_nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error (%s) opening NVS handle!\n", esp_err_to_name(err));
+    } else {
+        ESP_LOGI(TAG, "Saving scenes to NVS ... ");
+        err = nvs_set_blob(esp_nvs_handle, ESP_NVS_SCENES_KEY, scenes, sizeof(scene_t) * SCENE_MAX_COUNT);
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "Scenes saved!");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s) writing!\n", esp_err_to_name(err));
+        }
+        ESP_LOGI(TAG, "Committing updates in NVS ... ");
+        err = nvs_commit(esp_nvs_handle);
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "Done");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s)\n", esp_err_to_name(err));
+        }
+        nvs_close(esp_nvs_handle);
+    }
+}
+
+// Reads the DMX universe and start address used for UDP live control
+void read_dmx_info_from_nvs(uint16_t* dmx_universe, uint16_t* dmx_address)
+{
+    ESP_LOGI(TAG, "Opening Non-Volatile Storage (NVS) handle... ");
+    nvs_handle_t esp_nvs_handle;
+    esp_err_t err = nvs_open(ESP_NVS_NAMESPACE, NVS_READONLY, &esp_nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error (%s) opening NVS handle!\n", esp_err_to_name(err));
+    } else {
+        ESP_LOGI(TAG, "Reading DMX universe from NVS ... ");
+        err = nvs_get_u16(esp_nvs_handle, ESP_NVS_DMX_UNIVERSE_KEY, dmx_universe);
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "DMX universe = %d\n", *dmx_universe);
+                break;
+            case ESP_ERR_NVS_NOT_FOUND:
+                ESP_LOGI(TAG, "The DMX universe is not initialized yet!\n");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s) reading!\n", esp_err_to_name(err));
+        }
+        ESP_LOGI(TAG, "Reading DMX address from NVS ... ");
+        err = nvs_get_u16(esp_nvs_handle, ESP_NVS_DMX_ADDRESS_KEY, dmx_address);
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "DMX address = %d\n", *dmx_address);
+                break;
+            case ESP_ERR_NVS_NOT_FOUND:
+                ESP_LOGI(TAG, "The DMX address is not initialized yet!\n");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s) reading!\n", esp_err_to_name(err));
+        }
+        nvs_close(esp_nvs_handle);
+    }
+}
+
+// Saves the DMX universe and start address to NVS so they are preserved on reboot
+void save_dmx_info_to_nvs(uint16_t dmx_universe, uint16_t dmx_address)
+{
+    ESP_LOGI(TAG, "Opening Non-Volatile Storage (NVS) handle... ");
+    nvs_handle_t esp_nvs_handle;
+    esp_err_t err = nvs_open(ESP_NVS_NAMESPACE, NVS_READWRITE, &esp_nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error (%s) opening NVS handle!\n", esp_err_to_name(err));
+    } else {
+        ESP_LOGI(TAG, "Saving DMX universe to NVS ... ");
+        err = nvs_set_u16(esp_nvs_handle, ESP_NVS_DMX_UNIVERSE_KEY, dmx_universe);
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "DMX universe saved!");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s) writing!\n", esp_err_to_name(err));
+        }
+        ESP_LOGI(TAG, "Saving DMX address to NVS ... ");
+        err = nvs_set_u16(esp_nvs_handle, ESP_NVS_DMX_ADDRESS_KEY, dmx_address);
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "DMX address saved!");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s) writing!\n", esp_err_to_name(err));
+        }
+        ESP_LOGI(TAG, "Committing updates in NVS ... ");
+        err = nvs_commit(esp_nvs_handle);
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "Done");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s)\n", esp_err_to_name(err));
+        }
+        nvs_close(esp_nvs_handle);
+    }
+}
+
+// Reads the group membership bitmask for multicast group commands
+void read_groups_from_nvs(uint16_t* groups)
+{
+    ESP_LOGI(TAG, "Opening Non-Volatile Storage (NVS) handle... ");
+    nvs_handle_t esp_nvs_handle;
+    esp_err_t err = nvs_open(ESP_NVS_NAMESPACE, NVS_READONLY, &esp_nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error (%s) opening NVS handle!\n", esp_err_to_name(err));
+    } else {
+        ESP_LOGI(TAG, "Reading groups from NVS ... ");
+        err = nvs_get_u16(esp_nvs_handle, ESP_NVS_GROUPS_KEY, groups);
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "Groups = 0x%04x\n", *groups);
+                break;
+            case ESP_ERR_NVS_NOT_FOUND:
+                ESP_LOGI(TAG, "The groups are not initialized yet!\n");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s) reading!\n", esp_err_to_name(err));
+        }
+        nvs_close(esp_nvs_handle);
+    }
+}
+
+// Saves the group membership bitmask to NVS so it is preserved on reboot
+void save_groups_to_nvs(uint16_t groups)
+{
+    ESP_LOGI(TAG, "Opening Non-Volatile Storage (NVS) handle... ");
+    nvs_handle_t esp_nvs_handle;
+    esp_err_t err = nvs_open(ESP_NVS_NAMESPACE, NVS_READWRITE, &esp_nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error (%s) opening NVS handle!\n", esp_err_to_name(err));
+    } else {
+        ESP_LOGI(TAG, "Saving groups to NVS ... ");
+        err = nvs_set_u16(esp_nvs_handle, ESP_NVS_GROUPS_KEY, groups);
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "Groups saved!");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s) writing!\n", esp_err_to_name(err));
+        }
+        ESP_LOGI(TAG, "Committing updates in NVS ... ");
+        err = nvs_commit(esp_nvs_handle);
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "Done");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s)\n", esp_err_to_name(err));
+        }
+        nvs_close(esp_nvs_handle);
+    }
+}
+
+// Reads the cached AP from NVS
+void read_wifi_cache_from_nvs(wifi_fast_cache_t* cache)
+{
+    ESP_LOGI(TAG, "Opening Non-Volatile Storage (NVS) handle... ");
+    nvs_handle_t esp_nvs_handle;
+    esp_err_t err = nvs_open(ESP_NVS_NAMESPACE, NVS_READONLY, &esp_nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error (%s) opening NVS handle!\n", esp_err_to_name(err));
+    } else {
+        ESP_LOGI(TAG, "Reading cached AP from NVS ... ");
+        size_t required_length = sizeof(wifi_fast_cache_t);
+        err = nvs_get_blob(esp_nvs_handle, ESP_NVS_WIFI_CACHE_KEY, cache, &required_length);
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "Cached AP loaded");
+                break;
+            case ESP_ERR_NVS_NOT_FOUND:
+                ESP_LOGI(TAG, "The cached AP is not initialized yet!\n");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s) reading!\n", esp_err_to_name(err));
+        }
+        nvs_close(esp_nvs_handle);
+    }
+}
+
+// Saves the cached AP to NVS so it is preserved on reboot
+void save_wifi_cache_to_nvs(wifi_fast_cache_t* cache)
+{
+    ESP_LOGI(TAG, "Opening Non-Volatile Storage (NVS) handle... ");
+    nvs_handle_t esp_nvs_handle;
+    esp_err_t err = nvs_open(ESP_NVS_NAMESPACE, NVS_READWRITE, &esp_nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error (%s) opening NVS handle!\n", esp_err_to_name(err));
+    } else {
+        ESP_LOGI(TAG, "Saving cached AP to NVS ... ");
+        err = nvs_set_blob(esp_nvs_handle, ESP_NVS_WIFI_CACHE_KEY, cache, sizeof(wifi_fast_cache_t));
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "Cached AP saved!");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s) writing!\n", esp_err_to_name(err));
+        }
+        ESP_LOGI(TAG, "Committing updates in NVS ... ");
+        err = nvs_commit(esp_nvs_handle);
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "Done");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s)\n", esp_err_to_name(err));
+        }
+        nvs_close(esp_nvs_handle);
+    }
+}
+
+// Reads the static IP config from NVS
+void read_static_ip_from_nvs(wifi_static_ip_t* static_ip)
+{
+    ESP_LOGI(TAG, "Opening Non-Volatile Storage (NVS) handle... ");
+    nvs_handle_t esp_nvs_handle;
+    esp_err_t err = nvs_open(ESP_NVS_NAMESPACE, NVS_READONLY, &esp_nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error (%s) opening NVS handle!\n", esp_err_to_name(err));
+    } else {
+        ESP_LOGI(TAG, "Reading static IP config from NVS ... ");
+        size_t required_length = sizeof(wifi_static_ip_t);
+        err = nvs_get_blob(esp_nvs_handle, ESP_NVS_STATIC_IP_KEY, static_ip, &required_length);
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "Static IP config loaded");
+                break;
+            case ESP_ERR_NVS_NOT_FOUND:
+                ESP_LOGI(TAG, "The static IP config is not initialized yet!\n");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s) reading!\n", esp_err_to_name(err));
+        }
+        nvs_close(esp_nvs_handle);
+    }
+}
+
+// Saves the static IP config to NVS so it is preserved on reboot
+void save_static_ip_to_nvs(wifi_static_ip_t* static_ip)
+{
+    ESP_LOGI(TAG, "Opening Non-Volatile Storage (NVS) handle... ");
+    nvs_handle_t esp_nvs_handle;
+    esp_err_t err = nvs_open(ESP_NVS_NAMESPACE, NVS_READWRITE, &esp_nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error (%s) opening NVS handle!\n", esp_err_to_name(err));
+    } else {
+        ESP_LOGI(TAG, "Saving static IP config to NVS ... ");
+        err = nvs_set_blob(esp_nvs_handle, ESP_NVS_STATIC_IP_KEY, static_ip, sizeof(wifi_static_ip_t));
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "Static IP config saved!");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s) writing!\n", esp_err_to_name(err));
+        }
+        ESP_LOGI(TAG, "Committing updates in NVS ... ");
+        err = nvs_commit(esp_nvs_handle);
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "Done");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s)\n", esp_err_to_name(err));
+        }
+        nvs_close(esp_nvs_handle);
+    }
+}
+
+// Reads the hashes of the last published MQTT discovery configs
+void read_discovery_hashes_from_nvs(uint32_t* hashes, size_t count)
+{
+    ESP_LOGI(TAG, "Opening Non-Volatile Storage (NVS) handle... ");
+    nvs_handle_t esp_nvs_handle;
+    esp_err_t err = nvs_open(ESP_NVS_NAMESPACE, NVS_READONLY, &esp_nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error (%s) opening NVS handle!\n", esp_err_to_name(err));
+    } else {
+        ESP_LOGI(TAG, "Reading discovery hashes from NVS ... ");
+        size_t required_length = sizeof(uint32_t) * count;
+        err = nvs_get_blob(esp_nvs_handle, ESP_NVS_DISCOVERY_KEY, hashes, &required_length);
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "Discovery hashes loaded");
+                break;
+            case ESP_ERR_NVS_NOT_FOUND:
+                ESP_LOGI(TAG, "The discovery hashes are not initialized yet!\n");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s) reading!\n", esp_err_to_name(err));
+        }
+        nvs_close(esp_nvs_handle);
+    }
+}
+
+// Saves the hashes of the last published MQTT discovery configs so
+// unchanged configs aren't republished after a reboot
+void save_discovery_hashes_to_nvs(uint32_t* hashes, size_t count)
+{
+    ESP_LOGI(TAG, "Opening Non-Volatile Storage (NVS) handle... ");
+    nvs_handle_t esp_nvs_handle;
+    esp_err_t err = nvs_open(ESP_NVS_NAMESPACE, NVS_READWRITE, &esp_nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error (%s) opening NVS handle!\n", esp_err_to_name(err));
+    } else {
+        ESP_LOGI(TAG, "Saving discovery hashes to NVS ... ");
+        err = nvs_set_blob(esp_nvs_handle, ESP_NVS_DISCOVERY_KEY, hashes, sizeof(uint32_t) * count);
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "Discovery hashes saved!");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s) writing!\n", esp_err_to_name(err));
+        }
+        ESP_LOGI(TAG, "Committing updates in NVS ... ");
+        err = nvs_commit(esp_nvs_handle);
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "Done");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s)\n", esp_err_to_name(err));
+        }
+        nvs_close(esp_nvs_handle);
+    }
+}
+
+// Reads the energy totals
+void read_energy_totals_from_nvs(energy_totals_t* totals)
+{
+    ESP_LOGI(TAG, "Opening Non-Volatile Storage (NVS) handle... ");
+    nvs_handle_t esp_nvs_handle;
+    esp_err_t err = nvs_open(ESP_NVS_NAMESPACE, NVS_READONLY, &esp_nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error (%s) opening NVS handle!\n", esp_err_to_name(err));
+    } else {
+        ESP_LOGI(TAG, "Reading energy totals from NVS ... ");
+        size_t required_length = sizeof(energy_totals_t);
+        err = nvs_get_blob(esp_nvs_handle, ESP_NVS_ENERGY_KEY, totals, &required_length);
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "Energy totals loaded");
+                break;
+            case ESP_ERR_NVS_NOT_FOUND:
+                ESP_LOGI(TAG, "The energy totals are not initialized yet!\n");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s) reading!\n", esp_err_to_name(err));
+        }
+        nvs_close(esp_nvs_handle);
+    }
+}
+
+// Saves the energy totals. Only called every save interval to limit flash wear
+void save_energy_totals_to_nvs(energy_totals_t* totals)
+{
+    ESP_LOGI(TAG, "Opening Non-Volatile Storage (NVS) handle... ");
+    nvs_handle_t esp_nvs_handle;
+    esp_err_t err = nvs_open(ESP_NVS_NAMESPACE, NVS_READWRITE, &esp_nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error (%s) opening NVS handle!\n", esp_err_to_name(err));
+    } else {
+        ESP_LOGI(TAG, "Saving energy totals to NVS ... ");
+        err = nvs_set_blob(esp_nvs_handle, ESP_NVS_ENERGY_KEY, totals, sizeof(energy_totals_t));
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "Energy totals saved!");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s) writing!\n", esp_err_to_name(err));
+        }
+        ESP_LOGI(TAG, "Committing updates in NVS ... ");
+        err = nvs_commit(esp_nvs_handle);
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "Done");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s)\n", esp_err_to_name(err));
+        }
+        nvs_close(esp_nvs_handle);
+    }
+}
+
+// Reads the load wattages
+void read_load_watts_from_nvs(uint16_t* watts)
+{
+    ESP_LOGI(TAG, "Opening Non-Volatile Storage (NVS) handle... ");
+    nvs_handle_t esp_nvs_handle;
+    esp_err_t err = nvs_open(ESP_NVS_NAMESPACE, NVS_READONLY, &esp_nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error (%s) opening NVS handle!\n", esp_err_to_name(err));
+    } else {
+        ESP_LOGI(TAG, "Reading load wattages from NVS ... ");
+        size_t required_length = sizeof(uint16_t) * 4;
+        err = nvs_get_blob(esp_nvs_handle, ESP_NVS_LOAD_WATTS_KEY, watts, &required_length);
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "Load wattages loaded");
+                break;
+            case ESP_ERR_NVS_NOT_FOUND:
+                ESP_LOGI(TAG, "The load wattages are not initialized yet!\n");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s) reading!\n", esp_err_to_name(err));
+        }
+        nvs_close(esp_nvs_handle);
+    }
+}
+
+// Saves the load wattage of each output
+void save_load_watts_to_nvs(uint16_t* watts)
+{
+    ESP_LOGI(TAG, "Opening Non-Volatile Storage (NVS) handle... ");
+    nvs_handle_t esp_nvs_handle;
+    esp_err_t err = nvs_open(ESP_NVS_NAMESPACE, NVS_READWRITE, &esp_nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error (%s) opening NVS handle!\n", esp_err_to_name(err));
+    } else {
+        ESP_LOGI(TAG, "Saving load wattages to NVS ... ");
+        err = nvs_set_blob(esp_nvs_handle, ESP_NVS_LOAD_WATTS_KEY, watts, sizeof(uint16_t) * 4);
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "Load wattages saved!");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s) writing!\n", esp_err_to_name(err));
+        }
+        ESP_LOGI(TAG, "Committing updates in NVS ... ");
+        err = nvs_commit(esp_nvs_handle);
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "Done");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s)\n", esp_err_to_name(err));
+        }
+        nvs_close(esp_nvs_handle);
+    }
+}
+
+// Returns the length of a stored MQTT TLS PEM with its terminator, or 0
+// if it isn't stored. Lets the caller skip the buffer for one that isn't
+size_t read_mqtt_pem_length_from_nvs(uint8_t pem)
+{
+    nvs_handle_t esp_nvs_handle;
+    size_t length = 0;
+    if (nvs_open(ESP_NVS_NAMESPACE, NVS_READONLY, &esp_nvs_handle) == ESP_OK) {
+        if (nvs_get_str(esp_nvs_handle, mqtt_pem_keys[pem], NULL, &length) != ESP_OK) {
+            length = 0;
+        }
+        nvs_close(esp_nvs_handle);
+    }
+    return length;
+}
+
+// Reads one of the MQTT TLS PEMs. Left empty if it isn't stored
+void read_mqtt_pem_from_nvs(uint8_t pem, char* data, size_t size)
+{
+    ESP_LOGI(TAG, "Opening Non-Volatile Storage (NVS) handle... ");
+    nvs_handle_t esp_nvs_handle;
+    esp_err_t err = nvs_open(ESP_NVS_NAMESPACE, NVS_READONLY, &esp_nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error (%s) opening NVS handle!\n", esp_err_to_name(err));
+    } else {
+        ESP_LOGI(TAG, "Reading %s from NVS ... ", mqtt_pem_keys[pem]);
+        size_t required_length = size;
+        err = nvs_get_str(esp_nvs_handle, mqtt_pem_keys[pem], data, &required_length);
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "%s loaded", mqtt_pem_keys[pem]);
+                break;
+            case ESP_ERR_NVS_NOT_FOUND:
+                ESP_LOGI(TAG, "%s is not initialized yet!\n", mqtt_pem_keys[pem]);
+                break;
+            default :
+                data[0] = '\0';
+                ESP_LOGI(TAG, "Error (%s) reading!\n", esp_err_to_name(err));
+        }
+        nvs_close(esp_nvs_handle);
+    }
+}
+
+// Saves one of the MQTT TLS PEMs. An empty string removes it
+void save_mqtt_pem_to_nvs(uint8_t pem, const char* data)
+{
+    ESP_LOGI(TAG, "Opening Non-Volatile Storage (NVS) handle... ");
+    nvs_handle_t esp_nvs_handle;
+    esp_err_t err = nvs_open(ESP_NVS_NAMESPACE, NVS_READWRITE, &esp_nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error (%s) opening NVS handle!\n", esp_err_to_name(err));
+    } else {
+        ESP_LOGI(TAG, "Saving %s to NVS ... ", mqtt_pem_keys[pem]);
+        err = nvs_set_str(esp_nvs_handle, mqtt_pem_keys[pem], data);
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "%s saved!", mqtt_pem_keys[pem]);
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s) writing!\n", esp_err_to_name(err));
+        }
+        ESP_LOGI(TAG, "Committing updates in NVS ... ");
+        err = nvs_commit(esp_nvs_handle);
+        switch (err) {
+            case ESP_OK:
+                ESP_LOGI(TAG, "Done");
+                break;
+            default :
+                ESP_LOGI(TAG, "Error (%s)\n", esp_err_to_name(err));
+        }
+        nvs_close(esp_nvs_handle);
+    }
+}
@@ -1,9 +1,35 @@
 #ifndef NVS_DATA_H_INCLUDED
 #define NVS_DATA_H_INCLUDED
 
+#include "schedule.h"
+#include "scene.h"
+#include "wifi_fast.h"
+#include "energy.h"
+
 void read_data_from_nvs(char* esp_wifi_sta_ssid, char* esp_wifi_sta_pass, light_info_t* light_info, char* mqtt_broker_uri);
 void save_wifi_info_to_nvs(char* esp_wifi_sta_ssid, char* esp_wifi_sta_pass);
 void save_light_info_to_nvs(light_info_t* light_info);
 void save_mqtt_info_to_nvs(char* mqtt_broker_uri);
+void read_schedule_from_nvs(schedule_entry_t* schedule, char* timezone);
+void save_schedule_to_nvs(schedule_entry_t* schedule, char* timezone);
+void read_scenes_from_nvs(scene_t* scenes);
+void save_scenes_to_nvs(scene_t* scenes);
+void read_dmx_info_from_nvs(uint16_t* dmx_universe, uint16_t* dmx_address);
+void save_dmx_info_to_nvs(uint16_t dmx_universe, uint16_t dmx_address);
+void read_groups_from_nvs(uint16_t* groups);
+void save_groups_to_nvs(uint16_t groups);
+void read_wifi_cache_from_nvs(wifi_fast_cache_t* cache);
+void save_wifi_cache_to_nvs(wifi_fast_cache_t* cache);
+void read_static_ip_from_nvs(wifi_static_ip_t* static_ip);
+void save_static_ip_to_nvs(wifi_static_ip_t* static_ip);
+void read_discovery_hashes_from_nvs(uint32_t* hashes, size_t count);
+void save_discovery_hashes_to_nvs(uint32_t* hashes, size_t count);
+void read_energy_totals_from_nvs(energy_totals_t* totals);
+void save_energy_totals_to_nvs(energy_totals_t* totals);
+void read_load_watts_from_nvs(uint16_t* watts);
+void save_load_watts_to_nvs(uint16_t* watts);
+size_t read_mqtt_pem_length_from_nvs(uint8_t pem);
+void read_mqtt_pem_from_nvs(uint8_t pem, char* data, size_t size);
+void save_mqtt_pem_to_nvs(uint8_t pem, const char* data);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,323 @@
+#include <string.h>
+#include <esp_log.h>
+
+#include "mqtt_outbox.h"
+#include "outbox_latest.h"
+
+// Custom outbox for esp-mqtt (CONFIG_MQTT_CUSTOM_OUTBOX). Built into the
+// mqtt component library by main/CMakeLists.txt since mqtt_outbox.h is
+// private to it. All calls are made with the client lock held.
+//
+// The library outbox mallocs every QoS 1 message and keeps all of them, so
+// during a broker outage every intermediate light level piles up in RAM
+// and is replayed in order on reconnect. This one has a fixed number of
+// fixed size slots, and a publish to a topic replaces any publish to the
+// same topic that hasn't been sent yet, so only the newest state is ever
+// replayed
+
+// MQTT control packet type for PUBLISH, in the top 4 bits of the first byte,
+// and the RETAIN flag in the bottom bit
+#define OUTBOX_PUBLISH_TYPE  3
+#define OUTBOX_RETAIN_FLAG   0x01
+
+struct outbox_item
+{
+  uint8_t in_use;
+  uint32_t sequence; // Enqueue order, so messages are replayed oldest first
+  int msg_id;
+  int msg_type;
+  int msg_qos;
+  outbox_tick_t tick;
+  pending_state_t pending;
+  size_t len;
+  uint8_t buffer[OUTBOX_SLOT_SIZE];
+};
+
+struct outbox_list_t
+{
+  struct outbox_item items[CONFIG_MQTT_OUTBOX_SLOTS];
+  uint32_t next_sequence;
+};
+
+// There is only one MQTT client, so the outbox is static
+static struct outbox_list_t outbox_pool;
+static outbox_latest_stats_t outbox_stats = { .slots = CONFIG_MQTT_OUTBOX_SLOTS };
+
+// Debug tag for log statements
+static const char *TAG = "MQTT Outbox";
+
+// Finds the topic of a PUBLISH packet
+// Returns the topic length, or -1 if the packet isn't a publish
+static int publish_topic(const uint8_t* data, size_t len, const uint8_t** topic)
+{
+    if (len < 2 || (data[0] >> 4) != OUTBOX_PUBLISH_TYPE) {
+        return -1;
+    }
+    // Skip the remaining length. 1-4 bytes with the top bit set on all but the last
+    size_t pos = 1;
+    while (pos < len && pos < 4 && (data[pos] & 0x80)) {
+        pos++;
+    }
+    pos++;
+    if (pos + 2 > len) {
+        return -1;
+    }
+    int topic_len = (data[pos] << 8) | data[pos + 1];
+    if (pos + 2 + topic_len > len) {
+        return -1;
+    }
+    *topic = data + pos + 2;
+    return topic_len;
+}
+
+static void outbox_free_item(outbox_item_handle_t item)
+{
+    if (item->in_use) {
+        item->in_use = 0;
+        outbox_stats.used--;
+    }
+}
+
+// Picks the slot for a new message
+//  - A queued publish to the same topic is replaced. One that has been sent
+//    is left alone, since the client matches its PUBACK by msg_id
+//  - Otherwise a free slot is used
+//  - If the outbox is full the oldest queued state publish is evicted, since
+//    a newer state replaces it anyway. Retained publishes, which are the
+//    discovery configs and availability, and subscribes are never evicted
+// Returns NULL if none of these leave room, and the new message is refused
+static outbox_item_handle_t outbox_find_slot(outbox_handle_t outbox, const uint8_t* topic, int topic_len)
+{
+    outbox_item_handle_t free_item = NULL;
+    outbox_item_handle_t oldest_state = NULL;
+    for (int i = 0; i < CONFIG_MQTT_OUTBOX_SLOTS; i++) {
+        outbox_item_handle_t item = &outbox->items[i];
+        if (!item->in_use) {
+            if (free_item == NULL) {
+                free_item = item;
+            }
+            continue;
+        }
+        if (item->pending != QUEUED) {
+            continue;
+        }
+        const uint8_t* item_topic;
+        int item_topic_len = publish_topic(item->buffer, item->len, &item_topic);
+        if (item_topic_len < 0) {
+            continue;
+        }
+        if (topic_len >= 0 && item_topic_len == topic_len && memcmp(item_topic, topic, topic_len) == 0) {
+            outbox_stats.replaced++;
+            outbox_free_item(item);
+            return item;
+        }
+        if (!(item->buffer[0] & OUTBOX_RETAIN_FLAG) && (oldest_state == NULL || item->sequence < oldest_state->sequence)) {
+            oldest_state = item;
+        }
+    }
+    if (free_item != NULL) {
+        return free_item;
+    }
+    outbox_stats.dropped++;
+    if (oldest_state == NULL) {
+        ESP_LOGW(TAG, "Outbox full. Refusing new message");
+        return NULL;
+    }
+    ESP_LOGW(TAG, "Outbox full. Dropping msg_id %d", oldest_state->msg_id);
+    outbox_free_item(oldest_state);
+    return oldest_state;
+}
+
+outbox_handle_t outbox_init(void)
+{
+    memset(&outbox_pool, 0, sizeof(outbox_pool));
+    outbox_stats.used = 0;
+    return &outbox_pool;
+}
+
+outbox_item_handle_t outbox_enqueue(outbox_handle_t outbox, outbox_message_handle_t message, outbox_tick_t tick)
+{
+    size_t len = message->len + message->remaining_len;
+    if (len > OUTBOX_SLOT_SIZE) {
+        ESP_LOGW(TAG, "Message of %d bytes is too big for the outbox", len);
+        outbox_stats.dropped++;
+        return NULL;
+    }
+    // The topic is always in the first part, the payload may be in remaining_data
+    const uint8_t* topic = NULL;
+    int topic_len = publish_topic(message->data, message->len, &topic);
+    outbox_item_handle_t item = outbox_find_slot(outbox, topic, topic_len);
+    if (item == NULL) {
+        return NULL;
+    }
+
+    item->in_use = 1;
+    item->sequence = outbox->next_sequence++;
+    item->msg_id = message->msg_id;
+    item->msg_type = message->msg_type;
+    item->msg_qos = message->msg_qos;
+    item->tick = tick;
+    item->pending = QUEUED;
+    item->len = len;
+    memcpy(item->buffer, message->data, message->len);
+    if (message->remaining_data) {
+        memcpy(item->buffer + message->len, message->remaining_data, message->remaining_len);
+    }
+    outbox_stats.used++;
+    if (outbox_stats.used > outbox_stats.high_water) {
+        outbox_stats.high_water = outbox_stats.used;
+    }
+    return item;
+}
+
+outbox_item_handle_t outbox_get(outbox_handle_t outbox, int msg_id)
+{
+    for (int i = 0; i < CONFIG_MQTT_OUTBOX_SLOTS; i++) {
+        if (outbox->items[i].in_use && outbox->items[i].msg_id == msg_id) {
+            return &outbox->items[i];
+        }
+    }
+    return NULL;
+}
+
+// Returns the oldest message in the given state
+outbox_item_handle_t outbox_dequeue(outbox_handle_t outbox, pending_state_t pending, outbox_tick_t *tick)
+{
+    outbox_item_handle_t oldest = NULL;
+    for (int i = 0; i < CONFIG_MQTT_OUTBOX_SLOTS; i++) {
+        outbox_item_handle_t item = &outbox->items[i];
+        if (item->in_use && item->pending == pending && (oldest == NULL || item->sequence < oldest->sequence)) {
+            oldest = item;
+        }
+    }
+    if (oldest != NULL && tick != NULL) {
+        *tick = oldest->tick;
+    }
+    return oldest;
+}
+
+uint8_t *outbox_item_get_data(outbox_item_handle_t item, size_t *len, uint16_t *msg_id, int *msg_type, int *qos)
+{
+    if (item == NULL) {
+        return NULL;
+    }
+    *len = item->len;
+    *msg_id = item->msg_id;
+    *msg_type = item->msg_type;
+    *qos = item->msg_qos;
+    return item->buffer;
+}
+
+esp_err_t outbox_delete_item(outbox_handle_t outbox, outbox_item_handle_t item_to_delete)
+{
+    if (item_to_delete == NULL || !item_to_delete->in_use) {
+        return ESP_FAIL;
+    }
+    outbox_free_item(item_to_delete);
+    return ESP_OK;
+}
+
+esp_err_t outbox_delete(outbox_handle_t outbox, int msg_id, int msg_type)
+{
+    for (int i = 0; i < CONFIG_MQTT_OUTBOX_SLOTS; i++) {
+        outbox_item_handle_t item = &outbox->items[i];
+        if (item->in_use && item->msg_id == msg_id && item->msg_type == msg_type) {
+            outbox_free_item(item);
+            return ESP_OK;
+        }
+    }
+    return ESP_FAIL;
+}
+
+esp_err_t outbox_delete_msgid(outbox_handle_t outbox, int msg_id)
+{
+    return outbox_delete_item(outbox, outbox_get(outbox, msg_id));
+}
+
+esp_err_t outbox_delete_msgtype(outbox_handle_t outbox, int msg_type)
+{
+    for (int i = 0; i < CONFIG_MQTT_OUTBOX_SLOTS; i++) {
+        if (outbox->items[i].in_use && outbox->items[i].msg_type == msg_type) {
+            outbox_free_item(&outbox->items[i]);
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t outbox_set_pending(outbox_handle_t outbox, int msg_id, pending_state_t pending)
+{
+    outbox_item_handle_t item = outbox_get(outbox, msg_id);
+    if (item == NULL) {
+        return ESP_FAIL;
+    }
+    item->pending = pending;
+    return ESP_OK;
+}
+
+pending_state_t outbox_item_get_pending(outbox_item_handle_t item)
+{
+    return item->pending;
+}
+
+esp_err_t outbox_set_tick(outbox_handle_t outbox, int msg_id, outbox_tick_t tick)
+{
+    outbox_item_handle_t item = outbox_get(outbox, msg_id);
+    if (item == NULL) {
+        return ESP_FAIL;
+    }
+    item->tick = tick;
+    return ESP_OK;
+}
+
+// Deletes one expired message and returns its msg_id, or -1 if none have expired
+int outbox_delete_single_expired(outbox_handle_t outbox, outbox_tick_t current_tick, outbox_tick_t timeout)
+{
+    for (int i = 0; i < CONFIG_MQTT_OUTBOX_SLOTS; i++) {
+        outbox_item_handle_t item = &outbox->items[i];
+        if (item->in_use && current_tick - item->tick > timeout) {
+            int msg_id = item->msg_id;
+            outbox_stats.expired++;
+            outbox_free_item(item);
+            return msg_id;
+        }
+    }
+    return -1;
+}
+
+int outbox_delete_expired(outbox_handle_t outbox, outbox_tick_t current_tick, outbox_tick_t timeout)
+{
+    int deleted = 0;
+    for (int i = 0; i < CONFIG_MQTT_OUTBOX_SLOTS; i++) {
+        outbox_item_handle_t item = &outbox->items[i];
+        if (item->in_use && current_tick - item->tick > timeout) {
+            outbox_stats.expired++;
+            outbox_free_item(item);
+            deleted++;
+        }
+    }
+    return deleted;
+}
+
+// Total bytes of all pending messages
+int outbox_get_size(outbox_handle_t outbox)
+{
+    int size = 0;
+    for (int i = 0; i < CONFIG_MQTT_OUTBOX_SLOTS; i++) {
+        if (outbox->items[i].in_use) {
+            size += outbox->items[i].len;
+        }
+    }
+    return size;
+}
+
+void outbox_destroy(outbox_handle_t outbox)
+{
+    for (int i = 0; i < CONFIG_MQTT_OUTBOX_SLOTS; i++) {
+        outbox_free_item(&outbox->items[i]);
+    }
+}
+
+void outbox_latest_get_stats(outbox_latest_stats_t* stats)
+{
+    *stats = outbox_stats;
+}
@@ -0,0 +1,38 @@
+#ifndef OUTBOX_LATEST_H_INCLUDED
+#define OUTBOX_LATEST_H_INCLUDED
+
+#include <stdint.h>
+#include "sdkconfig.h"
+
+// Number of messages the MQTT outbox can hold. Each slot is a fixed
+// OUTBOX_SLOT_SIZE bytes so the outbox never touches the heap. The default
+// holds a connect (availability and 8 subscribes) and a full discovery
+// burst of 22 publishes with room to spare for a live state
+#ifndef CONFIG_MQTT_OUTBOX_SLOTS
+#define CONFIG_MQTT_OUTBOX_SLOTS 32
+#endif
+
+// A whole PUBLISH packet has to fit one slot. A bigger one is refused
+#define OUTBOX_SLOT_SIZE         512
+
+// Fixed header, a 2 byte remaining length, the topic length and the msg_id
+// of a QoS 1 PUBLISH, which is all a packet adds to its topic and payload
+#define OUTBOX_PUBLISH_OVERHEAD  7
+
+// Longest payload a publish to a topic of topic_len bytes can carry
+#define OUTBOX_MAX_PAYLOAD(topic_len) (OUTBOX_SLOT_SIZE - OUTBOX_PUBLISH_OVERHEAD - (topic_len))
+
+typedef struct
+{
+  uint16_t slots;
+  uint16_t used;
+  uint16_t high_water;
+  uint32_t replaced; // Queued publishes superseded by a newer one to the same topic
+  uint32_t dropped;  // State publishes evicted or new messages refused because the
+                     // outbox was full, or messages too big for a slot
+  uint32_t expired;  // Messages deleted by the client after the outbox timeout
+} outbox_latest_stats_t;
+
+void outbox_latest_get_stats(outbox_latest_stats_t* stats);
+
+#endif
@@ -0,0 +1,40 @@
+#include <stdint.h>
+#include <esp_log.h>
+
+#include "req_arena.h"
+
+// Aligned for any type that might be put in it
+static uint32_t arena[REQ_ARENA_SIZE / sizeof(uint32_t)];
+static size_t arena_used = 0;
+static size_t arena_high_water = 0;
+
+// Debug tag for log statements
+static const char *TAG = "Request Arena";
+
+// Returns size bytes from the arena, or NULL if it's full
+void* req_arena_alloc(size_t size)
+{
+    size_t aligned = (size + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1);
+    if (aligned > REQ_ARENA_SIZE - arena_used) {
+        ESP_LOGI(TAG, "Out of space: %d bytes requested, %d free", size, REQ_ARENA_SIZE - arena_used);
+        return NULL;
+    }
+    void* ptr = (uint8_t*)arena + arena_used;
+    arena_used += aligned;
+    if (arena_used > arena_high_water) {
+        arena_high_water = arena_used;
+    }
+    return ptr;
+}
+
+// Frees everything. Called at the end of each request
+void req_arena_reset(void)
+{
+    arena_used = 0;
+}
+
+// Most of the arena ever used by one request
+size_t req_arena_high_water(void)
+{
+    return arena_high_water;
+}
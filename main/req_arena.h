@@ -0,0 +1,19 @@
+#ifndef REQ_ARENA_H_INCLUDED
+#define REQ_ARENA_H_INCLUDED
+
+#include <stddef.h>
+
+// Scratch memory for handling one HTTP request
+// Handlers take buffers from here instead of the stack or heap, and
+// everything is released at once with req_arena_reset() when the request is
+// done. The httpd server runs all handlers on a single worker task, so one
+// arena is enough and it must only be used from httpd handlers
+// Sized for the largest body, a PEM for MQTT TLS, plus the buffers for
+// checking basic auth on the same request
+#define REQ_ARENA_SIZE 5376
+
+void* req_arena_alloc(size_t size);
+void req_arena_reset(void);
+size_t req_arena_high_water(void);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef SCENE_H_INCLUDED
+#define SCENE_H_INCLUDED
+
+#include <stdint.h>
+
+// Max number of scenes and the length of a scene name including the terminator
+#define SCENE_MAX_COUNT      8
+#define SCENE_NAME_LENGTH    13
+
+// Time for every light to fade to the scene brightness
+#define SCENE_FADE_TIME      1000 // 1s
+
+// A scene is a named snapshot of the brightness of every light
+// An empty name marks an unused slot
+typedef struct
+{
+  char name[SCENE_NAME_LENGTH];
+  uint8_t brightness[4];
+} scene_t;
+
+#endif
@@ -0,0 +1,331 @@
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/param.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_sntp.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+
+#include "schedule.h"
+
+// Schedule entries are kept in a hierarchical timer wheel so a tick only
+// has to look at one slot no matter how many entries are stored.
+// Each level has 64 slots. Level 0 counts seconds, level 1 counts
+// 64 second blocks and so on, so 4 levels cover about 194 days which is
+// more than the one week maximum between firings of an entry
+#define WHEEL_BITS      6
+#define WHEEL_SIZE      (1 << WHEEL_BITS)
+#define WHEEL_MASK      (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS    4
+#define WHEEL_MAX_DELAY ((1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+#define WHEEL_NONE      (-1)
+
+// Any time before this (Sept 2020) means SNTP hasn't synced yet
+#define SCHEDULE_VALID_EPOCH  1600000000
+
+#define SCHEDULE_NTP_SERVER   "pool.ntp.org"
+
+// Wheel node for each schedule entry. Nodes are linked into slot lists by index
+typedef struct
+{
+  int16_t next;
+  int16_t prev;
+  int16_t slot;
+  uint32_t expires; // Monotonic seconds since boot
+} wheel_node_t;
+
+static wheel_node_t wheel_nodes[SCHEDULE_MAX_ENTRIES];
+static int16_t wheel_slots[WHEEL_LEVELS * WHEEL_SIZE];
+static uint32_t wheel_now = 0;
+
+static schedule_entry_t* schedule_entries = NULL;
+static schedule_action_cb_t schedule_action = NULL;
+static SemaphoreHandle_t schedule_mutex = NULL;
+static StaticSemaphore_t schedule_mutex_buffer;
+
+// Entries due on the current tick. They are copied out so the actions run
+// after the mutex is released, and can take their time or call back in here
+// Only used from the schedule task
+typedef struct
+{
+  uint8_t light;
+  uint8_t brightness;
+  uint16_t transition_s;
+} schedule_due_t;
+
+static schedule_due_t schedule_due[SCHEDULE_MAX_ENTRIES];
+static int schedule_due_count = 0;
+
+// Set by the SNTP callback so the task re-arms every entry against the new wall time
+static volatile uint8_t schedule_resync = 1;
+
+// Debug tag for log statements
+static const char *TAG = "Schedule";
+
+// The wheel always runs on the monotonic clock so SNTP steps and lost
+// Wi-Fi don't cause missed or doubled firings. Wall time is only used
+// to work out how far away the next firing is
+static uint32_t monotonic_seconds(void)
+{
+    return (uint32_t)(esp_timer_get_time() / 1000000);
+}
+
+uint8_t schedule_time_synced(void)
+{
+    return time(NULL) > SCHEDULE_VALID_EPOCH;
+}
+
+static void wheel_remove(int16_t i)
+{
+    wheel_node_t* node = &wheel_nodes[i];
+    if (node->slot == WHEEL_NONE) {
+        return;
+    }
+    if (node->prev != WHEEL_NONE) {
+        wheel_nodes[node->prev].next = node->next;
+    }
+    else {
+        wheel_slots[node->slot] = node->next;
+    }
+    if (node->next != WHEEL_NONE) {
+        wheel_nodes[node->next].prev = node->prev;
+    }
+    node->slot = WHEEL_NONE;
+}
+
+static void wheel_insert(int16_t i)
+{
+    wheel_node_t* node = &wheel_nodes[i];
+    uint32_t delta = node->expires - wheel_now;
+    if (delta > WHEEL_MAX_DELAY) {
+        delta = WHEEL_MAX_DELAY;
+        node->expires = wheel_now + delta;
+    }
+
+    // Pick the lowest level that can hold the delay
+    uint8_t level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1UL << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    int16_t slot = (level * WHEEL_SIZE) + ((node->expires >> (WHEEL_BITS * level)) & WHEEL_MASK);
+
+    node->slot = slot;
+    node->prev = WHEEL_NONE;
+    node->next = wheel_slots[slot];
+    if (node->next != WHEEL_NONE) {
+        wheel_nodes[node->next].prev = i;
+    }
+    wheel_slots[slot] = i;
+}
+
+// Detaches a whole slot list and returns its head
+static int16_t wheel_take_slot(int16_t slot)
+{
+    int16_t head = wheel_slots[slot];
+    wheel_slots[slot] = WHEEL_NONE;
+    for (int16_t i = head; i != WHEEL_NONE; i = wheel_nodes[i].next) {
+        wheel_nodes[i].slot = WHEEL_NONE;
+    }
+    return head;
+}
+
+// Moves every node in a higher level slot down to the level that now fits it
+static void wheel_cascade(uint8_t level)
+{
+    int16_t i = wheel_take_slot((level * WHEEL_SIZE) + ((wheel_now >> (WHEEL_BITS * level)) & WHEEL_MASK));
+    while (i != WHEEL_NONE) {
+        int16_t next = wheel_nodes[i].next;
+        wheel_insert(i);
+        i = next;
+    }
+}
+
+// Returns the next wall time after now that the entry should fire, or 0 if never
+static time_t schedule_next_fire(const schedule_entry_t* entry, time_t now)
+{
+    if (entry->enabled == 0 || (entry->days & 0x7F) == 0 || entry->hour > 23 || entry->minute > 59) {
+        return 0;
+    }
+    struct tm now_tm;
+    localtime_r(&now, &now_tm);
+    for (int day = 0; day <= 7; day++) {
+        struct tm fire_tm = now_tm;
+        fire_tm.tm_mday += day;
+        fire_tm.tm_hour = entry->hour;
+        fire_tm.tm_min = entry->minute;
+        fire_tm.tm_sec = 0;
+        fire_tm.tm_isdst = -1;
+        time_t fire = mktime(&fire_tm);
+        if (fire > now && (entry->days & (1 << fire_tm.tm_wday))) {
+            return fire;
+        }
+    }
+    return 0;
+}
+
+// Computes the next firing of an entry after the given wall time and puts it in the wheel
+// Must be called with the schedule mutex held
+static void schedule_arm(int16_t i, time_t after)
+{
+    wheel_remove(i);
+    if (!schedule_time_synced()) {
+        return;
+    }
+    time_t now = time(NULL);
+    time_t fire = schedule_next_fire(&schedule_entries[i], MAX(now, after));
+    if (fire == 0) {
+        return;
+    }
+    // The delay is from the wall clock's now, which matches the monotonic
+    // clock and not the wheel. The wheel is behind it until the task has
+    // ticked this second, or further if it is catching up
+    uint32_t expires = monotonic_seconds() + (uint32_t)(fire - now);
+    if ((int32_t)(expires - wheel_now) <= 0) {
+        expires = wheel_now + 1;
+    }
+    wheel_nodes[i].expires = expires;
+    wheel_insert(i);
+}
+
+// Advances the wheel by one second and collects everything in the current
+// slot into schedule_due. Must be called with the schedule mutex held
+static void wheel_tick(void)
+{
+    wheel_now++;
+    if ((wheel_now & WHEEL_MASK) == 0) {
+        for (uint8_t level = 1; level < WHEEL_LEVELS; level++) {
+            wheel_cascade(level);
+            if (((wheel_now >> (WHEEL_BITS * level)) & WHEEL_MASK) != 0) {
+                break;
+            }
+        }
+    }
+
+    int16_t i = wheel_take_slot(wheel_now & WHEEL_MASK);
+    while (i != WHEEL_NONE) {
+        int16_t next = wheel_nodes[i].next;
+        schedule_entry_t* entry = &schedule_entries[i];
+        ESP_LOGI(TAG, "Entry %d firing: light%d to %d over %ds", i, entry->light, entry->brightness, entry->transition_s);
+        if (schedule_due_count < SCHEDULE_MAX_ENTRIES) {
+            schedule_due[schedule_due_count].light = entry->light;
+            schedule_due[schedule_due_count].brightness = entry->brightness;
+            schedule_due[schedule_due_count].transition_s = entry->transition_s;
+            schedule_due_count++;
+        }
+        // Entries have minute resolution, so skip ahead a minute in case
+        // the wall clock is a fraction of a second behind the wheel
+        schedule_arm(i, time(NULL) + 60);
+        i = next;
+    }
+}
+
+static void schedule_rearm_all(void)
+{
+    for (int16_t i = 0; i < SCHEDULE_MAX_ENTRIES; i++) {
+        schedule_arm(i, 0);
+    }
+}
+
+static void sntp_sync_cb(struct timeval *tv)
+{
+    ESP_LOGI(TAG, "Time synchronized");
+    schedule_resync = 1;
+}
+
+void schedule_init(schedule_entry_t* entries, const char* timezone, schedule_action_cb_t action_cb)
+{
+    schedule_entries = entries;
+    schedule_action = action_cb;
+    schedule_mutex = xSemaphoreCreateMutexStatic(&schedule_mutex_buffer);
+
+    for (int i = 0; i < WHEEL_LEVELS * WHEEL_SIZE; i++) {
+        wheel_slots[i] = WHEEL_NONE;
+    }
+    for (int i = 0; i < SCHEDULE_MAX_ENTRIES; i++) {
+        wheel_nodes[i].next = WHEEL_NONE;
+        wheel_nodes[i].prev = WHEEL_NONE;
+        wheel_nodes[i].slot = WHEEL_NONE;
+    }
+    wheel_now = monotonic_seconds();
+
+    setenv("TZ", timezone, 1);
+    tzset();
+}
+
+// Starts SNTP once the device has a network connection
+// Safe to call on every reconnect
+void schedule_start_sntp(void)
+{
+    static uint8_t sntp_started = 0;
+    if (sntp_started == 0) {
+        ESP_LOGI(TAG, "Starting SNTP");
+        sntp_setoperatingmode(SNTP_OPMODE_POLL);
+        sntp_setservername(0, SCHEDULE_NTP_SERVER);
+        sntp_set_time_sync_notification_cb(sntp_sync_cb);
+        sntp_init();
+        sntp_started = 1;
+    }
+}
+
+// Updates one schedule entry and re-arms it
+// Returns 0 on success, -1 if the entry is invalid
+int schedule_set_entry(uint8_t index, const schedule_entry_t* entry)
+{
+    if (index >= SCHEDULE_MAX_ENTRIES || entry->light > 3 || entry->hour > 23 || entry->minute > 59) {
+        return -1;
+    }
+    xSemaphoreTake(schedule_mutex, portMAX_DELAY);
+    schedule_entries[index] = *entry;
+    schedule_arm(index, 0);
+    xSemaphoreGive(schedule_mutex);
+    return 0;
+}
+
+void schedule_set_timezone(const char* timezone)
+{
+    xSemaphoreTake(schedule_mutex, portMAX_DELAY);
+    setenv("TZ", timezone, 1);
+    tzset();
+    schedule_rearm_all();
+    xSemaphoreGive(schedule_mutex);
+}
+
+// Schedule task
+// Ticks the timer wheel once a second. If the task falls behind it catches
+// up tick by tick so no entries are skipped. The mutex is only held for the
+// wheel itself, and the due actions run after it is released
+void schedule_task(void *Param)
+{
+    ESP_LOGI(TAG, "Schedule task starting");
+    const uint32_t task_delay_ms = 1000;
+    TickType_t last_wake = xTaskGetTickCount();
+    while(1) {
+        vTaskDelayUntil(&last_wake, task_delay_ms / portTICK_RATE_MS);
+        xSemaphoreTake(schedule_mutex, portMAX_DELAY);
+        if (schedule_resync == 1 && schedule_time_synced()) {
+            schedule_resync = 0;
+            schedule_rearm_all();
+        }
+        xSemaphoreGive(schedule_mutex);
+
+        uint32_t now = monotonic_seconds();
+        while (1) {
+            xSemaphoreTake(schedule_mutex, portMAX_DELAY);
+            if ((int32_t)(now - wheel_now) <= 0) {
+                xSemaphoreGive(schedule_mutex);
+                break;
+            }
+            schedule_due_count = 0;
+            wheel_tick();
+            xSemaphoreGive(schedule_mutex);
+
+            for (int i = 0; i < schedule_due_count && schedule_action; i++) {
+                schedule_action(schedule_due[i].light, schedule_due[i].brightness, (uint32_t)schedule_due[i].transition_s * 1000);
+            }
+        }
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef SCHEDULE_H_INCLUDED
+#define SCHEDULE_H_INCLUDED
+
+#include <stdint.h>
+
+// Max number of schedule entries stored on the device
+#define SCHEDULE_MAX_ENTRIES     128
+
+// Length of the POSIX timezone string, e.g. "EST5EDT,M3.2.0,M11.1.0"
+#define SCHEDULE_TZ_LENGTH       48
+
+// One cron-like schedule entry. Fires at hour:minute local time on
+// every day set in the days bitmask (bit 0 = Sunday ... bit 6 = Saturday)
+// Kept small since the whole table is stored in NVS as a single blob
+typedef struct
+{
+  uint8_t enabled;
+  uint8_t light;
+  uint8_t brightness;
+  uint8_t hour;
+  uint8_t minute;
+  uint8_t days;
+  uint16_t transition_s;
+} schedule_entry_t;
+
+// Called from the schedule task when an entry fires
+typedef void (*schedule_action_cb_t)(uint8_t light, uint8_t brightness, uint32_t transition_ms);
+
+void schedule_init(schedule_entry_t* entries, const char* timezone, schedule_action_cb_t action_cb);
+void schedule_start_sntp(void);
+int schedule_set_entry(uint8_t index, const schedule_entry_t* entry);
+void schedule_set_timezone(const char* timezone);
+uint8_t schedule_time_synced(void);
+void schedule_task(void *Param);
+
+#endif
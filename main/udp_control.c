@@ -0,0 +1,566 @@
+#include <string.h>
+#include <sys/param.h>
+#include <sys/time.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <esp_system.h>
+#include <lwip/sockets.h>
+
+#include "udp_control.h"
+#include "lights_ledc.h"
+#include "log_ring.h"
+#include "schedule.h"
+
+// Live dimming from a lighting desk. Frames are decoded straight out of a
+// static receive buffer and written to the LEDC driver, so there is no JSON
+// parsing and no allocation on the data path. Three frame types are accepted:
+//
+//  - Compact frame on the Art-Net port:
+//      'L' 'C' <sequence> <count> <level 0> ... <level count-1>
+//  - Art-Net ArtDmx on port 6454
+//  - E1.31 (sACN) data packets on port 5568, unicast or multicast
+//
+// For Art-Net and E1.31 the lights map to 4 DMX slots starting at the
+// configured start address (1-512) of the configured universe
+//
+// Group commands let one packet control every board in a space at once.
+// They are sent to a multicast group so each board only gets one copy:
+//      'G' 'C' <sequence> <group> <execute at, 8 bytes> <fade ms, 2 bytes>
+//      <command> <data length> <data>
+// Multi-byte fields are big-endian. Group 0 addresses every board, and
+// groups 1-16 address the boards that are members. Execute at is in ms
+// since the Unix epoch. Every board waits until then before starting, so
+// boards whose MQTT or Wi-Fi is slower don't start late. 0 means run now.
+// The sequence starts at a random number on each boot and repeats are
+// spotted per sender, so two boards sending at once can't hide each other
+
+#define UDP_RX_BUFFER_LENGTH    638 // Largest E1.31 data packet
+
+// Art-Net ArtDmx layout
+#define ARTNET_HEADER_LENGTH    18
+#define ARTNET_OPCODE_DMX       0x5000
+
+// E1.31 data packet layout
+#define E131_HEADER_LENGTH      126
+#define E131_SEQUENCE_OFFSET    111
+#define E131_OPTIONS_OFFSET     112
+#define E131_UNIVERSE_OFFSET    113
+#define E131_COUNT_OFFSET       123
+#define E131_START_CODE_OFFSET  125
+#define E131_OPTION_TERMINATED  0x40
+
+// Frames whose sequence number is up to this far behind the last one are late and dropped
+// A bigger jump back means the sender restarted, so the frame is used
+#define SEQUENCE_DROP_WINDOW    20
+
+static uint8_t rx_buffer[UDP_RX_BUFFER_LENGTH];
+
+static volatile uint16_t dmx_universe = 1;
+static volatile uint16_t dmx_start_address = 1;
+static volatile uint8_t rejoin_multicast = 1;
+
+static udp_control_release_cb_t release_callback = NULL;
+
+// Group command state
+#define GROUP_HEADER_LENGTH      16
+#define GROUP_MAX_DATA_LENGTH    16
+#define GROUP_MAX_DELAY_MS       60000   // Later than this means the sender's clock is wrong
+#define GROUP_REPEAT_WINDOW_US   5000000 // Same sequence within this time is a repeat
+#define GROUP_SENDERS            4       // Senders whose last sequence is remembered
+
+typedef struct
+{
+  uint8_t command;
+  uint8_t len;
+  uint16_t fade_ms;
+  uint8_t data[GROUP_MAX_DATA_LENGTH];
+} group_command_t;
+
+// Last sequence seen from one sender, by source IP
+typedef struct
+{
+  uint32_t addr;
+  uint8_t sequence;
+  int64_t seen_us;
+} group_sender_t;
+
+static volatile uint16_t member_groups = 0;
+static udp_control_group_cb_t group_callback = NULL;
+static esp_timer_handle_t group_timer = NULL;
+static group_sender_t group_senders[GROUP_SENDERS];
+
+// The waiting command is set from the UDP task and from anything that sends
+// a group command, and read by the timer, so it is only touched with the
+// mutex held. The timer hands the command to the group task through the
+// queue so the lights and MQTT are never driven from the esp_timer task
+static group_command_t pending_command;
+static SemaphoreHandle_t group_mutex = NULL;
+static StaticSemaphore_t group_mutex_buffer;
+#define GROUP_QUEUE_LENGTH  2
+static QueueHandle_t group_queue = NULL;
+static StaticQueue_t group_queue_buffer;
+static uint8_t group_queue_storage[GROUP_QUEUE_LENGTH * sizeof(group_command_t)];
+
+// Live control state
+static uint8_t live_active = 0;
+static uint8_t live_levels[4];
+static int64_t last_frame_us = 0;
+static int16_t last_sequence = -1;
+
+// Counters for debugging dropped frames
+static uint32_t frames_received = 0;
+static uint32_t frames_dropped = 0;
+
+// Debug tag for log statements
+static const char *TAG = "UDP Control";
+
+void udp_control_init(uint16_t universe, uint16_t start_address, udp_control_release_cb_t release_cb)
+{
+    release_callback = release_cb;
+    udp_control_set_address(universe, start_address);
+}
+
+void udp_control_set_address(uint16_t universe, uint16_t start_address)
+{
+    if (start_address < 1 || start_address > 509) {
+        start_address = 1;
+    }
+    if (universe < 1 || universe > 63999) {
+        universe = 1;
+    }
+    dmx_universe = universe;
+    dmx_start_address = start_address;
+    rejoin_multicast = 1;
+}
+
+static void group_timer_cb(void* arg)
+{
+    group_command_t command;
+    xSemaphoreTake(group_mutex, portMAX_DELAY);
+    command = pending_command;
+    xSemaphoreGive(group_mutex);
+    xQueueSend(group_queue, &command, 0);
+}
+
+// Sets up group commands. groups is a bitmask where bit 0 is group 1
+void udp_control_init_groups(uint16_t groups, udp_control_group_cb_t group_cb)
+{
+    member_groups = groups;
+    group_callback = group_cb;
+    group_mutex = xSemaphoreCreateMutexStatic(&group_mutex_buffer);
+    group_queue = xQueueCreateStatic(GROUP_QUEUE_LENGTH, sizeof(group_command_t), group_queue_storage, &group_queue_buffer);
+    const esp_timer_create_args_t timer_args = {
+        .callback = group_timer_cb,
+        .name = "group_command",
+    };
+    esp_timer_create(&timer_args, &group_timer);
+}
+
+void udp_control_set_groups(uint16_t groups)
+{
+    member_groups = groups;
+}
+
+uint8_t udp_control_active(void)
+{
+    return live_active;
+}
+
+// Returns 1 if the frame is older than the last one and should be dropped
+// A sequence number of 0 in Art-Net means sequencing is disabled
+static uint8_t sequence_is_late(uint8_t sequence, uint8_t zero_disables)
+{
+    if (zero_disables && sequence == 0) {
+        return 0;
+    }
+    if (last_sequence >= 0) {
+        int8_t diff = (int8_t)(sequence - (uint8_t)last_sequence);
+        if (diff <= 0 && diff > -SEQUENCE_DROP_WINDOW) {
+            frames_dropped++;
+            return 1;
+        }
+    }
+    last_sequence = sequence;
+    return 0;
+}
+
+// Writes any changed levels straight to the LEDC driver
+static void apply_levels(const uint8_t* levels, uint8_t count)
+{
+    for (uint8_t i = 0; i < count && i < 4; i++) {
+        if (live_active == 0 || levels[i] != live_levels[i]) {
+            lights_set_brightness_immediate(levels[i], i);
+            live_levels[i] = levels[i];
+        }
+    }
+    if (live_active == 0) {
+        ESP_LOGI(TAG, "Live control started");
+        LOG_RING("UDP live control started");
+        live_active = 1;
+    }
+    last_frame_us = esp_timer_get_time();
+    frames_received++;
+}
+
+// Applies the 4 slots at the start address from a DMX universe
+static void apply_dmx(const uint8_t* slots, uint16_t slot_count)
+{
+    uint16_t first = dmx_start_address - 1;
+    if (slot_count < first + 4) {
+        return;
+    }
+    apply_levels(slots + first, 4);
+}
+
+static void handle_compact_frame(const uint8_t* frame, int len)
+{
+    if (len < 4 || frame[3] > 4 || len < 4 + frame[3]) {
+        return;
+    }
+    if (sequence_is_late(frame[2], 0)) {
+        return;
+    }
+    apply_levels(frame + 4, frame[3]);
+}
+
+static void handle_artnet_frame(const uint8_t* frame, int len)
+{
+    if (len < ARTNET_HEADER_LENGTH || memcmp(frame, "Art-Net\0", 8) != 0) {
+        return;
+    }
+    uint16_t opcode = frame[8] | (frame[9] << 8);
+    if (opcode != ARTNET_OPCODE_DMX) {
+        return;
+    }
+    // Art-Net universes start at 0, so universe 1 here is Art-Net port address 0
+    uint16_t port_address = frame[14] | ((frame[15] & 0x7F) << 8);
+    if (port_address != dmx_universe - 1) {
+        return;
+    }
+    uint16_t slot_count = (frame[16] << 8) | frame[17];
+    if (len < ARTNET_HEADER_LENGTH + slot_count) {
+        return;
+    }
+    if (sequence_is_late(frame[12], 1)) {
+        return;
+    }
+    apply_dmx(frame + ARTNET_HEADER_LENGTH, slot_count);
+}
+
+static void handle_e131_frame(const uint8_t* frame, int len)
+{
+    if (len < E131_HEADER_LENGTH || memcmp(frame + 4, "ASC-E1.17\0\0\0", 12) != 0) {
+        return;
+    }
+    uint16_t universe = (frame[E131_UNIVERSE_OFFSET] << 8) | frame[E131_UNIVERSE_OFFSET + 1];
+    if (universe != dmx_universe || frame[E131_START_CODE_OFFSET] != 0) {
+        return;
+    }
+    if (frame[E131_OPTIONS_OFFSET] & E131_OPTION_TERMINATED) {
+        // Source is going away. Let the hold timeout end live control
+        return;
+    }
+    // The property count includes the start code
+    uint16_t slot_count = ((frame[E131_COUNT_OFFSET] << 8) | frame[E131_COUNT_OFFSET + 1]) - 1;
+    if (len < E131_HEADER_LENGTH + slot_count) {
+        return;
+    }
+    if (sequence_is_late(frame[E131_SEQUENCE_OFFSET], 0)) {
+        return;
+    }
+    apply_dmx(frame + E131_HEADER_LENGTH, slot_count);
+}
+
+// Returns 1 if the frame repeats the last one from the same sender
+// Senders repeat each command a few times since multicast is lossy
+static uint8_t group_is_repeat(uint32_t addr, uint8_t sequence)
+{
+    int64_t now_us = esp_timer_get_time();
+    group_sender_t* sender = NULL;
+    for (int i = 0; i < GROUP_SENDERS; i++) {
+        if (group_senders[i].addr == addr) {
+            sender = &group_senders[i];
+            break;
+        }
+        // Otherwise reuse the sender heard from longest ago
+        if (sender == NULL || group_senders[i].seen_us < sender->seen_us) {
+            sender = &group_senders[i];
+        }
+    }
+    if (sender->addr == addr && sender->sequence == sequence && (now_us - sender->seen_us) < GROUP_REPEAT_WINDOW_US) {
+        return 1;
+    }
+    sender->addr = addr;
+    sender->sequence = sequence;
+    sender->seen_us = now_us;
+    return 0;
+}
+
+// Waits for the start time in a group command frame and then runs it
+// The frame must already have been checked to be complete
+static void group_schedule(const uint8_t* frame)
+{
+    uint8_t group = frame[3];
+    if (group > UDP_CONTROL_MAX_GROUPS || (group != 0 && (member_groups & (1 << (group - 1))) == 0)) {
+        return;
+    }
+
+    uint64_t execute_at = 0;
+    for (int i = 4; i < 12; i++) {
+        execute_at = (execute_at << 8) | frame[i];
+    }
+
+    // Work out how long to wait. If the clock isn't synced yet, or the
+    // time has already passed, the command runs now
+    int64_t delay_us = 0;
+    if (execute_at != 0 && schedule_time_synced()) {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        delay_us = (int64_t)execute_at * 1000 - ((int64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+        if (delay_us > GROUP_MAX_DELAY_MS * 1000LL) {
+            ESP_LOGI(TAG, "Group command is too far in the future. Dropping it");
+            return;
+        }
+    }
+    if (delay_us < 1) {
+        delay_us = 1;
+    }
+
+    // A newer command replaces one that is still waiting
+    xSemaphoreTake(group_mutex, portMAX_DELAY);
+    esp_timer_stop(group_timer);
+    pending_command.command = frame[14];
+    pending_command.fade_ms = (frame[12] << 8) | frame[13];
+    pending_command.len = frame[15];
+    memcpy(pending_command.data, frame + GROUP_HEADER_LENGTH, frame[15]);
+    esp_timer_start_once(group_timer, delay_us);
+    xSemaphoreGive(group_mutex);
+    LOG_RING("Group %d command %d runs in %d us", group, frame[14], (int32_t)delay_us);
+}
+
+static void handle_group_frame(const uint8_t* frame, int len, uint32_t addr)
+{
+    if (len < GROUP_HEADER_LENGTH || frame[15] > GROUP_MAX_DATA_LENGTH || len < GROUP_HEADER_LENGTH + frame[15]) {
+        return;
+    }
+    if (group_is_repeat(addr, frame[2])) {
+        return;
+    }
+    group_schedule(frame);
+}
+
+// Group command task
+// Runs each group command once its start time comes round
+void udp_control_group_task(void *Param)
+{
+    group_command_t command;
+    while(1) {
+        if (xQueueReceive(group_queue, &command, portMAX_DELAY) == pdTRUE && group_callback) {
+            group_callback(command.command, command.data, command.len, command.fade_ms);
+        }
+    }
+}
+
+static int open_udp_socket(uint16_t port)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    if (sock < 0) {
+        ESP_LOGI(TAG, "Unable to create socket: errno %d", errno);
+        return -1;
+    }
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        ESP_LOGI(TAG, "Socket unable to bind to port %d: errno %d", port, errno);
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Joins the E1.31 multicast group for the universe, 239.255.<hi>.<lo>
+// Fails until wifi is connected, so it is retried from the task loop
+static uint8_t join_e131_multicast(int sock, uint16_t old_universe, uint16_t universe)
+{
+    struct ip_mreq mreq;
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (old_universe != 0) {
+        mreq.imr_multiaddr.s_addr = htonl(0xEFFF0000 | old_universe);
+        setsockopt(sock, IPPROTO_IP, IP_DROP_MEMBERSHIP, &mreq, sizeof(mreq));
+    }
+    mreq.imr_multiaddr.s_addr = htonl(0xEFFF0000 | universe);
+    if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        return 0;
+    }
+    ESP_LOGI(TAG, "Joined E1.31 multicast group for universe %d", universe);
+    return 1;
+}
+
+// Sends a group command to every board, including this one
+// The start time is set delay_ms in the future so every board has time to
+// receive it, and the packet is sent a few times since multicast is lossy
+// Multicast loopback is off, so this board schedules its own copy directly
+#define GROUP_SEND_REPEATS 3
+
+void udp_control_send_group(uint8_t group, uint8_t command, const uint8_t* data, uint8_t len, uint16_t fade_ms, uint16_t delay_ms)
+{
+    static uint8_t send_sequence = 0;
+    static uint8_t sequence_seeded = 0;
+    uint8_t frame[GROUP_HEADER_LENGTH + GROUP_MAX_DATA_LENGTH];
+    if (len > GROUP_MAX_DATA_LENGTH) {
+        return;
+    }
+    // A board that restarts quickly would otherwise reuse the sequence
+    // numbers its last commands went out with, and be taken for a repeat
+    if (sequence_seeded == 0) {
+        send_sequence = esp_random();
+        sequence_seeded = 1;
+    }
+
+    uint64_t execute_at = 0;
+    if (schedule_time_synced()) {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        execute_at = (uint64_t)tv.tv_sec * 1000 + (tv.tv_usec / 1000) + delay_ms;
+    }
+    frame[0] = 'G';
+    frame[1] = 'C';
+    frame[2] = ++send_sequence;
+    frame[3] = group;
+    for (int i = 11; i >= 4; i--) {
+        frame[i] = execute_at & 0xFF;
+        execute_at >>= 8;
+    }
+    frame[12] = fade_ms >> 8;
+    frame[13] = fade_ms & 0xFF;
+    frame[14] = command;
+    frame[15] = len;
+    memcpy(frame + GROUP_HEADER_LENGTH, data, len);
+
+    group_schedule(frame);
+
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    if (sock < 0) {
+        ESP_LOGI(TAG, "Unable to create socket: errno %d", errno);
+        return;
+    }
+    // Make sure the copy isn't looped back and run a second time
+    uint8_t loop = 0;
+    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(UDP_CONTROL_GROUP_PORT),
+        .sin_addr.s_addr = inet_addr(UDP_CONTROL_GROUP_ADDR),
+    };
+    for (int i = 0; i < GROUP_SEND_REPEATS; i++) {
+        sendto(sock, frame, GROUP_HEADER_LENGTH + len, 0, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    close(sock);
+    ESP_LOGI(TAG, "Sent group %d command %d", group, command);
+}
+
+// Joins the multicast group used for group commands
+static uint8_t join_group_multicast(int sock)
+{
+    struct ip_mreq mreq;
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    mreq.imr_multiaddr.s_addr = inet_addr(UDP_CONTROL_GROUP_ADDR);
+    if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        return 0;
+    }
+    ESP_LOGI(TAG, "Joined group command multicast group");
+    return 1;
+}
+
+// UDP control task
+// Waits on all the sockets and handles frames as they arrive. The select
+// timeout also drives the hold-last-look timeout and multicast retries
+void udp_control_task(void *Param)
+{
+    ESP_LOGI(TAG, "UDP control task starting");
+    int artnet_sock = open_udp_socket(UDP_CONTROL_ARTNET_PORT);
+    int e131_sock = open_udp_socket(UDP_CONTROL_E131_PORT);
+    int group_sock = open_udp_socket(UDP_CONTROL_GROUP_PORT);
+    uint16_t joined_universe = 0;
+    uint8_t group_joined = 0;
+
+    while(1) {
+        if (rejoin_multicast == 1 && e131_sock >= 0) {
+            if (join_e131_multicast(e131_sock, joined_universe, dmx_universe)) {
+                joined_universe = dmx_universe;
+                rejoin_multicast = 0;
+            }
+        }
+        if (group_joined == 0 && group_sock >= 0) {
+            group_joined = join_group_multicast(group_sock);
+        }
+
+        fd_set read_fds;
+        FD_ZERO(&read_fds);
+        int max_fd = -1;
+        if (artnet_sock >= 0) {
+            FD_SET(artnet_sock, &read_fds);
+            max_fd = MAX(max_fd, artnet_sock);
+        }
+        if (e131_sock >= 0) {
+            FD_SET(e131_sock, &read_fds);
+            max_fd = MAX(max_fd, e131_sock);
+        }
+        if (group_sock >= 0) {
+            FD_SET(group_sock, &read_fds);
+            max_fd = MAX(max_fd, group_sock);
+        }
+        if (max_fd < 0) {
+            ESP_LOGI(TAG, "No sockets open. Stopping UDP control task");
+            vTaskDelete(NULL);
+        }
+
+        struct timeval timeout = {
+            .tv_sec = 0,
+            .tv_usec = 500000,
+        };
+        int ready = select(max_fd + 1, &read_fds, NULL, NULL, &timeout);
+
+        if (ready > 0 && artnet_sock >= 0 && FD_ISSET(artnet_sock, &read_fds)) {
+            int len = recv(artnet_sock, rx_buffer, sizeof(rx_buffer), 0);
+            if (len >= 2 && rx_buffer[0] == 'L' && rx_buffer[1] == 'C') {
+                handle_compact_frame(rx_buffer, len);
+            }
+            else if (len > 0) {
+                handle_artnet_frame(rx_buffer, len);
+            }
+        }
+        if (ready > 0 && e131_sock >= 0 && FD_ISSET(e131_sock, &read_fds)) {
+            int len = recv(e131_sock, rx_buffer, sizeof(rx_buffer), 0);
+            if (len > 0) {
+                handle_e131_frame(rx_buffer, len);
+            }
+        }
+        if (ready > 0 && group_sock >= 0 && FD_ISSET(group_sock, &read_fds)) {
+            struct sockaddr_in source;
+            socklen_t source_len = sizeof(source);
+            int len = recvfrom(group_sock, rx_buffer, sizeof(rx_buffer), 0, (struct sockaddr *)&source, &source_len);
+            if (len >= 2 && rx_buffer[0] == 'G' && rx_buffer[1] == 'C') {
+                handle_group_frame(rx_buffer, len, source.sin_addr.s_addr);
+            }
+        }
+
+        // Hold the last look, but hand control back once the sender goes quiet
+        if (live_active == 1 && (esp_timer_get_time() - last_frame_us) > (UDP_CONTROL_HOLD_TIMEOUT * 1000LL)) {
+            ESP_LOGI(TAG, "Live control timed out. Holding last look. %d frames, %d dropped", frames_received, frames_dropped);
+            LOG_RING("UDP live control ended. %d frames, %d dropped", frames_received, frames_dropped);
+            live_active = 0;
+            last_sequence = -1;
+            if (release_callback) {
+                release_callback(live_levels);
+            }
+        }
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef UDP_CONTROL_H_INCLUDED
+#define UDP_CONTROL_H_INCLUDED
+
+#include <stdint.h>
+
+// Ports for the live control listener
+// Art-Net and the compact frame share the Art-Net port
+#define UDP_CONTROL_ARTNET_PORT    6454
+#define UDP_CONTROL_E131_PORT      5568
+
+// Multicast group commands for a whole fleet of controllers
+#define UDP_CONTROL_GROUP_ADDR     "239.255.76.67"
+#define UDP_CONTROL_GROUP_PORT     6455
+#define UDP_CONTROL_MAX_GROUPS     16
+
+// Group commands
+#define GROUP_COMMAND_SCENE        0 // Data is a scene name
+#define GROUP_COMMAND_LEVELS       1 // Data is 4 brightness levels
+
+// How far ahead a relayed group command is scheduled so every board gets it first
+#define UDP_CONTROL_GROUP_DELAY    300 // In ms
+
+// If no frames arrive for this long, live control ends and the last look is kept
+#define UDP_CONTROL_HOLD_TIMEOUT   2500 // In ms
+
+// Called once when live control times out with the levels that are being held
+typedef void (*udp_control_release_cb_t)(const uint8_t* levels);
+
+// Called when a group command for this device is due, from the group command task
+typedef void (*udp_control_group_cb_t)(uint8_t command, const uint8_t* data, uint8_t len, uint16_t fade_ms);
+
+void udp_control_init(uint16_t universe, uint16_t start_address, udp_control_release_cb_t release_cb);
+void udp_control_init_groups(uint16_t groups, udp_control_group_cb_t group_cb);
+void udp_control_set_groups(uint16_t groups);
+void udp_control_send_group(uint8_t group, uint8_t command, const uint8_t* data, uint8_t len, uint16_t fade_ms, uint16_t delay_ms);
+void udp_control_set_address(uint16_t universe, uint16_t start_address);
+uint8_t udp_control_active(void);
+void udp_control_task(void *Param);
+void udp_control_group_task(void *Param);
+
+#endif
@@ -0,0 +1,64 @@
+#include <string.h>
+#include <esp_wifi.h>
+
+#include "wifi_fast.h"
+
+// The decision logic is kept free of any Wi-Fi calls so it only depends on
+// the cache and the sequence of connect events
+
+// A directed attempt is only worth trying if the cache has a real channel
+wifi_fast_mode_t wifi_fast_first_mode(const wifi_fast_cache_t* cache)
+{
+    if (cache->valid && cache->channel >= 1 && cache->channel <= 14) {
+        return WIFI_FAST_DIRECTED;
+    }
+    return WIFI_FAST_FULL_SCAN;
+}
+
+// Returns the mode for the next attempt after a failed one
+// failures counts the failed attempts in the current mode
+wifi_fast_mode_t wifi_fast_after_failure(wifi_fast_mode_t mode, uint8_t failures, uint8_t reason)
+{
+    if (mode == WIFI_FAST_FULL_SCAN) {
+        return WIFI_FAST_FULL_SCAN;
+    }
+    // The AP moved channel or was replaced rather than just being busy,
+    // so there's no point trying it again
+    if (reason == WIFI_REASON_NO_AP_FOUND || reason == WIFI_REASON_AUTH_FAIL) {
+        return WIFI_FAST_FULL_SCAN;
+    }
+    if (failures >= WIFI_FAST_DIRECTED_TRIES) {
+        return WIFI_FAST_FULL_SCAN;
+    }
+    return WIFI_FAST_DIRECTED;
+}
+
+// Fills in the scan fields of the station config for the given mode
+void wifi_fast_apply(wifi_sta_config_t* config, const wifi_fast_cache_t* cache, wifi_fast_mode_t mode)
+{
+    if (mode == WIFI_FAST_DIRECTED) {
+        config->scan_method = WIFI_FAST_SCAN;
+        config->bssid_set = 1;
+        memcpy(config->bssid, cache->bssid, sizeof(config->bssid));
+        config->channel = cache->channel;
+    }
+    else {
+        config->scan_method = WIFI_ALL_CHANNEL_SCAN;
+        config->bssid_set = 0;
+        memset(config->bssid, 0, sizeof(config->bssid));
+        config->channel = 0;
+    }
+}
+
+// Records the AP of a successful connection
+// Returns 1 if the cache changed and needs saving, so NVS is only written when roaming
+uint8_t wifi_fast_update_cache(wifi_fast_cache_t* cache, const uint8_t* bssid, uint8_t channel)
+{
+    if (cache->valid && cache->channel == channel && memcmp(cache->bssid, bssid, sizeof(cache->bssid)) == 0) {
+        return 0;
+    }
+    cache->valid = 1;
+    cache->channel = channel;
+    memcpy(cache->bssid, bssid, sizeof(cache->bssid));
+    return 1;
+}
@@ -0,0 +1,41 @@
+#ifndef WIFI_FAST_H_INCLUDED
+#define WIFI_FAST_H_INCLUDED
+
+#include <stdint.h>
+#include <esp_wifi.h>
+
+// Directed attempts at the cached AP before falling back to a full scan
+#define WIFI_FAST_DIRECTED_TRIES   2
+
+// The AP that the last successful connection used
+// Saved in NVS so the next boot can skip the all-channel scan
+typedef struct
+{
+  uint8_t valid;
+  uint8_t channel;
+  uint8_t bssid[6];
+} wifi_fast_cache_t;
+
+// Optional static IP so the station doesn't have to wait for DHCP
+// Addresses are in network byte order, the same as esp_ip4_addr_t
+typedef struct
+{
+  uint8_t enabled;
+  uint32_t ip;
+  uint32_t netmask;
+  uint32_t gateway;
+  uint32_t dns;
+} wifi_static_ip_t;
+
+typedef enum
+{
+  WIFI_FAST_DIRECTED,  // Connect straight to the cached BSSID on the cached channel
+  WIFI_FAST_FULL_SCAN, // Scan every channel and pick the strongest AP
+} wifi_fast_mode_t;
+
+wifi_fast_mode_t wifi_fast_first_mode(const wifi_fast_cache_t* cache);
+wifi_fast_mode_t wifi_fast_after_failure(wifi_fast_mode_t mode, uint8_t failures, uint8_t reason);
+void wifi_fast_apply(wifi_sta_config_t* config, const wifi_fast_cache_t* cache, wifi_fast_mode_t mode);
+uint8_t wifi_fast_update_cache(wifi_fast_cache_t* cache, const uint8_t* bssid, uint8_t channel);
+
+#endif
@@ -0,0 +1,30 @@
+#include "wifi_link.h"
+
+// Decides when the softAP comes and goes. Only ever adds or removes the
+// softAP next to the station, so the Wifi driver and the webserver keep
+// running through every change. Kept free of any Wifi calls like wifi_fast.c
+
+wifi_link_action_t wifi_link_next(const wifi_link_state_t* state)
+{
+    if (state->mode == WIFI_LINK_STA) {
+        // Nothing to connect to, or the station has had its chance
+        if (!state->sta_connected && (!state->has_credentials || state->sta_gave_up
+            || state->sta_ms >= WIFI_LINK_CONNECT_WAIT_MS)) {
+            return WIFI_LINK_START_AP;
+        }
+        return WIFI_LINK_NONE;
+    }
+
+    // Leave the softAP alone while anyone is using it. A station scan or a
+    // connect on another channel would move the softAP and drop them
+    if (state->ap_stations > 0) {
+        return WIFI_LINK_NONE;
+    }
+    if (state->sta_connected) {
+        return state->sta_ms >= WIFI_LINK_AP_LINGER_MS ? WIFI_LINK_STOP_AP : WIFI_LINK_NONE;
+    }
+    if (state->has_credentials && state->sta_ms >= WIFI_LINK_RETRY_MS) {
+        return WIFI_LINK_RETRY_STA;
+    }
+    return WIFI_LINK_NONE;
+}
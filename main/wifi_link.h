@@ -0,0 +1,40 @@
+#ifndef WIFI_LINK_H_INCLUDED
+#define WIFI_LINK_H_INCLUDED
+
+#include <stdint.h>
+
+// Time the station gets to connect before the softAP is brought up
+#define WIFI_LINK_CONNECT_WAIT_MS  15000
+// How often the station is retried while the softAP is up
+#define WIFI_LINK_RETRY_MS         60000
+// How long the softAP stays up once the station is connected, so whoever
+// used it to set up the Wifi can see the new address
+#define WIFI_LINK_AP_LINGER_MS     60000
+
+typedef enum
+{
+  WIFI_LINK_STA,   // Station only
+  WIFI_LINK_APSTA, // softAP running alongside the station
+} wifi_link_mode_t;
+
+typedef enum
+{
+  WIFI_LINK_NONE,
+  WIFI_LINK_START_AP,  // Bring the softAP up next to the station
+  WIFI_LINK_RETRY_STA, // Try the station again, leaving the softAP up
+  WIFI_LINK_STOP_AP,   // The station is connected and nobody is on the softAP
+} wifi_link_action_t;
+
+typedef struct
+{
+  wifi_link_mode_t mode;
+  uint8_t has_credentials;
+  uint8_t sta_connected;   // The station has an IP
+  uint8_t sta_gave_up;     // The station used up its retries
+  uint8_t ap_stations;     // Devices connected to the softAP
+  uint32_t sta_ms;         // Time since the station connected, lost its connection or was retried
+} wifi_link_state_t;
+
+wifi_link_action_t wifi_link_next(const wifi_link_state_t* state);
+
+#endif
@@ -0,0 +1,167 @@
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "idf_host.h"
+#include "fake_clock.h"
+
+#define HOST_MAX_TIMERS 32
+
+struct esp_timer
+{
+  esp_timer_cb_t callback;
+  void* arg;
+  uint8_t active;
+  int64_t expires_us;
+  int64_t period_us;
+};
+
+static struct esp_timer timers[HOST_MAX_TIMERS];
+static int timer_count = 0;
+static int64_t now_us = 0;
+static int64_t wall_base_s = 0;
+static uint32_t timer_fires = 0;
+static void (*settle_fn)(void) = NULL;
+static pthread_mutex_t clock_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int64_t esp_timer_get_time(void)
+{
+    pthread_mutex_lock(&clock_lock);
+    int64_t now = now_us;
+    pthread_mutex_unlock(&clock_lock);
+    return now;
+}
+
+int64_t host_clock_now(void)
+{
+    return esp_timer_get_time();
+}
+
+void host_clock_set_wall(int64_t epoch_s)
+{
+    pthread_mutex_lock(&clock_lock);
+    wall_base_s = epoch_s == 0 ? 0 : epoch_s - (now_us / 1000000);
+    pthread_mutex_unlock(&clock_lock);
+}
+
+void host_clock_set_settle(void (*settle)(void))
+{
+    settle_fn = settle;
+}
+
+uint32_t host_clock_timer_fires(void)
+{
+    return timer_fires;
+}
+
+// These replace the C library's, so schedule.c and udp_control.c see the virtual wall clock
+time_t time(time_t* out)
+{
+    time_t t = (time_t)(wall_base_s + (esp_timer_get_time() / 1000000));
+    if (out) {
+        *out = t;
+    }
+    return t;
+}
+
+int gettimeofday(struct timeval* tv, void* tz)
+{
+    int64_t now = esp_timer_get_time();
+    tv->tv_sec = (time_t)(wall_base_s + (now / 1000000));
+    tv->tv_usec = (suseconds_t)(now % 1000000);
+    return 0;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* args, esp_timer_handle_t* handle)
+{
+    pthread_mutex_lock(&clock_lock);
+    if (timer_count >= HOST_MAX_TIMERS) {
+        pthread_mutex_unlock(&clock_lock);
+        return ESP_ERR_NO_MEM;
+    }
+    struct esp_timer* timer = &timers[timer_count++];
+    timer->callback = args->callback;
+    timer->arg = args->arg;
+    timer->active = 0;
+    *handle = timer;
+    pthread_mutex_unlock(&clock_lock);
+    return ESP_OK;
+}
+
+// Same rules as the IDF: starting a running timer or stopping a stopped one is an error
+static esp_err_t timer_start(esp_timer_handle_t timer, uint64_t timeout_us, int64_t period_us)
+{
+    pthread_mutex_lock(&clock_lock);
+    if (timer->active) {
+        pthread_mutex_unlock(&clock_lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->active = 1;
+    timer->expires_us = now_us + (int64_t)timeout_us;
+    timer->period_us = period_us;
+    pthread_mutex_unlock(&clock_lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    return timer_start(timer, timeout_us, 0);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us)
+{
+    return timer_start(timer, period_us, (int64_t)period_us);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    pthread_mutex_lock(&clock_lock);
+    esp_err_t err = timer->active ? ESP_OK : ESP_ERR_INVALID_STATE;
+    timer->active = 0;
+    pthread_mutex_unlock(&clock_lock);
+    return err;
+}
+
+uint8_t host_clock_step(int64_t limit_us)
+{
+    pthread_mutex_lock(&clock_lock);
+    struct esp_timer* next = NULL;
+    for (int i = 0; i < timer_count; i++) {
+        if (timers[i].active && timers[i].expires_us <= limit_us && (next == NULL || timers[i].expires_us < next->expires_us)) {
+            next = &timers[i];
+        }
+    }
+    if (next == NULL) {
+        pthread_mutex_unlock(&clock_lock);
+        return 0;
+    }
+    if (next->expires_us > now_us) {
+        now_us = next->expires_us;
+    }
+    if (next->period_us > 0) {
+        next->expires_us += next->period_us;
+    }
+    else {
+        next->active = 0;
+    }
+    timer_fires++;
+    pthread_mutex_unlock(&clock_lock);
+
+    next->callback(next->arg);
+    if (settle_fn) {
+        settle_fn();
+    }
+    return 1;
+}
+
+void host_clock_advance(int64_t us)
+{
+    int64_t target = esp_timer_get_time() + us;
+    while (host_clock_step(target)) {
+    }
+    pthread_mutex_lock(&clock_lock);
+    if (target > now_us) {
+        now_us = target;
+    }
+    pthread_mutex_unlock(&clock_lock);
+}
@@ -0,0 +1,25 @@
+#ifndef FAKE_CLOCK_H_INCLUDED
+#define FAKE_CLOCK_H_INCLUDED
+
+#include <stdint.h>
+
+// Virtual clock behind esp_timer_get_time, the esp_timer API, time() and
+// gettimeofday(). It only moves when a test advances it, and esp_timer
+// callbacks run from host_clock_advance in expiry order, the way the
+// esp_timer task runs them on the device
+
+// Moves the clock forward, firing every timer that expires on the way
+void host_clock_advance(int64_t us);
+// Moves the clock to the next timer expiry, if it is no later than limit_us,
+// and fires it. Returns 0 if nothing was due by then
+uint8_t host_clock_step(int64_t limit_us);
+int64_t host_clock_now(void);
+// Sets the wall clock seen by time() and gettimeofday(). 0 means not synced
+void host_clock_set_wall(int64_t epoch_s);
+// Called after every timer callback, so a test can let other threads
+// catch up before time moves on
+void host_clock_set_settle(void (*settle)(void));
+// Number of esp_timer callbacks run so far
+uint32_t host_clock_timer_fires(void);
+
+#endif
@@ -0,0 +1,360 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "idf_host.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "fake_freertos.h"
+#include "fake_clock.h"
+
+#define HOST_MAX_TASKS    16
+#define HOST_MAX_ALLOWED  8
+
+typedef struct host_task
+{
+  char name[configMAX_TASK_NAME_LEN];
+  TaskFunction_t fn;
+  void* param;
+  pthread_t thread;
+  uint8_t started;
+  uint32_t notify;
+  pthread_cond_t notify_cond;
+} host_task_t;
+
+typedef struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  uint8_t* storage;
+  UBaseType_t item_size;
+  UBaseType_t length;
+  UBaseType_t head;
+  UBaseType_t count;
+  int receivers_waiting;
+} host_queue_t;
+
+static host_task_t tasks[HOST_MAX_TASKS];
+static int task_count = 0;
+static host_task_t main_task = { .name = "main" };
+static const char* allowed[HOST_MAX_ALLOWED];
+static int allowed_count = 0;
+static pthread_mutex_t task_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t critical_lock;
+static pthread_once_t critical_once = PTHREAD_ONCE_INIT;
+static __thread host_task_t* current_task = NULL;
+static void (*delay_hook)(TickType_t ticks) = NULL;
+
+void host_task_allow(const char* name)
+{
+    if (allowed_count < HOST_MAX_ALLOWED) {
+        allowed[allowed_count++] = name;
+    }
+}
+
+int host_task_created(const char* name)
+{
+    int created = 0;
+    pthread_mutex_lock(&task_lock);
+    for (int i = 0; i < task_count; i++) {
+        if (strcmp(tasks[i].name, name) == 0) {
+            created++;
+        }
+    }
+    pthread_mutex_unlock(&task_lock);
+    return created;
+}
+
+void host_task_set_delay_hook(void (*hook)(TickType_t ticks))
+{
+    delay_hook = hook;
+}
+
+int64_t host_task_cpu_us(const char* name)
+{
+    int64_t cpu_us = -1;
+    pthread_mutex_lock(&task_lock);
+    for (int i = 0; i < task_count; i++) {
+        clockid_t clock;
+        struct timespec ts;
+        // Names are cut to fit, as FreeRTOS does
+        if (strncmp(tasks[i].name, name, sizeof(tasks[i].name) - 1) == 0 && tasks[i].started &&
+            pthread_getcpuclockid(tasks[i].thread, &clock) == 0 && clock_gettime(clock, &ts) == 0) {
+            cpu_us = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&task_lock);
+    return cpu_us;
+}
+
+static void* task_entry(void* arg)
+{
+    host_task_t* task = arg;
+    current_task = task;
+    task->fn(task->param);
+    return NULL;
+}
+
+TaskHandle_t xTaskCreateStatic(TaskFunction_t fn, const char* name, uint32_t stack_depth, void* param, UBaseType_t priority, StackType_t* stack, StaticTask_t* tcb)
+{
+    pthread_mutex_lock(&task_lock);
+    if (task_count >= HOST_MAX_TASKS) {
+        pthread_mutex_unlock(&task_lock);
+        return NULL;
+    }
+    host_task_t* task = &tasks[task_count++];
+    snprintf(task->name, sizeof(task->name), "%s", name);
+    task->fn = fn;
+    task->param = param;
+    pthread_cond_init(&task->notify_cond, NULL);
+    uint8_t start = 0;
+    for (int i = 0; i < allowed_count; i++) {
+        if (strcmp(allowed[i], name) == 0) {
+            start = 1;
+        }
+    }
+    pthread_mutex_unlock(&task_lock);
+    if (start) {
+        pthread_create(&task->thread, NULL, task_entry, task);
+        pthread_detach(task->thread);
+        pthread_mutex_lock(&task_lock);
+        task->started = 1;
+        pthread_mutex_unlock(&task_lock);
+    }
+    return task;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char* name, uint32_t stack_depth, void* param, UBaseType_t priority, TaskHandle_t* handle)
+{
+    TaskHandle_t task = xTaskCreateStatic(fn, name, stack_depth, param, priority, NULL, NULL);
+    if (handle) {
+        *handle = task;
+    }
+    return task ? pdPASS : pdFALSE;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    if (task == NULL && current_task != NULL) {
+        pthread_exit(NULL);
+    }
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return current_task ? current_task : &main_task;
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return (TickType_t)(esp_timer_get_time() / 1000);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    if (delay_hook) {
+        delay_hook(ticks);
+    }
+    else {
+        sched_yield();
+    }
+}
+
+void vTaskDelayUntil(TickType_t* last_wake, TickType_t ticks)
+{
+    *last_wake += ticks;
+    vTaskDelay(ticks);
+}
+
+UBaseType_t uxTaskGetNumberOfTasks(void)
+{
+    return task_count;
+}
+
+UBaseType_t uxTaskGetSystemState(TaskStatus_t* status, UBaseType_t size, uint32_t* total_run_time)
+{
+    if (total_run_time) {
+        *total_run_time = 0;
+    }
+    return 0;
+}
+
+// Task notifications, as a counting semaphore per task
+BaseType_t xTaskNotifyGive(TaskHandle_t handle)
+{
+    host_task_t* task = handle;
+    pthread_mutex_lock(&task_lock);
+    task->notify++;
+    pthread_cond_broadcast(&task->notify_cond);
+    pthread_mutex_unlock(&task_lock);
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+    host_task_t* task = xTaskGetCurrentTaskHandle();
+    pthread_mutex_lock(&task_lock);
+    if (task->notify == 0 && ticks == portMAX_DELAY) {
+        while (task->notify == 0) {
+            pthread_cond_wait(&task->notify_cond, &task_lock);
+        }
+    }
+    uint32_t value = task->notify;
+    if (value > 0) {
+        task->notify = clear ? 0 : value - 1;
+    }
+    pthread_mutex_unlock(&task_lock);
+    if (value == 0 && ticks != portMAX_DELAY) {
+        vTaskDelay(ticks);
+    }
+    return value;
+}
+
+// Critical sections share one recursive lock, which is enough to keep the
+// spinlock-protected state in the firmware consistent between threads
+static void critical_init(void)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&critical_lock, &attr);
+}
+
+void portENTER_CRITICAL(portMUX_TYPE* mux)
+{
+    pthread_once(&critical_once, critical_init);
+    pthread_mutex_lock(&critical_lock);
+}
+
+void portEXIT_CRITICAL(portMUX_TYPE* mux)
+{
+    pthread_mutex_unlock(&critical_lock);
+}
+
+// Error checking mutexes, so a task taking a mutex it already holds stops
+// the test with a message instead of hanging it like it would the device
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    pthread_mutex_t* mutex = malloc(sizeof(pthread_mutex_t));
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
+    pthread_mutex_init(mutex, &attr);
+    return mutex;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t* buffer)
+{
+    return xSemaphoreCreateMutex();
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    if (ticks == portMAX_DELAY) {
+        if (pthread_mutex_lock(sem) == EDEADLK) {
+            printf("Deadlock: %s took a mutex it already holds\n", ((host_task_t*)xTaskGetCurrentTaskHandle())->name);
+            abort();
+        }
+        return pdTRUE;
+    }
+    return pthread_mutex_trylock(sem) == 0 ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    pthread_mutex_unlock(sem);
+    return pdTRUE;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    host_queue_t* queue = calloc(1, sizeof(host_queue_t));
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->changed, NULL);
+    queue->storage = malloc(length * item_size);
+    queue->length = length;
+    queue->item_size = item_size;
+    return queue;
+}
+
+QueueHandle_t xQueueCreateStatic(UBaseType_t length, UBaseType_t item_size, uint8_t* storage, StaticQueue_t* buffer)
+{
+    return xQueueCreate(length, item_size);
+}
+
+BaseType_t xQueueSend(QueueHandle_t handle, const void* item, TickType_t ticks)
+{
+    host_queue_t* queue = handle;
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->length && ticks == portMAX_DELAY) {
+        pthread_cond_wait(&queue->changed, &queue->lock);
+    }
+    if (queue->count == queue->length) {
+        pthread_mutex_unlock(&queue->lock);
+        return pdFALSE;
+    }
+    UBaseType_t tail = (queue->head + queue->count) % queue->length;
+    memcpy(queue->storage + (tail * queue->item_size), item, queue->item_size);
+    queue->count++;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+    return pdTRUE;
+}
+
+BaseType_t xQueueSendFromISR(QueueHandle_t queue, const void* item, BaseType_t* task_woken)
+{
+    if (task_woken) {
+        *task_woken = pdFALSE;
+    }
+    return xQueueSend(queue, item, 0);
+}
+
+BaseType_t xQueueOverwrite(QueueHandle_t handle, const void* item)
+{
+    host_queue_t* queue = handle;
+    pthread_mutex_lock(&queue->lock);
+    queue->head = 0;
+    queue->count = 0;
+    pthread_mutex_unlock(&queue->lock);
+    return xQueueSend(handle, item, 0);
+}
+
+// A finite timeout doesn't wait, since nothing else moves the virtual clock
+// while a task is blocked
+BaseType_t xQueueReceive(QueueHandle_t handle, void* item, TickType_t ticks)
+{
+    host_queue_t* queue = handle;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count == 0 && ticks == portMAX_DELAY) {
+        queue->receivers_waiting++;
+        pthread_cond_broadcast(&queue->changed);
+        while (queue->count == 0) {
+            pthread_cond_wait(&queue->changed, &queue->lock);
+        }
+        queue->receivers_waiting--;
+    }
+    if (queue->count == 0) {
+        pthread_mutex_unlock(&queue->lock);
+        return pdFALSE;
+    }
+    memcpy(item, queue->storage + (queue->head * queue->item_size), queue->item_size);
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+    return pdTRUE;
+}
+
+void host_queue_wait_idle(QueueHandle_t handle)
+{
+    host_queue_t* queue = handle;
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count > 0 || queue->receivers_waiting == 0) {
+        pthread_cond_wait(&queue->changed, &queue->lock);
+    }
+    pthread_mutex_unlock(&queue->lock);
+}
@@ -0,0 +1,25 @@
+#ifndef FAKE_FREERTOS_H_INCLUDED
+#define FAKE_FREERTOS_H_INCLUDED
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+// FreeRTOS on pthreads. Mutexes and queues block for real, and ticks are
+// 1 ms of the virtual clock. xTaskCreateStatic only starts a task as a
+// thread if the test asked for it by name, so a test can include main.c
+// and run just the tasks it is about
+
+void host_task_allow(const char* name);
+// Number of tasks created with this name, started or not
+int host_task_created(const char* name);
+// Waits until the queue is empty and a task is blocked receiving from it
+void host_queue_wait_idle(QueueHandle_t queue);
+// Called from vTaskDelay and vTaskDelayUntil with the ticks asked for
+// Without a hook the delay just yields
+void host_task_set_delay_hook(void (*hook)(TickType_t ticks));
+// CPU time the thread of a started task has used on this host, or -1 if
+// no task with the name was started
+int64_t host_task_cpu_us(const char* name);
+
+#endif
@@ -0,0 +1,228 @@
+#include "idf_host.h"
+#include "esp_http_server.h"
+#include "fake_httpd.h"
+#include "fake_clock.h"
+
+#define HOST_MAX_URI_HANDLERS 32
+
+typedef struct
+{
+  const char* body;
+  size_t body_len;
+  size_t received;
+  const host_http_client_t* client;
+  host_http_response_t* response;
+} host_req_t;
+
+host_httpd_t host_httpd;
+
+static httpd_uri_t uri_handlers[HOST_MAX_URI_HANDLERS];
+static int uri_handler_count = 0;
+static int server_token;
+
+esp_err_t httpd_start(httpd_handle_t* handle, const httpd_config_t* config)
+{
+    host_httpd.start++;
+    host_httpd.config = *config;
+    *handle = &server_token;
+    return ESP_OK;
+}
+
+esp_err_t httpd_stop(httpd_handle_t handle)
+{
+    host_httpd.stop++;
+    uri_handler_count = 0;
+    return ESP_OK;
+}
+
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t* uri)
+{
+    if (uri_handler_count >= host_httpd.config.max_uri_handlers || uri_handler_count == HOST_MAX_URI_HANDLERS) {
+        host_httpd.register_failures++;
+        return ESP_ERR_NO_MEM;
+    }
+    uri_handlers[uri_handler_count++] = *uri;
+    host_httpd.handlers = uri_handler_count;
+    return ESP_OK;
+}
+
+// The IDF's matcher: a trailing * matches anything after it, and a ? makes
+// the character before it optional
+bool httpd_uri_match_wildcard(const char* template, const char* uri, size_t len)
+{
+    size_t tpl_len = strlen(template);
+    char last = tpl_len > 0 ? template[tpl_len - 1] : 0;
+    char prevlast = tpl_len > 1 ? template[tpl_len - 2] : 0;
+    bool asterisk = last == '*' || (prevlast == '*' && last == '?');
+    bool quest = last == '?' || (prevlast == '?' && last == '*');
+    if (tpl_len < (size_t)(asterisk + quest * 2)) {
+        return false;
+    }
+    size_t exact = tpl_len - (asterisk + quest * 2);
+    if (len < exact) {
+        return false;
+    }
+    if (!quest) {
+        if (!asterisk && len != exact) {
+            return false;
+        }
+        return strncmp(template, uri, exact) == 0;
+    }
+    if (len > exact && template[exact] != uri[exact]) {
+        return false;
+    }
+    if (strncmp(template, uri, exact) != 0) {
+        return false;
+    }
+    return asterisk || len <= exact + 1;
+}
+
+static void response_append(host_http_response_t* response, const char* data, size_t len)
+{
+    response->body = realloc(response->body, response->body_len + len + 1);
+    memcpy(response->body + response->body_len, data, len);
+    response->body_len += len;
+    response->body[response->body_len] = '\0';
+}
+
+void host_httpd_request(httpd_method_t method, const char* uri, const char* body, size_t body_len,
+    const host_http_client_t* client, host_http_response_t* response)
+{
+    static const host_http_client_t plain_client = {0};
+    memset(response, 0, sizeof(*response));
+    strcpy(response->status, HTTPD_200);
+    response_append(response, "", 0);
+
+    host_req_t host_req = {
+        .body = body,
+        .body_len = body_len,
+        .client = client ? client : &plain_client,
+        .response = response,
+    };
+    httpd_req_t req = {0};
+    snprintf((char*)req.uri, sizeof(req.uri), "%s", uri);
+    req.method = method;
+    req.content_len = body_len;
+    req.aux = &host_req;
+
+    size_t uri_len = strcspn(uri, "?");
+    for (int i = 0; i < uri_handler_count; i++) {
+        httpd_uri_match_func_t match = host_httpd.config.uri_match_fn;
+        uint8_t matched = match ? match(uri_handlers[i].uri, uri, uri_len)
+            : (strlen(uri_handlers[i].uri) == uri_len && strncmp(uri_handlers[i].uri, uri, uri_len) == 0);
+        if (matched && uri_handlers[i].method == method) {
+            req.user_ctx = uri_handlers[i].user_ctx;
+            response->matched = 1;
+            response->result = uri_handlers[i].handler(&req);
+            return;
+        }
+    }
+    strcpy(response->status, HTTPD_404);
+}
+
+void host_httpd_response_free(host_http_response_t* response)
+{
+    free(response->body);
+    response->body = NULL;
+}
+
+int httpd_req_recv(httpd_req_t* req, char* buf, size_t len)
+{
+    host_req_t* host_req = req->aux;
+    const host_http_client_t* client = host_req->client;
+    size_t remaining = host_req->body_len - host_req->received;
+    if (client->stall_after && host_req->received >= client->stall_after) {
+        // Nothing more arrives, so the recv times out like the socket would
+        host_clock_advance((int64_t)host_httpd.config.recv_wait_timeout * 1000000);
+        return HTTPD_SOCK_ERR_TIMEOUT;
+    }
+    size_t n = len < remaining ? len : remaining;
+    if (client->recv_chunk && n > client->recv_chunk) {
+        n = client->recv_chunk;
+    }
+    if (client->stall_after && host_req->received + n > client->stall_after) {
+        n = client->stall_after - host_req->received;
+    }
+    memcpy(buf, host_req->body + host_req->received, n);
+    host_req->received += n;
+    if (client->recv_us_per_kb) {
+        host_clock_advance((client->recv_us_per_kb * (int64_t)n) / 1024);
+    }
+    return (int)n;
+}
+
+size_t httpd_req_get_hdr_value_len(httpd_req_t* req, const char* field)
+{
+    host_req_t* host_req = req->aux;
+    if (strcmp(field, "Authorization") == 0 && host_req->client->authorization) {
+        return strlen(host_req->client->authorization);
+    }
+    return 0;
+}
+
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t* req, const char* field, char* val, size_t val_size)
+{
+    host_req_t* host_req = req->aux;
+    if (strcmp(field, "Authorization") != 0 || host_req->client->authorization == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    snprintf(val, val_size, "%s", host_req->client->authorization);
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_status(httpd_req_t* req, const char* status)
+{
+    host_req_t* host_req = req->aux;
+    snprintf(host_req->response->status, sizeof(host_req->response->status), "%s", status);
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t* req, const char* type)
+{
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_hdr(httpd_req_t* req, const char* field, const char* value)
+{
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send(httpd_req_t* req, const char* buf, ssize_t len)
+{
+    host_req_t* host_req = req->aux;
+    if (buf) {
+        response_append(host_req->response, buf, len == HTTPD_RESP_USE_STRLEN ? strlen(buf) : (size_t)len);
+    }
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_chunk(httpd_req_t* req, const char* buf, ssize_t len)
+{
+    return httpd_resp_send(req, buf, len);
+}
+
+esp_err_t httpd_resp_send_err(httpd_req_t* req, httpd_err_code_t error, const char* message)
+{
+    static const char* statuses[] = {
+        [HTTPD_500_INTERNAL_SERVER_ERROR] = HTTPD_500,
+        [HTTPD_400_BAD_REQUEST] = HTTPD_400,
+        [HTTPD_404_NOT_FOUND] = HTTPD_404,
+        [HTTPD_405_METHOD_NOT_ALLOWED] = "405 Method Not Allowed",
+        [HTTPD_408_REQ_TIMEOUT] = HTTPD_408,
+        [HTTPD_411_LENGTH_REQUIRED] = "411 Length Required",
+        [HTTPD_414_URI_TOO_LONG] = "414 URI Too Long",
+        [HTTPD_431_REQ_HDR_FIELDS_TOO_LARGE] = "431 Request Header Fields Too Large",
+    };
+    httpd_resp_set_status(req, statuses[error]);
+    return httpd_resp_send(req, message, HTTPD_RESP_USE_STRLEN);
+}
+
+esp_err_t httpd_resp_send_408(httpd_req_t* req)
+{
+    return httpd_resp_send_err(req, HTTPD_408_REQ_TIMEOUT, "Request Timeout");
+}
+
+esp_err_t httpd_resp_send_404(httpd_req_t* req)
+{
+    return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Not Found");
+}
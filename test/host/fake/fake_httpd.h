@@ -0,0 +1,43 @@
+#ifndef FAKE_HTTPD_H_INCLUDED
+#define FAKE_HTTPD_H_INCLUDED
+
+#include <stdint.h>
+#include "esp_http_server.h"
+
+// esp_http_server without the sockets. Handlers are kept as registered and
+// host_httpd_request runs one request through the matching handler on the
+// calling thread, like the httpd task does on the device
+
+typedef struct
+{
+  int start;
+  int stop;
+  int handlers;
+  int register_failures;   // Handlers that didn't fit in max_uri_handlers
+  httpd_config_t config;
+} host_httpd_t;
+
+extern host_httpd_t host_httpd;
+
+typedef struct
+{
+  const char* authorization;     // Authorization header, or NULL
+  size_t recv_chunk;             // Most bytes one httpd_req_recv returns. 0 is no limit
+  size_t stall_after;            // The client stops sending after this many bytes. 0 never stalls
+  int64_t recv_us_per_kb;        // Virtual time each received KB takes on the wire
+} host_http_client_t;
+
+typedef struct
+{
+  esp_err_t result;   // What the handler returned
+  char status[40];
+  char* body;         // Null terminated. Freed by host_httpd_response_free
+  size_t body_len;
+  uint8_t matched;    // A handler was found for the URI
+} host_http_response_t;
+
+void host_httpd_request(httpd_method_t method, const char* uri, const char* body, size_t body_len,
+    const host_http_client_t* client, host_http_response_t* response);
+void host_httpd_response_free(host_http_response_t* response);
+
+#endif
@@ -0,0 +1,576 @@
+#include <pthread.h>
+#include <sys/param.h>
+
+#include "idf_host.h"
+#include "driver/ledc.h"
+#include "esp_timer.h"
+#include "fake_ledc.h"
+
+// Limits of the ESP32-C3 fader, as in the IDF's ledc.c
+#define LEDC_CLK_HZ          (80000000)
+#define LEDC_STEP_NUM_MAX    (1023)
+#define LEDC_DUTY_NUM_MAX    (1023)
+#define LEDC_DUTY_SCALE_MAX  (1023)
+
+#define HOST_LEDC_TRACE_MAX  4096
+
+// One fade as the hardware runs it: the duty starts at duty and moves by
+// scale every cycle_num PWM cycles, step_num times. A duty set with no
+// fade is a segment with no steps
+typedef struct
+{
+  int64_t start_us;
+  int64_t end_us;       // The last step lands here, or earlier if stopped
+  uint32_t duty;
+  int8_t dir;
+  uint16_t step_num;
+  uint16_t cycle_num;
+  uint16_t scale;
+  uint32_t period_ns;
+} ledc_segment_t;
+
+typedef struct
+{
+  uint8_t configured;
+  ledc_timer_t timer;
+  ledc_cb_t cb;
+  void* cb_arg;
+  esp_timer_handle_t end_timer;  // Stands in for the fade end interrupt
+  uint32_t duty;                 // The output when no fade is running
+  uint32_t target;               // Where the driver leaves the channel at the fade end
+  uint8_t programmed;            // set holds a fade for ledc_fade_start
+  ledc_segment_t set;
+  uint8_t fading;
+  ledc_segment_t run;
+  ledc_segment_t trace[HOST_LEDC_TRACE_MAX];
+  int trace_count;
+} sim_channel_t;
+
+host_ledc_t host_ledc;
+
+static uint32_t timer_freq_hz[LEDC_TIMER_MAX];
+static uint8_t timer_duty_res[LEDC_TIMER_MAX];
+static sim_channel_t sim[LEDC_CHANNEL_MAX];
+static pthread_mutex_t ledc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void fade_end_timer_cb(void* arg);
+
+static uint32_t channel_period_ns(sim_channel_t* ch)
+{
+    return 1000000000UL / timer_freq_hz[ch->timer];
+}
+
+static uint32_t channel_max_duty(sim_channel_t* ch)
+{
+    return (1UL << timer_duty_res[ch->timer]) - 1;
+}
+
+// When step k of a segment lands
+static int64_t segment_step_us(const ledc_segment_t* seg, uint32_t k)
+{
+    return seg->start_us + ((int64_t)k * seg->cycle_num * seg->period_ns) / 1000;
+}
+
+static uint32_t segment_duty_at(const ledc_segment_t* seg, int64_t time_us)
+{
+    if (time_us > seg->end_us) {
+        time_us = seg->end_us;
+    }
+    if (seg->step_num == 0 || time_us <= seg->start_us) {
+        return seg->duty;
+    }
+    // The last k with segment_step_us(k) <= time_us
+    int64_t k = (((time_us - seg->start_us) * 1000) + 999) / ((int64_t)seg->cycle_num * seg->period_ns);
+    if (k > seg->step_num) {
+        k = seg->step_num;
+    }
+    return seg->duty + (seg->dir * (int32_t)k * seg->scale);
+}
+
+static void trace_push(sim_channel_t* ch, const ledc_segment_t* seg)
+{
+    if (ch->trace_count == HOST_LEDC_TRACE_MAX) {
+        host_ledc.trace_dropped++;
+        return;
+    }
+    ch->trace[ch->trace_count++] = *seg;
+}
+
+// The segment a duty set with no fade becomes
+static ledc_segment_t segment_fixed(sim_channel_t* ch, uint32_t duty)
+{
+    return (ledc_segment_t){ .duty = duty, .dir = 1, .cycle_num = 1, .period_ns = channel_period_ns(ch) };
+}
+
+// Starts a segment and arms the fade end for when its last step lands, or
+// one cycle on for a duty set with no steps. Called with ledc_lock held
+static void segment_start(ledc_channel_t channel, ledc_segment_t seg)
+{
+    sim_channel_t* ch = &sim[channel];
+    int64_t now = esp_timer_get_time();
+    seg.start_us = now;
+    int64_t end_us = seg.step_num ? segment_step_us(&seg, seg.step_num) : now + ((seg.period_ns + 999) / 1000);
+    seg.end_us = seg.step_num ? end_us : now;
+    ch->run = seg;
+    ch->fading = 1;
+    trace_push(ch, &seg);
+    if (ch->end_timer == NULL) {
+        esp_timer_create_args_t args = { .callback = fade_end_timer_cb, .arg = (void*)(intptr_t)channel, .name = "ledc_fade" };
+        esp_timer_create(&args, &ch->end_timer);
+    }
+    esp_timer_stop(ch->end_timer);
+    esp_timer_start_once(ch->end_timer, (uint64_t)(end_us > now ? end_us - now : 1));
+}
+
+static void fade_end_timer_cb(void* arg)
+{
+    ledc_channel_t channel = (ledc_channel_t)(intptr_t)arg;
+    sim_channel_t* ch = &sim[channel];
+    pthread_mutex_lock(&ledc_lock);
+    if (!ch->fading) {
+        pthread_mutex_unlock(&ledc_lock);
+        return;
+    }
+    ch->fading = 0;
+    ch->duty = segment_duty_at(&ch->run, ch->run.end_us);
+    if (ch->duty != ch->target && ch->run.scale != 0) {
+        // Not there yet, either because a fade can only be 1023 steps or
+        // because the steps didn't divide evenly. The ISR carries on with
+        // the same step, or sets the target once less than a step is left
+        ledc_segment_t more = ch->run;
+        more.dir = ch->target > ch->duty ? 1 : -1;
+        more.duty = ch->duty;
+        more.step_num = MIN((ch->target > ch->duty ? ch->target - ch->duty : ch->duty - ch->target) / ch->run.scale, LEDC_STEP_NUM_MAX);
+        segment_start(channel, more.step_num ? more : segment_fixed(ch, ch->target));
+        pthread_mutex_unlock(&ledc_lock);
+        return;
+    }
+    ch->duty = ch->target;
+    host_ledc.fade_ends++;
+    ledc_cb_t cb = ch->cb;
+    void* cb_arg = ch->cb_arg;
+    ledc_cb_param_t param = { .event = LEDC_FADE_END_EVT, .speed_mode = LEDC_LOW_SPEED_MODE, .channel = channel, .duty = ch->target };
+    pthread_mutex_unlock(&ledc_lock);
+    if (cb) {
+        cb(&param, cb_arg);
+    }
+}
+
+// The driver takes the channel's fade semaphore in every call that sets a
+// duty, so a call while a fade runs waits for it to finish. That can't be
+// waited for on the virtual clock, so the call is counted with how long it
+// would have waited and the fade is finished at once. Called with ledc_lock
+// held, and returns with it held
+static void fade_acquire(ledc_channel_t channel)
+{
+    sim_channel_t* ch = &sim[channel];
+    if (!ch->fading) {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    host_ledc.blocked++;
+    host_ledc.blocked_us += ch->run.end_us > now ? ch->run.end_us - now : 0;
+    esp_timer_stop(ch->end_timer);
+    ch->fading = 0;
+    ch->duty = ch->target;
+    ledc_segment_t done = segment_fixed(ch, ch->target);
+    done.start_us = now;
+    done.end_us = now;
+    trace_push(ch, &done);
+    host_ledc.fade_ends++;
+    ledc_cb_t cb = ch->cb;
+    void* cb_arg = ch->cb_arg;
+    ledc_cb_param_t param = { .event = LEDC_FADE_END_EVT, .speed_mode = LEDC_LOW_SPEED_MODE, .channel = channel, .duty = ch->target };
+    pthread_mutex_unlock(&ledc_lock);
+    if (cb) {
+        cb(&param, cb_arg);
+    }
+    pthread_mutex_lock(&ledc_lock);
+}
+
+static uint8_t channel_valid(ledc_channel_t channel)
+{
+    return channel < LEDC_CHANNEL_MAX && sim[channel].configured;
+}
+
+esp_err_t ledc_timer_config(const ledc_timer_config_t* config)
+{
+    if (config->timer_num >= LEDC_TIMER_MAX || config->freq_hz == 0
+        || ((uint64_t)config->freq_hz << config->duty_resolution) > LEDC_CLK_HZ) {
+        return ESP_FAIL;
+    }
+    pthread_mutex_lock(&ledc_lock);
+    timer_freq_hz[config->timer_num] = config->freq_hz;
+    timer_duty_res[config->timer_num] = config->duty_resolution;
+    pthread_mutex_unlock(&ledc_lock);
+    return ESP_OK;
+}
+
+uint32_t ledc_get_freq(ledc_mode_t mode, ledc_timer_t timer)
+{
+    return timer < LEDC_TIMER_MAX ? timer_freq_hz[timer] : 0;
+}
+
+esp_err_t ledc_channel_config(const ledc_channel_config_t* config)
+{
+    if (config->channel >= LEDC_CHANNEL_MAX || config->timer_sel >= LEDC_TIMER_MAX || timer_freq_hz[config->timer_sel] == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&ledc_lock);
+    sim_channel_t* ch = &sim[config->channel];
+    ch->configured = 1;
+    ch->timer = config->timer_sel;
+    ch->duty = config->duty;
+    ch->target = config->duty;
+    ledc_segment_t seg = segment_fixed(ch, config->duty);
+    seg.start_us = esp_timer_get_time();
+    seg.end_us = seg.start_us;
+    trace_push(ch, &seg);
+    pthread_mutex_unlock(&ledc_lock);
+    return ESP_OK;
+}
+
+esp_err_t ledc_fade_func_install(int flags)
+{
+    return ESP_OK;
+}
+
+esp_err_t ledc_cb_register(ledc_mode_t mode, ledc_channel_t channel, ledc_cbs_t* cbs, void* arg)
+{
+    if (!channel_valid(channel)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&ledc_lock);
+    sim[channel].cb = cbs->fade_cb;
+    sim[channel].cb_arg = arg;
+    pthread_mutex_unlock(&ledc_lock);
+    return ESP_OK;
+}
+
+uint32_t ledc_get_duty(ledc_mode_t mode, ledc_channel_t channel)
+{
+    if (!channel_valid(channel)) {
+        return 0;
+    }
+    pthread_mutex_lock(&ledc_lock);
+    sim_channel_t* ch = &sim[channel];
+    uint32_t duty = ch->fading ? segment_duty_at(&ch->run, esp_timer_get_time()) : ch->duty;
+    pthread_mutex_unlock(&ledc_lock);
+    return duty;
+}
+
+// _ledc_set_fade_with_step in the driver. Called with ledc_lock held
+static void fade_program_step(ledc_channel_t channel, uint32_t target, uint32_t scale, uint32_t cycle_num)
+{
+    sim_channel_t* ch = &sim[channel];
+    uint32_t duty_cur = ch->duty;
+    // The driver steps back one from full duty, as fading down from there
+    // overflows the counter
+    if (duty_cur == channel_max_duty(ch)) {
+        duty_cur -= 1;
+    }
+    ch->target = target;
+    uint32_t step_num = 0;
+    int8_t dir = -1;
+    if (scale > 0) {
+        if (duty_cur > target) {
+            step_num = (duty_cur - target) / scale;
+        }
+        else {
+            dir = 1;
+            step_num = (target - duty_cur) / scale;
+        }
+        step_num = step_num > LEDC_STEP_NUM_MAX ? LEDC_STEP_NUM_MAX : step_num;
+    }
+    if (scale > 0 && step_num > 0) {
+        ch->set = (ledc_segment_t){
+            .duty = duty_cur, .dir = dir, .step_num = step_num, .cycle_num = cycle_num, .scale = scale,
+            .period_ns = channel_period_ns(ch),
+        };
+    }
+    else {
+        ch->set = segment_fixed(ch, target);
+    }
+    ch->programmed = 1;
+}
+
+esp_err_t ledc_set_fade_with_time(ledc_mode_t mode, ledc_channel_t channel, uint32_t target, int time_ms)
+{
+    if (!channel_valid(channel)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&ledc_lock);
+    fade_acquire(channel);
+    sim_channel_t* ch = &sim[channel];
+    uint32_t duty_cur = ch->duty;
+    uint32_t total_cycles = ((uint64_t)time_ms * timer_freq_hz[ch->timer]) / 1000;
+    if (duty_cur == target || total_cycles == 0) {
+        if (duty_cur != target) {
+            host_ledc.too_fast++;
+        }
+        ch->target = target;
+        ch->set = segment_fixed(ch, target);
+        ch->programmed = 1;
+        pthread_mutex_unlock(&ledc_lock);
+        return ESP_OK;
+    }
+    uint32_t delta = duty_cur > target ? duty_cur - target : target - duty_cur;
+    uint32_t scale;
+    uint32_t cycle_num;
+    if (total_cycles > delta) {
+        scale = 1;
+        cycle_num = total_cycles / delta;
+        if (cycle_num > LEDC_DUTY_NUM_MAX) {
+            host_ledc.too_slow++;
+            cycle_num = LEDC_DUTY_NUM_MAX;
+        }
+    }
+    else {
+        cycle_num = 1;
+        scale = delta / total_cycles;
+        if (scale > LEDC_DUTY_SCALE_MAX) {
+            scale = LEDC_DUTY_SCALE_MAX;
+        }
+    }
+    fade_program_step(channel, target, scale, cycle_num);
+    pthread_mutex_unlock(&ledc_lock);
+    return ESP_OK;
+}
+
+esp_err_t ledc_set_fade_with_step(ledc_mode_t mode, ledc_channel_t channel, uint32_t target, uint32_t scale, uint32_t cycle_num)
+{
+    if (!channel_valid(channel) || scale > LEDC_DUTY_SCALE_MAX || cycle_num > LEDC_DUTY_NUM_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&ledc_lock);
+    fade_acquire(channel);
+    fade_program_step(channel, target, scale, cycle_num);
+    pthread_mutex_unlock(&ledc_lock);
+    return ESP_OK;
+}
+
+// LEDC_FADE_WAIT_DONE isn't waited for, since nothing moves the virtual
+// clock while the caller would be blocked
+esp_err_t ledc_fade_start(ledc_mode_t mode, ledc_channel_t channel, ledc_fade_mode_t wait)
+{
+    if (!channel_valid(channel)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&ledc_lock);
+    fade_acquire(channel);
+    sim_channel_t* ch = &sim[channel];
+    if (!ch->programmed) {
+        ch->set = segment_fixed(ch, ch->duty);
+    }
+    ch->programmed = 0;
+    host_ledc.fades++;
+    segment_start(channel, ch->set);
+    pthread_mutex_unlock(&ledc_lock);
+    return ESP_OK;
+}
+
+// The duty stays where the fade had got to and no fade end is raised
+esp_err_t ledc_fade_stop(ledc_mode_t mode, ledc_channel_t channel)
+{
+    if (!channel_valid(channel)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&ledc_lock);
+    sim_channel_t* ch = &sim[channel];
+    if (ch->fading) {
+        int64_t now = esp_timer_get_time();
+        esp_timer_stop(ch->end_timer);
+        ch->fading = 0;
+        ch->duty = segment_duty_at(&ch->run, now);
+        ch->target = ch->duty;
+        if (ch->trace_count > 0 && ch->trace[ch->trace_count - 1].end_us > now) {
+            ch->trace[ch->trace_count - 1].end_us = now;
+        }
+        host_ledc.stops++;
+    }
+    pthread_mutex_unlock(&ledc_lock);
+    return ESP_OK;
+}
+
+// A one step fade the driver waits out, so it ends with a fade end too
+esp_err_t ledc_set_duty_and_update(ledc_mode_t mode, ledc_channel_t channel, uint32_t value, uint32_t hpoint)
+{
+    if (!channel_valid(channel)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&ledc_lock);
+    fade_acquire(channel);
+    fade_program_step(channel, value, 0, 1);
+    sim[channel].programmed = 0;
+    host_ledc.duty_updates++;
+    segment_start(channel, sim[channel].set);
+    pthread_mutex_unlock(&ledc_lock);
+    return ESP_OK;
+}
+
+uint32_t host_ledc_duty_at(ledc_channel_t channel, int64_t time_us)
+{
+    pthread_mutex_lock(&ledc_lock);
+    sim_channel_t* ch = &sim[channel];
+    uint32_t duty = 0;
+    for (int i = ch->trace_count - 1; i >= 0; i--) {
+        if (ch->trace[i].start_us <= time_us) {
+            duty = segment_duty_at(&ch->trace[i], time_us);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ledc_lock);
+    return duty;
+}
+
+uint8_t host_ledc_fading(ledc_channel_t channel)
+{
+    pthread_mutex_lock(&ledc_lock);
+    uint8_t fading = sim[channel].fading;
+    pthread_mutex_unlock(&ledc_lock);
+    return fading;
+}
+
+void host_ledc_reset(void)
+{
+    pthread_mutex_lock(&ledc_lock);
+    memset(&host_ledc, 0, sizeof(host_ledc));
+    int64_t now = esp_timer_get_time();
+    for (int channel = 0; channel < LEDC_CHANNEL_MAX; channel++) {
+        sim_channel_t* ch = &sim[channel];
+        if (!ch->configured) {
+            continue;
+        }
+        ch->trace_count = 0;
+        if (ch->fading) {
+            trace_push(ch, &ch->run);
+        }
+        else {
+            ledc_segment_t seg = segment_fixed(ch, ch->duty);
+            seg.start_us = now;
+            seg.end_us = now;
+            trace_push(ch, &seg);
+        }
+    }
+    pthread_mutex_unlock(&ledc_lock);
+}
+
+// Walks a channel's trace one duty change at a time
+typedef struct
+{
+  int seg;
+  uint32_t step;
+  uint8_t has_last;
+  uint32_t last_duty;
+} trace_cursor_t;
+
+static uint8_t trace_next(sim_channel_t* ch, trace_cursor_t* cur, int64_t* time_us, uint32_t* duty)
+{
+    while (cur->seg < ch->trace_count) {
+        const ledc_segment_t* seg = &ch->trace[cur->seg];
+        const ledc_segment_t* next = cur->seg + 1 < ch->trace_count ? &ch->trace[cur->seg + 1] : NULL;
+        if (cur->step <= seg->step_num) {
+            int64_t t = segment_step_us(seg, cur->step);
+            // A step that would land after a stop or after the next segment took over never happens
+            if (cur->step == 0 || (t <= seg->end_us && (next == NULL || t < next->start_us))) {
+                uint32_t d = seg->duty + (seg->dir * (int32_t)cur->step * seg->scale);
+                cur->step++;
+                if (cur->has_last && d == cur->last_duty) {
+                    continue;
+                }
+                cur->has_last = 1;
+                cur->last_duty = d;
+                *time_us = t;
+                *duty = d;
+                return 1;
+            }
+        }
+        cur->seg++;
+        cur->step = 0;
+    }
+    return 0;
+}
+
+int64_t host_ledc_settled_at(ledc_channel_t channel)
+{
+    pthread_mutex_lock(&ledc_lock);
+    trace_cursor_t cur = {0};
+    int64_t time_us;
+    int64_t last_us = 0;
+    uint32_t duty;
+    while (trace_next(&sim[channel], &cur, &time_us, &duty)) {
+        last_us = time_us;
+    }
+    pthread_mutex_unlock(&ledc_lock);
+    return last_us;
+}
+
+// Calls out for every change on every channel in time order
+static void trace_merge(FILE* file, void (*out)(FILE* file, int channel, int64_t time_us, uint32_t duty))
+{
+    trace_cursor_t cur[LEDC_CHANNEL_MAX] = {0};
+    uint8_t pending[LEDC_CHANNEL_MAX] = {0};
+    int64_t times[LEDC_CHANNEL_MAX];
+    uint32_t duties[LEDC_CHANNEL_MAX];
+    for (int channel = 0; channel < LEDC_CHANNEL_MAX; channel++) {
+        pending[channel] = sim[channel].configured && trace_next(&sim[channel], &cur[channel], &times[channel], &duties[channel]);
+    }
+    for (;;) {
+        int first = -1;
+        for (int channel = 0; channel < LEDC_CHANNEL_MAX; channel++) {
+            if (pending[channel] && (first < 0 || times[channel] < times[first])) {
+                first = channel;
+            }
+        }
+        if (first < 0) {
+            return;
+        }
+        out(file, first, times[first], duties[first]);
+        pending[first] = trace_next(&sim[first], &cur[first], &times[first], &duties[first]);
+    }
+}
+
+static void csv_row(FILE* file, int channel, int64_t time_us, uint32_t duty)
+{
+    fprintf(file, "%lld,%d,%u\n", (long long)time_us, channel, duty);
+}
+
+void host_ledc_write_csv(FILE* file)
+{
+    pthread_mutex_lock(&ledc_lock);
+    fprintf(file, "time_us,channel,duty\n");
+    trace_merge(file, csv_row);
+    pthread_mutex_unlock(&ledc_lock);
+}
+
+static int64_t vcd_time = -1;
+
+static void vcd_change(FILE* file, int channel, int64_t time_us, uint32_t duty)
+{
+    if (time_us != vcd_time) {
+        fprintf(file, "#%lld\n", (long long)time_us);
+        vcd_time = time_us;
+    }
+    char bits[33];
+    int width = timer_duty_res[sim[channel].timer];
+    for (int i = 0; i < width; i++) {
+        bits[i] = (duty >> (width - 1 - i)) & 1 ? '1' : '0';
+    }
+    bits[width] = '\0';
+    fprintf(file, "b%s %c\n", bits, '!' + channel);
+}
+
+void host_ledc_write_vcd(FILE* file)
+{
+    pthread_mutex_lock(&ledc_lock);
+    fprintf(file, "$timescale 1us $end\n$scope module ledc $end\n");
+    for (int channel = 0; channel < LEDC_CHANNEL_MAX; channel++) {
+        if (sim[channel].configured) {
+            fprintf(file, "$var wire %d %c duty%d $end\n", timer_duty_res[sim[channel].timer], '!' + channel, channel);
+        }
+    }
+    fprintf(file, "$upscope $end\n$enddefinitions $end\n");
+    vcd_time = -1;
+    trace_merge(file, vcd_change);
+    pthread_mutex_unlock(&ledc_lock);
+}
@@ -0,0 +1,49 @@
+#ifndef FAKE_LEDC_H_INCLUDED
+#define FAKE_LEDC_H_INCLUDED
+
+#include <stdio.h>
+#include <stdint.h>
+#include "driver/ledc.h"
+
+// The LEDC fader on the virtual clock. A fade is worked out the way the
+// IDF 4.4 driver does it, so the same rounding and limits apply: the fade
+// time becomes a number of PWM cycles, that is split into steps of scale
+// duty every cycle_num cycles, and the fade end interrupt is an esp_timer
+// that goes off when the last step lands. If the steps come up short of the
+// target the interrupt sets the target and ends one cycle later, and then
+// calls the registered callback, like the driver's ISR
+//
+// Every duty change is traced per channel, and the trace can be written as
+// CSV or as a VCD to open in GTKWave. host_ledc_duty_at and
+// host_ledc_settled_at read the same trace
+
+typedef struct
+{
+  int fades;              // Fades started with ledc_fade_start
+  int duty_updates;       // ledc_set_duty_and_update calls
+  int stops;              // ledc_fade_stop calls that stopped a running fade
+  int fade_ends;          // Fade end callbacks raised
+  int blocked;            // Calls that would have blocked on a running fade
+  int64_t blocked_us;     // How long they would have waited
+  int too_fast;           // Fades shorter than one cycle, set straight to the target
+  int too_slow;           // Fades slower than 1023 cycles per step, cut short
+  int trace_dropped;      // Segments that didn't fit in the trace
+} host_ledc_t;
+
+extern host_ledc_t host_ledc;
+
+// Duty the channel's output had at the given time
+uint32_t host_ledc_duty_at(ledc_channel_t channel, int64_t time_us);
+// Time of the channel's last duty change so far
+int64_t host_ledc_settled_at(ledc_channel_t channel);
+// 1 while a fade is running on the channel
+uint8_t host_ledc_fading(ledc_channel_t channel);
+// Forgets the trace and the counts. The channels keep their duty
+void host_ledc_reset(void);
+
+// time_us,channel,duty for every duty change, in time order
+void host_ledc_write_csv(FILE* file);
+// The same changes as a value change dump, one variable per channel
+void host_ledc_write_vcd(FILE* file);
+
+#endif
@@ -0,0 +1,155 @@
+#include "idf_host.h"
+#include "mqtt_client.h"
+#include "fake_mqtt.h"
+
+host_mqtt_t host_mqtt;
+
+static struct esp_mqtt_client { int unused; } client;
+static esp_event_handler_t event_handler = NULL;
+static void* event_arg = NULL;
+static int next_msg_id = 1;
+
+// Messages held in the outbox model, oldest first
+static struct
+{
+  int msg_id;
+  esp_mqtt_event_id_t ack;
+} outbox[HOST_MQTT_OUTBOX];
+
+// Takes an outbox slot for a QoS 1 message. Returns 0 if they are all taken
+static int outbox_hold(int qos, int msg_id, esp_mqtt_event_id_t ack)
+{
+    if (host_mqtt.outbox_slots == 0 || qos == 0) {
+        return 1;
+    }
+    if (host_mqtt.outbox_used >= host_mqtt.outbox_slots || host_mqtt.outbox_used >= HOST_MQTT_OUTBOX) {
+        host_mqtt.refused++;
+        return 0;
+    }
+    outbox[host_mqtt.outbox_used].msg_id = msg_id;
+    outbox[host_mqtt.outbox_used].ack = ack;
+    host_mqtt.outbox_used++;
+    return 1;
+}
+
+esp_mqtt_client_handle_t esp_mqtt_client_init(const esp_mqtt_client_config_t* config)
+{
+    host_mqtt.init++;
+    host_mqtt.config = *config;
+    return &client;
+}
+
+esp_err_t esp_mqtt_set_config(esp_mqtt_client_handle_t handle, const esp_mqtt_client_config_t* config)
+{
+    host_mqtt.config = *config;
+    return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_set_uri(esp_mqtt_client_handle_t handle, const char* uri)
+{
+    host_mqtt.config.uri = uri;
+    return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_register_event(esp_mqtt_client_handle_t handle, esp_mqtt_event_id_t id, esp_event_handler_t handler, void* arg)
+{
+    event_handler = handler;
+    event_arg = arg;
+    return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_start(esp_mqtt_client_handle_t handle)
+{
+    host_mqtt.start++;
+    return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_stop(esp_mqtt_client_handle_t handle)
+{
+    host_mqtt.stop++;
+    return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_disconnect(esp_mqtt_client_handle_t handle)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_reconnect(esp_mqtt_client_handle_t handle)
+{
+    return ESP_OK;
+}
+
+int esp_mqtt_client_subscribe(esp_mqtt_client_handle_t handle, const char* topic, int qos)
+{
+    if (!outbox_hold(qos, next_msg_id, MQTT_EVENT_SUBSCRIBED)) {
+        return -1;
+    }
+    host_mqtt.subscribes++;
+    return next_msg_id++;
+}
+
+int esp_mqtt_client_publish(esp_mqtt_client_handle_t handle, const char* topic, const char* data, int len, int qos, int retain)
+{
+    if (!outbox_hold(qos, next_msg_id, MQTT_EVENT_PUBLISHED)) {
+        return -1;
+    }
+    if (host_mqtt.publishes < HOST_MQTT_LOG) {
+        host_mqtt_publish_t* publish = &host_mqtt.log[host_mqtt.publishes];
+        snprintf(publish->topic, sizeof(publish->topic), "%s", topic);
+        snprintf(publish->payload, sizeof(publish->payload), "%.*s", len ? len : (int)strlen(data), data);
+        publish->qos = qos;
+        publish->retain = retain;
+    }
+    host_mqtt.publishes++;
+    return next_msg_id++;
+}
+
+int esp_mqtt_client_enqueue(esp_mqtt_client_handle_t handle, const char* topic, const char* data, int len, int qos, int retain, bool store)
+{
+    return esp_mqtt_client_publish(handle, topic, data, len, qos, retain);
+}
+
+const host_mqtt_publish_t* host_mqtt_last(const char* topic)
+{
+    int logged = host_mqtt.publishes < HOST_MQTT_LOG ? host_mqtt.publishes : HOST_MQTT_LOG;
+    for (int i = logged - 1; i >= 0; i--) {
+        if (strcmp(host_mqtt.log[i].topic, topic) == 0) {
+            return &host_mqtt.log[i];
+        }
+    }
+    return NULL;
+}
+
+void host_mqtt_ack(int count)
+{
+    while (count-- > 0 && host_mqtt.outbox_used > 0) {
+        esp_mqtt_event_t event = {
+            .event_id = outbox[0].ack,
+            .client = &client,
+            .msg_id = outbox[0].msg_id,
+        };
+        host_mqtt.outbox_used--;
+        memmove(&outbox[0], &outbox[1], host_mqtt.outbox_used * sizeof(outbox[0]));
+        if (event_handler != NULL) {
+            event_handler(event_arg, "MQTT_EVENTS", event.event_id, &event);
+        }
+    }
+}
+
+void host_mqtt_event(esp_mqtt_event_id_t id, const char* topic, const char* data)
+{
+    if (event_handler == NULL) {
+        return;
+    }
+    esp_mqtt_event_t event = {
+        .event_id = id,
+        .client = &client,
+        .topic = (char*)topic,
+        .topic_len = topic ? strlen(topic) : 0,
+        .data = (char*)data,
+        .data_len = data ? strlen(data) : 0,
+    };
+    event.total_data_len = event.data_len;
+    event_handler(event_arg, "MQTT_EVENTS", id, &event);
+}
@@ -0,0 +1,49 @@
+#ifndef FAKE_MQTT_H_INCLUDED
+#define FAKE_MQTT_H_INCLUDED
+
+#include <stdint.h>
+#include "mqtt_client.h"
+
+// esp-mqtt client without a broker. Publishes are recorded, and a test
+// raises client events with host_mqtt_event, which calls the registered
+// handler the way the MQTT task does
+
+#define HOST_MQTT_LOG 64
+
+typedef struct
+{
+  char topic[96];
+  char payload[128];
+  int qos;
+  int retain;
+} host_mqtt_publish_t;
+
+#define HOST_MQTT_OUTBOX 64
+
+typedef struct
+{
+  int init;
+  int start;
+  int stop;
+  int subscribes;
+  int publishes;
+  // When set, QoS 1 publishes and subscribes hold one of this many outbox
+  // slots until host_mqtt_ack, and once they are all taken a publish is
+  // refused with -1 the way the firmware's outbox refuses it
+  int outbox_slots;
+  int outbox_used;
+  int refused;
+  esp_mqtt_client_config_t config;
+  host_mqtt_publish_t log[HOST_MQTT_LOG]; // The first HOST_MQTT_LOG publishes
+} host_mqtt_t;
+
+extern host_mqtt_t host_mqtt;
+
+void host_mqtt_event(esp_mqtt_event_id_t id, const char* topic, const char* data);
+// The broker acks up to count of the messages held in the outbox, oldest
+// first, raising MQTT_EVENT_PUBLISHED or MQTT_EVENT_SUBSCRIBED for each
+void host_mqtt_ack(int count);
+// The most recent publish to the topic, or NULL
+const host_mqtt_publish_t* host_mqtt_last(const char* topic);
+
+#endif
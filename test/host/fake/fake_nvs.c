@@ -0,0 +1,210 @@
+#include <pthread.h>
+
+#include "idf_host.h"
+#include "nvs_flash.h"
+#include "fake_nvs.h"
+
+// NVS in RAM. Every value is kept as bytes with its type, so a get with the
+// wrong type misses like it does on the device
+
+#define HOST_NVS_ENTRIES     128
+#define HOST_NVS_NAMESPACES  8
+#define HOST_NVS_KEY_LENGTH  16   // NVS_KEY_NAME_MAX_SIZE, including the null
+#define HOST_NVS_VALUE_SIZE  4096
+
+typedef enum
+{
+  HOST_NVS_U8,
+  HOST_NVS_U16,
+  HOST_NVS_U32,
+  HOST_NVS_U64,
+  HOST_NVS_STR,
+  HOST_NVS_BLOB,
+} host_nvs_type_t;
+
+typedef struct
+{
+  uint8_t used;
+  uint8_t ns;
+  host_nvs_type_t type;
+  char key[HOST_NVS_KEY_LENGTH];
+  size_t len;
+  uint8_t* value;
+} host_nvs_entry_t;
+
+host_nvs_t host_nvs;
+
+static host_nvs_entry_t entries[HOST_NVS_ENTRIES];
+static char namespaces[HOST_NVS_NAMESPACES][HOST_NVS_KEY_LENGTH];
+static int namespace_count = 0;
+static pthread_mutex_t nvs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void host_nvs_erase_all(void)
+{
+    pthread_mutex_lock(&nvs_lock);
+    for (int i = 0; i < HOST_NVS_ENTRIES; i++) {
+        free(entries[i].value);
+    }
+    memset(entries, 0, sizeof(entries));
+    pthread_mutex_unlock(&nvs_lock);
+}
+
+esp_err_t nvs_flash_init(void)
+{
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void)
+{
+    host_nvs_erase_all();
+    return ESP_OK;
+}
+
+// Handles are the namespace index plus one, so 0 is never a valid handle
+esp_err_t nvs_open(const char* name, nvs_open_mode_t mode, nvs_handle_t* handle)
+{
+    if (strlen(name) >= HOST_NVS_KEY_LENGTH) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&nvs_lock);
+    int ns = 0;
+    while (ns < namespace_count && strcmp(namespaces[ns], name) != 0) {
+        ns++;
+    }
+    if (ns == namespace_count) {
+        if (mode == NVS_READONLY || namespace_count == HOST_NVS_NAMESPACES) {
+            pthread_mutex_unlock(&nvs_lock);
+            return ESP_ERR_NVS_NOT_FOUND;
+        }
+        strcpy(namespaces[namespace_count++], name);
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    host_nvs.opens++;
+    *handle = ns + 1;
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+    host_nvs.closes++;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    host_nvs.commits++;
+    return ESP_OK;
+}
+
+static host_nvs_entry_t* find_entry(nvs_handle_t handle, const char* key)
+{
+    for (int i = 0; i < HOST_NVS_ENTRIES; i++) {
+        if (entries[i].used && entries[i].ns == handle && strcmp(entries[i].key, key) == 0) {
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+static esp_err_t set_value(nvs_handle_t handle, const char* key, host_nvs_type_t type, const void* value, size_t len)
+{
+    if (strlen(key) >= HOST_NVS_KEY_LENGTH || len > HOST_NVS_VALUE_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&nvs_lock);
+    host_nvs_entry_t* entry = find_entry(handle, key);
+    for (int i = 0; entry == NULL && i < HOST_NVS_ENTRIES; i++) {
+        if (!entries[i].used) {
+            entry = &entries[i];
+        }
+    }
+    if (entry == NULL) {
+        pthread_mutex_unlock(&nvs_lock);
+        return ESP_ERR_NVS_NO_FREE_PAGES;
+    }
+    free(entry->value);
+    entry->used = 1;
+    entry->ns = handle;
+    entry->type = type;
+    strcpy(entry->key, key);
+    entry->len = len;
+    entry->value = malloc(len ? len : 1);
+    memcpy(entry->value, value, len);
+    pthread_mutex_unlock(&nvs_lock);
+    host_nvs.writes++;
+    host_nvs.bytes_written += len;
+    return ESP_OK;
+}
+
+// Fixed size values need an exact type match. Strings and blobs report
+// their length when out is NULL and fail if the buffer is too small
+static esp_err_t get_value(nvs_handle_t handle, const char* key, host_nvs_type_t type, void* out, size_t* len)
+{
+    pthread_mutex_lock(&nvs_lock);
+    host_nvs_entry_t* entry = find_entry(handle, key);
+    esp_err_t err = ESP_OK;
+    if (entry == NULL || entry->type != type) {
+        err = ESP_ERR_NVS_NOT_FOUND;
+    }
+    else if (out == NULL) {
+        *len = entry->len;
+    }
+    else if (*len < entry->len) {
+        *len = entry->len;
+        err = ESP_ERR_NVS_INVALID_LENGTH;
+    }
+    else {
+        memcpy(out, entry->value, entry->len);
+        *len = entry->len;
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    host_nvs.reads++;
+    return err;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char* key)
+{
+    pthread_mutex_lock(&nvs_lock);
+    host_nvs_entry_t* entry = find_entry(handle, key);
+    if (entry != NULL) {
+        free(entry->value);
+        memset(entry, 0, sizeof(*entry));
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    return entry != NULL ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_set_str(nvs_handle_t handle, const char* key, const char* value)
+{
+    return set_value(handle, key, HOST_NVS_STR, value, strlen(value) + 1);
+}
+
+esp_err_t nvs_get_str(nvs_handle_t handle, const char* key, char* out, size_t* len)
+{
+    return get_value(handle, key, HOST_NVS_STR, out, len);
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char* key, const void* value, size_t len)
+{
+    return set_value(handle, key, HOST_NVS_BLOB, value, len);
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char* key, void* out, size_t* len)
+{
+    return get_value(handle, key, HOST_NVS_BLOB, out, len);
+}
+
+#define HOST_NVS_INT(suffix, type_t, type) \
+esp_err_t nvs_set_##suffix(nvs_handle_t handle, const char* key, type_t value) \
+{ \
+    return set_value(handle, key, type, &value, sizeof(value)); \
+} \
+esp_err_t nvs_get_##suffix(nvs_handle_t handle, const char* key, type_t* out) \
+{ \
+    size_t len = sizeof(*out); \
+    return get_value(handle, key, type, out, &len); \
+}
+
+HOST_NVS_INT(u8, uint8_t, HOST_NVS_U8)
+HOST_NVS_INT(u16, uint16_t, HOST_NVS_U16)
+HOST_NVS_INT(u32, uint32_t, HOST_NVS_U32)
+HOST_NVS_INT(u64, uint64_t, HOST_NVS_U64)
@@ -0,0 +1,25 @@
+#ifndef FAKE_NVS_H_INCLUDED
+#define FAKE_NVS_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+// NVS kept in RAM for the life of the test. Calls are counted so a test
+// can see how much flash traffic the firmware would cause
+
+typedef struct
+{
+  int opens;
+  int closes;
+  int commits;
+  int reads;
+  int writes;
+  size_t bytes_written;
+} host_nvs_t;
+
+extern host_nvs_t host_nvs;
+
+// Forgets every key, like a fresh flash
+void host_nvs_erase_all(void);
+
+#endif
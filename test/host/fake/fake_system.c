@@ -0,0 +1,176 @@
+#include "idf_host.h"
+#include "esp_ota_ops.h"
+#include "esp_heap_caps.h"
+#include "esp_tls_crypto.h"
+#include "esp_crt_bundle.h"
+#include "esp_sntp.h"
+#include "mdns.h"
+#include "lwip/inet.h"
+#include "fake_system.h"
+
+host_system_t host_system = {
+    .free_heap = 160 * 1024,
+};
+
+static const esp_partition_t ota_partitions[2] = {
+    { .address = 0x10000, .size = 0x180000 },
+    { .address = 0x190000, .size = 0x180000 },
+};
+
+const esp_partition_t* esp_ota_get_running_partition(void)
+{
+    return &ota_partitions[0];
+}
+
+const esp_partition_t* esp_ota_get_next_update_partition(const esp_partition_t* start)
+{
+    return &ota_partitions[1];
+}
+
+esp_err_t esp_ota_get_state_partition(const esp_partition_t* partition, esp_ota_img_states_t* state)
+{
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t esp_ota_begin(const esp_partition_t* partition, size_t size, esp_ota_handle_t* handle)
+{
+    host_system.ota_begins++;
+    *handle = 1;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void* data, size_t size)
+{
+    host_system.ota_bytes += size;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_end(esp_ota_handle_t handle)
+{
+    host_system.ota_ends++;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_abort(esp_ota_handle_t handle)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t* partition)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_mark_app_valid_cancel_rollback(void)
+{
+    return ESP_OK;
+}
+
+// Counted instead of restarting, so the caller carries on
+void esp_restart(void)
+{
+    host_system.restarts++;
+}
+
+esp_err_t esp_read_mac(uint8_t* mac, esp_mac_type_t type)
+{
+    static const uint8_t host_mac[6] = { 0x58, 0xcf, 0x79, 0x12, 0x34, 0x56 };
+    memcpy(mac, host_mac, 6);
+    return ESP_OK;
+}
+
+size_t esp_get_free_heap_size(void)
+{
+    return host_system.free_heap;
+}
+
+size_t esp_get_minimum_free_heap_size(void)
+{
+    return host_system.free_heap;
+}
+
+size_t heap_caps_get_free_size(uint32_t caps)
+{
+    return host_system.free_heap;
+}
+
+size_t heap_caps_get_minimum_free_size(uint32_t caps)
+{
+    return host_system.free_heap;
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t caps)
+{
+    return host_system.free_heap / 2;
+}
+
+esp_err_t mdns_init(void)
+{
+    return ESP_OK;
+}
+
+esp_err_t mdns_hostname_set(const char* hostname)
+{
+    return ESP_OK;
+}
+
+esp_err_t mdns_instance_name_set(const char* name)
+{
+    return ESP_OK;
+}
+
+void sntp_setoperatingmode(int mode)
+{
+}
+
+void sntp_setservername(int index, const char* server)
+{
+}
+
+void sntp_set_time_sync_notification_cb(sntp_sync_time_cb_t cb)
+{
+    host_system.sntp_cb = cb;
+}
+
+void sntp_init(void)
+{
+    host_system.sntp_init++;
+}
+
+esp_err_t esp_crt_bundle_attach(void* conf)
+{
+    return ESP_OK;
+}
+
+char* inet_ntoa_r(struct in_addr addr, char* buf, int buflen)
+{
+    return (char*)inet_ntop(AF_INET, &addr, buf, buflen);
+}
+
+// Real base64, since the basic auth check compares against its output
+int esp_crypto_base64_encode(unsigned char* dst, size_t dlen, size_t* olen, const unsigned char* src, size_t slen)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t needed = ((slen + 2) / 3) * 4 + 1;
+    if (dst == NULL || dlen < needed) {
+        *olen = needed;
+        return -0x002A; // MBEDTLS_ERR_BASE64_BUFFER_TOO_SMALL
+    }
+    size_t out = 0;
+    for (size_t i = 0; i < slen; i += 3) {
+        uint32_t bits = (uint32_t)src[i] << 16;
+        if (i + 1 < slen) {
+            bits |= (uint32_t)src[i + 1] << 8;
+        }
+        if (i + 2 < slen) {
+            bits |= src[i + 2];
+        }
+        dst[out++] = alphabet[(bits >> 18) & 0x3f];
+        dst[out++] = alphabet[(bits >> 12) & 0x3f];
+        dst[out++] = i + 1 < slen ? alphabet[(bits >> 6) & 0x3f] : '=';
+        dst[out++] = i + 2 < slen ? alphabet[bits & 0x3f] : '=';
+    }
+    dst[out] = '\0';
+    *olen = out;
+    return 0;
+}
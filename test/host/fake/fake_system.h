@@ -0,0 +1,23 @@
+#ifndef FAKE_SYSTEM_H_INCLUDED
+#define FAKE_SYSTEM_H_INCLUDED
+
+#include <stdint.h>
+#include "esp_sntp.h"
+
+// The smaller IDF services: OTA, mDNS, SNTP, heap info, the MAC address
+// and restarts. Only what a test wants to look at is recorded
+
+typedef struct
+{
+  int restarts;
+  int ota_begins;
+  int ota_ends;
+  size_t ota_bytes;
+  int sntp_init;
+  sntp_sync_time_cb_t sntp_cb;
+  size_t free_heap;
+} host_system_t;
+
+extern host_system_t host_system;
+
+#endif
@@ -0,0 +1,196 @@
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include "idf_host.h"
+#include "fake_tls.h"
+
+host_tls_t host_tls;
+
+static pthread_mutex_t broker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t broker_cond = PTHREAD_COND_INITIALIZER;
+static EVP_PKEY* broker_key = NULL;
+static X509* broker_cert = NULL;
+static SSL_CTX* broker_ctx = NULL;
+static SSL_CTX* client_ctx = NULL;
+static int listen_fd = -1;
+static pthread_t broker;
+static volatile uint8_t broker_stopping = 0;
+
+// Self-signed, made fresh for each run
+static void make_broker_cert(void)
+{
+    broker_key = EVP_EC_gen("P-256");
+    broker_cert = X509_new();
+    X509_set_version(broker_cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(broker_cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(broker_cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(broker_cert), 3600);
+    X509_set_pubkey(broker_cert, broker_key);
+    X509_NAME* name = X509_get_subject_name(broker_cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)"localhost", -1, -1, 0);
+    X509_set_issuer_name(broker_cert, name);
+    X509_sign(broker_cert, broker_key, EVP_sha256());
+}
+
+static SSL_CTX* new_broker_ctx(void)
+{
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_use_certificate(ctx, broker_cert);
+    SSL_CTX_use_PrivateKey(ctx, broker_key);
+    return ctx;
+}
+
+// One connection at a time: the handshake, then a read that returns once
+// the client hangs up
+static void* broker_thread(void* arg)
+{
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (broker_stopping) {
+                break;
+            }
+            continue;
+        }
+        pthread_mutex_lock(&broker_lock);
+        SSL* ssl = SSL_new(broker_ctx);
+        pthread_mutex_unlock(&broker_lock);
+        SSL_set_fd(ssl, fd);
+        if (SSL_accept(ssl) == 1) {
+            pthread_mutex_lock(&broker_lock);
+            host_tls.handshakes++;
+            host_tls.resumed += SSL_session_reused(ssl);
+            pthread_cond_broadcast(&broker_cond);
+            pthread_mutex_unlock(&broker_lock);
+            char byte;
+            SSL_read(ssl, &byte, 1);
+        }
+        SSL_free(ssl);
+        close(fd);
+    }
+    return NULL;
+}
+
+int host_tls_broker_start(void)
+{
+    make_broker_cert();
+    broker_ctx = new_broker_ctx();
+    client_ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_max_proto_version(client_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_verify(client_ctx, SSL_VERIFY_NONE, NULL);
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr));
+    listen(listen_fd, 4);
+    socklen_t len = sizeof(addr);
+    getsockname(listen_fd, (struct sockaddr*)&addr, &len);
+    pthread_create(&broker, NULL, broker_thread, NULL);
+    return ntohs(addr.sin_port);
+}
+
+void host_tls_broker_restart(void)
+{
+    pthread_mutex_lock(&broker_lock);
+    SSL_CTX_free(broker_ctx);
+    broker_ctx = new_broker_ctx();
+    pthread_mutex_unlock(&broker_lock);
+}
+
+void host_tls_broker_wait(int handshakes)
+{
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += 1;
+    pthread_mutex_lock(&broker_lock);
+    while (host_tls.handshakes < handshakes) {
+        if (pthread_cond_timedwait(&broker_cond, &broker_lock, &until) != 0) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&broker_lock);
+}
+
+void host_tls_broker_stop(void)
+{
+    broker_stopping = 1;
+    shutdown(listen_fd, SHUT_RDWR);
+    pthread_join(broker, NULL);
+    close(listen_fd);
+}
+
+esp_tls_t* esp_tls_init(void)
+{
+    esp_tls_t* tls = calloc(1, sizeof(esp_tls_t));
+    tls->sockfd = -1;
+    return tls;
+}
+
+int esp_tls_conn_new_sync(const char* hostname, int hostlen, int port, const esp_tls_cfg_t* cfg, esp_tls_t* tls)
+{
+    char host[128];
+    char service[8];
+    snprintf(host, sizeof(host), "%.*s", hostlen, hostname);
+    snprintf(service, sizeof(service), "%d", port);
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+    struct addrinfo* res = NULL;
+    if (getaddrinfo(host, service, &hints, &res) != 0) {
+        return -1;
+    }
+    tls->sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    int err = connect(tls->sockfd, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    if (err != 0) {
+        return -1;
+    }
+    SSL* ssl = SSL_new(client_ctx);
+    tls->host_ssl = ssl;
+    SSL_set_fd(ssl, tls->sockfd);
+    SSL_set_tlsext_host_name(ssl, host);
+    if (cfg->client_session != NULL) {
+        SSL_set_session(ssl, cfg->client_session->saved_session.host_session);
+    }
+    return SSL_connect(ssl) == 1 ? 1 : -1;
+}
+
+int esp_tls_conn_destroy(esp_tls_t* tls)
+{
+    if (tls->host_ssl != NULL) {
+        SSL_shutdown(tls->host_ssl);
+        SSL_free(tls->host_ssl);
+    }
+    if (tls->sockfd >= 0) {
+        close(tls->sockfd);
+    }
+    free(tls);
+    return 0;
+}
+
+esp_tls_client_session_t* esp_tls_get_client_session(esp_tls_t* tls)
+{
+    SSL_SESSION* session = SSL_get1_session(tls->host_ssl);
+    if (session == NULL) {
+        return NULL;
+    }
+    esp_tls_client_session_t* client_session = calloc(1, sizeof(esp_tls_client_session_t));
+    client_session->saved_session.host_session = session;
+    SSL_SESSION_get_master_key(session, client_session->saved_session.master, sizeof(client_session->saved_session.master));
+    return client_session;
+}
+
+void mbedtls_ssl_session_free(mbedtls_ssl_session* session)
+{
+    SSL_SESSION_free(session->host_session);
+    session->host_session = NULL;
+}
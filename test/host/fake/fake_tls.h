@@ -0,0 +1,32 @@
+#ifndef FAKE_TLS_H_INCLUDED
+#define FAKE_TLS_H_INCLUDED
+
+#include "esp_tls.h"
+
+// esp-tls on OpenSSL, and a broker on loopback that completes a TLS 1.2
+// handshake with an ECDSA P-256 certificate and waits for the client to
+// hang up. TLS 1.2 is what mbedtls in IDF 4.4 speaks. The handshakes are
+// real ones, so they show what resuming saves, but on this PC's CPU and
+// OpenSSL rather than the ESP32-C3's. The client doesn't check the
+// broker's certificate
+
+typedef struct
+{
+  int handshakes; // Completed by the broker
+  int resumed;    // Of those, the ones that resumed a session
+} host_tls_t;
+
+extern host_tls_t host_tls;
+
+// Starts the broker and returns its port
+int host_tls_broker_start(void);
+// New ticket keys and an empty session cache, as after a broker restart,
+// so earlier sessions are turned down
+void host_tls_broker_restart(void);
+// Waits until the broker has completed handshakes in all
+void host_tls_broker_wait(int handshakes);
+// Stops the broker once it has finished with the last connection. Must be
+// called before the test exits, as OpenSSL frees its state at exit
+void host_tls_broker_stop(void);
+
+#endif
@@ -0,0 +1,214 @@
+#include "idf_host.h"
+#include "esp_wifi.h"
+#include "esp_netif.h"
+#include "fake_wifi.h"
+
+#define HOST_MAX_HANDLERS  16
+#define HOST_MAX_EVENTS    32
+#define HOST_EVENT_DATA    64
+
+typedef struct
+{
+  esp_event_base_t base;
+  int32_t id;
+  esp_event_handler_t handler;
+  void* arg;
+} host_handler_t;
+
+typedef struct
+{
+  esp_event_base_t base;
+  int32_t id;
+  uint8_t data[HOST_EVENT_DATA];
+} host_event_t;
+
+host_wifi_t host_wifi = {
+    .ap_in_range = 1,
+    .channel = 6,
+    .bssid = { 0x24, 0x0a, 0xc4, 0x00, 0x00, 0x01 },
+};
+
+static host_handler_t handlers[HOST_MAX_HANDLERS];
+static int handler_count = 0;
+static host_event_t events[HOST_MAX_EVENTS];
+static int event_head = 0;
+static int event_count = 0;
+static struct esp_netif_obj { int dhcp; } sta_netif, ap_netif;
+
+void host_wifi_post(esp_event_base_t base, int32_t id, const void* data, size_t len)
+{
+    if (event_count == HOST_MAX_EVENTS) {
+        return;
+    }
+    host_event_t* event = &events[(event_head + event_count++) % HOST_MAX_EVENTS];
+    event->base = base;
+    event->id = id;
+    memset(event->data, 0, sizeof(event->data));
+    if (data) {
+        memcpy(event->data, data, len < HOST_EVENT_DATA ? len : HOST_EVENT_DATA);
+    }
+}
+
+void host_wifi_run_events(void)
+{
+    while (event_count > 0) {
+        host_event_t event = events[event_head];
+        event_head = (event_head + 1) % HOST_MAX_EVENTS;
+        event_count--;
+        for (int i = 0; i < handler_count; i++) {
+            if (handlers[i].base == event.base && (handlers[i].id == event.id || handlers[i].id == ESP_EVENT_ANY_ID)) {
+                handlers[i].handler(handlers[i].arg, event.base, event.id, event.data);
+            }
+        }
+    }
+}
+
+static void post_disconnected(uint8_t reason)
+{
+    wifi_event_sta_disconnected_t event = { .reason = reason };
+    host_wifi_post(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &event, sizeof(event));
+}
+
+void host_wifi_ap_lost(void)
+{
+    host_wifi.ap_in_range = 0;
+    if (host_wifi.sta_connected) {
+        host_wifi.sta_connected = 0;
+        post_disconnected(WIFI_REASON_BEACON_TIMEOUT);
+    }
+}
+
+esp_err_t esp_event_loop_create_default(void)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_event_handler_instance_register(esp_event_base_t base, int32_t id, esp_event_handler_t handler, void* arg, esp_event_handler_instance_t* instance)
+{
+    if (handler_count == HOST_MAX_HANDLERS) {
+        return ESP_ERR_NO_MEM;
+    }
+    handlers[handler_count++] = (host_handler_t){ base, id, handler, arg };
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_init(const wifi_init_config_t* config)
+{
+    host_wifi.init++;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_mode(wifi_mode_t mode)
+{
+    host_wifi.set_mode++;
+    if (mode != host_wifi.mode && host_wifi.mode_changes < 16) {
+        host_wifi.mode_history[host_wifi.mode_changes++] = mode;
+    }
+    host_wifi.mode = mode;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_get_mode(wifi_mode_t* mode)
+{
+    *mode = host_wifi.mode;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_config(wifi_interface_t interface, wifi_config_t* config)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_start(void)
+{
+    host_wifi.start++;
+    host_wifi_post(WIFI_EVENT, WIFI_EVENT_STA_START, NULL, 0);
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_stop(void)
+{
+    host_wifi.stop++;
+    host_wifi.sta_connected = 0;
+    return ESP_OK;
+}
+
+// Connects if the home AP is there, otherwise fails the way the driver does
+// after a scan turns up nothing
+esp_err_t esp_wifi_connect(void)
+{
+    host_wifi.connect++;
+    if (host_wifi.ap_in_range) {
+        host_wifi.sta_connected = 1;
+        ip_event_got_ip_t event = { .ip_info.ip.addr = 0x6401a8c0 }; // 192.168.1.100
+        host_wifi_post(IP_EVENT, IP_EVENT_STA_GOT_IP, &event, sizeof(event));
+    }
+    else {
+        post_disconnected(WIFI_REASON_NO_AP_FOUND);
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_disconnect(void)
+{
+    host_wifi.disconnect++;
+    if (host_wifi.sta_connected) {
+        host_wifi.sta_connected = 0;
+        post_disconnected(WIFI_REASON_ASSOC_LEAVE);
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_ap_get_sta_list(wifi_sta_list_t* list)
+{
+    memset(list, 0, sizeof(*list));
+    list->num = host_wifi.ap_stations;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_sta_get_ap_info(wifi_ap_record_t* info)
+{
+    if (!host_wifi.sta_connected) {
+        return ESP_FAIL;
+    }
+    memcpy(info->bssid, host_wifi.bssid, 6);
+    info->primary = host_wifi.channel;
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_init(void)
+{
+    return ESP_OK;
+}
+
+esp_netif_t* esp_netif_create_default_wifi_sta(void)
+{
+    return &sta_netif;
+}
+
+esp_netif_t* esp_netif_create_default_wifi_ap(void)
+{
+    return &ap_netif;
+}
+
+esp_err_t esp_netif_dhcpc_start(esp_netif_t* netif)
+{
+    netif->dhcp = 1;
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_dhcpc_stop(esp_netif_t* netif)
+{
+    netif->dhcp = 0;
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_set_ip_info(esp_netif_t* netif, const esp_netif_ip_info_t* info)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_set_dns_info(esp_netif_t* netif, esp_netif_dns_type_t type, esp_netif_dns_info_t* info)
+{
+    return ESP_OK;
+}
@@ -0,0 +1,39 @@
+#ifndef FAKE_WIFI_H_INCLUDED
+#define FAKE_WIFI_H_INCLUDED
+
+#include <stdint.h>
+#include "esp_wifi.h"
+
+// Wi-Fi driver, netif and default event loop. Calls are counted, and events
+// are queued like the driver does and only delivered by host_wifi_run_events,
+// so handlers run after the call that caused them returns
+
+typedef struct
+{
+  int init;
+  int start;
+  int stop;
+  int connect;
+  int disconnect;
+  int set_mode;
+  wifi_mode_t mode;
+  wifi_mode_t mode_history[16];
+  int mode_changes;
+  // What the air looks like
+  uint8_t ap_in_range;   // The home AP answers connects
+  uint8_t ap_stations;   // Phones on our softAP
+  uint8_t sta_connected;
+  uint8_t channel;
+  uint8_t bssid[6];
+} host_wifi_t;
+
+extern host_wifi_t host_wifi;
+
+// Delivers queued events to the registered handlers until none are left
+void host_wifi_run_events(void);
+// Queues an event as if the driver raised it
+void host_wifi_post(esp_event_base_t base, int32_t id, const void* data, size_t len);
+// The home AP goes away, e.g. the router reboots
+void host_wifi_ap_lost(void);
+
+#endif
@@ -0,0 +1,48 @@
+#include <stdarg.h>
+#include <stdlib.h>
+
+#include "idf_host.h"
+
+// Pieces of the IDF every host test links against
+
+int host_log_enabled = 0;
+void (*host_log_sink)(char level, const char* tag, const char* text) = NULL;
+int test_failures = 0;
+
+esp_event_base_t WIFI_EVENT = "WIFI_EVENT";
+esp_event_base_t IP_EVENT = "IP_EVENT";
+
+const char* esp_err_to_name(esp_err_t err)
+{
+    return err == ESP_OK ? "ESP_OK" : "ESP_ERR";
+}
+
+// Fixed seed so every run of a test sees the same numbers
+uint32_t esp_random(void)
+{
+    static uint32_t state = 0x12345678;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+void host_log(char level, const char* tag, const char* fmt, ...)
+{
+    char text[512];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(text, sizeof(text), fmt, args);
+    va_end(args);
+    if (host_log_sink) {
+        host_log_sink(level, tag, text);
+    }
+    else {
+        printf("%s\n", text);
+    }
+}
+
+__attribute__((constructor)) static void host_log_from_env(void)
+{
+    host_log_enabled = getenv("HOST_LOG") != NULL;
+}
@@ -0,0 +1,26 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "jsmn/jsmn_mode.h"
+
+// libFuzzer target. Parses the input with both jsmn builds, whole and in
+// chunks, with enough tokens and with too few, and stops on the first
+// difference. Seed it with the real payloads:
+//   fuzz_jsmn -max_len=1024 fuzz/jsmn_corpus
+// Without clang it is built with fuzz_replay.c instead, which only runs
+// the corpus through it
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    static const size_t chunks[] = { 0, 1, 7 };
+    static const unsigned int token_counts[] = { 4, 16, 32 };
+    for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+        for (size_t t = 0; t < sizeof(token_counts) / sizeof(token_counts[0]); t++) {
+            if (jsmn_host_differs((const char*)data, size, chunks[c], token_counts[t], 0)) {
+                abort();
+            }
+        }
+    }
+    return 0;
+}
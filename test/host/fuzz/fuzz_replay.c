@@ -0,0 +1,41 @@
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Stands in for libFuzzer's main when the compiler doesn't have it. Runs
+// every file in the directories given through the fuzz target once
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+int main(int argc, char** argv)
+{
+    static uint8_t data[1 << 16];
+    int runs = 0;
+    for (int i = 1; i < argc; i++) {
+        DIR* dir = opendir(argv[i]);
+        if (dir == NULL) {
+            printf("Can't open %s\n", argv[i]);
+            return 1;
+        }
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.') {
+                continue;
+            }
+            char path[512];
+            snprintf(path, sizeof(path), "%s/%s", argv[i], entry->d_name);
+            FILE* file = fopen(path, "rb");
+            if (file == NULL) {
+                continue;
+            }
+            size_t size = fread(data, 1, sizeof(data), file);
+            fclose(file);
+            LLVMFuzzerTestOneInput(data, size);
+            runs++;
+        }
+        closedir(dir);
+    }
+    printf("Ran %d inputs\n", runs);
+    return runs > 0 ? 0 : 1;
+}
@@ -0,0 +1,28 @@
+#include <string.h>
+
+#include "jsmn_mode.h"
+
+#define JSMN_DIFF_MAX_TOKENS 512
+
+int jsmn_host_differs(const char* js, size_t len, size_t chunk, unsigned int num_tokens, uint8_t compare_size)
+{
+    static jsmn_host_tok_t parent[JSMN_DIFF_MAX_TOKENS];
+    static jsmn_host_tok_t plain[JSMN_DIFF_MAX_TOKENS];
+    unsigned int parent_filled = 0;
+    unsigned int plain_filled = 0;
+    if (num_tokens > JSMN_DIFF_MAX_TOKENS) {
+        num_tokens = JSMN_DIFF_MAX_TOKENS;
+    }
+    int parent_ret = jsmn_host_parse_parent(js, len, chunk, parent, num_tokens, &parent_filled);
+    int plain_ret = jsmn_host_parse_plain(js, len, chunk, plain, num_tokens, &plain_filled);
+    if (parent_ret != plain_ret || parent_filled != plain_filled) {
+        return 1;
+    }
+    for (unsigned int i = 0; i < parent_filled; i++) {
+        if (parent[i].type != plain[i].type || parent[i].start != plain[i].start || parent[i].end != plain[i].end
+            || (compare_size && parent[i].size != plain[i].size)) {
+            return 1;
+        }
+    }
+    return 0;
+}
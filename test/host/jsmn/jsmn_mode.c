@@ -0,0 +1,53 @@
+// Built once with JSMN_PARENT_LINKS and once without. See jsmn_mode.h
+#define JSMN_STATIC
+#include "jsmn.h"
+#include "jsmn_mode.h"
+
+#ifdef JSMN_PARENT_LINKS
+#define JSMN_MODE(name) name##_parent
+#else
+#define JSMN_MODE(name) name##_plain
+#endif
+
+#define JSMN_HOST_MAX_TOKENS 512
+
+int JSMN_MODE(jsmn_host_parse)(const char* js, size_t len, size_t chunk, jsmn_host_tok_t* tokens, unsigned int num_tokens, unsigned int* filled)
+{
+    jsmntok_t parsed[JSMN_HOST_MAX_TOKENS];
+    jsmn_parser parser;
+    if (num_tokens > JSMN_HOST_MAX_TOKENS) {
+        num_tokens = JSMN_HOST_MAX_TOKENS;
+    }
+    jsmn_init(&parser);
+    int ret;
+    if (chunk == 0) {
+        ret = jsmn_parse(&parser, js, len, parsed, num_tokens);
+    }
+    else {
+        size_t fed = 0;
+        do {
+            fed = fed + chunk < len ? fed + chunk : len;
+            ret = jsmn_parse(&parser, js, fed, parsed, num_tokens);
+        } while (ret == JSMN_ERROR_PART && fed < len);
+    }
+    *filled = parser.toknext;
+    for (unsigned int i = 0; i < parser.toknext; i++) {
+        tokens[i] = (jsmn_host_tok_t){ parsed[i].type, parsed[i].start, parsed[i].end, parsed[i].size };
+    }
+    return ret;
+}
+
+uint64_t JSMN_MODE(jsmn_host_bench)(const char* js, size_t len, unsigned int num_tokens, int iterations)
+{
+    jsmntok_t parsed[JSMN_HOST_MAX_TOKENS];
+    jsmn_parser parser;
+    uint64_t total = 0;
+    for (int i = 0; i < iterations; i++) {
+        jsmn_init(&parser);
+        int ret = jsmn_parse(&parser, js, len, parsed, num_tokens);
+        total += ret > 0 ? ret : 0;
+        // Keeps the compiler from dropping the parse
+        __asm__ volatile("" : : "r"(parsed) : "memory");
+    }
+    return total;
+}
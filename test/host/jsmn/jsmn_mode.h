@@ -0,0 +1,38 @@
+#ifndef JSMN_MODE_H_INCLUDED
+#define JSMN_MODE_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+// main/jsmn.h built twice, once as the firmware has it with
+// JSMN_PARENT_LINKS and once in jsmn's default mode, so the two can be
+// compared and timed against each other. Tokens are copied out into one
+// layout that both builds share
+
+typedef struct
+{
+  int type;
+  int start;
+  int end;
+  int size;
+} jsmn_host_tok_t;
+
+// Parses like the firmware does. With chunk set the data arrives chunk
+// bytes at a time and jsmn is called again on each, the way POST / bodies
+// are parsed as they come in. Returns the jsmn result, and *filled is the
+// number of tokens jsmn wrote, which on an error can be more than zero
+int jsmn_host_parse_parent(const char* js, size_t len, size_t chunk, jsmn_host_tok_t* tokens, unsigned int num_tokens, unsigned int* filled);
+int jsmn_host_parse_plain(const char* js, size_t len, size_t chunk, jsmn_host_tok_t* tokens, unsigned int num_tokens, unsigned int* filled);
+
+// Parses the same data the given number of times and returns the total
+// number of tokens, for timing
+uint64_t jsmn_host_bench_parent(const char* js, size_t len, unsigned int num_tokens, int iterations);
+uint64_t jsmn_host_bench_plain(const char* js, size_t len, unsigned int num_tokens, int iterations);
+
+// Parses with both builds and compares the result and every token's
+// type, start and end. Returns 0 if they match. token.size is only
+// compared when compare_size is set, since the two builds count it
+// differently on some malformed input both of them accept
+int jsmn_host_differs(const char* js, size_t len, size_t chunk, unsigned int num_tokens, uint8_t compare_size);
+
+#endif
@@ -0,0 +1,32 @@
+#pragma once
+#include "idf_host.h"
+typedef enum {LEDC_LOW_SPEED_MODE} ledc_mode_t;
+typedef enum {LEDC_TIMER_0, LEDC_TIMER_1, LEDC_TIMER_2, LEDC_TIMER_3, LEDC_TIMER_MAX} ledc_timer_t;
+typedef enum {LEDC_CHANNEL_0, LEDC_CHANNEL_1, LEDC_CHANNEL_2, LEDC_CHANNEL_3, LEDC_CHANNEL_4, LEDC_CHANNEL_5, LEDC_CHANNEL_MAX} ledc_channel_t;
+typedef enum {LEDC_TIMER_1_BIT=1, LEDC_TIMER_8_BIT=8, LEDC_TIMER_10_BIT=10, LEDC_TIMER_12_BIT=12, LEDC_TIMER_13_BIT=13, LEDC_TIMER_14_BIT=14, LEDC_TIMER_BIT_MAX} ledc_timer_bit_t;
+typedef enum {LEDC_AUTO_CLK, LEDC_USE_APB_CLK, LEDC_USE_XTAL_CLK, LEDC_USE_RTC8M_CLK} ledc_clk_cfg_t;
+typedef enum {LEDC_INTR_DISABLE} ledc_intr_type_t;
+typedef enum {LEDC_FADE_NO_WAIT, LEDC_FADE_WAIT_DONE} ledc_fade_mode_t;
+typedef struct { ledc_mode_t speed_mode; union {ledc_timer_bit_t duty_resolution; ledc_timer_bit_t bit_num;}; ledc_timer_t timer_num; uint32_t freq_hz; ledc_clk_cfg_t clk_cfg; } ledc_timer_config_t;
+typedef struct { int gpio_num; ledc_mode_t speed_mode; ledc_channel_t channel; ledc_intr_type_t intr_type; ledc_timer_t timer_sel; uint32_t duty; int hpoint; struct {unsigned output_invert:1;} flags; } ledc_channel_config_t;
+esp_err_t ledc_timer_config(const ledc_timer_config_t*);
+esp_err_t ledc_channel_config(const ledc_channel_config_t*);
+esp_err_t ledc_fade_func_install(int);
+uint32_t ledc_get_duty(ledc_mode_t, ledc_channel_t);
+esp_err_t ledc_fade_stop(ledc_mode_t, ledc_channel_t);
+esp_err_t ledc_set_fade_with_time(ledc_mode_t, ledc_channel_t, uint32_t, int);
+esp_err_t ledc_set_fade_with_step(ledc_mode_t, ledc_channel_t, uint32_t, uint32_t, uint32_t);
+esp_err_t ledc_fade_start(ledc_mode_t, ledc_channel_t, ledc_fade_mode_t);
+esp_err_t ledc_set_duty_and_update(ledc_mode_t, ledc_channel_t, uint32_t, uint32_t);
+esp_err_t ledc_set_fade_time_and_start(ledc_mode_t, ledc_channel_t, uint32_t, uint32_t, ledc_fade_mode_t);
+esp_err_t ledc_set_duty(ledc_mode_t, ledc_channel_t, uint32_t);
+esp_err_t ledc_update_duty(ledc_mode_t, ledc_channel_t);
+uint32_t ledc_get_freq(ledc_mode_t, ledc_timer_t);
+esp_err_t ledc_timer_rst(ledc_mode_t, ledc_timer_t);
+esp_err_t ledc_timer_pause(ledc_mode_t, ledc_timer_t);
+typedef enum {LEDC_FADE_END_EVT} ledc_cb_event_t;
+typedef struct { ledc_cb_event_t event; uint32_t speed_mode; uint32_t channel; uint32_t duty; } ledc_cb_param_t;
+typedef bool (*ledc_cb_t)(const ledc_cb_param_t *param, void *user_arg);
+typedef struct { ledc_cb_t fade_cb; } ledc_cbs_t;
+esp_err_t ledc_cb_register(ledc_mode_t, ledc_channel_t, ledc_cbs_t*, void*);
+uint32_t ledc_find_suitable_duty_resolution(uint32_t, uint32_t);
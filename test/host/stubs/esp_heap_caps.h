@@ -0,0 +1,8 @@
+#pragma once
+#include "idf_host.h"
+#define MALLOC_CAP_8BIT (1<<2)
+#define MALLOC_CAP_DEFAULT (1<<12)
+size_t heap_caps_get_free_size(uint32_t); size_t heap_caps_get_minimum_free_size(uint32_t); size_t heap_caps_get_largest_free_block(uint32_t);
+void* heap_caps_malloc(size_t, uint32_t);
+bool heap_caps_check_integrity_all(bool);
+size_t heap_caps_get_total_size(uint32_t);
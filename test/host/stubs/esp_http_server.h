@@ -0,0 +1,39 @@
+#pragma once
+#include "idf_host.h"
+typedef void* httpd_handle_t;
+typedef enum {HTTP_GET, HTTP_POST, HTTP_PUT, HTTP_DELETE} httpd_method_t;
+typedef struct httpd_req { httpd_handle_t handle; int method; const char uri[513]; size_t content_len; void* aux; void* user_ctx; void* sess_ctx; void (*free_ctx)(void*); bool ignore_sess_ctx_changes; } httpd_req_t;
+typedef esp_err_t (*httpd_uri_handler_t)(httpd_req_t*);
+typedef struct { const char* uri; httpd_method_t method; esp_err_t (*handler)(httpd_req_t*); void* user_ctx; } httpd_uri_t;
+typedef bool (*httpd_uri_match_func_t)(const char*, const char*, size_t);
+typedef esp_err_t (*httpd_open_func_t)(httpd_handle_t, int);
+typedef void (*httpd_close_func_t)(httpd_handle_t, int);
+typedef struct { unsigned task_priority; size_t stack_size; int core_id; uint16_t server_port; uint16_t ctrl_port; uint16_t max_open_sockets; uint16_t max_uri_handlers; uint16_t max_resp_headers; uint16_t backlog_conn; bool lru_purge_enable; uint16_t recv_wait_timeout; uint16_t send_wait_timeout; void* global_user_ctx; void (*global_user_ctx_free_fn)(void*); void* global_transport_ctx; void (*global_transport_ctx_free_fn)(void*); httpd_open_func_t open_fn; httpd_close_func_t close_fn; httpd_uri_match_func_t uri_match_fn; } httpd_config_t;
+#define HTTPD_DEFAULT_CONFIG() { .task_priority=5, .stack_size=4096, .server_port=80, .ctrl_port=32768, .max_open_sockets=7, .max_uri_handlers=8, .max_resp_headers=8, .backlog_conn=5, .lru_purge_enable=false, .recv_wait_timeout=5, .send_wait_timeout=5 }
+#define HTTPD_200 "200 OK"
+#define HTTPD_204 "204 No Content"
+#define HTTPD_400 "400 Bad Request"
+#define HTTPD_404 "404 Not Found"
+#define HTTPD_408 "408 Request Timeout"
+#define HTTPD_500 "500 Internal Server Error"
+#define HTTPD_RESP_USE_STRLEN -1
+#define HTTPD_SOCK_ERR_TIMEOUT -3
+typedef enum { HTTPD_500_INTERNAL_SERVER_ERROR, HTTPD_400_BAD_REQUEST, HTTPD_404_NOT_FOUND, HTTPD_405_METHOD_NOT_ALLOWED, HTTPD_408_REQ_TIMEOUT, HTTPD_411_LENGTH_REQUIRED, HTTPD_414_URI_TOO_LONG, HTTPD_431_REQ_HDR_FIELDS_TOO_LARGE } httpd_err_code_t;
+esp_err_t httpd_start(httpd_handle_t*, const httpd_config_t*);
+esp_err_t httpd_stop(httpd_handle_t);
+esp_err_t httpd_register_uri_handler(httpd_handle_t, const httpd_uri_t*);
+esp_err_t httpd_resp_send(httpd_req_t*, const char*, ssize_t);
+esp_err_t httpd_resp_send_chunk(httpd_req_t*, const char*, ssize_t);
+esp_err_t httpd_resp_set_status(httpd_req_t*, const char*);
+esp_err_t httpd_resp_set_type(httpd_req_t*, const char*);
+esp_err_t httpd_resp_set_hdr(httpd_req_t*, const char*, const char*);
+esp_err_t httpd_resp_send_408(httpd_req_t*);
+esp_err_t httpd_resp_send_err(httpd_req_t*, httpd_err_code_t, const char*);
+esp_err_t httpd_resp_send_404(httpd_req_t*);
+int httpd_req_recv(httpd_req_t*, char*, size_t);
+size_t httpd_req_get_hdr_value_len(httpd_req_t*, const char*);
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t*, const char*, char*, size_t);
+bool httpd_uri_match_wildcard(const char*, const char*, size_t);
+int httpd_req_to_sockfd(httpd_req_t*);
+void* httpd_get_global_user_ctx(httpd_handle_t);
+esp_err_t httpd_sess_trigger_close(httpd_handle_t, int);
@@ -0,0 +1,19 @@
+#pragma once
+#include "idf_host.h"
+typedef struct { uint32_t addr; } esp_ip4_addr_t;
+typedef struct { esp_ip4_addr_t ip; esp_ip4_addr_t netmask; esp_ip4_addr_t gw; } esp_netif_ip_info_t;
+typedef struct esp_netif_obj esp_netif_t;
+esp_err_t esp_netif_init(void);
+esp_netif_t* esp_netif_create_default_wifi_sta(void);
+esp_netif_t* esp_netif_create_default_wifi_ap(void);
+esp_err_t esp_netif_dhcpc_stop(esp_netif_t*);
+esp_err_t esp_netif_dhcpc_start(esp_netif_t*);
+esp_err_t esp_netif_set_ip_info(esp_netif_t*, const esp_netif_ip_info_t*);
+esp_err_t esp_netif_get_ip_info(esp_netif_t*, esp_netif_ip_info_t*);
+typedef struct { union { esp_ip4_addr_t ip4; } u_addr; int type; } esp_ip_addr_t;
+typedef struct { esp_ip_addr_t ip; } esp_netif_dns_info_t;
+typedef enum { ESP_NETIF_DNS_MAIN } esp_netif_dns_type_t;
+esp_err_t esp_netif_set_dns_info(esp_netif_t*, esp_netif_dns_type_t, esp_netif_dns_info_t*);
+#define ESP_IPADDR_TYPE_V4 0
+uint32_t esp_ip4addr_aton(const char*);
+esp_netif_t* esp_netif_get_handle_from_ifkey(const char*);
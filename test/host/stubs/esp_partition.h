@@ -0,0 +1,3 @@
+#pragma once
+#include "idf_host.h"
+typedef struct { int type; int subtype; uint32_t address; uint32_t size; } esp_partition_t;
@@ -0,0 +1,7 @@
+#pragma once
+#include "idf_host.h"
+#include <sys/time.h>
+#define SNTP_OPMODE_POLL 0
+void sntp_setoperatingmode(int); void sntp_setservername(int, const char*);
+typedef void (*sntp_sync_time_cb_t)(struct timeval *tv);
+void sntp_set_time_sync_notification_cb(sntp_sync_time_cb_t); void sntp_init(void);
@@ -0,0 +1,3 @@
+#pragma once
+#include "idf_host.h"
+uint32_t esp_random(void);
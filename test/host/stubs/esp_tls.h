@@ -0,0 +1,38 @@
+#pragma once
+#include <stdbool.h>
+#include "esp_err.h"
+#include "mbedtls/ssl.h"
+
+// The esp-tls client API as IDF 4.4 has it with
+// CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS, cut down to the fields used
+
+typedef struct esp_tls_client_session
+{
+  mbedtls_ssl_session saved_session;
+} esp_tls_client_session_t;
+
+typedef struct esp_tls_cfg
+{
+  const unsigned char* cacert_buf;
+  unsigned int cacert_bytes;
+  const unsigned char* clientcert_buf;
+  unsigned int clientcert_bytes;
+  const unsigned char* clientkey_buf;
+  unsigned int clientkey_bytes;
+  int timeout_ms;
+  const char* common_name;
+  bool skip_common_name;
+  esp_err_t (*crt_bundle_attach)(void* conf);
+  esp_tls_client_session_t* client_session;
+} esp_tls_cfg_t;
+
+typedef struct esp_tls
+{
+  int sockfd;
+  void* host_ssl;
+} esp_tls_t;
+
+esp_tls_t* esp_tls_init(void);
+int esp_tls_conn_new_sync(const char* hostname, int hostlen, int port, const esp_tls_cfg_t* cfg, esp_tls_t* tls);
+int esp_tls_conn_destroy(esp_tls_t* tls);
+esp_tls_client_session_t* esp_tls_get_client_session(esp_tls_t* tls);
@@ -0,0 +1,3 @@
+#pragma once
+#include "idf_host.h"
+int esp_crypto_base64_encode(unsigned char*, size_t, size_t*, const unsigned char*, size_t);
@@ -0,0 +1,32 @@
+#pragma once
+#include "idf_host.h"
+#include "esp_netif.h"
+typedef enum { WIFI_MODE_NULL, WIFI_MODE_STA, WIFI_MODE_AP, WIFI_MODE_APSTA } wifi_mode_t;
+typedef enum { WIFI_IF_STA, WIFI_IF_AP } wifi_interface_t;
+typedef enum { WIFI_AUTH_OPEN, WIFI_AUTH_WPA_PSK, WIFI_AUTH_WPA2_PSK, WIFI_AUTH_WPA_WPA2_PSK } wifi_auth_mode_t;
+typedef enum { WIFI_ALL_CHANNEL_SCAN, WIFI_FAST_SCAN } wifi_scan_method_t;
+typedef struct { wifi_auth_mode_t authmode; int8_t rssi; } wifi_scan_threshold_t;
+typedef struct { uint8_t ssid[32]; uint8_t password[64]; wifi_scan_method_t scan_method; bool bssid_set; uint8_t bssid[6]; uint8_t channel; wifi_scan_threshold_t threshold; } wifi_sta_config_t;
+typedef struct { uint8_t ssid[32]; uint8_t password[64]; uint8_t ssid_len; uint8_t channel; wifi_auth_mode_t authmode; uint8_t max_connection; } wifi_ap_config_t;
+typedef union { wifi_ap_config_t ap; wifi_sta_config_t sta; } wifi_config_t;
+typedef struct { int x; } wifi_init_config_t;
+#define WIFI_INIT_CONFIG_DEFAULT() {0}
+typedef struct { uint8_t mac[6]; } wifi_sta_info_t;
+typedef struct { wifi_sta_info_t sta[10]; int num; } wifi_sta_list_t;
+typedef struct { uint8_t mac[6]; uint8_t aid; } wifi_event_ap_staconnected_t;
+typedef struct { uint8_t mac[6]; uint8_t aid; } wifi_event_ap_stadisconnected_t;
+typedef struct { uint8_t ssid[32]; uint8_t ssid_len; uint8_t bssid[6]; uint8_t channel; wifi_auth_mode_t authmode; } wifi_event_sta_connected_t;
+typedef struct { uint8_t ssid[32]; uint8_t ssid_len; uint8_t bssid[6]; uint8_t reason; } wifi_event_sta_disconnected_t;
+typedef struct { uint8_t bssid[6]; uint8_t primary; } wifi_ap_record_t;
+enum { WIFI_EVENT_STA_START, WIFI_EVENT_STA_STOP, WIFI_EVENT_STA_CONNECTED, WIFI_EVENT_STA_DISCONNECTED, WIFI_EVENT_AP_STACONNECTED, WIFI_EVENT_AP_STADISCONNECTED, WIFI_EVENT_AP_START };
+enum { IP_EVENT_STA_GOT_IP, IP_EVENT_STA_LOST_IP };
+typedef struct { esp_netif_ip_info_t ip_info; } ip_event_got_ip_t;
+esp_err_t esp_wifi_init(const wifi_init_config_t*);
+esp_err_t esp_wifi_set_mode(wifi_mode_t); esp_err_t esp_wifi_get_mode(wifi_mode_t*);
+esp_err_t esp_wifi_set_config(wifi_interface_t, wifi_config_t*);
+esp_err_t esp_wifi_start(void); esp_err_t esp_wifi_stop(void);
+esp_err_t esp_wifi_connect(void); esp_err_t esp_wifi_disconnect(void);
+esp_err_t esp_wifi_ap_get_sta_list(wifi_sta_list_t*);
+esp_err_t esp_wifi_sta_get_ap_info(wifi_ap_record_t*);
+enum { WIFI_REASON_AUTH_EXPIRE = 2, WIFI_REASON_ASSOC_EXPIRE = 4, WIFI_REASON_ASSOC_LEAVE = 8, WIFI_REASON_BEACON_TIMEOUT = 200,
+       WIFI_REASON_NO_AP_FOUND = 201, WIFI_REASON_AUTH_FAIL = 202, WIFI_REASON_ASSOC_FAIL = 203, WIFI_REASON_HANDSHAKE_TIMEOUT = 204 };
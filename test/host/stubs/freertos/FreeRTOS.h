@@ -0,0 +1,21 @@
+#pragma once
+#include "idf_host.h"
+typedef uint32_t TickType_t; typedef int BaseType_t; typedef unsigned UBaseType_t;
+typedef uint32_t StackType_t;
+#define portTICK_RATE_MS 1
+#define portTICK_PERIOD_MS 1
+#define portMAX_DELAY 0xffffffff
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define pdMS_TO_TICKS(x) (x)
+#define configMAX_TASK_NAME_LEN 16
+typedef struct { int x[30]; } StaticTask_t;
+typedef struct { int x[20]; } StaticQueue_t;
+typedef StaticQueue_t StaticSemaphore_t;
+typedef struct { int x[10]; } StaticTimer_t;
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED 0
+void portENTER_CRITICAL(portMUX_TYPE*); void portEXIT_CRITICAL(portMUX_TYPE*);
+#define portENTER_CRITICAL_ISR portENTER_CRITICAL
+#define portEXIT_CRITICAL_ISR portEXIT_CRITICAL
@@ -0,0 +1,9 @@
+#pragma once
+#include "FreeRTOS.h"
+typedef void* QueueHandle_t;
+QueueHandle_t xQueueCreate(UBaseType_t, UBaseType_t);
+QueueHandle_t xQueueCreateStatic(UBaseType_t, UBaseType_t, uint8_t*, StaticQueue_t*);
+BaseType_t xQueueSend(QueueHandle_t, const void*, TickType_t);
+BaseType_t xQueueSendFromISR(QueueHandle_t, const void*, BaseType_t*);
+BaseType_t xQueueReceive(QueueHandle_t, void*, TickType_t);
+BaseType_t xQueueOverwrite(QueueHandle_t, const void*);
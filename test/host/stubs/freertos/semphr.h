@@ -0,0 +1,8 @@
+#pragma once
+#include "queue.h"
+typedef void* SemaphoreHandle_t;
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t*);
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t, TickType_t);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t);
@@ -0,0 +1,21 @@
+#pragma once
+#include "FreeRTOS.h"
+typedef void* TaskHandle_t;
+typedef void (*TaskFunction_t)(void*);
+BaseType_t xTaskCreate(TaskFunction_t, const char*, uint32_t, void*, UBaseType_t, TaskHandle_t*);
+TaskHandle_t xTaskCreateStatic(TaskFunction_t, const char*, uint32_t, void*, UBaseType_t, StackType_t*, StaticTask_t*);
+void vTaskDelay(TickType_t); void vTaskDelayUntil(TickType_t*, TickType_t);
+TickType_t xTaskGetTickCount(void);
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t);
+TaskHandle_t xTaskGetHandle(const char*);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+UBaseType_t uxTaskGetNumberOfTasks(void);
+typedef enum {eRunning, eReady, eBlocked, eSuspended, eDeleted} eTaskState;
+typedef struct { TaskHandle_t xHandle; const char* pcTaskName; UBaseType_t xTaskNumber; eTaskState eCurrentState; UBaseType_t uxCurrentPriority; UBaseType_t uxBasePriority; uint32_t ulRunTimeCounter; StackType_t* pxStackBase; uint32_t usStackHighWaterMark; } TaskStatus_t;
+UBaseType_t uxTaskGetSystemState(TaskStatus_t*, UBaseType_t, uint32_t*);
+void vTaskDelete(TaskHandle_t);
+uint32_t ulTaskNotifyTake(BaseType_t, TickType_t);
+void vTaskNotifyGiveFromISR(TaskHandle_t, BaseType_t*);
+BaseType_t xTaskNotifyGive(TaskHandle_t);
+void portYIELD_FROM_ISR(void);
+const char* pcTaskGetName(TaskHandle_t);
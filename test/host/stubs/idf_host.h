@@ -0,0 +1,76 @@
+#pragma once
+
+// Just enough of the ESP-IDF API for the firmware sources to build on a PC
+// Every stub header includes this one. The functions are implemented by the
+// fakes in test/host/fake, and only the ones a test links against are needed
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_NO_MEM 0x101
+#define ESP_ERR_INVALID_ARG 0x102
+#define ESP_ERR_INVALID_STATE 0x103
+#define ESP_ERR_INVALID_SIZE 0x104
+#define ESP_ERR_NOT_FOUND 0x105
+#define ESP_ERR_TIMEOUT 0x107
+#define ESP_ERR_NVS_NOT_FOUND 0x1102
+#define ESP_ERR_NVS_NO_FREE_PAGES 0x110d
+#define ESP_ERR_NVS_NEW_VERSION_FOUND 0x1110
+#define ESP_ERR_NVS_INVALID_LENGTH 0x110c
+const char* esp_err_to_name(esp_err_t);
+#define ESP_ERROR_CHECK(x) (void)(x)
+
+// Logs are type checked but not printed, so test output stays readable
+// Set host_log_enabled to see them, or set host_log_sink as well to get
+// every line with its level and tag, the way the device would print it
+extern int host_log_enabled;
+extern void (*host_log_sink)(char level, const char* tag, const char* text);
+void host_log(char level, const char* tag, const char* fmt, ...) __attribute__((format(printf, 3, 4)));
+#define HOST_LOG(level, tag, fmt, ...) do { if (host_log_enabled) host_log(level, tag, fmt, ##__VA_ARGS__); } while (0)
+#define ESP_LOGI(tag, fmt, ...) HOST_LOG('I', tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) HOST_LOG('W', tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGE(tag, fmt, ...) HOST_LOG('E', tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) HOST_LOG('D', tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGV(tag, fmt, ...) HOST_LOG('V', tag, fmt, ##__VA_ARGS__)
+#define ESP_EARLY_LOGI(tag, fmt, ...) HOST_LOG('I', tag, fmt, ##__VA_ARGS__)
+typedef enum { ESP_LOG_NONE, ESP_LOG_ERROR, ESP_LOG_WARN, ESP_LOG_INFO, ESP_LOG_DEBUG, ESP_LOG_VERBOSE } esp_log_level_t;
+#define ESP_LOG_LEVEL_LOCAL(level, tag, fmt, ...) HOST_LOG("NEWIDV"[level], tag, fmt, ##__VA_ARGS__)
+
+typedef const char* esp_event_base_t;
+typedef void* esp_event_handler_instance_t;
+typedef void (*esp_event_handler_t)(void*, esp_event_base_t, int32_t, void*);
+extern esp_event_base_t WIFI_EVENT, IP_EVENT;
+#define ESP_EVENT_ANY_ID -1
+esp_err_t esp_event_loop_create_default(void);
+esp_err_t esp_event_handler_instance_register(esp_event_base_t, int32_t, esp_event_handler_t, void*, esp_event_handler_instance_t*);
+
+#define IRAM_ATTR
+#define MACSTR "%02x:%02x:%02x:%02x:%02x:%02x"
+#define MAC2STR(a) (a)[0], (a)[1], (a)[2], (a)[3], (a)[4], (a)[5]
+#define IPSTR "%d.%d.%d.%d"
+#define IP2STR(ipaddr) (int)((ipaddr)->addr & 0xff), (int)(((ipaddr)->addr >> 8) & 0xff), \
+    (int)(((ipaddr)->addr >> 16) & 0xff), (int)(((ipaddr)->addr >> 24) & 0xff)
+
+typedef enum { ESP_MAC_WIFI_STA } esp_mac_type_t;
+esp_err_t esp_read_mac(uint8_t*, esp_mac_type_t);
+void esp_restart(void);
+uint32_t esp_random(void);
+size_t esp_get_free_heap_size(void);
+size_t esp_get_minimum_free_heap_size(void);
+
+int64_t esp_timer_get_time(void);
+typedef struct esp_timer* esp_timer_handle_t;
+typedef void (*esp_timer_cb_t)(void* arg);
+typedef enum { ESP_TIMER_TASK } esp_timer_dispatch_t;
+typedef struct { esp_timer_cb_t callback; void* arg; esp_timer_dispatch_t dispatch_method; const char* name; bool skip_unhandled_events; } esp_timer_create_args_t;
+esp_err_t esp_timer_create(const esp_timer_create_args_t*, esp_timer_handle_t*);
+esp_err_t esp_timer_start_once(esp_timer_handle_t, uint64_t);
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t, uint64_t);
+esp_err_t esp_timer_stop(esp_timer_handle_t);
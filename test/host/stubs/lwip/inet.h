@@ -0,0 +1,3 @@
+#pragma once
+#include "sockets.h"
+char* inet_ntoa_r(struct in_addr addr, char* buf, int buflen);
@@ -0,0 +1,11 @@
+#pragma once
+
+// The part of an mbedtls session the firmware reads. host_session is the
+// OpenSSL session behind it in test/host/fake/fake_tls.c
+typedef struct mbedtls_ssl_session
+{
+  unsigned char master[48];
+  void* host_session;
+} mbedtls_ssl_session;
+
+void mbedtls_ssl_session_free(mbedtls_ssl_session* session);
@@ -0,0 +1,3 @@
+#pragma once
+#include "idf_host.h"
+esp_err_t mdns_init(void); esp_err_t mdns_hostname_set(const char*); esp_err_t mdns_instance_name_set(const char*);
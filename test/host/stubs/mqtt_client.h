@@ -0,0 +1,21 @@
+#pragma once
+#include "idf_host.h"
+typedef struct esp_mqtt_client* esp_mqtt_client_handle_t;
+typedef enum { MQTT_EVENT_ANY=-1, MQTT_EVENT_ERROR=0, MQTT_EVENT_CONNECTED, MQTT_EVENT_DISCONNECTED, MQTT_EVENT_SUBSCRIBED, MQTT_EVENT_UNSUBSCRIBED, MQTT_EVENT_PUBLISHED, MQTT_EVENT_DATA, MQTT_EVENT_BEFORE_CONNECT, MQTT_EVENT_DELETED } esp_mqtt_event_id_t;
+typedef enum { MQTT_ERROR_TYPE_NONE, MQTT_ERROR_TYPE_TCP_TRANSPORT, MQTT_ERROR_TYPE_CONNECTION_REFUSED } esp_mqtt_error_type_t;
+typedef struct { esp_err_t esp_tls_last_esp_err; int esp_tls_stack_err; int esp_tls_cert_verify_flags; esp_mqtt_error_type_t error_type; int connect_return_code; int esp_transport_sock_errno; } esp_mqtt_error_codes_t;
+typedef struct esp_mqtt_event_t { esp_mqtt_event_id_t event_id; esp_mqtt_client_handle_t client; void* user_context; char* data; int data_len; int total_data_len; int current_data_offset; char* topic; int topic_len; int msg_id; int session_present; esp_mqtt_error_codes_t* error_handle; bool retain; int qos; bool dup; } esp_mqtt_event_t;
+typedef esp_mqtt_event_t* esp_mqtt_event_handle_t;
+typedef struct { const char* uri; const char* client_id; const char* lwt_topic; const char* lwt_msg; int lwt_qos; int lwt_retain; int lwt_msg_len; int disable_clean_session; int keepalive; bool disable_auto_reconnect; int reconnect_timeout_ms; const char* cert_pem; size_t cert_len; const char* client_cert_pem; size_t client_cert_len; const char* client_key_pem; size_t client_key_len; esp_err_t (*crt_bundle_attach)(void *conf); bool skip_cert_common_name_check; int network_timeout_ms; int out_buffer_size; int buffer_size; int task_prio; int task_stack; int outbox_limit; } esp_mqtt_client_config_t;
+esp_mqtt_client_handle_t esp_mqtt_client_init(const esp_mqtt_client_config_t*);
+esp_err_t esp_mqtt_client_set_uri(esp_mqtt_client_handle_t, const char*);
+esp_err_t esp_mqtt_client_start(esp_mqtt_client_handle_t);
+esp_err_t esp_mqtt_client_stop(esp_mqtt_client_handle_t);
+esp_err_t esp_mqtt_client_disconnect(esp_mqtt_client_handle_t);
+esp_err_t esp_mqtt_client_reconnect(esp_mqtt_client_handle_t);
+esp_err_t esp_mqtt_set_config(esp_mqtt_client_handle_t, const esp_mqtt_client_config_t*);
+int esp_mqtt_client_publish(esp_mqtt_client_handle_t, const char*, const char*, int, int, int);
+int esp_mqtt_client_enqueue(esp_mqtt_client_handle_t, const char*, const char*, int, int, int, bool);
+int esp_mqtt_client_subscribe(esp_mqtt_client_handle_t, const char*, int);
+esp_err_t esp_mqtt_client_register_event(esp_mqtt_client_handle_t, esp_mqtt_event_id_t, esp_event_handler_t, void*);
+int esp_mqtt_client_get_outbox_size(esp_mqtt_client_handle_t);
@@ -0,0 +1,35 @@
+#ifndef TEST_COMMON_H_INCLUDED
+#define TEST_COMMON_H_INCLUDED
+
+#include <stdio.h>
+
+// Minimal test helpers. Each test file is its own executable and returns
+// non-zero from main if any check failed, which is all ctest looks at
+
+extern int test_failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        test_failures++; \
+    } \
+} while (0)
+
+#define CHECK_EQ(actual, expected) do { \
+    long long check_a = (long long)(actual); \
+    long long check_e = (long long)(expected); \
+    if (check_a != check_e) { \
+        printf("%s:%d: check failed: %s is %lld, expected %lld\n", __FILE__, __LINE__, #actual, check_a, check_e); \
+        test_failures++; \
+    } \
+} while (0)
+
+#define RUN_TEST(test) do { \
+    int failures_before = test_failures; \
+    test(); \
+    printf("%s %s\n", test_failures == failures_before ? "PASS" : "FAIL", #test); \
+} while (0)
+
+#define TEST_RESULT() (test_failures == 0 ? 0 : 1)
+
+#endif
@@ -0,0 +1,165 @@
+#include "test_common.h"
+#include "fake/fake_clock.h"
+#include "fake/fake_mqtt.h"
+#include "fake/fake_nvs.h"
+
+// The firmware itself, so the test can reach the discovery state
+#include "main.c"
+
+// Connects to a broker whose outbox holds a fixed number of messages until
+// it acks them, and checks that a forced discovery burst gets every config
+// and state to the broker: all at once with the default outbox, and paced
+// on the acks with a small one. A config the outbox refuses is sent again
+// once there is room. outbox_latest_get_stats is wrapped to report the
+// fake client's outbox, since that is the one the messages go into
+
+void __wrap_outbox_latest_get_stats(outbox_latest_stats_t* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->slots = host_mqtt.outbox_slots;
+    stats->used = host_mqtt.outbox_used;
+}
+
+// Boots with a saved scene that is active, then connects without a
+// session so discovery is forced
+static void connect_to_broker(int slots)
+{
+    host_mqtt_ack(HOST_MQTT_OUTBOX);
+    host_mqtt.outbox_slots = slots;
+    host_mqtt.refused = 0;
+    host_mqtt.publishes = 0;
+    host_nvs_erase_all();
+    initialize_data();
+    memset(discovery_hashes, 0, sizeof(discovery_hashes));
+    memset(discovery_pending_msg_id, 0, sizeof(discovery_pending_msg_id));
+    memset(light_state_hashes, 0, sizeof(light_state_hashes));
+    scene_state_hash = 0;
+    discovery_unsent = 0;
+    save_scene(0, "Evening", 7);
+    strcpy(active_scene, "Evening");
+
+    host_mqtt_event(MQTT_EVENT_CONNECTED, NULL, NULL);
+    CHECK_EQ(mqtt_discovery_force, 1);
+    mqtt_discovery_force = 0;
+    publish_discovery(1);
+}
+
+// Every config has been acked with the payload the device has now, and
+// every state has been published
+static void check_all_delivered(void)
+{
+    char topic_buf[64];
+    char payload_buf[384];
+    for (uint8_t index = 0; index < MQTT_DISCOVERY_ENTITIES; index++) {
+        const char* topic;
+        const char* payload;
+        discovery_config(index, topic_buf, payload_buf, &topic, &payload);
+        CHECK_EQ(discovery_hashes[index], mqtt_hash(payload));
+    }
+    for (uint8_t i = 0; i < 4; i++) {
+        CHECK(host_mqtt_last(light_data[i].mqtt_state_topic) != NULL);
+    }
+    CHECK(host_mqtt_last(mqtt_scene_state_topic) != NULL);
+    CHECK_EQ(discovery_unsent, 0);
+    CHECK_EQ(host_mqtt.refused, 0);
+}
+
+// The availability and 8 subscribes of the connect, then 22 discovery
+// messages, fit the default outbox in one pass
+static void test_forced_burst_fits_default_outbox(void)
+{
+    connect_to_broker(CONFIG_MQTT_OUTBOX_SLOTS);
+    CHECK_EQ(host_mqtt.subscribes % 8, 0);
+    CHECK_EQ(host_mqtt.publishes, 1 + 22);
+    CHECK(host_mqtt.outbox_used <= CONFIG_MQTT_OUTBOX_SLOTS);
+    CHECK_EQ(discovery_unsent, 0);
+    host_mqtt_ack(HOST_MQTT_OUTBOX);
+    check_all_delivered();
+}
+
+// With 16 slots the burst waits for acks and the MQTT task sends the rest,
+// a few acks at a time, without a message being refused
+static void test_small_outbox_paces_burst(void)
+{
+    connect_to_broker(16);
+    CHECK(discovery_unsent != 0);
+    CHECK_EQ(host_mqtt.refused, 0);
+    int passes = 0;
+    while (discovery_unsent != 0 && passes < 20) {
+        host_mqtt_ack(3);
+        publish_discovery_unsent();
+        CHECK(host_mqtt.outbox_used <= 16);
+        passes++;
+    }
+    host_mqtt_ack(HOST_MQTT_OUTBOX);
+    check_all_delivered();
+    printf("  16 slots: sent in %d more passes of the MQTT task\n", passes);
+}
+
+// A rename while the outbox is full has its config refused, and it goes
+// out on the MQTT task's next pass once the broker has acked
+static void test_refused_config_is_sent_again(void)
+{
+    connect_to_broker(16);
+    while (discovery_unsent != 0) {
+        host_mqtt_ack(HOST_MQTT_OUTBOX);
+        publish_discovery_unsent();
+    }
+    host_mqtt_ack(HOST_MQTT_OUTBOX);
+    while (esp_mqtt_client_publish(mqtt_client, "other/state", "x", 0, 1, 0) > 0) {
+    }
+    host_mqtt.refused = 0;
+
+    sprintf(light_data[0].name, "Desk");
+    set_mqtt_config_payload(0);
+    publish_light_config(0);
+    CHECK(host_mqtt.refused > 0);
+    CHECK(discovery_is_unsent(0));
+    publish_discovery_unsent();
+    CHECK(discovery_is_unsent(0));
+
+    host_mqtt_ack(HOST_MQTT_OUTBOX);
+    host_mqtt.refused = 0;
+    publish_discovery_unsent();
+    host_mqtt_ack(HOST_MQTT_OUTBOX);
+    check_all_delivered();
+    CHECK(strstr(host_mqtt_last(light_data[0].mqtt_config_topic)->payload, "Desk") != NULL);
+}
+
+// 8 scene names that each escape to 72 bytes don't fit one outbox slot, so
+// the ones that would take the publish past it are left out
+static void test_scene_config_fits_a_slot(void)
+{
+    connect_to_broker(CONFIG_MQTT_OUTBOX_SLOTS);
+    host_mqtt_ack(HOST_MQTT_OUTBOX);
+    char name[SCENE_NAME_LENGTH];
+    memset(name, 0x01, SCENE_NAME_LENGTH - 1);
+    name[SCENE_NAME_LENGTH - 1] = '\0';
+    for (uint8_t slot = 0; slot < SCENE_MAX_COUNT; slot++) {
+        name[0] = 'A' + slot;
+        save_scene(slot, name, SCENE_NAME_LENGTH - 1);
+        host_mqtt_ack(HOST_MQTT_OUTBOX);
+    }
+    size_t len = strlen(mqtt_scene_config_payload);
+    CHECK(len + strlen(mqtt_scene_config_topic) + OUTBOX_PUBLISH_OVERHEAD <= OUTBOX_SLOT_SIZE);
+    CHECK_EQ(strcmp(mqtt_scene_config_payload + len - 2, "]}"), 0);
+    CHECK(strstr(mqtt_scene_config_payload, "\"A\\u0001") != NULL);
+    CHECK(strstr(mqtt_scene_config_payload, "\"H\\u0001") == NULL);
+    CHECK_EQ(host_mqtt.refused, 0);
+}
+
+int main(void)
+{
+    esp_timer_create_args_t discovery_timer_args = {
+        .callback = &discovery_timer_cb,
+        .name = "mqtt_discovery",
+    };
+    esp_timer_create(&discovery_timer_args, &mqtt_discovery_timer);
+    esp_mqtt_client_register_event(mqtt_client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
+
+    RUN_TEST(test_forced_burst_fits_default_outbox);
+    RUN_TEST(test_small_outbox_paces_burst);
+    RUN_TEST(test_refused_config_is_sent_again);
+    RUN_TEST(test_scene_config_fits_a_slot);
+    return TEST_RESULT();
+}
@@ -0,0 +1,335 @@
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "test_common.h"
+#include "fake/fake_clock.h"
+#include "fake/fake_freertos.h"
+
+// The firmware's UDP control itself, so the test can reach the group state
+#include "udp_control.c"
+
+// Several boards on one PC, each a process running the real UDP control
+// and group tasks, all joined to the group command multicast group through
+// the loopback of the default interface. The test sends group commands the
+// way a relaying board does, three copies of each, and every board reports
+// the PC's time when its group task ran the command. The spread of those
+// times is the skew between fixtures
+//
+// The boards' virtual clocks are pumped to follow the PC's clock, so the
+// wall clock they schedule against is the same one, as if SNTP were
+// perfect. The skew measured is what the boards themselves add on top of
+// their clocks, and it is for this PC, so it is only a rough guide to the
+// device. Commands with no start time are measured the same way to compare
+//
+// If the PC has no multicast route the test is skipped
+
+#define BOARDS            6
+#define COMMANDS          20
+#define COMMAND_GAP_US    100000
+#define PUMP_US           50
+#define SKIP_CODE         77
+
+#define COMMAND_PING      100  // Sent until every board answers
+#define COMMAND_MEASURE   101
+#define COMMAND_STOP      102
+
+typedef struct
+{
+  uint8_t board;
+  uint8_t command;
+  uint8_t id;
+  int64_t ran_us;
+} board_report_t;
+
+// Only live control sets levels, and this test doesn't send any
+void lights_set_brightness_immediate(int pwm, int channel)
+{
+}
+
+// Every board here is a process on one PC, so they share the ports that
+// each board has to itself on the device
+int __real_bind(int sock, const struct sockaddr* addr, socklen_t len);
+int __wrap_bind(int sock, const struct sockaddr* addr, socklen_t len)
+{
+    int on = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    return __real_bind(sock, addr, len);
+}
+
+static int64_t realtime_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint8_t board_id;
+static int report_fd;
+static volatile uint8_t board_stop = 0;
+
+static void board_command(uint8_t command, const uint8_t* data, uint8_t len, uint16_t fade_ms)
+{
+    board_report_t report = {
+        .board = board_id,
+        .command = command,
+        .id = len > 0 ? data[0] : 0,
+        .ran_us = realtime_us(),
+    };
+    if (write(report_fd, &report, sizeof(report)) != sizeof(report)) {
+        board_stop = 1;
+    }
+    if (command == COMMAND_STOP) {
+        board_stop = 1;
+    }
+}
+
+// One board. Odd boards are in group 1, even boards in groups 1 and 2
+static void run_board(uint8_t id, int fd)
+{
+    board_id = id;
+    report_fd = fd;
+    host_clock_advance(realtime_us());
+    host_clock_set_wall(host_clock_now() / 1000000);
+    udp_control_init(1, 1, NULL);
+    udp_control_init_groups(id % 2 ? 0x1 : 0x3, board_command);
+    host_task_allow("udp_control_task");
+    host_task_allow("group_task");
+    xTaskCreate(udp_control_task, "udp_control_task", 4096, NULL, 5, NULL);
+    xTaskCreate(udp_control_group_task, "group_task", 4096, NULL, 6, NULL);
+    int64_t give_up = realtime_us() + 60000000;
+    while (!board_stop && realtime_us() < give_up) {
+        usleep(PUMP_US);
+        host_clock_advance(realtime_us() - host_clock_now());
+    }
+    _exit(0);
+}
+
+static int send_sock = -1;
+static struct sockaddr_in group_addr;
+static uint8_t send_sequence = 0;
+
+static void send_command(uint8_t group, uint8_t command, uint8_t id, int64_t execute_at_ms)
+{
+    uint8_t frame[GROUP_HEADER_LENGTH + 1] = { 'G', 'C', ++send_sequence, group };
+    for (int i = 11; i >= 4; i--) {
+        frame[i] = execute_at_ms & 0xFF;
+        execute_at_ms >>= 8;
+    }
+    frame[14] = command;
+    frame[15] = 1;
+    frame[16] = id;
+    for (int i = 0; i < GROUP_SEND_REPEATS; i++) {
+        sendto(send_sock, frame, sizeof(frame), 0, (struct sockaddr*)&group_addr, sizeof(group_addr));
+    }
+}
+
+// Joins the group and sends a frame to itself. 0 if the PC can't do that
+static uint8_t multicast_works(void)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(UDP_CONTROL_GROUP_PORT) };
+    int on = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct ip_mreq mreq = { .imr_multiaddr.s_addr = inet_addr(UDP_CONTROL_GROUP_ADDR), .imr_interface.s_addr = htonl(INADDR_ANY) };
+    struct timeval timeout = { .tv_sec = 1 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    uint8_t works = bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0
+        && setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == 0
+        && sendto(send_sock, "ping", 4, 0, (struct sockaddr*)&group_addr, sizeof(group_addr)) == 4;
+    char buffer[8];
+    works = works && recv(sock, buffer, sizeof(buffer), 0) == 4;
+    close(sock);
+    return works;
+}
+
+static board_report_t reports[4096];
+static int report_count = 0;
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+static int report_pipe[2];
+
+static void* report_reader(void* arg)
+{
+    board_report_t report;
+    while (read(report_pipe[0], &report, sizeof(report)) == sizeof(report)) {
+        pthread_mutex_lock(&report_lock);
+        if (report_count < (int)(sizeof(reports) / sizeof(reports[0]))) {
+            reports[report_count++] = report;
+        }
+        pthread_mutex_unlock(&report_lock);
+    }
+    return NULL;
+}
+
+// Boards that have run this command, as a bitmask, and the first and last time
+static uint32_t ran_by(uint8_t command, uint8_t id, int* runs, int64_t* first, int64_t* last)
+{
+    uint32_t boards = 0;
+    *runs = 0;
+    *first = INT64_MAX;
+    *last = 0;
+    pthread_mutex_lock(&report_lock);
+    for (int i = 0; i < report_count; i++) {
+        if (reports[i].command == command && reports[i].id == id) {
+            boards |= 1 << reports[i].board;
+            (*runs)++;
+            *first = MIN(*first, reports[i].ran_us);
+            *last = MAX(*last, reports[i].ran_us);
+        }
+    }
+    pthread_mutex_unlock(&report_lock);
+    return boards;
+}
+
+static int compare_i64(const void* a, const void* b)
+{
+    int64_t x = *(const int64_t*)a;
+    int64_t y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void report_spread(const char* label, int64_t* values, int n)
+{
+    qsort(values, n, sizeof(values[0]), compare_i64);
+    printf("  %-26s p50 %7.3f ms  p99 %7.3f ms  max %7.3f ms\n", label, values[n / 2] / 1000.0,
+        values[(n * 99) / 100] / 1000.0, values[n - 1] / 1000.0);
+}
+
+#define ALL_BOARDS  ((1 << BOARDS) - 1)
+#define EVEN_BOARDS (0x15555555 & ALL_BOARDS)
+
+static void test_boards_start_together(void)
+{
+    // Pings until every board has joined the group and answers
+    uint8_t ping = 0;
+    uint32_t ready = 0;
+    for (int tries = 0; tries < 100 && ready != ALL_BOARDS; tries++) {
+        int runs;
+        int64_t first, last;
+        send_command(0, COMMAND_PING, ++ping, 0);
+        usleep(100000);
+        ready = ran_by(COMMAND_PING, ping, &runs, &first, &last);
+    }
+    CHECK_EQ(ready, ALL_BOARDS);
+
+    static int64_t timed_skew[COMMANDS];
+    static int64_t timed_late[COMMANDS * BOARDS];
+    static int64_t now_skew[COMMANDS];
+    int late_count = 0;
+    uint8_t early = 0;
+    for (int i = 0; i < COMMANDS; i++) {
+        int64_t execute_at_ms = (realtime_us() / 1000) + UDP_CONTROL_GROUP_DELAY;
+        send_command(0, COMMAND_MEASURE, i, execute_at_ms);
+        usleep(UDP_CONTROL_GROUP_DELAY * 1000 + COMMAND_GAP_US);
+        int runs;
+        int64_t first, last;
+        CHECK_EQ(ran_by(COMMAND_MEASURE, i, &runs, &first, &last), ALL_BOARDS);
+        CHECK_EQ(runs, BOARDS);
+        timed_skew[i] = last - first;
+        pthread_mutex_lock(&report_lock);
+        for (int r = 0; r < report_count; r++) {
+            if (reports[r].command == COMMAND_MEASURE && reports[r].id == i) {
+                early |= reports[r].ran_us < execute_at_ms * 1000;
+                timed_late[late_count++] = reports[r].ran_us - execute_at_ms * 1000;
+            }
+        }
+        pthread_mutex_unlock(&report_lock);
+    }
+    for (int i = 0; i < COMMANDS; i++) {
+        send_command(0, COMMAND_MEASURE, COMMANDS + i, 0);
+        usleep(COMMAND_GAP_US);
+        int runs;
+        int64_t first, last;
+        CHECK_EQ(ran_by(COMMAND_MEASURE, COMMANDS + i, &runs, &first, &last), ALL_BOARDS);
+        CHECK_EQ(runs, BOARDS);
+        now_skew[i] = last - first;
+    }
+
+    // Only the members run a group's command
+    send_command(2, COMMAND_MEASURE, 2 * COMMANDS, 0);
+    usleep(COMMAND_GAP_US);
+    int runs;
+    int64_t first, last;
+    CHECK_EQ(ran_by(COMMAND_MEASURE, 2 * COMMANDS, &runs, &first, &last), EVEN_BOARDS);
+
+    printf("Group command skew across %d boards on this host, %d commands each way:\n", BOARDS, COMMANDS);
+    report_spread("with a start time", timed_skew, COMMANDS);
+    report_spread("run on arrival", now_skew, COMMANDS);
+    report_spread("late after the start time", timed_late, late_count);
+    // A board never starts before the time it was given, and with the
+    // same clock the boards are well within one 100 Hz frame of each other
+    CHECK(!early);
+    CHECK(timed_skew[COMMANDS - 1] < 10000);
+}
+
+// Two boards relaying at once can use the same sequence number, and only
+// a repeat from the same sender is dropped
+static void test_repeats_are_per_sender(void)
+{
+    static uint8_t frame[GROUP_HEADER_LENGTH + 1] = { 'G', 'C', 42, 0 };
+    frame[14] = COMMAND_MEASURE;
+    frame[15] = 1;
+    uint32_t sender_a = inet_addr("192.0.2.10");
+    uint32_t sender_b = inet_addr("192.0.2.11");
+    group_command_t command;
+
+    udp_control_init_groups(0x1, NULL);
+    handle_group_frame(frame, sizeof(frame), sender_a);
+    host_clock_advance(1000);
+    CHECK_EQ(xQueueReceive(group_queue, &command, 0), pdTRUE);
+    handle_group_frame(frame, sizeof(frame), sender_a);
+    host_clock_advance(1000);
+    CHECK_EQ(xQueueReceive(group_queue, &command, 0), pdFALSE);
+    handle_group_frame(frame, sizeof(frame), sender_b);
+    host_clock_advance(1000);
+    CHECK_EQ(xQueueReceive(group_queue, &command, 0), pdTRUE);
+    // The same sequence from the same sender is new again after the window
+    host_clock_advance(GROUP_REPEAT_WINDOW_US);
+    handle_group_frame(frame, sizeof(frame), sender_a);
+    host_clock_advance(1000);
+    CHECK_EQ(xQueueReceive(group_queue, &command, 0), pdTRUE);
+}
+
+int main(void)
+{
+    send_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    uint8_t loop = 1;
+    setsockopt(send_sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    group_addr = (struct sockaddr_in){
+        .sin_family = AF_INET,
+        .sin_port = htons(UDP_CONTROL_GROUP_PORT),
+        .sin_addr.s_addr = inet_addr(UDP_CONTROL_GROUP_ADDR),
+    };
+    if (!multicast_works()) {
+        printf("SKIP: no multicast route on this PC\n");
+        return SKIP_CODE;
+    }
+
+    // The boards are forked before the test starts any threads of its own
+    if (pipe(report_pipe) != 0) {
+        return 1;
+    }
+    pid_t boards[BOARDS];
+    for (int i = 0; i < BOARDS; i++) {
+        boards[i] = fork();
+        if (boards[i] == 0) {
+            close(report_pipe[0]);
+            run_board(i, report_pipe[1]);
+        }
+    }
+    close(report_pipe[1]);
+    pthread_t reader;
+    pthread_create(&reader, NULL, report_reader, NULL);
+
+    RUN_TEST(test_boards_start_together);
+    send_command(0, COMMAND_STOP, 0, 0);
+    for (int i = 0; i < BOARDS; i++) {
+        waitpid(boards[i], NULL, 0);
+    }
+    pthread_join(reader, NULL);
+    close(send_sock);
+
+    RUN_TEST(test_repeats_are_per_sender);
+    return TEST_RESULT();
+}
@@ -0,0 +1,439 @@
+#include <stdlib.h>
+
+#include "test_common.h"
+#include "fake/fake_clock.h"
+#include "fake/fake_freertos.h"
+#include "fake/fake_httpd.h"
+#include "fake/fake_nvs.h"
+#include "fake/fake_system.h"
+
+// The firmware itself, so the test can start the real webserver
+#include "main.c"
+
+// Puts the web server under the load that stalls tablets at home: several
+// tablets polling /status_update every 2 seconds, a slider being dragged,
+// a firmware upload, and a phone that stops sending in the middle of a
+// request. Every request runs through the real handler, but the sockets
+// around it are simulated on the virtual clock the way esp_http_server
+// treats them: one server task serves one request at a time, at most
+// max_open_sockets sessions are open, new connections wait in a backlog of
+// backlog_conn, and with lru_purge_enable the least recently used session
+// is closed to make room for a new one. A connection that finds the
+// backlog full is dropped and the browser tries again after 1, 2, 4... seconds
+//
+// The test is built twice, once with the default profile and once with the
+// tuned one, and prints p50 and p99 latency and the dropped connections
+// for each. Handler and Wi-Fi costs on the device are estimates, the
+// REQUEST_US and _US_PER_KB values below, so the numbers are for comparing
+// the profiles and not what a tablet will see
+
+#define SCENARIO_US        60000000LL  // Requests are made for this long
+#define DRAIN_US           180000000LL // Then the clients get this long to finish
+#define POLLERS            6
+#define POLL_US            2000000     // setInterval(statusUpdate, 2000) in index.html
+#define SLIDER_STEP_US     50000       // A slider being dragged sends this often
+#define SLIDER_STEPS       40
+#define OTA_AT_US          15000000
+#define OTA_BYTES          (1024 * 1024)
+#define STALL_AT_US        35000000
+#define STALL_AFTER        10          // Bytes the phone sends before it stops
+
+#define REQUEST_US         4000        // Parsing, the handler and sending the response
+#define WIFI_US_PER_KB     1000        // A response to a tablet
+#define OTA_US_PER_KB      10000       // The upload, as fast as flash writes go
+#define SYN_RETRY_US       1000000     // Doubled on every try, as TCP does
+#define SYN_TRIES          7           // Linux's tcp_syn_retries of 6, then the request fails
+#define BROWSER_SOCKETS    6           // Connections a browser opens to one host
+
+#define MAX_REQUESTS       4096
+#define MAX_EVENTS         1024
+
+typedef enum
+{
+  REQ_POLL,
+  REQ_SLIDER,
+  REQ_OTA,
+  REQ_STALL,
+  REQ_KINDS,
+} req_kind_t;
+
+static const char* req_names[REQ_KINDS] = { "poll", "slider", "ota", "stalled" };
+
+typedef struct
+{
+  req_kind_t kind;
+  int client;
+  int value;
+  int64_t issued_us;
+} sim_req_t;
+
+typedef struct
+{
+  uint8_t open;
+  uint8_t busy;            // Has a request waiting or being served
+  int client;
+  int64_t last_used_us;    // What the LRU purge goes by
+  int64_t ready_us;        // When the request was all there to read
+  sim_req_t req;
+} session_t;
+
+typedef struct
+{
+  int connections;         // Open sessions and connections in the backlog
+  sim_req_t waiting[64];   // Requests waiting for one of the browser's sockets
+  int waiting_count;
+} client_t;
+
+typedef struct
+{
+  int64_t at_us;
+  uint8_t retry;           // Times the connection has been dropped with the backlog full
+  sim_req_t req;
+} event_t;
+
+// The clients are the pollers, the slider, the upload and the phone
+#define CLIENT_SLIDER  POLLERS
+#define CLIENT_OTA     (POLLERS + 1)
+#define CLIENT_STALL   (POLLERS + 2)
+#define CLIENTS        (POLLERS + 3)
+
+static session_t sessions[16];
+static sim_req_t backlog[16];
+static int backlog_count = 0;
+static client_t clients[CLIENTS];
+static event_t events[MAX_EVENTS];
+static int event_count = 0;
+
+static int64_t latencies[REQ_KINDS][MAX_REQUESTS];
+static int completed[REQ_KINDS];
+static int failed[REQ_KINDS];      // Anything other than the status the request should get
+static int issued[REQ_KINDS];
+static int dropped_syns = 0;       // Connections refused because the backlog was full
+static int purged = 0;             // Idle sessions closed by the LRU purge
+static int reset = 0;              // Sessions closed by the purge with a request waiting
+static int lost[REQ_KINDS];        // Requests whose connection never got through
+static int max_backlog = 0;
+
+static uint8_t* ota_image;
+
+static void add_event(int64_t at_us, uint8_t retry, const sim_req_t* req)
+{
+    if (event_count == MAX_EVENTS) {
+        printf("Too many events\n");
+        exit(1);
+    }
+    events[event_count++] = (event_t){ .at_us = at_us, .retry = retry, .req = *req };
+}
+
+static int next_event(void)
+{
+    int next = -1;
+    for (int i = 0; i < event_count; i++) {
+        if (next < 0 || events[i].at_us < events[next].at_us) {
+            next = i;
+        }
+    }
+    return next;
+}
+
+// The SYN arrives at at_us. The backlog doesn't drain while the server is
+// busy, so checking it later gives the same answer
+static void connect_client(const sim_req_t* req, uint8_t tries, int64_t at_us)
+{
+    if (backlog_count < host_httpd.config.backlog_conn) {
+        backlog[backlog_count++] = *req;
+        clients[req->client].connections++;
+        max_backlog = MAX(max_backlog, backlog_count);
+    }
+    else if (tries + 1 < SYN_TRIES) {
+        dropped_syns++;
+        add_event(at_us + ((int64_t)SYN_RETRY_US << tries), tries + 1, req);
+    }
+    else {
+        dropped_syns++;
+        lost[req->kind]++;
+    }
+}
+
+// A request from a browser goes on one of its idle sessions, on a new
+// connection if it has sockets to spare, or waits for one of them
+static void issue(const sim_req_t* req, int64_t at_us)
+{
+    for (int i = 0; i < host_httpd.config.max_open_sockets; i++) {
+        if (sessions[i].open && !sessions[i].busy && sessions[i].client == req->client) {
+            sessions[i].busy = 1;
+            sessions[i].ready_us = host_clock_now();
+            sessions[i].req = *req;
+            return;
+        }
+    }
+    client_t* client = &clients[req->client];
+    if (client->connections < BROWSER_SOCKETS) {
+        connect_client(req, 0, at_us);
+    }
+    else if (client->waiting_count < (int)(sizeof(client->waiting) / sizeof(client->waiting[0]))) {
+        client->waiting[client->waiting_count++] = *req;
+    }
+}
+
+static void session_close(session_t* session)
+{
+    session->open = 0;
+    clients[session->client].connections--;
+    client_t* client = &clients[session->client];
+    if (client->waiting_count > 0) {
+        sim_req_t next = client->waiting[0];
+        memmove(client->waiting, client->waiting + 1, --client->waiting_count * sizeof(client->waiting[0]));
+        issue(&next, host_clock_now());
+    }
+}
+
+// The server's select loop accepting one connection. Returns 0 if it can't
+static uint8_t accept_one(void)
+{
+    if (backlog_count == 0) {
+        return 0;
+    }
+    session_t* free_session = NULL;
+    session_t* lru = NULL;
+    for (int i = 0; i < host_httpd.config.max_open_sockets; i++) {
+        if (!sessions[i].open) {
+            free_session = free_session ? free_session : &sessions[i];
+        }
+        else if (lru == NULL || sessions[i].last_used_us < lru->last_used_us) {
+            lru = &sessions[i];
+        }
+    }
+    if (free_session == NULL) {
+        if (!host_httpd.config.lru_purge_enable) {
+            return 0;
+        }
+        // The browser sees the connection close and sends the request again
+        if (lru->busy) {
+            reset++;
+            sim_req_t again = lru->req;
+            session_close(lru);
+            issue(&again, host_clock_now());
+        }
+        else {
+            purged++;
+            session_close(lru);
+        }
+        return 1;
+    }
+    sim_req_t req = backlog[0];
+    memmove(backlog, backlog + 1, --backlog_count * sizeof(backlog[0]));
+    *free_session = (session_t){
+        .open = 1,
+        .busy = 1,
+        .client = req.client,
+        .last_used_us = host_clock_now(),
+        .ready_us = host_clock_now(),
+        .req = req,
+    };
+    return 1;
+}
+
+static int http_status(const host_http_response_t* response)
+{
+    return atoi(response->status);
+}
+
+// Runs the request through its handler. The clock moves on by however long
+// the server task is busy with it
+static void serve(session_t* session)
+{
+    sim_req_t* req = &session->req;
+    host_http_client_t client = {0};
+    host_http_response_t response;
+    char body[64];
+    int expected = 200;
+    switch (req->kind) {
+        case REQ_POLL:
+            host_httpd_request(HTTP_GET, "/status_update", NULL, 0, &client, &response);
+            break;
+        case REQ_SLIDER: {
+            int len = snprintf(body, sizeof(body), "{\"light\": \"1\", \"val\": \"%d\"}", req->value);
+            host_httpd_request(HTTP_POST, "/", body, len, &client, &response);
+            break;
+        }
+        case REQ_OTA:
+            client.recv_us_per_kb = OTA_US_PER_KB;
+            host_httpd_request(HTTP_POST, "/ota", (const char*)ota_image, OTA_BYTES, &client, &response);
+            break;
+        default: {
+            int len = snprintf(body, sizeof(body), "{\"light\": \"1\", \"val\": \"200\"}");
+            client.stall_after = STALL_AFTER;
+            host_httpd_request(HTTP_POST, "/", body, len, &client, &response);
+            expected = 408;
+            break;
+        }
+    }
+    host_clock_advance(REQUEST_US + (WIFI_US_PER_KB * (int64_t)response.body_len) / 1024);
+    if (http_status(&response) != expected) {
+        failed[req->kind]++;
+    }
+    host_httpd_response_free(&response);
+
+    if (completed[req->kind] < MAX_REQUESTS) {
+        latencies[req->kind][completed[req->kind]] = host_clock_now() - req->issued_us;
+    }
+    completed[req->kind]++;
+    session->busy = 0;
+    session->last_used_us = host_clock_now();
+    // A handler that fails, like the 408, has its socket closed
+    if (response.result != ESP_OK) {
+        session_close(session);
+    }
+    else {
+        client_t* client_state = &clients[session->client];
+        if (client_state->waiting_count > 0) {
+            sim_req_t next = client_state->waiting[0];
+            memmove(client_state->waiting, client_state->waiting + 1, --client_state->waiting_count * sizeof(client_state->waiting[0]));
+            issue(&next, host_clock_now());
+        }
+    }
+}
+
+// The session whose request has been waiting longest, of those that were
+// ready by the given time, or NULL
+static session_t* next_ready(int64_t by_us)
+{
+    session_t* next = NULL;
+    for (int i = 0; i < host_httpd.config.max_open_sockets; i++) {
+        if (sessions[i].open && sessions[i].busy && sessions[i].ready_us <= by_us && (next == NULL || sessions[i].ready_us < next->ready_us)) {
+            next = &sessions[i];
+        }
+    }
+    return next;
+}
+
+// Handlers that wait, like the OTA handler before it restarts, hold the server task
+static void server_delay(TickType_t ticks)
+{
+    host_clock_advance((int64_t)ticks * 1000);
+}
+
+static void schedule_clients(void)
+{
+    for (int i = 0; i < POLLERS; i++) {
+        for (int64_t at = i * POLL_US / POLLERS; at < SCENARIO_US; at += POLL_US) {
+            add_event(at, 0, &(sim_req_t){ .kind = REQ_POLL, .client = i });
+        }
+    }
+    // A drag at the start, one during the upload and one during the stall
+    const int64_t drags[] = { 5000000, 20000000, STALL_AT_US + 500000 };
+    for (size_t d = 0; d < sizeof(drags) / sizeof(drags[0]); d++) {
+        for (int step = 0; step < SLIDER_STEPS; step++) {
+            add_event(drags[d] + step * SLIDER_STEP_US, 0, &(sim_req_t){ .kind = REQ_SLIDER, .client = CLIENT_SLIDER, .value = step * 6 });
+        }
+    }
+    add_event(OTA_AT_US, 0, &(sim_req_t){ .kind = REQ_OTA, .client = CLIENT_OTA });
+    add_event(STALL_AT_US, 0, &(sim_req_t){ .kind = REQ_STALL, .client = CLIENT_STALL });
+}
+
+static void run_load(void)
+{
+    ota_image = calloc(1, OTA_BYTES);
+    host_nvs_erase_all();
+    lights_ledc_init();
+    initialize_data();
+    start_webserver();
+    host_task_set_delay_hook(server_delay);
+    schedule_clients();
+
+    while (host_clock_now() < SCENARIO_US + DRAIN_US) {
+        // Everything the clients did while the server was busy
+        int e;
+        while ((e = next_event()) >= 0 && events[e].at_us <= host_clock_now()) {
+            event_t event = events[e];
+            events[e] = events[--event_count];
+            if (event.retry) {
+                connect_client(&event.req, event.retry, event.at_us);
+            }
+            else {
+                event.req.issued_us = event.at_us;
+                issued[event.req.kind]++;
+                issue(&event.req, event.at_us);
+            }
+        }
+        // One pass of the server's select loop: a request from every session
+        // that had one when it woke up, then one new connection
+        int64_t woke_us = host_clock_now();
+        uint8_t worked = 0;
+        session_t* session;
+        while ((session = next_ready(woke_us)) != NULL) {
+            serve(session);
+            worked = 1;
+        }
+        if (accept_one()) {
+            worked = 1;
+        }
+        if (worked) {
+            continue;
+        }
+        if (e < 0) {
+            break;
+        }
+        host_clock_advance(events[e].at_us - host_clock_now());
+    }
+    host_task_set_delay_hook(NULL);
+    free(ota_image);
+}
+
+static int compare_i64(const void* a, const void* b)
+{
+    int64_t x = *(const int64_t*)a;
+    int64_t y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void test_every_request_is_answered(void)
+{
+    for (int kind = 0; kind < REQ_KINDS; kind++) {
+        if (completed[kind] + lost[kind] != issued[kind] || failed[kind] != 0) {
+            printf("%s: %d issued, %d answered, %d lost, %d failed\n", req_names[kind], issued[kind], completed[kind], lost[kind], failed[kind]);
+        }
+        // Every request is either answered or its browser gave up connecting
+        CHECK_EQ(completed[kind] + lost[kind], issued[kind]);
+        CHECK_EQ(failed[kind], 0);
+    }
+    CHECK_EQ(issued[REQ_POLL], POLLERS * (SCENARIO_US / POLL_US));
+    CHECK_EQ(issued[REQ_SLIDER], 3 * SLIDER_STEPS);
+    CHECK_EQ(host_system.ota_ends, 1);
+    CHECK_EQ(host_system.ota_bytes, OTA_BYTES);
+    // The phone holds the server for one recv timeout, then gets its 408
+    int64_t stall_us = (int64_t)host_httpd.config.recv_wait_timeout * 1000000;
+    CHECK(latencies[REQ_STALL][0] >= stall_us && latencies[REQ_STALL][0] < stall_us + 100000);
+    CHECK(max_backlog <= host_httpd.config.backlog_conn);
+}
+
+static void test_report(void)
+{
+    printf("%s profile: %d sockets, backlog %d, %d s recv timeout. Simulated latency:\n",
+#ifdef CONFIG_WEB_SERVER_PROFILE_TUNED
+        "Tuned",
+#else
+        "Default",
+#endif
+        host_httpd.config.max_open_sockets, host_httpd.config.backlog_conn, host_httpd.config.recv_wait_timeout);
+    for (int kind = 0; kind < REQ_KINDS; kind++) {
+        int n = MIN(completed[kind], MAX_REQUESTS);
+        if (n == 0) {
+            continue;
+        }
+        qsort(latencies[kind], n, sizeof(latencies[kind][0]), compare_i64);
+        printf("  %-8s %4d answered %3d lost  p50 %8.1f ms  p99 %8.1f ms  max %8.1f ms\n", req_names[kind], n, lost[kind],
+            latencies[kind][n / 2] / 1000.0, latencies[kind][(n * 99) / 100] / 1000.0, latencies[kind][n - 1] / 1000.0);
+    }
+    printf("  %d connections dropped with the backlog full, %d idle sessions purged, %d purged with a request waiting\n",
+        dropped_syns, purged, reset);
+}
+
+int main(void)
+{
+    run_load();
+    RUN_TEST(test_every_request_is_answered);
+    RUN_TEST(test_report);
+    return TEST_RESULT();
+}
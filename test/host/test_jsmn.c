@@ -0,0 +1,278 @@
+#include <dirent.h>
+#include <string.h>
+#include <time.h>
+
+#include "test_common.h"
+#include "jsmn/jsmn_mode.h"
+
+// Checks that building jsmn with JSMN_PARENT_LINKS, as main.c does, parses
+// exactly like jsmn's default mode. The real payloads in fuzz/jsmn_corpus
+// are parsed whole, in chunks as POST bodies arrive, and with token arrays
+// too small for them, then again after tens of thousands of random edits.
+// The result and every token's type, start and end have to match
+//
+// The benchmark at the end prints tokens per second for both builds on
+// this PC. It is only good for comparing the two
+
+#define CORPUS_MAX     32
+#define PAYLOAD_MAX    1024
+#define MUTATIONS      10000
+
+typedef struct
+{
+  char name[64];
+  char data[PAYLOAD_MAX];
+  size_t len;
+} payload_t;
+
+static payload_t corpus[CORPUS_MAX];
+static int corpus_count = 0;
+
+static void load_corpus(void)
+{
+    DIR* dir = opendir(JSMN_CORPUS_DIR);
+    if (dir == NULL) {
+        printf("Can't open %s\n", JSMN_CORPUS_DIR);
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL && corpus_count < CORPUS_MAX) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", JSMN_CORPUS_DIR, entry->d_name);
+        FILE* file = fopen(path, "rb");
+        if (file == NULL) {
+            continue;
+        }
+        payload_t* payload = &corpus[corpus_count++];
+        snprintf(payload->name, sizeof(payload->name), "%s", entry->d_name);
+        payload->len = fread(payload->data, 1, PAYLOAD_MAX - 1, file);
+        payload->data[payload->len] = '\0';
+        fclose(file);
+    }
+    closedir(dir);
+}
+
+static void test_real_payloads_parse(void)
+{
+    CHECK(corpus_count >= 10);
+    for (int i = 0; i < corpus_count; i++) {
+        payload_t* payload = &corpus[i];
+        jsmn_host_tok_t tokens[32];
+        unsigned int filled;
+        // 32 tokens, the most any handler in main.c gives jsmn
+        int ret = jsmn_host_parse_parent(payload->data, payload->len, 0, tokens, 32, &filled);
+        if (ret < 3 || tokens[0].type != 1) {
+            printf("%s: jsmn returned %d\n", payload->name, ret);
+        }
+        CHECK(ret >= 3);
+        CHECK_EQ(tokens[0].type, 1); // JSMN_OBJECT
+        CHECK_EQ(tokens[0].size * 2 + 1, ret);
+        for (size_t chunk = 0; chunk <= 16; chunk++) {
+            CHECK_EQ(jsmn_host_differs(payload->data, payload->len, chunk, 32, 1), 0);
+        }
+        for (unsigned int num_tokens = 1; num_tokens < 32; num_tokens++) {
+            CHECK_EQ(jsmn_host_differs(payload->data, payload->len, 0, num_tokens, 1), 0);
+        }
+    }
+}
+
+typedef struct
+{
+  const char* json;
+  int expected;
+} malformed_t;
+
+// What the firmware relies on: anything it can't use comes back negative
+static void test_malformed_inputs(void)
+{
+    static const malformed_t cases[] = {
+        { "", 0 },
+        { "{", -3 },                                // JSMN_ERROR_PART
+        { "{\"light\": \"2\"", -3 },
+        { "{\"light\": \"2", -3 },
+        { "{\"light\": \"2\"]", -2 },               // JSMN_ERROR_INVAL
+        { "}", -2 },
+        { "{\"a\": [1, 2}", -2 },
+        { "[1, 2}", -2 },
+        { "{\"a\": \"\\x\"}", -2 },                 // Bad escape
+        { "{\"a\": \"\\u12G4\"}", -2 },
+        { "{\"a\": \"tab\there\"}", 3 },            // Control chars are let through
+        { "{\"ssid\": \"a\", \"psk\": \"b\", \"x\": \"c\", \"y\": \"d\", \"z\": \"e\", \"w\": \"f\", \"v\": \"g\", \"u\": \"h\"}", -1 }, // JSMN_ERROR_NOMEM with 16
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        jsmn_host_tok_t tokens[16];
+        unsigned int filled;
+        int ret = jsmn_host_parse_parent(cases[i].json, strlen(cases[i].json), 0, tokens, 16, &filled);
+        if (ret != cases[i].expected) {
+            printf("case %zu '%s': got %d\n", i, cases[i].json, ret);
+        }
+        CHECK_EQ(ret, cases[i].expected);
+        CHECK_EQ(jsmn_host_differs(cases[i].json, strlen(cases[i].json), 0, 16, 1), 0);
+    }
+}
+
+static uint32_t rng_state = 0x2545F491;
+
+static uint32_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+// One random edit, biased towards the characters jsmn cares about
+static size_t mutate(char* data, size_t len)
+{
+    static const char special[] = "{}[]\":,\\ tfn0123456789-.eu";
+    size_t pos = len ? rng() % len : 0;
+    char c = rng() % 4 ? special[rng() % (sizeof(special) - 1)] : (char)rng();
+    switch (rng() % 5) {
+        case 0:
+            if (len > 0) {
+                data[pos] = c;
+            }
+            break;
+        case 1:
+            if (len + 1 < PAYLOAD_MAX) {
+                memmove(data + pos + 1, data + pos, len - pos);
+                data[pos] = c;
+                len++;
+            }
+            break;
+        case 2:
+            if (len > 0) {
+                memmove(data + pos, data + pos + 1, len - pos - 1);
+                len--;
+            }
+            break;
+        case 3:
+            len = pos;
+            break;
+        default:
+            if (len > 0) {
+                size_t other = rng() % len;
+                char swap = data[pos];
+                data[pos] = data[other];
+                data[other] = swap;
+            }
+            break;
+    }
+    return len;
+}
+
+static void test_mutated_payloads_match(void)
+{
+    int mismatches = 0;
+    int size_only = 0;
+    int accepted = 0;
+    int total = 0;
+    for (int i = 0; i < corpus_count; i++) {
+        for (int m = 0; m < MUTATIONS; m++) {
+            char data[PAYLOAD_MAX];
+            size_t len = corpus[i].len;
+            memcpy(data, corpus[i].data, len);
+            int edits = 1 + rng() % 4;
+            for (int e = 0; e < edits; e++) {
+                len = mutate(data, len);
+            }
+            size_t chunk = rng() % 3 == 0 ? 1 + rng() % 16 : 0;
+            unsigned int num_tokens = rng() % 4 == 0 ? 1 + rng() % 16 : 32;
+            total++;
+            if (jsmn_host_differs(data, len, chunk, num_tokens, 0)) {
+                if (mismatches++ < 5) {
+                    printf("Mismatch on '%.*s' chunk %zu tokens %u\n", (int)len, data, chunk, num_tokens);
+                }
+            }
+            else if (jsmn_host_differs(data, len, chunk, num_tokens, 1)) {
+                size_only++;
+            }
+            jsmn_host_tok_t tokens[32];
+            unsigned int filled;
+            if (jsmn_host_parse_parent(data, len, chunk, tokens, num_tokens, &filled) > 0) {
+                accepted++;
+            }
+        }
+    }
+    CHECK_EQ(mismatches, 0);
+    printf("  %d mutated parses, %d still parsed, %d differ only in token.size\n", total, accepted, size_only);
+}
+
+static double seconds_since(const struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Tokens per second for one payload. The best of five runs of about
+// 50 ms each, so a busy machine doesn't skew one build against the other
+static double bench(const char* js, size_t len, uint8_t parent)
+{
+    int iterations = 1000;
+    double best = 0;
+    for (int run = 0; run < 5; run++) {
+        for (;;) {
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            uint64_t tokens = parent ? jsmn_host_bench_parent(js, len, 512, iterations) : jsmn_host_bench_plain(js, len, 512, iterations);
+            double elapsed = seconds_since(&start);
+            if (elapsed >= 0.05) {
+                best = tokens / elapsed > best ? tokens / elapsed : best;
+                break;
+            }
+            iterations *= 2;
+        }
+    }
+    return best;
+}
+
+static void bench_report(const char* label, const char* js, size_t len)
+{
+    double plain = bench(js, len, 0);
+    double parent = bench(js, len, 1);
+    printf("  %-24s %7.1f -> %7.1f Mtok/s  (%.2fx)\n", label, plain / 1e6, parent / 1e6, parent / plain);
+}
+
+// A flat object of string pairs, like the settings the web page posts
+static size_t flat_object(char* out, size_t size, int keys)
+{
+    size_t len = snprintf(out, size, "{");
+    for (int i = 0; i < keys; i++) {
+        len += snprintf(out + len, size - len, "%s\"key%d\": \"value%d\"", i ? ", " : "", i, i);
+    }
+    len += snprintf(out + len, size - len, "}");
+    return len;
+}
+
+static void test_benchmark(void)
+{
+    static char object[8192];
+    printf("jsmn tokens per second on this host, default -> JSMN_PARENT_LINKS:\n");
+    for (int i = 0; i < corpus_count; i++) {
+        if (strcmp(corpus[i].name, "schedule_entry.json") == 0 || strcmp(corpus[i].name, "post_light_setup.json") == 0
+            || strcmp(corpus[i].name, "mqtt_light_command.json") == 0) {
+            bench_report(corpus[i].name, corpus[i].data, corpus[i].len);
+        }
+    }
+    const int sizes[] = { 8, 32, 128 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        char label[32];
+        snprintf(label, sizeof(label), "flat object, %d keys", sizes[i]);
+        size_t len = flat_object(object, sizeof(object), sizes[i]);
+        bench_report(label, object, len);
+    }
+}
+
+int main(void)
+{
+    load_corpus();
+    RUN_TEST(test_real_payloads_parse);
+    RUN_TEST(test_malformed_inputs);
+    RUN_TEST(test_mutated_payloads_match);
+    RUN_TEST(test_benchmark);
+    return TEST_RESULT();
+}
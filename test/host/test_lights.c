@@ -0,0 +1,498 @@
+#include <time.h>
+
+#include "test_common.h"
+#include "fake/fake_clock.h"
+#include "fake/fake_freertos.h"
+#include "fake/fake_ledc.h"
+
+// The firmware's lights module itself, so the test can reach the fade queue
+#include "lights_ledc.c"
+
+// Runs lights_ledc.c against the LEDC simulator in fake/fake_ledc.c with
+// the fade task on its own thread. After every timer the clock waits for the
+// fade task to empty its queue, so each fade end is handled before time
+// moves on, as it would be on the device where the task runs at once
+//
+// The times checked are the ones the IDF's fade maths gives, which is not
+// quite what was asked for: it rounds the cycles per step down, so a fade
+// can end a little early and a long transition gets corrected each segment
+//
+// The effects are run step by step and checked against their fixed step
+// times, and candle against the flicker its fixed seed gives
+//
+// The last tests time the effects and the control path with the host's
+// clock, so their numbers are for this PC and only useful to compare one
+// build with another
+
+#define MAX_DUTY       2047   // 11 bits at 25 kHz
+#define PERIOD_US      40
+
+static void settle(void)
+{
+    host_queue_wait_idle(fade_queue);
+}
+
+// Every channel off, the clock moved on and the trace started over
+static int64_t setup(void)
+{
+    for (int channel = 0; channel < 4; channel++) {
+        lights_set_brightness_immediate(0, channel);
+    }
+    host_clock_advance(1000000);
+    host_ledc_reset();
+    return host_clock_now();
+}
+
+static void set_levels(const uint8_t* pwm)
+{
+    for (int channel = 0; channel < 4; channel++) {
+        lights_set_brightness_immediate(pwm[channel], channel);
+    }
+    host_clock_advance(1000);
+    host_ledc_reset();
+}
+
+static void test_brightness_fades_scale_with_the_change(void)
+{
+    int64_t start = setup();
+    // 0 to 255 asks for 250 ms: 6250 cycles over 2047 duty steps is 3
+    // cycles a step, so the fade really takes 2047 * 3 * 40 us
+    lights_set_brightness(255, 0);
+    host_clock_advance(1000000);
+    CHECK_EQ(host_ledc_duty_at(0, host_clock_now()), MAX_DUTY);
+    CHECK_EQ(host_ledc_settled_at(0) - start, 2047 * 3 * PERIOD_US);
+
+    // 255 to 128 is 124 ms. The driver starts one below full duty, so
+    // 1018 steps of 3 cycles
+    start = host_clock_now();
+    lights_set_brightness(128, 0);
+    host_clock_advance(1000000);
+    CHECK_EQ(host_ledc_duty_at(0, host_clock_now()), 1028);
+    CHECK_EQ(host_ledc_settled_at(0) - start, 1018 * 3 * PERIOD_US);
+
+    // 128 to 0 is 125 ms: 3125 cycles over 1028 steps
+    start = host_clock_now();
+    lights_set_brightness(0, 0);
+    host_clock_advance(1000000);
+    CHECK_EQ(host_ledc_duty_at(0, host_clock_now()), 0);
+    CHECK_EQ(host_ledc_settled_at(0) - start, 1028 * 3 * PERIOD_US);
+
+    // Nothing chains off a plain fade, and nothing had to wait
+    CHECK_EQ(host_ledc.fades, 3);
+    CHECK_EQ(host_ledc.blocked, 0);
+}
+
+static void test_timed_fade_ends_on_time(void)
+{
+    int64_t start = setup();
+    lights_set_brightness_with_time(255, 1, 5000);
+    host_clock_advance(10000000);
+    int64_t took = host_ledc_settled_at(1) - start;
+    printf("  5 s fade on 1 s segments took %lld us in %d fades\n", (long long)took, host_ledc.fades);
+    CHECK_EQ(host_ledc_duty_at(1, host_clock_now()), MAX_DUTY);
+    // Each segment's time is rounded down to whole ms and whole cycles a
+    // step, so it ends a little early and the next one makes up for it.
+    // Only the last one's rounding is left over
+    CHECK(took <= 5000000);
+    CHECK(took > 5000000 - 2000);
+    // Each segment is corrected against the clock, so halfway is half way
+    uint32_t halfway = host_ledc_duty_at(1, start + 2500000);
+    CHECK(halfway >= MAX_DUTY / 2 - 3 && halfway <= MAX_DUTY / 2 + 3);
+    // One fade a segment, and at most one more to set the target when the
+    // last segment ends short of it
+    CHECK(host_ledc.fades >= 5 && host_ledc.fades <= 6);
+    CHECK_EQ(host_ledc.blocked, 0);
+    CHECK_EQ(host_ledc.too_slow, 0);
+}
+
+static void test_slow_fade_steps_on_the_timer(void)
+{
+    // 600 s over 2047 steps is 293 ms a step, past the 1023 cycles the
+    // fader can wait, so every step is a duty set from the step timer
+    int64_t start = setup();
+    lights_set_brightness_with_time(255, 2, 600000);
+    host_clock_advance(601000000);
+    CHECK_EQ(host_ledc_duty_at(2, host_clock_now()), MAX_DUTY);
+    CHECK(host_ledc_settled_at(2) - start <= 600000000);
+    CHECK(host_ledc_settled_at(2) - start > 600000000 - 300000);
+    uint32_t halfway = host_ledc_duty_at(2, start + 300000000);
+    CHECK(halfway >= MAX_DUTY / 2 - 1 && halfway <= MAX_DUTY / 2 + 1);
+    uint32_t last = 0;
+    uint8_t rising = 1;
+    for (int second = 0; second <= 600; second++) {
+        uint32_t duty = host_ledc_duty_at(2, start + (int64_t)second * 1000000);
+        rising &= duty >= last;
+        last = duty;
+    }
+    CHECK(rising);
+    CHECK_EQ(host_ledc.fades, 0);
+    CHECK_EQ(host_ledc.too_slow, 0);
+    CHECK_EQ(host_ledc.trace_dropped, 0);
+}
+
+static void test_scene_channels_finish_together(void)
+{
+    static const uint8_t from[4] = { 0, 255, 200, 30 };
+    static const uint8_t to[4] = { 255, 0, 100, 31 };
+    setup();
+    set_levels(from);
+    int64_t start = host_clock_now();
+    lights_set_all_with_time(to, 3000);
+    host_clock_advance(5000000);
+    int64_t first = INT64_MAX;
+    int64_t last = 0;
+    for (int channel = 0; channel < 4; channel++) {
+        int64_t settled = host_ledc_settled_at(channel) - start;
+        printf("  channel %d: %3d -> %3d settled at %lld us\n", channel, from[channel], to[channel], (long long)settled);
+        CHECK_EQ(host_ledc_duty_at(channel, host_clock_now()), lights_duty_from_pwm(channel, to[channel]));
+        first = MIN(first, settled);
+        last = MAX(last, settled);
+    }
+    // Every channel's last segment aims at the same end, so they only
+    // differ by its rounding
+    CHECK(last <= 3000000);
+    CHECK(first > 3000000 - 2000);
+    CHECK_EQ(host_ledc.blocked, 0);
+
+    FILE* csv = fopen("lights_scene.csv", "w");
+    FILE* vcd = fopen("lights_scene.vcd", "w");
+    CHECK(csv != NULL && vcd != NULL);
+    if (csv && vcd) {
+        host_ledc_write_csv(csv);
+        host_ledc_write_vcd(vcd);
+        fclose(csv);
+        fclose(vcd);
+    }
+}
+
+// Reads the CSV back: in time order and every channel ends on its target
+static void test_trace_csv_reads_back(void)
+{
+    FILE* csv = fopen("lights_scene.csv", "r");
+    CHECK(csv != NULL);
+    if (csv == NULL) {
+        return;
+    }
+    char line[64];
+    CHECK(fgets(line, sizeof(line), csv) != NULL);
+    CHECK(strcmp(line, "time_us,channel,duty\n") == 0);
+    long long time_us;
+    long long last_time = 0;
+    int channel;
+    unsigned int duty;
+    unsigned int final[4] = {0};
+    int rows = 0;
+    uint8_t ordered = 1;
+    while (fscanf(csv, "%lld,%d,%u\n", &time_us, &channel, &duty) == 3 && channel >= 0 && channel < 4) {
+        ordered &= time_us >= last_time;
+        last_time = time_us;
+        final[channel] = duty;
+        rows++;
+    }
+    fclose(csv);
+    CHECK(ordered);
+    CHECK(rows > 2047);
+    CHECK_EQ(final[0], MAX_DUTY);
+    CHECK_EQ(final[1], 0);
+    CHECK_EQ(final[2], lights_duty_from_pwm(2, 100));
+    CHECK_EQ(final[3], lights_duty_from_pwm(3, 31));
+}
+
+static void test_new_command_replaces_the_running_fade(void)
+{
+    int64_t start = setup();
+    lights_set_brightness_with_time(255, 0, 10000);
+    host_clock_advance(2500000);
+    lights_set_brightness_with_time(50, 0, 1000);
+    host_clock_advance(2000000);
+    int fades_after = host_ledc.fades;
+    int ends_after = host_ledc.fade_ends;
+    host_clock_advance(15000000);
+    // The old chain was dropped with its stopped fade, so nothing moves
+    // once the new fade is done
+    CHECK_EQ(host_ledc.fades, fades_after);
+    CHECK_EQ(host_ledc.fade_ends, ends_after);
+    CHECK_EQ(host_ledc_duty_at(0, host_clock_now()), lights_duty_from_pwm(0, 50));
+    CHECK(host_ledc_settled_at(0) - start <= 3500000);
+    CHECK(host_ledc_settled_at(0) - start > 3400000);
+    CHECK_EQ(host_ledc.stops, 1);
+    CHECK_EQ(host_ledc.blocked, 0);
+    CHECK(!host_ledc_fading(0));
+}
+
+// Moves the clock one timer at a time until the effect on the channel has
+// started count more steps, and records the time each one started at
+static void record_steps(int channel, int64_t* step_us, int count)
+{
+    lights_effect_stats_t stats;
+    lights_get_effect_stats(channel, &stats);
+    uint32_t steps = stats.steps;
+    for (int i = 0; i < count; ) {
+        CHECK(host_clock_step(host_clock_now() + 10000000));
+        lights_get_effect_stats(channel, &stats);
+        if (stats.steps != steps) {
+            CHECK_EQ(stats.steps, steps + 1);
+            steps = stats.steps;
+            step_us[i++] = host_clock_now();
+        }
+    }
+}
+
+// Duty the channel had when a step started. The driver starts a fade
+// from full duty one below it, so once the next fade has started full duty
+// reads as one less
+static uint32_t step_start_duty(int channel, int64_t time_us)
+{
+    uint32_t duty = host_ledc_duty_at(channel, time_us);
+    return duty == MAX_DUTY - 1 ? MAX_DUTY : duty;
+}
+
+// A step that fades from one duty to another. The IDF rounds the PWM
+// cycles per duty step down, so the fade can end up to one cycle per duty
+// step early. A step that keeps the duty runs on the timer and is exact
+static void check_step_time(int64_t took, uint32_t step_ms, uint32_t from, uint32_t to)
+{
+    uint32_t change = from > to ? from - to : to - from;
+    CHECK(took <= step_ms * 1000LL);
+    CHECK(took >= step_ms * 1000LL - (int64_t)change * PERIOD_US);
+}
+
+#define EFFECT_TEST_STEPS 40
+
+// Fades between full and 1/8 once a second
+static void test_breathe_steps_every_second(void)
+{
+    int64_t step_us[EFFECT_TEST_STEPS];
+    int64_t start = setup();
+    lights_start_effect(1, LIGHTS_EFFECT_BREATHE, 255);
+    record_steps(1, step_us, EFFECT_TEST_STEPS);
+    int64_t last = start;
+    uint32_t last_duty = 0;
+    for (int step = 0; step < EFFECT_TEST_STEPS; step++) {
+        // Each step starts where the one before was fading to
+        uint32_t duty = step_start_duty(1, step_us[step]);
+        CHECK_EQ(duty, step % 2 ? MAX_DUTY / 8 : MAX_DUTY);
+        check_step_time(step_us[step] - last, EFFECT_BREATHE_STEP_MS, last_duty, duty);
+        last = step_us[step];
+        last_duty = duty;
+    }
+    printf("  breathe: %d steps in %lld ms\n", EFFECT_TEST_STEPS, (long long)(last - start) / 1000);
+    lights_set_brightness_immediate(0, 1);
+    CHECK_EQ(host_ledc.blocked, 0);
+}
+
+// The flicker the candle's fixed seed gives, the same way effect_step works it out
+static void candle_expected(int channel, uint32_t level, uint32_t* duty, int count)
+{
+    lights_transition_t tr = { .effect_rand = 0x9E3779B9 ^ (channel + 1) };
+    for (int i = 0; i < count; i++) {
+        duty[i] = level - ((level * (effect_random(&tr) % 41)) / 100);
+    }
+}
+
+// Runs a candle and returns the duty each step started at
+static void run_candle(int channel, uint32_t* duty, int count)
+{
+    int64_t step_us[EFFECT_TEST_STEPS];
+    int64_t last = setup();
+    lights_start_effect(channel, LIGHTS_EFFECT_CANDLE, 255);
+    record_steps(channel, step_us, count);
+    for (int step = 0; step < count; step++) {
+        duty[step] = step_start_duty(channel, step_us[step]);
+        check_step_time(step_us[step] - last, EFFECT_CANDLE_STEP_MS, step ? duty[step - 1] : 0, duty[step]);
+        last = step_us[step];
+    }
+    lights_set_brightness_immediate(0, channel);
+}
+
+// Flickers between 60% and 100% every 100 ms, the same way every time
+static void test_candle_flicker_repeats(void)
+{
+    uint32_t expected[EFFECT_TEST_STEPS];
+    uint32_t first[EFFECT_TEST_STEPS];
+    uint32_t again[EFFECT_TEST_STEPS];
+    candle_expected(2, MAX_DUTY, expected, EFFECT_TEST_STEPS);
+    run_candle(2, first, EFFECT_TEST_STEPS);
+    run_candle(2, again, EFFECT_TEST_STEPS);
+    int unchanged = 0;
+    for (int step = 0; step < EFFECT_TEST_STEPS; step++) {
+        CHECK_EQ(first[step], expected[step]);
+        CHECK_EQ(again[step], expected[step]);
+        CHECK(first[step] >= (MAX_DUTY * 60) / 100);
+        CHECK(first[step] <= MAX_DUTY);
+        unchanged += step > 0 && expected[step] == expected[step - 1];
+    }
+    // A step that stays at the same duty has no fade end and runs on the timer
+    printf("  candle: %d of %d steps kept the duty\n", unchanged, EFFECT_TEST_STEPS);
+    CHECK_EQ(host_ledc.blocked, 0);
+}
+
+static void test_strobe_toggles_every_step(void)
+{
+    int64_t step_us[EFFECT_TEST_STEPS];
+    int64_t start = setup();
+    lights_start_effect(3, LIGHTS_EFFECT_STROBE, 255);
+    record_steps(3, step_us, EFFECT_TEST_STEPS);
+    for (int step = 0; step < EFFECT_TEST_STEPS; step++) {
+        CHECK_EQ(step_us[step] - start, (step + 1) * EFFECT_STROBE_STEP_MS * 1000);
+    }
+    host_clock_advance(1000000 - (host_clock_now() - start));
+    for (int step = 0; step < 20; step++) {
+        uint32_t duty = host_ledc_duty_at(3, start + (step * 50000) + 25000);
+        CHECK_EQ(duty, step % 2 ? 0 : MAX_DUTY);
+    }
+    lights_set_brightness_immediate(0, 3);
+    int64_t stopped = host_clock_now();
+    host_clock_advance(1000000);
+    CHECK(host_ledc_settled_at(3) <= stopped + PERIOD_US);
+    CHECK_EQ(host_ledc_duty_at(3, host_clock_now()), 0);
+    CHECK_EQ(host_ledc.blocked, 0);
+}
+
+// An effect step is counted from when its source fired, so time the event
+// spends in the queue or the fade task spends waiting for the mutex counts
+static void test_effect_step_counts_the_wait(void)
+{
+    setup();
+    lights_start_effect(2, LIGHTS_EFFECT_STROBE, 255);
+    lights_effect_stats_t before;
+    lights_get_effect_stats(2, &before);
+    // Past the fade end the first duty change raises, which is dropped
+    host_clock_advance(1000);
+    host_clock_set_settle(NULL);
+    xSemaphoreTake(transition_mutex, portMAX_DELAY);
+    host_clock_advance((EFFECT_STROBE_STEP_MS - 1) * 1000);
+    host_clock_advance(3000);
+    xSemaphoreGive(transition_mutex);
+    settle();
+    host_clock_set_settle(settle);
+    lights_effect_stats_t after;
+    lights_get_effect_stats(2, &after);
+    CHECK_EQ(after.effect, LIGHTS_EFFECT_STROBE);
+    CHECK_EQ(after.steps, before.steps + 1);
+    CHECK_EQ(after.busy_us - before.busy_us, 3000);
+    CHECK_EQ(after.step_max_us, 3000);
+    lights_set_brightness_immediate(0, 2);
+    lights_get_effect_stats(2, &after);
+    CHECK_EQ(after.effect, LIGHTS_EFFECT_NONE);
+}
+
+#define BENCH_EFFECT_SECONDS 600
+
+// Runs an effect for 10 minutes of virtual time and reports the CPU the
+// fade task used per step on this host. A strobe step is two events, its
+// timer and the fade end its duty change raises. The fade end and timer
+// callbacks run on the test's thread and aren't in the figure
+static void bench_effect(lights_effect_t effect)
+{
+    setup();
+    int64_t cpu_before = host_task_cpu_us("lights_fade_task");
+    CHECK(cpu_before >= 0);
+    lights_start_effect(0, effect, 255);
+    host_clock_advance(BENCH_EFFECT_SECONDS * 1000000LL);
+    lights_effect_stats_t stats;
+    lights_get_effect_stats(0, &stats);
+    int64_t cpu_us = host_task_cpu_us("lights_fade_task") - cpu_before;
+    CHECK_EQ(stats.effect, effect);
+    CHECK(stats.steps > 0);
+    printf("  %-8s %6u steps  %5.2f us per step  %6.4f%% of one core\n", lights_effect_name(effect), stats.steps,
+        (double)cpu_us / stats.steps, (cpu_us * 100.0) / (BENCH_EFFECT_SECONDS * 1000000.0));
+    lights_set_brightness_immediate(0, 0);
+    CHECK_EQ(host_ledc.blocked, 0);
+}
+
+static void test_effect_cost(void)
+{
+    printf("Fade task CPU per effect on this host, %d s of virtual time each:\n", BENCH_EFFECT_SECONDS);
+    bench_effect(LIGHTS_EFFECT_BREATHE);
+    bench_effect(LIGHTS_EFFECT_CANDLE);
+    bench_effect(LIGHTS_EFFECT_STROBE);
+}
+
+static uint64_t elapsed_ns(const struct timespec* from, const struct timespec* to)
+{
+    return (uint64_t)(to->tv_sec - from->tv_sec) * 1000000000ULL + (to->tv_nsec - from->tv_nsec);
+}
+
+static int compare_u32(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+#define BENCH_CALLS 20000
+
+typedef enum
+{
+  BENCH_BRIGHTNESS,
+  BENCH_WITH_TIME,
+  BENCH_ALL_WITH_TIME,
+  BENCH_IMMEDIATE,
+} bench_call_t;
+
+// Times one API call at a time, with the clock moved on 7 ms between calls
+// so fades are part way through and have to be stopped, like a slider
+static void bench_call(const char* label, bench_call_t call)
+{
+    static uint32_t call_ns[BENCH_CALLS];
+    uint64_t total = 0;
+    setup();
+    for (int i = 0; i < BENCH_CALLS; i++) {
+        int pwm = (i * 37) % 256;
+        uint8_t scene[4] = { pwm, 255 - pwm, pwm / 2, 128 };
+        struct timespec before, after;
+        clock_gettime(CLOCK_MONOTONIC, &before);
+        switch (call) {
+            case BENCH_BRIGHTNESS:
+                lights_set_brightness(pwm, 0);
+                break;
+            case BENCH_WITH_TIME:
+                lights_set_brightness_with_time(pwm, 0, 2000);
+                break;
+            case BENCH_ALL_WITH_TIME:
+                lights_set_all_with_time(scene, 2000);
+                break;
+            case BENCH_IMMEDIATE:
+                lights_set_brightness_immediate(pwm, 0);
+                break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &after);
+        call_ns[i] = (uint32_t)elapsed_ns(&before, &after);
+        total += call_ns[i];
+        host_clock_advance(7000);
+    }
+    qsort(call_ns, BENCH_CALLS, sizeof(call_ns[0]), compare_u32);
+    printf("  %-32s mean %6.2f us  p50 %6.2f us  p99 %6.2f us  max %7.2f us\n", label, total / 1000.0 / BENCH_CALLS,
+        call_ns[BENCH_CALLS / 2] / 1000.0, call_ns[(BENCH_CALLS * 99) / 100] / 1000.0, call_ns[BENCH_CALLS - 1] / 1000.0);
+    CHECK_EQ(host_ledc.blocked, 0);
+}
+
+static void test_control_path_cost(void)
+{
+    printf("Lights control path per call on this host, %d calls each:\n", BENCH_CALLS);
+    bench_call("lights_set_brightness", BENCH_BRIGHTNESS);
+    bench_call("lights_set_brightness_with_time", BENCH_WITH_TIME);
+    bench_call("lights_set_all_with_time", BENCH_ALL_WITH_TIME);
+    bench_call("lights_set_brightness_immediate", BENCH_IMMEDIATE);
+}
+
+int main(void)
+{
+    host_task_allow("lights_fade_task");
+    lights_ledc_init();
+    host_clock_set_settle(settle);
+    RUN_TEST(test_brightness_fades_scale_with_the_change);
+    RUN_TEST(test_timed_fade_ends_on_time);
+    RUN_TEST(test_slow_fade_steps_on_the_timer);
+    RUN_TEST(test_scene_channels_finish_together);
+    RUN_TEST(test_trace_csv_reads_back);
+    RUN_TEST(test_new_command_replaces_the_running_fade);
+    RUN_TEST(test_breathe_steps_every_second);
+    RUN_TEST(test_candle_flicker_repeats);
+    RUN_TEST(test_strobe_toggles_every_step);
+    RUN_TEST(test_effect_step_counts_the_wait);
+    RUN_TEST(test_effect_cost);
+    RUN_TEST(test_control_path_cost);
+    return TEST_RESULT();
+}
@@ -0,0 +1,319 @@
+#include <time.h>
+
+#include "test_common.h"
+#include "fake/fake_clock.h"
+#include "fake/fake_freertos.h"
+#include "fake/fake_httpd.h"
+#include "fake/fake_mqtt.h"
+#include "fake/fake_nvs.h"
+
+// LOG_LATENCY_LEVEL builds the firmware with the hot path logs of every
+// subsystem at that level instead of the one in sdkconfig. sdkconfig.h is
+// only read once, so the levels set here are the ones log_ring.h sees
+#include "sdkconfig.h"
+#ifdef LOG_LATENCY_LEVEL
+#undef CONFIG_LOG_LEVEL_HTTP
+#undef CONFIG_LOG_LEVEL_MQTT
+#undef CONFIG_LOG_LEVEL_LIGHTS
+#define CONFIG_LOG_LEVEL_HTTP   LOG_LATENCY_LEVEL
+#define CONFIG_LOG_LEVEL_MQTT   LOG_LATENCY_LEVEL
+#define CONFIG_LOG_LEVEL_LIGHTS LOG_LATENCY_LEVEL
+#endif
+
+// The firmware itself, so the test can call the real handlers
+#include "main.c"
+
+// Measures what the serial log costs the requests that change the lights:
+// a slider being dragged on the web page, tablets polling /status_update
+// and Home Assistant sending light commands over MQTT. Every request runs
+// through the real handler with MQTT connected, so set_light also publishes
+// the new state, and the broker's PUBACK for it reaches the MQTT event
+// handler a little later. SUBACKs for the 8 subscribes of a reconnect
+// arrive every few seconds as well. Each line the handler logs is built the way esp_log prints
+// it on the device, with the colour codes and timestamp, and written to a
+// model of the console UART: 115200 baud and the ESP32-C3's 128 byte TX
+// FIFO. Without the UART driver installed the console write waits for room
+// in the FIFO, so any line that doesn't fit holds up the handler until the
+// bytes ahead of it have gone out
+//
+// The test is built once with the log levels in sdkconfig and once as
+// log_latency_info with every subsystem at info. Each prints p50 and p99
+// per kind of request of the time the handler waited on the UART, which is
+// modelled, and of the time the handler took on this PC, which doesn't
+// include what formatting costs on the device. Lines below the runtime
+// level in sdkconfig are filtered out before they reach the UART, as
+// esp_log does
+
+#define SCENARIO_US       20000000LL
+#define SLIDER_STEP_US    50000       // A slider being dragged sends this often
+#define POLLERS           6
+#define POLL_US           2000000     // setInterval(statusUpdate, 2000) in index.html
+#define MQTT_STEP_US      200000      // A Home Assistant brightness slider
+#define PUBACK_US         20000       // Broker round trip for a state publish
+#define SUBACK_US         5000000     // A reconnect, with its burst of SUBACKs
+#define SUBSCRIBES        8           // Sent on every connect
+#define UART_BYTE_US      (10 * 1000000.0 / CONFIG_ESP_CONSOLE_UART_BAUDRATE) // Start, 8 data and stop bits
+#define UART_FIFO_BYTES   128
+
+#define MAX_REQUESTS      512
+#define MAX_PUBACKS       64          // Waiting at once
+
+typedef enum
+{
+  REQ_SLIDER,
+  REQ_POLL,
+  REQ_MQTT,
+  REQ_PUBACK,
+  REQ_SUBACK,
+  REQ_KINDS,
+} req_kind_t;
+
+static const char* req_names[REQ_KINDS] = { "slider", "poll", "mqtt", "puback", "suback" };
+
+static int64_t uart_wait[REQ_KINDS][MAX_REQUESTS];
+static int64_t host_time[REQ_KINDS][MAX_REQUESTS];
+static int uart_bytes[REQ_KINDS];
+static int completed[REQ_KINDS];
+
+// Console UART. fifo_bytes were in the FIFO at fifo_us and go out one
+// every UART_BYTE_US from then. request_wait_us is how long the request
+// being handled has waited for room so far
+static double fifo_bytes;
+static double fifo_us;
+static double request_wait_us;
+static int request_bytes;
+
+static void uart_write(size_t len)
+{
+    double now_us = host_clock_now() + request_wait_us;
+    if (now_us > fifo_us) {
+        fifo_bytes -= (now_us - fifo_us) / UART_BYTE_US;
+        if (fifo_bytes < 0) {
+            fifo_bytes = 0;
+        }
+        fifo_us = now_us;
+    }
+    fifo_bytes += len;
+    if (fifo_bytes > UART_FIFO_BYTES) {
+        // The write returns once the last byte is in the FIFO
+        double wait_us = (fifo_bytes - UART_FIFO_BYTES) * UART_BYTE_US;
+        request_wait_us += wait_us;
+        fifo_us += wait_us;
+        fifo_bytes = UART_FIFO_BYTES;
+    }
+    request_bytes += len;
+}
+
+// esp_log's line for each level, with CONFIG_LOG_COLORS
+static void device_log(char level, const char* tag, const char* text)
+{
+    const char* colour;
+    switch (level) {
+        case 'E': colour = "\033[0;31m"; break;
+        case 'W': colour = "\033[0;33m"; break;
+        case 'I': colour = "\033[0;32m"; break;
+        default: colour = NULL; break;
+    }
+    if (strchr("NEWIDV", level) - "NEWIDV" > CONFIG_LOG_DEFAULT_LEVEL) {
+        return;
+    }
+    char line[600];
+    int len = snprintf(line, sizeof(line), "%s%c (%u) %s: %s%s\n", colour ? colour : "", level,
+        (unsigned)(host_clock_now() / 1000), tag, text, colour ? "\033[0m" : "");
+    uart_write(MIN(len, (int)sizeof(line) - 1));
+}
+
+static int64_t host_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void handle(req_kind_t kind, int value)
+{
+    char body[64];
+    int len;
+    host_http_response_t response;
+    host_http_client_t client = {0};
+    request_wait_us = 0;
+    request_bytes = 0;
+    int64_t start_us = host_us();
+    switch (kind) {
+        case REQ_SLIDER:
+            len = snprintf(body, sizeof(body), "{\"light\": \"1\", \"val\": \"%d\"}", value);
+            host_httpd_request(HTTP_POST, "/", body, len, &client, &response);
+            CHECK(response.result == ESP_OK);
+            host_httpd_response_free(&response);
+            break;
+        case REQ_POLL:
+            host_httpd_request(HTTP_GET, "/status_update", NULL, 0, &client, &response);
+            CHECK(response.result == ESP_OK);
+            host_httpd_response_free(&response);
+            break;
+        case REQ_PUBACK:
+        case REQ_SUBACK: {
+            esp_mqtt_event_id_t id = kind == REQ_PUBACK ? MQTT_EVENT_PUBLISHED : MQTT_EVENT_SUBSCRIBED;
+            esp_mqtt_event_t event = {
+                .event_id = id,
+                .msg_id = value,
+            };
+            mqtt_event_handler(NULL, "MQTT_EVENTS", id, &event);
+            break;
+        }
+        default: {
+            snprintf(body, sizeof(body), "{\"state\": \"ON\", \"brightness\": %d}", value);
+            esp_mqtt_event_t event = {
+                .event_id = MQTT_EVENT_DATA,
+                .topic = light_data[2].mqtt_command_topic,
+                .topic_len = strlen(light_data[2].mqtt_command_topic),
+                .data = body,
+                .data_len = strlen(body),
+            };
+            event.total_data_len = event.data_len;
+            mqtt_event_handler(NULL, "MQTT_EVENTS", MQTT_EVENT_DATA, &event);
+            break;
+        }
+    }
+    int n = completed[kind]++;
+    if (n < MAX_REQUESTS) {
+        host_time[kind][n] = host_us() - start_us;
+        uart_wait[kind][n] = (int64_t)request_wait_us;
+    }
+    uart_bytes[kind] += request_bytes;
+}
+
+// Runs the streams on the virtual clock, in the order they arrive
+static void run_requests(void)
+{
+    host_nvs_erase_all();
+    lights_ledc_init();
+    initialize_data();
+    start_webserver();
+    mqtt_connected = 1;
+    host_log_enabled = 1;
+    host_log_sink = device_log;
+
+    // Home Assistant's commands land halfway between two slider steps, and
+    // the SUBACK bursts between two polls
+    int64_t next_us[REQ_KINDS] = { 0, 0, SLIDER_STEP_US / 2, 0, SUBACK_US / 2 + 3000 };
+    int64_t poll_us[POLLERS];
+    for (int i = 0; i < POLLERS; i++) {
+        poll_us[i] = (POLL_US * i) / POLLERS + 1000;
+    }
+    // PUBACKs in the order they are due, which is the order of the publishes
+    int64_t puback_us[MAX_PUBACKS];
+    int puback_ids[MAX_PUBACKS];
+    int pubacks_first = 0;
+    int pubacks_waiting = 0;
+    int step = 0;
+    while (1) {
+        next_us[REQ_PUBACK] = pubacks_waiting > 0 ? puback_us[pubacks_first] : INT64_MAX;
+        int poller = 0;
+        for (int i = 1; i < POLLERS; i++) {
+            if (poll_us[i] < poll_us[poller]) {
+                poller = i;
+            }
+        }
+        next_us[REQ_POLL] = poll_us[poller];
+        req_kind_t kind = REQ_SLIDER;
+        for (int k = 1; k < REQ_KINDS; k++) {
+            if (next_us[k] < next_us[kind]) {
+                kind = k;
+            }
+        }
+        int64_t at_us = next_us[kind];
+        if (at_us >= SCENARIO_US) {
+            break;
+        }
+        if (at_us > host_clock_now()) {
+            host_clock_advance(at_us - host_clock_now());
+        }
+        step++;
+        int publishes = host_mqtt.publishes;
+        switch (kind) {
+            case REQ_SLIDER:
+                handle(REQ_SLIDER, step % 256);
+                next_us[REQ_SLIDER] += SLIDER_STEP_US;
+                break;
+            case REQ_MQTT:
+                handle(REQ_MQTT, step % 256);
+                next_us[REQ_MQTT] += MQTT_STEP_US;
+                break;
+            case REQ_POLL:
+                handle(REQ_POLL, 0);
+                poll_us[poller] += POLL_US;
+                break;
+            case REQ_PUBACK:
+                handle(REQ_PUBACK, puback_ids[pubacks_first]);
+                pubacks_first = (pubacks_first + 1) % MAX_PUBACKS;
+                pubacks_waiting--;
+                break;
+            default:
+                for (int i = 0; i < SUBSCRIBES; i++) {
+                    handle(REQ_SUBACK, i + 1);
+                }
+                next_us[REQ_SUBACK] += SUBACK_US;
+                break;
+        }
+        for (int id = publishes; id < host_mqtt.publishes && pubacks_waiting < MAX_PUBACKS; id++) {
+            int slot = (pubacks_first + pubacks_waiting++) % MAX_PUBACKS;
+            puback_us[slot] = at_us + PUBACK_US;
+            puback_ids[slot] = id + 1;
+        }
+    }
+
+    host_log_sink = NULL;
+    host_log_enabled = 0;
+}
+
+static int compare_i64(const void* a, const void* b)
+{
+    int64_t x = *(const int64_t*)a;
+    int64_t y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// With the hot path logs compiled out the requests don't write to the
+// UART at all, and with them on every request does
+static void test_uart_bytes_follow_level(void)
+{
+    CHECK_EQ(completed[REQ_SLIDER], SCENARIO_US / SLIDER_STEP_US);
+    CHECK_EQ(completed[REQ_MQTT], SCENARIO_US / MQTT_STEP_US);
+    CHECK_EQ(completed[REQ_POLL], POLLERS * SCENARIO_US / POLL_US);
+    CHECK_EQ(completed[REQ_SUBACK], SUBSCRIBES * SCENARIO_US / SUBACK_US);
+    // Every slider step and light command publishes the light's state
+    CHECK(completed[REQ_PUBACK] >= completed[REQ_SLIDER] + completed[REQ_MQTT] - 2);
+    for (int kind = 0; kind < REQ_KINDS; kind++) {
+        if (CONFIG_LOG_LEVEL_HTTP < ESP_LOG_INFO && CONFIG_LOG_LEVEL_MQTT < ESP_LOG_INFO && CONFIG_LOG_LEVEL_LIGHTS < ESP_LOG_INFO) {
+            CHECK_EQ(uart_bytes[kind], 0);
+        }
+        else {
+            CHECK(uart_bytes[kind] >= completed[kind]);
+        }
+    }
+}
+
+static void test_report(void)
+{
+    printf("Hot path logs at level http %d, mqtt %d, lights %d, printed at level %d on a %d baud UART:\n",
+        CONFIG_LOG_LEVEL_HTTP, CONFIG_LOG_LEVEL_MQTT, CONFIG_LOG_LEVEL_LIGHTS, CONFIG_LOG_DEFAULT_LEVEL,
+        CONFIG_ESP_CONSOLE_UART_BAUDRATE);
+    for (int kind = 0; kind < REQ_KINDS; kind++) {
+        int n = MIN(completed[kind], MAX_REQUESTS);
+        qsort(uart_wait[kind], n, sizeof(uart_wait[kind][0]), compare_i64);
+        qsort(host_time[kind], n, sizeof(host_time[kind][0]), compare_i64);
+        printf("  %-6s %4d requests %5.0f bytes logged each  UART wait p50 %7.3f ms  p99 %7.3f ms  on this PC p50 %7.3f ms  p99 %7.3f ms\n",
+            req_names[kind], n, (double)uart_bytes[kind] / completed[kind],
+            uart_wait[kind][n / 2] / 1000.0, uart_wait[kind][(n * 99) / 100] / 1000.0,
+            host_time[kind][n / 2] / 1000.0, host_time[kind][(n * 99) / 100] / 1000.0);
+    }
+}
+
+int main(void)
+{
+    run_requests();
+    RUN_TEST(test_uart_bytes_follow_level);
+    RUN_TEST(test_report);
+    return TEST_RESULT();
+}
@@ -0,0 +1,141 @@
+#include <stdlib.h>
+#include <time.h>
+
+#include "test_common.h"
+#include "fake/fake_tls.h"
+#include "mqtt_tls.h"
+
+// Reconnects to a TLS broker on loopback through the firmware's esp-tls
+// wrapper in mqtt_tls_session.c, the way the MQTT client's SSL transport
+// does, and checks which reconnects resume the last session: the wrapper's
+// own count is checked against what the broker saw. Then it times
+// reconnects with the session resumed and with full handshakes. The times
+// are TCP connect plus the TLS handshake on this PC with OpenSSL, so they
+// show the share of a handshake that resuming saves, not what it takes on
+// the ESP32-C3
+
+#define RECONNECTS 200
+
+static int broker_port = 0;
+
+static int64_t monotonic_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Connects and hangs up, as a reconnect does. Returns how long the
+// connect took, or -1 if it failed
+static int64_t reconnect(const char* host)
+{
+    esp_tls_cfg_t cfg = { .timeout_ms = 1000 };
+    esp_tls_t* tls = esp_tls_init();
+    int64_t start_us = monotonic_us();
+    int ret = esp_tls_conn_new_sync(host, strlen(host), broker_port, &cfg, tls);
+    int64_t elapsed_us = monotonic_us() - start_us;
+    esp_tls_conn_destroy(tls);
+    return ret > 0 ? elapsed_us : -1;
+}
+
+// Reconnects and checks whether the wrapper and the broker both saw the
+// handshake resume
+static void check_reconnect(const char* host, uint8_t resumed)
+{
+    mqtt_tls_stats_t before;
+    mqtt_tls_get_stats(&before);
+    int broker_resumed = host_tls.resumed;
+    CHECK(reconnect(host) >= 0);
+    host_tls_broker_wait(host_tls.handshakes + 1);
+    mqtt_tls_stats_t after;
+    mqtt_tls_get_stats(&after);
+    CHECK_EQ(after.resumed_handshakes - before.resumed_handshakes, resumed);
+    CHECK_EQ(after.full_handshakes - before.full_handshakes, !resumed);
+    CHECK_EQ(host_tls.resumed - broker_resumed, resumed);
+}
+
+static void test_reconnect_resumes(void)
+{
+    check_reconnect("127.0.0.1", 0);
+    check_reconnect("127.0.0.1", 1);
+    check_reconnect("127.0.0.1", 1);
+}
+
+// New certificates are checked with a full handshake
+static void test_new_certificates_do_a_full_handshake(void)
+{
+    esp_mqtt_client_config_t config = { 0 };
+    mqtt_tls_apply(&config);
+    check_reconnect("127.0.0.1", 0);
+    check_reconnect("127.0.0.1", 1);
+}
+
+// The broker turns the session down after a restart, so the handshake is
+// a full one even though a session was offered, and the next one resumes
+static void test_broker_restart(void)
+{
+    host_tls_broker_restart();
+    check_reconnect("127.0.0.1", 0);
+    check_reconnect("127.0.0.1", 1);
+}
+
+// The same broker under another name is treated as another broker, so the
+// session isn't offered
+static void test_session_only_offered_to_its_broker(void)
+{
+    check_reconnect("localhost", 0);
+    check_reconnect("localhost", 1);
+    check_reconnect("127.0.0.1", 0);
+}
+
+static int compare_i64(const void* a, const void* b)
+{
+    int64_t x = *(const int64_t*)a;
+    int64_t y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Times RECONNECTS reconnects. Without resume every one is preceded by
+// applying the certificates, which makes it a full handshake
+static int64_t time_reconnects(uint8_t resume, const char* label)
+{
+    static int64_t latency[RECONNECTS];
+    esp_mqtt_client_config_t config = { 0 };
+    reconnect("127.0.0.1");
+    for (int i = 0; i < RECONNECTS; i++) {
+        if (!resume) {
+            mqtt_tls_apply(&config);
+        }
+        latency[i] = reconnect("127.0.0.1");
+        CHECK(latency[i] >= 0);
+    }
+    qsort(latency, RECONNECTS, sizeof(latency[0]), compare_i64);
+    printf("  %-8s p50 %6.3f ms  p99 %6.3f ms\n", label, latency[RECONNECTS / 2] / 1000.0, latency[(RECONNECTS * 99) / 100] / 1000.0);
+    return latency[RECONNECTS / 2];
+}
+
+static void test_reconnect_latency(void)
+{
+    printf("Reconnect latency on this host with OpenSSL, TCP connect and TLS 1.2 handshake, %d each:\n", RECONNECTS);
+    int64_t full_us = time_reconnects(0, "full");
+    mqtt_tls_stats_t before;
+    mqtt_tls_get_stats(&before);
+    int64_t resumed_us = time_reconnects(1, "resumed");
+    mqtt_tls_stats_t after;
+    mqtt_tls_get_stats(&after);
+    CHECK(after.resumed_handshakes - before.resumed_handshakes >= RECONNECTS);
+    CHECK(resumed_us < full_us);
+}
+
+int main(void)
+{
+    broker_port = host_tls_broker_start();
+
+    RUN_TEST(test_reconnect_resumes);
+    RUN_TEST(test_new_certificates_do_a_full_handshake);
+    RUN_TEST(test_broker_restart);
+    RUN_TEST(test_session_only_offered_to_its_broker);
+    RUN_TEST(test_reconnect_latency);
+    host_tls_broker_stop();
+    return TEST_RESULT();
+}
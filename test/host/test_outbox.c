@@ -0,0 +1,479 @@
+#include <malloc.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "test_common.h"
+#include "mqtt_outbox.h"
+#include "outbox_latest.h"
+
+// Measures what a broker outage leaves in the MQTT outbox and how long the
+// client takes to replay it, for outbox_latest.c and for a model of the
+// esp-mqtt library outbox it replaces, which mallocs a copy of every QoS 1
+// message and keeps them all in order
+//
+// The outage is four lights having their sliders dragged while the broker
+// is away. Each publish goes into the outbox the way esp-mqtt does it while
+// the client isn't connected: enqueued as QUEUED and not written. The
+// firmware only publishes while mqtt_connected is set, so on the device
+// this backlog builds between the broker going away and the keepalive
+// noticing it
+//
+// The replay is the esp-mqtt client loop after reconnecting: one QUEUED
+// message is written per pass and the broker's PUBACKs delete them. It runs
+// over a real TCP connection on loopback to a thread that answers every
+// PUBLISH with a PUBACK, and ends when the outbox is empty. The times are
+// for this PC, so only the comparison between the two outboxes means much
+//
+// malloc and free are wrapped so the heap either outbox uses is counted
+
+#define OUTAGE_S          15     // CONFIG_MQTT_KEEPALIVE plus the missed PINGRESP
+#define SLIDER_HZ         20     // Brightness changes per second per light
+#define LIGHTS            4
+#define OUTAGE_MESSAGES   (OUTAGE_S * SLIDER_HZ * LIGHTS)
+#define RUNS              5
+
+#define MQTT_PUBLISH_QOS1 0x32
+#define MQTT_PUBACK       0x40
+#define MQTT_MSG_TYPE_PUBLISH 3
+
+// Heap in use through the wrapped allocator
+static int64_t heap_live = 0;
+static int heap_allocs = 0;
+
+void* __real_malloc(size_t size);
+void __real_free(void* ptr);
+
+void* __wrap_malloc(size_t size)
+{
+    void* ptr = __real_malloc(size);
+    if (ptr != NULL) {
+        heap_live += malloc_usable_size(ptr);
+        heap_allocs++;
+    }
+    return ptr;
+}
+
+void __wrap_free(void* ptr)
+{
+    if (ptr != NULL) {
+        heap_live -= malloc_usable_size(ptr);
+    }
+    __real_free(ptr);
+}
+
+// The library outbox, as far as the replay goes: a list in enqueue order,
+// with the item and a copy of the message malloced for every publish
+typedef struct library_item
+{
+  struct library_item* next;
+  int msg_id;
+  int msg_type;
+  pending_state_t pending;
+  size_t len;
+  uint8_t* buffer;
+} library_item_t;
+
+typedef struct
+{
+  library_item_t* head;
+  library_item_t* tail;
+} library_outbox_t;
+
+static library_outbox_t library_outbox;
+
+static void* library_init(void)
+{
+    memset(&library_outbox, 0, sizeof(library_outbox));
+    return &library_outbox;
+}
+
+static void* library_enqueue(void* outbox, outbox_message_handle_t message, outbox_tick_t tick)
+{
+    library_outbox_t* list = outbox;
+    library_item_t* item = malloc(sizeof(library_item_t));
+    item->buffer = malloc(message->len + message->remaining_len);
+    memcpy(item->buffer, message->data, message->len);
+    if (message->remaining_data) {
+        memcpy(item->buffer + message->len, message->remaining_data, message->remaining_len);
+    }
+    item->len = message->len + message->remaining_len;
+    item->msg_id = message->msg_id;
+    item->msg_type = message->msg_type;
+    item->pending = QUEUED;
+    item->next = NULL;
+    if (list->tail) {
+        list->tail->next = item;
+    }
+    else {
+        list->head = item;
+    }
+    list->tail = item;
+    return item;
+}
+
+static void* library_dequeue(void* outbox, pending_state_t pending)
+{
+    library_item_t* item = ((library_outbox_t*)outbox)->head;
+    while (item != NULL && item->pending != pending) {
+        item = item->next;
+    }
+    return item;
+}
+
+static uint8_t* library_get_data(void* item, size_t* len, uint16_t* msg_id)
+{
+    *len = ((library_item_t*)item)->len;
+    *msg_id = ((library_item_t*)item)->msg_id;
+    return ((library_item_t*)item)->buffer;
+}
+
+static void library_set_pending(void* outbox, int msg_id, pending_state_t pending)
+{
+    for (library_item_t* item = ((library_outbox_t*)outbox)->head; item != NULL; item = item->next) {
+        if (item->msg_id == msg_id) {
+            item->pending = pending;
+            return;
+        }
+    }
+}
+
+static void library_delete(void* outbox, int msg_id, int msg_type)
+{
+    library_outbox_t* list = outbox;
+    library_item_t* prev = NULL;
+    for (library_item_t* item = list->head; item != NULL; prev = item, item = item->next) {
+        if (item->msg_id == msg_id && item->msg_type == msg_type) {
+            if (prev) {
+                prev->next = item->next;
+            }
+            else {
+                list->head = item->next;
+            }
+            if (list->tail == item) {
+                list->tail = prev;
+            }
+            free(item->buffer);
+            free(item);
+            return;
+        }
+    }
+}
+
+static int library_size(void* outbox)
+{
+    int size = 0;
+    for (library_item_t* item = ((library_outbox_t*)outbox)->head; item != NULL; item = item->next) {
+        size += item->len;
+    }
+    return size;
+}
+
+// outbox_latest.c through the same calls
+static void* latest_init(void)
+{
+    return outbox_init();
+}
+
+static void* latest_enqueue(void* outbox, outbox_message_handle_t message, outbox_tick_t tick)
+{
+    return outbox_enqueue(outbox, message, tick);
+}
+
+static void* latest_dequeue(void* outbox, pending_state_t pending)
+{
+    return outbox_dequeue(outbox, pending, NULL);
+}
+
+static uint8_t* latest_get_data(void* item, size_t* len, uint16_t* msg_id)
+{
+    int msg_type;
+    int qos;
+    return outbox_item_get_data(item, len, msg_id, &msg_type, &qos);
+}
+
+static void latest_set_pending(void* outbox, int msg_id, pending_state_t pending)
+{
+    outbox_set_pending(outbox, msg_id, pending);
+}
+
+static void latest_delete(void* outbox, int msg_id, int msg_type)
+{
+    outbox_delete(outbox, msg_id, msg_type);
+}
+
+static int latest_size(void* outbox)
+{
+    return outbox_get_size(outbox);
+}
+
+typedef struct
+{
+  void* (*init)(void);
+  void* (*enqueue)(void* outbox, outbox_message_handle_t message, outbox_tick_t tick);
+  void* (*dequeue)(void* outbox, pending_state_t pending);
+  uint8_t* (*get_data)(void* item, size_t* len, uint16_t* msg_id);
+  void (*set_pending)(void* outbox, int msg_id, pending_state_t pending);
+  void (*delete)(void* outbox, int msg_id, int msg_type);
+  int (*size)(void* outbox);
+} outbox_ops_t;
+
+static const outbox_ops_t library_ops = {
+    library_init, library_enqueue, library_dequeue, library_get_data, library_set_pending, library_delete, library_size,
+};
+static const outbox_ops_t latest_ops = {
+    latest_init, latest_enqueue, latest_dequeue, latest_get_data, latest_set_pending, latest_delete, latest_size,
+};
+
+// A QoS 1 PUBLISH packet the way esp-mqtt builds it. Returns its length
+static size_t build_publish(uint8_t* packet, const char* topic, const char* payload, uint16_t msg_id)
+{
+    size_t topic_len = strlen(topic);
+    size_t payload_len = strlen(payload);
+    size_t remaining = 2 + topic_len + 2 + payload_len;
+    size_t pos = 0;
+    packet[pos++] = MQTT_PUBLISH_QOS1;
+    do {
+        packet[pos] = remaining & 0x7F;
+        remaining >>= 7;
+        packet[pos++] |= remaining ? 0x80 : 0;
+    } while (remaining);
+    packet[pos++] = topic_len >> 8;
+    packet[pos++] = topic_len & 0xFF;
+    memcpy(packet + pos, topic, topic_len);
+    pos += topic_len;
+    packet[pos++] = msg_id >> 8;
+    packet[pos++] = msg_id & 0xFF;
+    memcpy(packet + pos, payload, payload_len);
+    return pos + payload_len;
+}
+
+typedef struct
+{
+  int messages;
+  int64_t heap_start;
+  int64_t heap_peak;
+  int64_t heap_end;
+  int heap_allocs;
+  int outbox_bytes;
+  int replayed;
+  int replay_bytes;
+  char last_payload[LIGHTS][64]; // Newest payload replayed for each light
+  int64_t replay_ns;
+} outage_t;
+
+// The sliders, in order. The last message for each light ends on its own level
+static void run_outage(const outbox_ops_t* ops, void* outbox, outage_t* result)
+{
+    uint16_t msg_id = 1;
+    result->heap_start = heap_live;
+    result->heap_peak = heap_live;
+    int allocs_before = heap_allocs;
+    for (int i = 0; i < OUTAGE_MESSAGES; i++) {
+        uint8_t light = i % LIGHTS;
+        int brightness = (i / LIGHTS) % 256;
+        char topic[64];
+        char payload[64];
+        sprintf(topic, "homeassistant/light/a0b765c2d3e4/light%d/state", light);
+        sprintf(payload, "{\"state\": \"ON\", \"brightness\": %d}", brightness);
+        uint8_t packet[160];
+        outbox_message_t message = {
+            .data = packet,
+            .len = build_publish(packet, topic, payload, msg_id),
+            .msg_id = msg_id,
+            .msg_qos = 1,
+            .msg_type = MQTT_MSG_TYPE_PUBLISH,
+        };
+        ops->enqueue(outbox, &message, i * 1000 / (SLIDER_HZ * LIGHTS));
+        msg_id++;
+        if (heap_live > result->heap_peak) {
+            result->heap_peak = heap_live;
+        }
+    }
+    result->messages = OUTAGE_MESSAGES;
+    result->heap_end = heap_live;
+    result->heap_allocs = heap_allocs - allocs_before;
+    result->outbox_bytes = ops->size(outbox);
+}
+
+// The broker end. Answers every PUBLISH with a PUBACK until the client closes
+static void* broker_thread(void* arg)
+{
+    int sock = *(int*)arg;
+    uint8_t buffer[4096];
+    size_t have = 0;
+    for (;;) {
+        ssize_t got = recv(sock, buffer + have, sizeof(buffer) - have, 0);
+        if (got <= 0) {
+            break;
+        }
+        have += got;
+        size_t pos = 0;
+        for (;;) {
+            size_t length_pos = pos + 1;
+            size_t remaining = 0;
+            int shift = 0;
+            while (length_pos < have && (buffer[length_pos] & 0x80)) {
+                remaining |= (buffer[length_pos++] & 0x7F) << shift;
+                shift += 7;
+            }
+            if (length_pos >= have) {
+                break;
+            }
+            remaining |= buffer[length_pos++] << shift;
+            if (length_pos + remaining > have) {
+                break;
+            }
+            size_t topic_len = (buffer[length_pos] << 8) | buffer[length_pos + 1];
+            uint8_t puback[4] = { MQTT_PUBACK, 2, buffer[length_pos + 2 + topic_len], buffer[length_pos + 3 + topic_len] };
+            send(sock, puback, sizeof(puback), 0);
+            pos = length_pos + remaining;
+        }
+        memmove(buffer, buffer + pos, have - pos);
+        have -= pos;
+    }
+    close(sock);
+    return NULL;
+}
+
+// Reads whatever PUBACKs have arrived and deletes their messages
+static void read_pubacks(const outbox_ops_t* ops, void* outbox, int sock)
+{
+    uint8_t acks[4 * 64];
+    ssize_t got;
+    while ((got = recv(sock, acks, sizeof(acks), MSG_DONTWAIT)) > 0) {
+        for (ssize_t i = 0; i + 4 <= got; i += 4) {
+            ops->delete(outbox, (acks[i + 2] << 8) | acks[i + 3], MQTT_MSG_TYPE_PUBLISH);
+        }
+    }
+}
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void run_replay(const outbox_ops_t* ops, void* outbox, outage_t* result)
+{
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t addr_len = sizeof(addr);
+    CHECK_EQ(bind(listener, (struct sockaddr*)&addr, sizeof(addr)), 0);
+    listen(listener, 1);
+    getsockname(listener, (struct sockaddr*)&addr, &addr_len);
+    int pair[2];
+    pair[0] = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK_EQ(connect(pair[0], (struct sockaddr*)&addr, sizeof(addr)), 0);
+    pair[1] = accept(listener, NULL, NULL);
+    close(listener);
+    // lwIP on the device doesn't hold back small segments either
+    int on = 1;
+    setsockopt(pair[0], IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    setsockopt(pair[1], IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    pthread_t broker;
+    pthread_create(&broker, NULL, broker_thread, &pair[1]);
+
+    int64_t start = now_ns();
+    while (ops->size(outbox) > 0) {
+        read_pubacks(ops, outbox, pair[0]);
+        void* item = ops->dequeue(outbox, QUEUED);
+        if (item == NULL) {
+            continue;
+        }
+        size_t len;
+        uint16_t msg_id;
+        uint8_t* data = ops->get_data(item, &len, &msg_id);
+        CHECK_EQ(send(pair[0], data, len, 0), len);
+        // These packets have a one byte remaining length, so the topic starts
+        // at 4 and the payload follows it and the msg_id. Light n's topic ends in "n/state"
+        size_t topic_len = (data[2] << 8) | data[3];
+        uint8_t light = data[4 + topic_len - 7] - '0';
+        size_t payload_pos = 4 + topic_len + 2;
+        snprintf(result->last_payload[light], sizeof(result->last_payload[light]), "%.*s", (int)(len - payload_pos), data + payload_pos);
+        result->replayed++;
+        result->replay_bytes += len;
+        ops->set_pending(outbox, msg_id, TRANSMITTED);
+    }
+    result->replay_ns = now_ns() - start;
+
+    close(pair[0]);
+    pthread_join(broker, NULL);
+}
+
+static void run_once(const outbox_ops_t* ops, outage_t* result)
+{
+    memset(result, 0, sizeof(*result));
+    void* outbox = ops->init();
+    run_outage(ops, outbox, result);
+    run_replay(ops, outbox, result);
+}
+
+static int compare_i64(const void* a, const void* b)
+{
+    int64_t x = *(const int64_t*)a;
+    int64_t y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void test_replay_after_outage(void)
+{
+    outage_t library;
+    outage_t latest;
+    int64_t library_ns[RUNS];
+    int64_t latest_ns[RUNS];
+    for (int run = 0; run < RUNS; run++) {
+        run_once(&library_ops, &library);
+        run_once(&latest_ops, &latest);
+        library_ns[run] = library.replay_ns;
+        latest_ns[run] = latest.replay_ns;
+    }
+
+    // The library outbox replays every level, the latest outbox one per light
+    CHECK_EQ(library.replayed, OUTAGE_MESSAGES);
+    CHECK_EQ(latest.replayed, LIGHTS);
+    outbox_latest_stats_t stats;
+    outbox_latest_get_stats(&stats);
+    CHECK_EQ(stats.used, 0);
+    CHECK_EQ(stats.high_water, LIGHTS);
+    CHECK_EQ(stats.dropped, 0);
+    CHECK_EQ(stats.replaced, (uint32_t)RUNS * (OUTAGE_MESSAGES - LIGHTS));
+    for (int light = 0; light < LIGHTS; light++) {
+        char newest[64];
+        sprintf(newest, "{\"state\": \"ON\", \"brightness\": %d}", (OUTAGE_MESSAGES / LIGHTS - 1) % 256);
+        CHECK(strcmp(latest.last_payload[light], newest) == 0);
+        CHECK(strcmp(library.last_payload[light], newest) == 0);
+    }
+
+    // The latest outbox is static, so the outage doesn't touch the heap
+    CHECK_EQ(latest.heap_allocs, 0);
+    CHECK_EQ(latest.heap_end - latest.heap_start, 0);
+    CHECK(library.heap_end - library.heap_start > 0);
+    CHECK_EQ(heap_live, 0);
+
+    qsort(library_ns, RUNS, sizeof(library_ns[0]), compare_i64);
+    qsort(latest_ns, RUNS, sizeof(latest_ns[0]), compare_i64);
+    printf("%d s outage, %d lights at %d changes a second, %d publishes. Median of %d replays on this host:\n",
+        OUTAGE_S, LIGHTS, SLIDER_HZ, OUTAGE_MESSAGES, RUNS);
+    const outage_t* results[] = { &library, &latest };
+    const int64_t* times[] = { library_ns, latest_ns };
+    const char* names[] = { "library outbox", "latest outbox" };
+    for (int i = 0; i < 2; i++) {
+        printf("  %-15s replays %4d messages, %6d bytes in %7.3f ms. Heap grew %6lld bytes in %4d mallocs\n",
+            names[i], results[i]->replayed, results[i]->replay_bytes, times[i][RUNS / 2] / 1e6,
+            (long long)(results[i]->heap_peak - results[i]->heap_start), results[i]->heap_allocs);
+    }
+    printf("  latest outbox has %d static slots of %d bytes\n", CONFIG_MQTT_OUTBOX_SLOTS, OUTBOX_SLOT_SIZE);
+}
+
+int main(void)
+{
+    RUN_TEST(test_replay_after_outage);
+    return TEST_RESULT();
+}
@@ -0,0 +1,277 @@
+#include <setjmp.h>
+#include <time.h>
+
+#include "test_common.h"
+#include "fake/fake_clock.h"
+#include "fake/fake_freertos.h"
+#include "fake/fake_system.h"
+#include "schedule.h"
+
+// Runs the real schedule_task on the virtual clock. Each vTaskDelayUntil is
+// one pass of the task: the hook moves the clock on by however long the
+// test says the task was away, which is normally the one second it asked
+// for but can be longer to make it catch up. The task is left with a
+// longjmp once the test has seen enough
+//
+// The last test times the task itself with the host's clock, so its numbers
+// are for this PC and only useful to compare one build with another
+
+#define FIRED_MAX 256
+
+typedef struct
+{
+  uint8_t light;
+  uint8_t brightness;
+  uint32_t transition_ms;
+  time_t wall;
+} fired_t;
+
+static schedule_entry_t entries[SCHEDULE_MAX_ENTRIES];
+static fired_t fired[FIRED_MAX];
+static int fired_count = 0;
+
+static jmp_buf run_end;
+static int64_t run_until_us = 0;
+static uint32_t step_s = 1;       // How long each delay really takes
+static void (*on_fire)(const fired_t* fire) = NULL;
+
+// Per pass timing for the benchmark
+static struct timespec pass_started;
+static uint8_t timing = 0;
+static uint32_t pass_ns[90000];
+static uint8_t pass_fired[90000];
+static int pass_count = 0;
+static int fired_before_pass = 0;
+
+static uint64_t elapsed_ns(const struct timespec* from, const struct timespec* to)
+{
+    return (uint64_t)(to->tv_sec - from->tv_sec) * 1000000000ULL + (to->tv_nsec - from->tv_nsec);
+}
+
+static void record_action(uint8_t light, uint8_t brightness, uint32_t transition_ms)
+{
+    if (fired_count < FIRED_MAX) {
+        fired[fired_count] = (fired_t){ light, brightness, transition_ms, time(NULL) };
+        if (on_fire) {
+            on_fire(&fired[fired_count]);
+        }
+    }
+    fired_count++;
+}
+
+static void task_delay(TickType_t ticks)
+{
+    if (timing && pass_count > 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int pass = pass_count - 1;
+        if (pass < (int)(sizeof(pass_ns) / sizeof(pass_ns[0]))) {
+            pass_ns[pass] = (uint32_t)elapsed_ns(&pass_started, &now);
+            pass_fired[pass] = fired_count != fired_before_pass;
+        }
+    }
+    if (host_clock_now() >= run_until_us) {
+        longjmp(run_end, 1);
+    }
+    host_clock_advance((int64_t)step_s * 1000000);
+    pass_count++;
+    fired_before_pass = fired_count;
+    if (timing) {
+        clock_gettime(CLOCK_MONOTONIC, &pass_started);
+    }
+}
+
+// Runs the schedule task for the given number of seconds of device time
+static void run_task(uint32_t seconds)
+{
+    run_until_us = host_clock_now() + (int64_t)seconds * 1000000;
+    host_task_set_delay_hook(task_delay);
+    if (setjmp(run_end) == 0) {
+        schedule_task(NULL);
+    }
+    host_task_set_delay_hook(NULL);
+}
+
+// 2024-01-01 was a Monday
+static time_t utc(int day, int hour, int minute, int second)
+{
+    struct tm tm = { .tm_year = 124, .tm_mon = 0, .tm_mday = day, .tm_hour = hour, .tm_min = minute, .tm_sec = second };
+    return timegm(&tm);
+}
+
+#define EVERY_DAY 0x7F
+#define MONDAY    (1 << 1)
+#define TUESDAY   (1 << 2)
+
+// A fresh schedule with the wall clock at the given time and SNTP synced
+static void setup(time_t wall)
+{
+    memset(entries, 0, sizeof(entries));
+    fired_count = 0;
+    step_s = 1;
+    on_fire = NULL;
+    host_clock_set_wall(wall);
+    schedule_init(entries, "UTC0", record_action);
+    schedule_start_sntp();
+    host_system.sntp_cb(NULL);
+}
+
+static void add_entry(uint8_t index, uint8_t light, uint8_t brightness, uint8_t hour, uint8_t minute, uint8_t days)
+{
+    schedule_entry_t entry = {
+        .enabled = 1,
+        .light = light,
+        .brightness = brightness,
+        .hour = hour,
+        .minute = minute,
+        .days = days,
+        .transition_s = 2,
+    };
+    CHECK_EQ(schedule_set_entry(index, &entry), 0);
+}
+
+static void test_entry_fires_on_the_minute(void)
+{
+    setup(utc(1, 6, 58, 30));
+    run_task(1);
+    add_entry(0, 1, 200, 7, 0, EVERY_DAY);
+    add_entry(1, 2, 50, 7, 0, TUESDAY);
+    run_task(180);
+    CHECK_EQ(fired_count, 1);
+    CHECK_EQ(fired[0].wall, utc(1, 7, 0, 0));
+    CHECK_EQ(fired[0].light, 1);
+    CHECK_EQ(fired[0].brightness, 200);
+    CHECK_EQ(fired[0].transition_ms, 2000);
+}
+
+static void test_entry_fires_every_matching_day(void)
+{
+    setup(utc(1, 12, 0, 0));
+    run_task(1);
+    add_entry(0, 0, 255, 6, 30, MONDAY | TUESDAY);
+    // Tuesday, then nothing until next Monday and Tuesday
+    run_task(8 * 24 * 3600);
+    CHECK_EQ(fired_count, 3);
+    CHECK_EQ(fired[0].wall, utc(2, 6, 30, 0));
+    CHECK_EQ(fired[1].wall, utc(8, 6, 30, 0));
+    CHECK_EQ(fired[2].wall, utc(9, 6, 30, 0));
+}
+
+static void test_late_task_catches_up(void)
+{
+    // The task only gets to run every 7 seconds, e.g. behind a long flash
+    // write. Every entry still fires exactly once, a few seconds late
+    setup(utc(1, 7, 59, 0));
+    run_task(1);
+    for (int i = 0; i < 10; i++) {
+        add_entry(i, i % 4, 10 * i, 8, i, EVERY_DAY);
+    }
+    step_s = 7;
+    run_task(11 * 60);
+    CHECK_EQ(fired_count, 10);
+    for (int i = 0; i < fired_count && i < 10; i++) {
+        CHECK_EQ(fired[i].brightness, 10 * i);
+        CHECK(fired[i].wall >= utc(1, 8, i, 0));
+        CHECK(fired[i].wall < utc(1, 8, i, 7));
+    }
+}
+
+static void test_no_firing_before_sntp(void)
+{
+    setup(0);
+    run_task(1);
+    add_entry(0, 0, 255, 0, 1, EVERY_DAY);
+    run_task(3600);
+    CHECK_EQ(fired_count, 0);
+
+    // Synced at 09:59:30, so it's armed for the next 10:00
+    entries[0].hour = 10;
+    entries[0].minute = 0;
+    host_clock_set_wall(utc(1, 9, 59, 30));
+    host_system.sntp_cb(NULL);
+    run_task(60);
+    CHECK_EQ(fired_count, 1);
+    CHECK_EQ(fired[0].wall, utc(1, 10, 0, 0));
+}
+
+// An action that changes the schedule, like an MQTT command handled on the
+// same task would. With the mutex held over the actions this deadlocked
+static void reschedule_from_action(const fired_t* fire)
+{
+    schedule_entry_t entry = entries[0];
+    entry.minute = 5;
+    schedule_set_entry(0, &entry);
+    add_entry(1, 3, 99, 7, 2, EVERY_DAY);
+}
+
+static void test_action_can_change_the_schedule(void)
+{
+    setup(utc(1, 6, 59, 30));
+    run_task(1);
+    add_entry(0, 0, 255, 7, 0, EVERY_DAY);
+    on_fire = reschedule_from_action;
+    run_task(10 * 60);
+    CHECK_EQ(fired_count, 3);
+    CHECK_EQ(fired[0].wall, utc(1, 7, 0, 0));
+    CHECK_EQ(fired[1].wall, utc(1, 7, 2, 0));
+    CHECK_EQ(fired[1].brightness, 99);
+    CHECK_EQ(fired[2].wall, utc(1, 7, 5, 0));
+}
+
+static int compare_u32(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void report_passes(const char* label, uint8_t want_fired)
+{
+    static uint32_t sorted[90000];
+    int n = 0;
+    uint64_t total = 0;
+    int limit = pass_count < 90000 ? pass_count - 1 : 90000;
+    for (int i = 0; i < limit; i++) {
+        if (pass_fired[i] == want_fired) {
+            sorted[n++] = pass_ns[i];
+            total += pass_ns[i];
+        }
+    }
+    if (n == 0) {
+        return;
+    }
+    qsort(sorted, n, sizeof(sorted[0]), compare_u32);
+    printf("  %-14s %6d passes  mean %6.2f us  p50 %6.2f us  p99 %6.2f us  max %7.2f us\n", label, n,
+        total / 1000.0 / n, sorted[n / 2] / 1000.0, sorted[(n * 99) / 100] / 1000.0, sorted[n - 1] / 1000.0);
+}
+
+static void test_task_cost_with_a_full_table(void)
+{
+    // Every slot used, spread over the day, so the wheel is as full as it
+    // gets and the task runs a whole day of ticks
+    setup(utc(1, 0, 0, 30));
+    run_task(1);
+    for (int i = 0; i < SCHEDULE_MAX_ENTRIES; i++) {
+        int minute_of_day = (i * 11) + 1;
+        add_entry(i, i % 4, i, minute_of_day / 60, minute_of_day % 60, EVERY_DAY);
+    }
+    pass_count = 0;
+    timing = 1;
+    run_task(24 * 3600);
+    timing = 0;
+    CHECK_EQ(fired_count, SCHEDULE_MAX_ENTRIES);
+    printf("Schedule task cost per pass on this host, %d entries over a day:\n", SCHEDULE_MAX_ENTRIES);
+    report_passes("idle", 0);
+    report_passes("with firing", 1);
+}
+
+int main(void)
+{
+    RUN_TEST(test_entry_fires_on_the_minute);
+    RUN_TEST(test_entry_fires_every_matching_day);
+    RUN_TEST(test_late_task_catches_up);
+    RUN_TEST(test_no_firing_before_sntp);
+    RUN_TEST(test_action_can_change_the_schedule);
+    RUN_TEST(test_task_cost_with_a_full_table);
+    return TEST_RESULT();
+}
@@ -0,0 +1,280 @@
+#include <pthread.h>
+#include <time.h>
+
+#include "test_common.h"
+#include "fake/fake_clock.h"
+#include "fake/fake_freertos.h"
+#include "fake/fake_ledc.h"
+
+// The firmware's UDP control itself, so the test can reach the live state
+#include "udp_control.c"
+
+// Sends live control frames from a socket on the PC to the real UDP control
+// task, which runs as a thread listening on its usual ports, and times each
+// one from sendto until lights_ledc.c writes the new duty to the LEDC.
+// ledc_set_duty_and_update is wrapped to take the time, so everything in
+// between is the firmware's own path: select, recv, decoding the frame,
+// the sequence check and lights_set_brightness_immediate
+//
+// Every frame changes the level of the first light, so every frame ends in
+// a duty write. The latency goes through the PC's loopback and scheduler,
+// so the p50 and p99 are for this PC and for comparing the frame types,
+// not what a desk on Wi-Fi will see
+//
+// The same frames are then sent late and out of order, to check they are
+// dropped, and the virtual clock is moved past the hold timeout to check
+// that live control ends and keeps the last look
+
+#define FRAMES          1000    // Of each type
+#define FRAME_GAP_US    200
+#define WRITE_WAIT_US   1000000 // A frame whose duty isn't written by then is lost
+
+typedef enum
+{
+  FRAME_COMPACT,
+  FRAME_ARTNET,
+  FRAME_E131,
+  FRAME_TYPES,
+} frame_type_t;
+
+static const char* frame_names[FRAME_TYPES] = { "compact", "Art-Net", "E1.31" };
+static const uint16_t frame_ports[FRAME_TYPES] = { UDP_CONTROL_ARTNET_PORT, UDP_CONTROL_ARTNET_PORT, UDP_CONTROL_E131_PORT };
+
+static int64_t monotonic_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Every duty write, counted and timed. The first light's are what the
+// frames are timed by
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t write_cond = PTHREAD_COND_INITIALIZER;
+static int first_light_writes = 0;
+static int64_t first_light_written_us = 0;
+
+esp_err_t __real_ledc_set_duty_and_update(ledc_mode_t mode, ledc_channel_t channel, uint32_t value, uint32_t hpoint);
+esp_err_t __wrap_ledc_set_duty_and_update(ledc_mode_t mode, ledc_channel_t channel, uint32_t value, uint32_t hpoint)
+{
+    int64_t now_us = monotonic_us();
+    esp_err_t err = __real_ledc_set_duty_and_update(mode, channel, value, hpoint);
+    if (channel == 0) {
+        pthread_mutex_lock(&write_lock);
+        first_light_writes++;
+        first_light_written_us = now_us;
+        pthread_cond_broadcast(&write_cond);
+        pthread_mutex_unlock(&write_lock);
+    }
+    return err;
+}
+
+// Waits for the first light's write count to pass writes. Returns when it
+// was written, or -1 if it never was
+static int64_t wait_for_write(int writes)
+{
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += WRITE_WAIT_US / 1000000;
+    int64_t written_us = -1;
+    pthread_mutex_lock(&write_lock);
+    while (first_light_writes <= writes) {
+        if (pthread_cond_timedwait(&write_cond, &write_lock, &until) != 0) {
+            break;
+        }
+    }
+    if (first_light_writes > writes) {
+        written_us = first_light_written_us;
+    }
+    pthread_mutex_unlock(&write_lock);
+    return written_us;
+}
+
+static int current_writes(void)
+{
+    pthread_mutex_lock(&write_lock);
+    int writes = first_light_writes;
+    pthread_mutex_unlock(&write_lock);
+    return writes;
+}
+
+// Builds a frame that sets the 4 lights, the first one to level
+static int build_frame(frame_type_t type, uint8_t* frame, uint8_t sequence, uint8_t level)
+{
+    uint8_t levels[4] = { level, 10, 20, 30 };
+    switch (type) {
+        case FRAME_COMPACT:
+            frame[0] = 'L';
+            frame[1] = 'C';
+            frame[2] = sequence;
+            frame[3] = 4;
+            memcpy(frame + 4, levels, 4);
+            return 8;
+        case FRAME_ARTNET:
+            memset(frame, 0, ARTNET_HEADER_LENGTH);
+            memcpy(frame, "Art-Net\0", 8);
+            frame[8] = ARTNET_OPCODE_DMX & 0xFF;
+            frame[9] = ARTNET_OPCODE_DMX >> 8;
+            frame[11] = 14;       // Protocol version
+            frame[12] = sequence;
+            frame[14] = 0;        // Port address 0 is universe 1
+            frame[16] = 0;
+            frame[17] = 4;
+            memcpy(frame + ARTNET_HEADER_LENGTH, levels, 4);
+            return ARTNET_HEADER_LENGTH + 4;
+        default:
+            memset(frame, 0, E131_HEADER_LENGTH);
+            memcpy(frame + 4, "ASC-E1.17\0\0\0", 12);
+            frame[E131_SEQUENCE_OFFSET] = sequence;
+            frame[E131_UNIVERSE_OFFSET + 1] = 1;
+            frame[E131_COUNT_OFFSET + 1] = 5; // The start code and 4 slots
+            frame[E131_START_CODE_OFFSET] = 0;
+            memcpy(frame + E131_HEADER_LENGTH, levels, 4);
+            return E131_HEADER_LENGTH + 4;
+    }
+}
+
+static int send_sock = -1;
+static uint8_t sent_sequence = 0;
+
+static void send_frame(frame_type_t type, uint8_t sequence, uint8_t level)
+{
+    uint8_t frame[E131_HEADER_LENGTH + 4];
+    int len = build_frame(type, frame, sequence, level);
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(frame_ports[type]),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    sendto(send_sock, frame, len, 0, (struct sockaddr*)&addr, sizeof(addr));
+}
+
+static volatile uint8_t released = 0;
+static volatile uint8_t released_level = 0;
+
+static void release(const uint8_t* levels)
+{
+    released_level = levels[0];
+    released = 1;
+}
+
+static int compare_i64(const void* a, const void* b)
+{
+    int64_t x = *(const int64_t*)a;
+    int64_t y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Waits for the task to listen by sending until a frame gets through
+static uint8_t task_listening(void)
+{
+    for (int tries = 0; tries < 100; tries++) {
+        int writes = current_writes();
+        send_frame(FRAME_COMPACT, ++sent_sequence, 250 + tries % 5);
+        usleep(10000);
+        if (current_writes() > writes) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void test_frame_latency(void)
+{
+    CHECK(task_listening());
+    static int64_t latency[FRAMES];
+    printf("Live control latency on this host, sendto to LEDC duty write, %d frames each:\n", FRAMES);
+    for (int type = 0; type < FRAME_TYPES; type++) {
+        int lost = 0;
+        int n = 0;
+        for (int i = 0; i < FRAMES; i++) {
+            int writes = current_writes();
+            int64_t sent_us = monotonic_us();
+            // No frame repeats the level of the one before it
+            send_frame(type, ++sent_sequence, 1 + (i % 200));
+            int64_t written_us = wait_for_write(writes);
+            if (written_us < 0) {
+                lost++;
+            }
+            else {
+                latency[n++] = written_us - sent_us;
+            }
+            usleep(FRAME_GAP_US);
+        }
+        CHECK_EQ(lost, 0);
+        if (n == 0) {
+            continue;
+        }
+        qsort(latency, n, sizeof(latency[0]), compare_i64);
+        printf("  %-8s p50 %7.3f ms  p99 %7.3f ms  max %7.3f ms\n", frame_names[type], latency[n / 2] / 1000.0,
+            latency[(n * 99) / 100] / 1000.0, latency[n - 1] / 1000.0);
+    }
+}
+
+// Waits until the task has used count frames in all, which it counts
+// after it has set the levels
+static uint8_t wait_for_frames(uint32_t count)
+{
+    for (int i = 0; i < 100 && frames_received < count; i++) {
+        usleep(10000);
+    }
+    return frames_received == count;
+}
+
+// A frame up to SEQUENCE_DROP_WINDOW behind the last one is dropped, and
+// a bigger jump back is taken as the sender restarting
+static void test_late_frames_are_dropped(void)
+{
+    // The last frame timed may still be finishing after its duty write
+    usleep(100000);
+    uint8_t last = ++sent_sequence;
+    uint32_t received = frames_received;
+    send_frame(FRAME_COMPACT, last, 250);
+    CHECK(wait_for_frames(received + 1));
+    uint32_t dropped = frames_dropped;
+    int writes = current_writes();
+    send_frame(FRAME_COMPACT, last - 1, 60);
+    send_frame(FRAME_COMPACT, last, 70);
+    send_frame(FRAME_COMPACT, last - SEQUENCE_DROP_WINDOW + 1, 80);
+    // The frame after them is used, so once it is in the others were seen
+    send_frame(FRAME_COMPACT, ++sent_sequence, 90);
+    CHECK(wait_for_frames(received + 2));
+    CHECK_EQ(current_writes(), writes + 1);
+    CHECK_EQ(frames_dropped - dropped, 3);
+    CHECK_EQ(live_levels[0], 90);
+
+    sent_sequence -= SEQUENCE_DROP_WINDOW + 10;
+    send_frame(FRAME_COMPACT, sent_sequence, 120);
+    CHECK(wait_for_frames(received + 3));
+    CHECK_EQ(live_levels[0], 120);
+}
+
+// Once the frames stop, live control ends after the hold timeout and hands
+// back the levels it was holding
+static void test_hold_last_look(void)
+{
+    CHECK_EQ(udp_control_active(), 1);
+    host_clock_advance(UDP_CONTROL_HOLD_TIMEOUT * 1000LL + 1000);
+    // The task checks on its next select timeout
+    for (int i = 0; i < 200 && !released; i++) {
+        usleep(10000);
+    }
+    CHECK(released);
+    CHECK_EQ(released_level, 120);
+    CHECK_EQ(udp_control_active(), 0);
+}
+
+int main(void)
+{
+    send_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    lights_ledc_init();
+    udp_control_init(1, 1, release);
+    host_task_allow("udp_control_task");
+    xTaskCreate(udp_control_task, "udp_control_task", 4096, NULL, 5, NULL);
+
+    RUN_TEST(test_frame_latency);
+    RUN_TEST(test_late_frames_are_dropped);
+    RUN_TEST(test_hold_last_look);
+    close(send_sock);
+    return TEST_RESULT();
+}
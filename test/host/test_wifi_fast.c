@@ -0,0 +1,307 @@
+#include <string.h>
+
+#include "test_common.h"
+#include "wifi_fast.h"
+
+// Runs wifi_fast.c through simulated boots. A fake radio answers each
+// connect attempt from a list of APs the way the Wi-Fi driver does, and the
+// boot loop follows disconnect_handler in main.c: count the failure, ask
+// wifi_fast_after_failure for the next mode, and reapply the config if it
+// changed. The cost of a boot is counted in channels scanned, since a
+// directed attempt listens on 1 channel and a full scan on all 13
+
+#define MAX_RETRIES       10 // ESP_MAXIMUM_CONNECT_RETRY in main.c
+#define SCAN_CHANNELS     13
+
+typedef struct
+{
+  uint8_t bssid[6];
+  uint8_t channel;
+  int8_t rssi;
+  uint8_t busy_attempts; // Rejects this many attempts before it lets us in
+} fake_ap_t;
+
+typedef struct
+{
+  fake_ap_t aps[4];
+  int ap_count;
+  uint8_t wrong_password;
+} fake_radio_t;
+
+typedef struct
+{
+  uint8_t connected;
+  uint8_t attempts;
+  uint8_t directed_attempts;
+  uint16_t channels_scanned;
+  uint8_t cache_changed;
+} boot_result_t;
+
+static const uint8_t BSSID_A[6] = { 0x24, 0x0a, 0xc4, 0x00, 0x00, 0x01 };
+static const uint8_t BSSID_B[6] = { 0x24, 0x0a, 0xc4, 0x00, 0x00, 0x02 };
+
+// One connect attempt. Returns the AP on success, or NULL with the reason
+static fake_ap_t* radio_connect(fake_radio_t* radio, const wifi_sta_config_t* config, uint8_t* reason)
+{
+    fake_ap_t* found = NULL;
+    for (int i = 0; i < radio->ap_count; i++) {
+        fake_ap_t* ap = &radio->aps[i];
+        if (config->bssid_set) {
+            // A directed attempt only listens for that BSSID on that channel
+            if (memcmp(ap->bssid, config->bssid, 6) == 0 && ap->channel == config->channel) {
+                found = ap;
+            }
+        }
+        else if (found == NULL || ap->rssi > found->rssi) {
+            found = ap;
+        }
+    }
+    if (found == NULL) {
+        *reason = WIFI_REASON_NO_AP_FOUND;
+        return NULL;
+    }
+    if (radio->wrong_password) {
+        *reason = WIFI_REASON_AUTH_FAIL;
+        return NULL;
+    }
+    if (found->busy_attempts > 0) {
+        found->busy_attempts--;
+        *reason = WIFI_REASON_ASSOC_EXPIRE;
+        return NULL;
+    }
+    return found;
+}
+
+static boot_result_t simulate_boot(fake_radio_t* radio, wifi_fast_cache_t* cache)
+{
+    boot_result_t result = {0};
+    wifi_sta_config_t config = {0};
+    wifi_fast_mode_t mode = wifi_fast_first_mode(cache);
+    uint8_t failures = 0;
+    wifi_fast_apply(&config, cache, mode);
+
+    for (int retry = 0; retry <= MAX_RETRIES; retry++) {
+        uint8_t reason = 0;
+        result.attempts++;
+        result.channels_scanned += config.bssid_set ? 1 : SCAN_CHANNELS;
+        if (config.bssid_set) {
+            result.directed_attempts++;
+        }
+        fake_ap_t* ap = radio_connect(radio, &config, &reason);
+        if (ap != NULL) {
+            result.connected = 1;
+            result.cache_changed = wifi_fast_update_cache(cache, ap->bssid, ap->channel);
+            return result;
+        }
+        failures++;
+        wifi_fast_mode_t next = wifi_fast_after_failure(mode, failures, reason);
+        if (next != mode) {
+            mode = next;
+            failures = 0;
+            wifi_fast_apply(&config, cache, mode);
+        }
+    }
+    return result;
+}
+
+static void setup_home(fake_radio_t* radio)
+{
+    memset(radio, 0, sizeof(*radio));
+    memcpy(radio->aps[0].bssid, BSSID_A, 6);
+    radio->aps[0].channel = 6;
+    radio->aps[0].rssi = -50;
+    radio->ap_count = 1;
+}
+
+// First boot has no cache, so it scans, then caches the AP
+static void test_first_boot_scans_and_caches(void)
+{
+    fake_radio_t radio;
+    wifi_fast_cache_t cache = {0};
+    setup_home(&radio);
+
+    boot_result_t boot = simulate_boot(&radio, &cache);
+    CHECK(boot.connected);
+    CHECK_EQ(boot.directed_attempts, 0);
+    CHECK_EQ(boot.channels_scanned, SCAN_CHANNELS);
+    CHECK(boot.cache_changed);
+    CHECK(cache.valid);
+    CHECK_EQ(cache.channel, 6);
+    CHECK(memcmp(cache.bssid, BSSID_A, 6) == 0);
+}
+
+// With a good cache every later boot goes straight to the AP and
+// nothing has to be written back to NVS
+static void test_cached_boot_is_directed(void)
+{
+    fake_radio_t radio;
+    wifi_fast_cache_t cache = {0};
+    setup_home(&radio);
+    simulate_boot(&radio, &cache);
+
+    for (int i = 0; i < 5; i++) {
+        boot_result_t boot = simulate_boot(&radio, &cache);
+        CHECK(boot.connected);
+        CHECK_EQ(boot.attempts, 1);
+        CHECK_EQ(boot.directed_attempts, 1);
+        CHECK_EQ(boot.channels_scanned, 1);
+        CHECK_EQ(boot.cache_changed, 0);
+    }
+}
+
+// The AP moved channel overnight. The directed attempt can't find it, so
+// the next attempt is a full scan straight away and the cache follows it
+static void test_ap_moved_channel(void)
+{
+    fake_radio_t radio;
+    wifi_fast_cache_t cache = {0};
+    setup_home(&radio);
+    simulate_boot(&radio, &cache);
+    radio.aps[0].channel = 11;
+
+    boot_result_t boot = simulate_boot(&radio, &cache);
+    CHECK(boot.connected);
+    CHECK_EQ(boot.attempts, 2);
+    CHECK_EQ(boot.directed_attempts, 1);
+    CHECK_EQ(boot.channels_scanned, 1 + SCAN_CHANNELS);
+    CHECK(boot.cache_changed);
+    CHECK_EQ(cache.channel, 11);
+
+    boot = simulate_boot(&radio, &cache);
+    CHECK_EQ(boot.channels_scanned, 1);
+}
+
+// The router was replaced. The old BSSID is gone, so the scan picks the
+// new one and the cache is rewritten
+static void test_router_replaced(void)
+{
+    fake_radio_t radio;
+    wifi_fast_cache_t cache = {0};
+    setup_home(&radio);
+    simulate_boot(&radio, &cache);
+    memcpy(radio.aps[0].bssid, BSSID_B, 6);
+
+    boot_result_t boot = simulate_boot(&radio, &cache);
+    CHECK(boot.connected);
+    CHECK_EQ(boot.directed_attempts, 1);
+    CHECK(boot.cache_changed);
+    CHECK(memcmp(cache.bssid, BSSID_B, 6) == 0);
+}
+
+// A busy AP that turns us away once is tried again directly, since it is
+// still the right AP, rather than paying for a full scan
+static void test_busy_ap_retried_directly(void)
+{
+    fake_radio_t radio;
+    wifi_fast_cache_t cache = {0};
+    setup_home(&radio);
+    simulate_boot(&radio, &cache);
+    radio.aps[0].busy_attempts = 1;
+
+    boot_result_t boot = simulate_boot(&radio, &cache);
+    CHECK(boot.connected);
+    CHECK_EQ(boot.attempts, 2);
+    CHECK_EQ(boot.directed_attempts, 2);
+    CHECK_EQ(boot.channels_scanned, 2);
+    CHECK_EQ(boot.cache_changed, 0);
+}
+
+// An AP that stays busy gets WIFI_FAST_DIRECTED_TRIES directed attempts
+// and then the boot falls back to scanning
+static void test_busy_ap_falls_back_to_scan(void)
+{
+    fake_radio_t radio;
+    wifi_fast_cache_t cache = {0};
+    setup_home(&radio);
+    simulate_boot(&radio, &cache);
+    radio.aps[0].busy_attempts = WIFI_FAST_DIRECTED_TRIES + 1;
+
+    boot_result_t boot = simulate_boot(&radio, &cache);
+    CHECK(boot.connected);
+    CHECK_EQ(boot.directed_attempts, WIFI_FAST_DIRECTED_TRIES);
+    CHECK_EQ(boot.attempts, WIFI_FAST_DIRECTED_TRIES + 2);
+}
+
+// A stronger second AP shows up. The cached one still works, so the boot
+// stays directed and doesn't roam on its own
+static void test_cached_ap_kept_when_stronger_appears(void)
+{
+    fake_radio_t radio;
+    wifi_fast_cache_t cache = {0};
+    setup_home(&radio);
+    simulate_boot(&radio, &cache);
+    memcpy(radio.aps[1].bssid, BSSID_B, 6);
+    radio.aps[1].channel = 1;
+    radio.aps[1].rssi = -30;
+    radio.ap_count = 2;
+
+    boot_result_t boot = simulate_boot(&radio, &cache);
+    CHECK(boot.connected);
+    CHECK_EQ(boot.channels_scanned, 1);
+    CHECK(memcmp(cache.bssid, BSSID_A, 6) == 0);
+}
+
+// A wrong password fails the same way in every mode, so the cache is
+// dropped after the first try and the retries run out scanning
+static void test_wrong_password(void)
+{
+    fake_radio_t radio;
+    wifi_fast_cache_t cache = {0};
+    setup_home(&radio);
+    simulate_boot(&radio, &cache);
+    radio.wrong_password = 1;
+
+    boot_result_t boot = simulate_boot(&radio, &cache);
+    CHECK_EQ(boot.connected, 0);
+    CHECK_EQ(boot.attempts, MAX_RETRIES + 1);
+    CHECK_EQ(boot.directed_attempts, 1);
+}
+
+// Channel 0 or anything past 14 means the cache is corrupt
+static void test_bad_cached_channel_scans(void)
+{
+    wifi_fast_cache_t cache = { .valid = 1, .channel = 0 };
+    CHECK_EQ(wifi_fast_first_mode(&cache), WIFI_FAST_FULL_SCAN);
+    cache.channel = 15;
+    CHECK_EQ(wifi_fast_first_mode(&cache), WIFI_FAST_FULL_SCAN);
+    cache.channel = 14;
+    CHECK_EQ(wifi_fast_first_mode(&cache), WIFI_FAST_DIRECTED);
+    cache.valid = 0;
+    CHECK_EQ(wifi_fast_first_mode(&cache), WIFI_FAST_FULL_SCAN);
+}
+
+// Going back to a scan must clear the BSSID lock and channel hint, or the
+// scan would still only look for the old AP
+static void test_apply_clears_directed_fields(void)
+{
+    wifi_fast_cache_t cache = { .valid = 1, .channel = 6 };
+    memcpy(cache.bssid, BSSID_A, 6);
+    wifi_sta_config_t config = {0};
+
+    wifi_fast_apply(&config, &cache, WIFI_FAST_DIRECTED);
+    CHECK(config.bssid_set);
+    CHECK_EQ(config.channel, 6);
+    CHECK_EQ(config.scan_method, WIFI_FAST_SCAN);
+
+    wifi_fast_apply(&config, &cache, WIFI_FAST_FULL_SCAN);
+    CHECK_EQ(config.bssid_set, 0);
+    CHECK_EQ(config.channel, 0);
+    CHECK_EQ(config.scan_method, WIFI_ALL_CHANNEL_SCAN);
+    static const uint8_t zero[6] = {0};
+    CHECK(memcmp(config.bssid, zero, 6) == 0);
+}
+
+int main(void)
+{
+    RUN_TEST(test_first_boot_scans_and_caches);
+    RUN_TEST(test_cached_boot_is_directed);
+    RUN_TEST(test_ap_moved_channel);
+    RUN_TEST(test_router_replaced);
+    RUN_TEST(test_busy_ap_retried_directly);
+    RUN_TEST(test_busy_ap_falls_back_to_scan);
+    RUN_TEST(test_cached_ap_kept_when_stronger_appears);
+    RUN_TEST(test_wrong_password);
+    RUN_TEST(test_bad_cached_channel_scans);
+    RUN_TEST(test_apply_clears_directed_fields);
+    return TEST_RESULT();
+}
@@ -0,0 +1,223 @@
+#include <setjmp.h>
+
+#include "test_common.h"
+#include "fake/fake_clock.h"
+#include "fake/fake_freertos.h"
+#include "fake/fake_httpd.h"
+#include "fake/fake_nvs.h"
+#include "fake/fake_wifi.h"
+
+// The firmware itself, so the test can run wifi_task and read its statics
+#include "main.c"
+
+// Runs the real wifi_task through a day in the life of the light: it boots
+// onto the home network, the router goes away, a phone joins the softAP and
+// sends new Wi-Fi settings, the station connects and the softAP goes away,
+// then the settings are changed once more over the station. The webserver
+// has to be the same one the whole way through and answer at every step
+//
+// wifi_task never returns, so each vTaskDelay is a step of the scenario:
+// the clock moves on, the scenario gets to change the world, the driver
+// events are delivered, and at the end the task is left with a longjmp
+
+#define SCENARIO_SECONDS 180
+
+typedef struct
+{
+  wifi_mode_t mode;
+  uint8_t connected;
+  int page_status;   // Status code of GET / at that second
+} scenario_sample_t;
+
+static jmp_buf scenario_end;
+static int scenario_second = 0;
+static scenario_sample_t samples[SCENARIO_SECONDS + 1];
+static int retries_without_router = -1;
+static int connects_with_phone = -1;
+static int disconnects_before_put = 0;
+static int retries_after_put = -1;
+
+static int http_status(const host_http_response_t* response)
+{
+    return atoi(response->status);
+}
+
+static int get_page(const char* uri)
+{
+    host_http_response_t response;
+    host_httpd_request(HTTP_GET, uri, NULL, 0, NULL, &response);
+    int status = response.body_len > 0 ? http_status(&response) : 0;
+    host_httpd_response_free(&response);
+    return status;
+}
+
+static int put_wifi(const char* ssid, const char* psk)
+{
+    char body[128];
+    int len = snprintf(body, sizeof(body), "{\"ssid\": \"%s\", \"psk\": \"%s\"}", ssid, psk);
+    host_http_response_t response;
+    host_httpd_request(HTTP_PUT, "/api/config/wifi", body, len, NULL, &response);
+    int status = http_status(&response);
+    host_httpd_response_free(&response);
+    return status;
+}
+
+static void phone_joins(void)
+{
+    wifi_event_ap_staconnected_t event = { .mac = { 0x02, 0, 0, 0, 0, 0x01 }, .aid = 1 };
+    host_wifi.ap_stations = 1;
+    host_wifi_post(WIFI_EVENT, WIFI_EVENT_AP_STACONNECTED, &event, sizeof(event));
+}
+
+static void scenario_step(int second)
+{
+    switch (second) {
+        case 10:
+            host_wifi_ap_lost();
+            break;
+        case 12:
+            retries_without_router = wifi_retry_count;
+            break;
+        case 30:
+            phone_joins();
+            connects_with_phone = host_wifi.connect;
+            break;
+        case 100:
+            // The phone has been on the softAP well past the station retry
+            // interval, and nothing touched the radio meanwhile
+            CHECK_EQ(host_wifi.connect, connects_with_phone);
+            CHECK_EQ(put_wifi("new_home", "password2"), 202);
+            host_wifi.ap_in_range = 1;
+            break;
+        case 110:
+            host_wifi.ap_stations = 0;
+            break;
+        case 170:
+            disconnects_before_put = host_wifi.disconnect;
+            CHECK_EQ(put_wifi("newer_home", "password3"), 202);
+            break;
+        case 172:
+            retries_after_put = wifi_retry_count;
+            break;
+    }
+}
+
+static void scenario_delay(TickType_t ticks)
+{
+    host_clock_advance((int64_t)ticks * 1000);
+    scenario_second++;
+    scenario_step(scenario_second);
+    host_wifi_run_events();
+    samples[scenario_second] = (scenario_sample_t){
+        .mode = host_wifi.mode,
+        .connected = wifi_connected,
+        .page_status = get_page("/"),
+    };
+    if (scenario_second == SCENARIO_SECONDS) {
+        longjmp(scenario_end, 1);
+    }
+}
+
+static void run_scenario(void)
+{
+    host_nvs_erase_all();
+    save_wifi_info_to_nvs("home", "password1");
+    initialize_data();
+    host_task_set_delay_hook(scenario_delay);
+    if (setjmp(scenario_end) == 0) {
+        wifi_task(NULL);
+    }
+    host_task_set_delay_hook(NULL);
+}
+
+static void test_boot_connects_as_station(void)
+{
+    CHECK_EQ(samples[1].connected, 1);
+    CHECK_EQ(samples[1].mode, WIFI_MODE_STA);
+    CHECK_EQ(samples[9].mode, WIFI_MODE_STA);
+}
+
+static void test_softap_comes_up_when_the_router_goes(void)
+{
+    CHECK_EQ(samples[10].connected, 0);
+    CHECK_EQ(samples[11].mode, WIFI_MODE_APSTA);
+    CHECK_EQ(retries_without_router, ESP_MAXIMUM_CONNECT_RETRY);
+}
+
+static void test_station_joins_new_network_next_to_softap(void)
+{
+    CHECK_EQ(samples[99].connected, 0);
+    CHECK_EQ(samples[101].connected, 1);
+    // The phone is still there, so the softAP stays up
+    CHECK_EQ(samples[105].mode, WIFI_MODE_APSTA);
+}
+
+static void test_softap_goes_once_the_station_has_lingered(void)
+{
+    // Connected at 101, so the softAP goes a linger time later
+    int stop_second = 101 + WIFI_LINK_AP_LINGER_MS / 1000;
+    CHECK_EQ(samples[stop_second - 1].mode, WIFI_MODE_APSTA);
+    CHECK_EQ(samples[stop_second + 1].mode, WIFI_MODE_STA);
+}
+
+static void test_new_settings_over_station_reconnect_cleanly(void)
+{
+    // The disconnect for the new settings is ASSOC_LEAVE and isn't counted
+    // as a failure, and the softAP isn't brought up for it
+    CHECK_EQ(host_wifi.disconnect, disconnects_before_put + 1);
+    CHECK_EQ(retries_after_put, 0);
+    CHECK_EQ(samples[171].connected, 1);
+    for (int second = 170; second <= SCENARIO_SECONDS; second++) {
+        CHECK_EQ(samples[second].mode, WIFI_MODE_STA);
+    }
+    CHECK(strcmp(esp_wifi_sta_ssid, "newer_home") == 0);
+}
+
+static void test_driver_mode_only_changes_for_the_softap(void)
+{
+    CHECK_EQ(host_wifi.init, 1);
+    CHECK_EQ(host_wifi.start, 1);
+    CHECK_EQ(host_wifi.stop, 0);
+    CHECK_EQ(host_wifi.mode_changes, 3);
+    CHECK_EQ(host_wifi.mode_history[0], WIFI_MODE_STA);
+    CHECK_EQ(host_wifi.mode_history[1], WIFI_MODE_APSTA);
+    CHECK_EQ(host_wifi.mode_history[2], WIFI_MODE_STA);
+}
+
+static void test_webserver_is_never_restarted(void)
+{
+    CHECK_EQ(host_httpd.start, 1);
+    CHECK_EQ(host_httpd.stop, 0);
+    CHECK_EQ(host_task_created("httpd"), 0);
+    for (int second = 1; second <= SCENARIO_SECONDS; second++) {
+        if (samples[second].page_status != 200) {
+            printf("GET / returned %d at %d s\n", samples[second].page_status, second);
+        }
+        CHECK_EQ(samples[second].page_status, 200);
+    }
+}
+
+static void test_every_handler_registers(void)
+{
+    // A handler past max_uri_handlers fails to register without stopping
+    // the rest, so a new page would quietly 404
+    CHECK_EQ(host_httpd.register_failures, 0);
+    host_http_response_t response;
+    host_httpd_request(HTTP_PUT, "/api/config/mqtt/tls/ca", "", 0, NULL, &response);
+    CHECK_EQ(response.matched, 1);
+    host_httpd_response_free(&response);
+}
+
+int main(void)
+{
+    run_scenario();
+    RUN_TEST(test_boot_connects_as_station);
+    RUN_TEST(test_softap_comes_up_when_the_router_goes);
+    RUN_TEST(test_station_joins_new_network_next_to_softap);
+    RUN_TEST(test_softap_goes_once_the_station_has_lingered);
+    RUN_TEST(test_new_settings_over_station_reconnect_cleanly);
+    RUN_TEST(test_driver_mode_only_changes_for_the_softap);
+    RUN_TEST(test_webserver_is_never_restarted);
+    RUN_TEST(test_every_handler_registers);
+    return TEST_RESULT();
+}
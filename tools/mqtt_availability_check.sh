@@ -0,0 +1,109 @@
+#!/bin/sh
+# Checks the MQTT birth and will messages against a local mosquitto broker
+#
+# Starts mosquitto on port 1883, points the device at it over the REST API
+# and checks that:
+#  - the device publishes a retained "online" at QoS 1 when it connects
+#  - changing the broker settings publishes "offline" before the device
+#    disconnects, then "online" again when it reconnects
+#  - when the device loses power the broker publishes the retained
+#    "offline" will at QoS 1
+#  - "online" comes back when the device is powered again
+#
+# The power loss step asks for the device to be unplugged. The time to
+# offline is measured from the last packet the broker got from the device,
+# read from the broker's log, to the will arriving. The broker should send
+# it within 1.5 times the keepalive the device connected with
+#
+# Usage: tools/mqtt_availability_check.sh <device ip> <ip of this machine>
+# Needs mosquitto, mosquitto_sub (2.0 or later) and curl
+
+set -e
+
+if [ $# -ne 2 ]; then
+    echo "Usage: $0 <device ip> <ip of this machine>"
+    exit 1
+fi
+DEVICE=$1
+HOST=$2
+PORT=1883
+DIR=$(mktemp -d)
+trap 'kill $SUB $BROKER 2>/dev/null; rm -rf "$DIR"' EXIT
+
+cat > "$DIR/mosquitto.conf" <<CONF
+listener $PORT
+allow_anonymous true
+log_dest file $DIR/broker.log
+log_type all
+log_timestamp_format %s
+CONF
+mosquitto -c "$DIR/mosquitto.conf" &
+BROKER=$!
+sleep 1
+
+# Every availability message, as "<unix time> <topic> <payload>"
+mosquitto_sub -h 127.0.0.1 -p $PORT -q 1 -t 'homeassistant/light/+/availability' \
+    -F '%U %t %p' > "$DIR/events" &
+SUB=$!
+sleep 1
+
+fail() {
+    echo "FAIL: $1"
+    exit 1
+}
+
+# Waits up to $2 seconds for the n-th availability message ($1) and
+# prints it
+wait_event() {
+    i=0
+    while [ "$(wc -l < "$DIR/events")" -lt "$1" ]; do
+        i=$((i + 1))
+        [ $i -gt "$2" ] && return 1
+        sleep 1
+    done
+    sed -n "${1}p" "$DIR/events"
+}
+
+# Prints "<retained> <qos> <payload>" of the message a new subscriber gets
+retained() {
+    mosquitto_sub -h 127.0.0.1 -p $PORT -q 1 -t "$TOPIC" -C 1 -W 5 -F '%r %q %p'
+}
+
+curl -sf -X PUT -d "{\"broker\": \"mqtt://$HOST:$PORT\"}" "http://$DEVICE/api/config/mqtt" > /dev/null
+echo "Waiting for the device to come online..."
+EVENT=$(wait_event 1 60) || fail "no availability message within 60 seconds"
+TOPIC=$(echo "$EVENT" | cut -d' ' -f2)
+CLIENT=esp32_light_$(echo "$TOPIC" | cut -d/ -f3)
+[ "$(echo "$EVENT" | cut -d' ' -f3)" = online ] || fail "first message was $EVENT"
+[ "$(retained)" = "1 1 online" ] || fail "online is not retained at QoS 1"
+echo "PASS: birth message is a retained online at QoS 1 on $TOPIC"
+
+# Sending the same broker again makes the device reconnect
+curl -sf -X PUT -d "{\"broker\": \"mqtt://$HOST:$PORT\"}" "http://$DEVICE/api/config/mqtt" > /dev/null
+EVENT=$(wait_event 2 60) || fail "no offline message when the settings changed"
+[ "$(echo "$EVENT" | cut -d' ' -f3)" = offline ] || fail "expected offline, got $EVENT"
+EVENT=$(wait_event 3 60) || fail "device didn't come back online after the settings changed"
+[ "$(echo "$EVENT" | cut -d' ' -f3)" = online ] || fail "expected online, got $EVENT"
+echo "PASS: offline is published before a reconnect, then online"
+
+echo "Unplug the device now. Waiting up to 5 minutes for the will..."
+EVENT=$(wait_event 4 300) || fail "no will within 5 minutes"
+[ "$(echo "$EVENT" | cut -d' ' -f3)" = offline ] || fail "expected offline, got $EVENT"
+[ "$(retained)" = "1 1 offline" ] || fail "the will is not retained at QoS 1"
+OFFLINE_AT=$(echo "$EVENT" | cut -d' ' -f1)
+# The broker logs a line for every packet from the client, and the
+# keepalive it connected with as "k<seconds>"
+LAST_RX=$(grep "Received .* from $CLIENT" "$DIR/broker.log" | tail -n 1 | cut -d: -f1)
+KEEPALIVE=$(grep "as $CLIENT " "$DIR/broker.log" | tail -n 1 | sed -n 's/.* k\([0-9]*\)[,)].*/\1/p')
+echo "PASS: the will is a retained offline at QoS 1"
+# The log only has whole seconds, so a second is allowed on top
+awk -v offline="$OFFLINE_AT" -v last="$LAST_RX" -v keepalive="$KEEPALIVE" 'BEGIN {
+    printf "Offline %.1f s after the last packet from the device. Keepalive %d s, so the broker allows up to %.1f s\n",
+        offline - last, keepalive, keepalive * 1.5
+    exit (offline - last > keepalive * 1.5 + 1)
+}' || fail "the will took longer than 1.5 times the keepalive"
+
+echo "Plug the device back in. Waiting up to 2 minutes for it to come online..."
+EVENT=$(wait_event 5 120) || fail "device didn't come back online"
+[ "$(echo "$EVENT" | cut -d' ' -f3)" = online ] || fail "expected online, got $EVENT"
+echo "PASS: online again after power is restored"